@@ -11,6 +11,8 @@
 
 // Include Files
 #include "bts.h"
+#include "lbr.h"
+#include "pt.h"
 
 //
 // Global Variables
@@ -20,11 +22,14 @@ char bts_state_lock[MAX_LOCK_LEN];
 char bts_state_head[MAX_LIST_LEN];
 // Head of bts state list
 
+u32 bts_governor_ticking;
+// Governor tick running, protected by the bts state lock
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : get_bts
 // Description  : Get the BTS records out from the BTS buffer. Pause the BTS
-//                tracing.
+//                tracing. Caller should hold the `bts_state_lock`.
 //
 // Inputs       : state - the BTS state
 // Outputs      : 0 if successful, -1 if failure
@@ -32,11 +37,8 @@ char bts_state_head[MAX_LIST_LEN];
 void get_bts(struct bts_state *state)
 {
     u64 dbgctlmsr;
-    char irql_flag[MAX_IRQL_LEN];
 
     // Disable BTS
-    xacquire_lock(bts_state_lock, irql_flag);
-
     xrdmsr(MSR_IA32_DEBUGCTLMSR, &dbgctlmsr);
     dbgctlmsr &= ~state->config.bts_config;
     xwrmsr(MSR_IA32_DEBUGCTLMSR, dbgctlmsr);
@@ -44,14 +46,19 @@ void get_bts(struct bts_state *state)
     // Reset BTS debug store buffer pointer
     xwrmsr(MSR_IA32_DS_AREA, NULL);
 
-    xrelease_lock(bts_state_lock, irql_flag);
+    // Account the buffer wraps happened during this time slice
+    sync_bts_index(state);
+    drain_bts(state);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : put_bts
 // Description  : Put the BTS records into the BTS buffer. Resume the BTS
-//                tracing.
+//                tracing, unless the gates of all the sessions subscribed to
+//                the state are closed, the governor turned it off or its
+//                buffer is being reconfigured. Caller should hold the
+//                `bts_state_lock`.
 //
 // Inputs       : state - the BTS state
 // Outputs      : 0 if successful, -1 if failure
@@ -59,19 +66,18 @@ void get_bts(struct bts_state *state)
 void put_bts(struct bts_state *state)
 {
     u64 dbgctlmsr;
-    char irql_flag[MAX_IRQL_LEN];
 
-    // Setup BTS debug store buffer pointer
-    xacquire_lock(bts_state_lock, irql_flag);
+    if (!subscribers_gate_open(&state->subs) || state->reconfig ||
+        state->governor.state != BTS_GOVERNOR_ON)
+        return;
 
+    // Setup BTS debug store buffer pointer
     xwrmsr(MSR_IA32_DS_AREA, (u64)state->ds_area);
 
     // Enable BTS
     xrdmsr(MSR_IA32_DEBUGCTLMSR, &dbgctlmsr);
     dbgctlmsr |= state->config.bts_config;
     xwrmsr(MSR_IA32_DEBUGCTLMSR, dbgctlmsr);
-
-    xrelease_lock(bts_state_lock, irql_flag);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -110,26 +116,151 @@ void flush_bts(void)
     xrelease_core(irql_flag);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stop_bts
+// Description  : Stop the BTS of the current core if it writes through a given
+//                debug store area, i.e. the BTS of a process running on this
+//                core while its state is removed or its buffer reconfigured.
+//                Dispatched to each core by `xon_each_cpu_arg`, the area is
+//                only compared and never accessed.
+//
+// Inputs       : ds_area - the debug store area
+// Outputs      : void
+
+void stop_bts(void *ds_area)
+{
+    u64 dbgctlmsr, curr_ds_area;
+
+    xrdmsr(MSR_IA32_DS_AREA, &curr_ds_area);
+    if (curr_ds_area != (u64)ds_area)
+        return;
+
+    // Disable BTS
+    xrdmsr(MSR_IA32_DEBUGCTLMSR, &dbgctlmsr);
+    dbgctlmsr &= ~(DEBUGCTLMSR_TR | DEBUGCTLMSR_BTS | DEBUGCTLMSR_BTINT |
+                    DEBUGCTLMSR_BTS_OFF_OS | DEBUGCTLMSR_BTS_OFF_USR);
+    xwrmsr(MSR_IA32_DEBUGCTLMSR, dbgctlmsr);
+
+    // Reset BTS debug store buffer pointer
+    xwrmsr(MSR_IA32_DS_AREA, NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : drain_bts
+// Description  : Drain the BTS records produced since the last drain into the
+//                session as BTS records, split at the buffer end and at
+//                `BTS_DRAIN_RECORDS`. Records overwritten by the hardware
+//                before being drained are reported as lost. Every subscribed
+//                session gets the same records. Caller should hold the
+//                `bts_state_lock`, which keeps the sessions subscribed.
+//
+// Inputs       : state - the BTS state
+// Outputs      : void
+
+void drain_bts(struct bts_state *state)
+{
+    u64 capacity, produced, oldest, slot, cnt;
+    struct bts_record *records;
+    struct session *session;
+    u32 i;
+
+    if (state->subs.count == 0)
+        return;
+
+    records = (struct bts_record *)state->ds_area->bts_buffer_base;
+    capacity = state->config.bts_buffer_size / sizeof(struct bts_record);
+    produced = count_bts_records(state);
+    oldest = produced > capacity ? produced - capacity : 0;
+
+    if (state->drain_cursor < oldest)
+    {
+        for (i = 0; i < state->subs.count; i++)
+            if (state->subs.sessions[i] &&
+                session_gate_open(state->subs.sessions[i]))
+                session_lost(state->subs.sessions[i], 0,
+                                oldest - state->drain_cursor, 0, 0, 0);
+        state->drain_cursor = oldest;
+    }
+
+    while (state->drain_cursor < produced)
+    {
+        slot = state->drain_cursor % capacity;
+        cnt = produced - state->drain_cursor;
+        if (cnt > capacity - slot)
+            cnt = capacity - slot;
+        if (cnt > BTS_DRAIN_RECORDS)
+            cnt = BTS_DRAIN_RECORDS;
+
+        for (i = 0; i < state->subs.count; i++)
+        {
+            session = state->subs.sessions[i];
+            if (session == NULL || !session_gate_open(session))
+                continue;
+
+            if (session_write(session, LIBIHT_RECORD_BTS, state->config.pid,
+                                records + slot,
+                                (u32)(cnt * sizeof(struct bts_record)),
+                                NULL, 0))
+                session_lost(session, 0, cnt, 0, 0, 0);
+        }
+        state->drain_cursor += cnt;
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : enable_bts
-// Description  : Enable the BTS.
+// Description  : Enable the BTS. The BTS is drained into the session the
+//                request comes from. If the process is already traced, the
+//                session subscribes to the existing state, which keeps its
+//                configuration and buffer.
 //
-// Inputs       : request - the BTS ioctl request
+// Inputs       : session - the session of the request, can be NULL
+//                request - the BTS ioctl request
 // Outputs      : 0 if successful, -1 if failure
 
-s32 enable_bts(struct bts_ioctl_request *request)
+s32 enable_bts(struct session *session, struct bts_ioctl_request *request)
 {
-    struct bts_state *state;
+    struct bts_state *state, *old_state;
+    char irql_flag[MAX_IRQL_LEN];
+    s32 ret;
+    u32 pid;
 
-    state = find_bts_state(request->bts_config.pid);
-    if (state)
+    pid = request->bts_config.pid ? request->bts_config.pid : xgetcurrent_pid();
+
+    // Tracing a process exposes its control flow, like ptrace does
+    if (!xtrace_allowed(pid))
     {
-        xprintdbg("LIBIHT-COM: BTS already enabled for pid %d.\n",
-                    request->bts_config.pid);
+        xprintdbg("LIBIHT-COM: BTS not permitted for pid %d.\n", pid);
         return -1;
     }
 
+    xacquire_lock(bts_state_lock, irql_flag);
+    state = find_bts_state(pid);
+    if (state)
+    {
+        ret = subscribe_session(&state->subs, session);
+        xrelease_lock(bts_state_lock, irql_flag);
+
+        if (ret)
+            xprintdbg("LIBIHT-COM: BTS already enabled for pid %d.\n",
+                        request->bts_config.pid);
+        else
+            xprintdbg("LIBIHT-COM: Share BTS of pid %d with a new session.\n",
+                        request->bts_config.pid);
+
+        // The new subscriber has not seen the mappings yet, unless it
+        // traces the process with another feature already
+        if (ret == 0 && session != NULL && !lbr_subscribed(pid, session) &&
+                !bts_shadowed(pid, session))
+            xfor_each_exec_mapping(pid, 0, (u64)-1, session_mmap, session);
+        return ret;
+    }
+    xrelease_lock(bts_state_lock, irql_flag);
+
+    // The state is created outside the lock, since it sleeps
     state = create_bts_state();
     if (state == NULL)
     {
@@ -139,20 +270,18 @@ s32 enable_bts(struct bts_ioctl_request *request)
 
     // Setup fields for BTS state
     state->parent = NULL;
-    state->config.pid = request->bts_config.pid ?
-                request->bts_config.pid : xgetcurrent_pid();
+    state->config.pid = pid;
     state->config.bts_config = request->bts_config.bts_config ?
                 request->bts_config.bts_config : DEFAULT_BTS_CONFIG;
-    state->config.bts_buffer_size = request->bts_config.bts_buffer_size ?
-                request->bts_config.bts_buffer_size : DEFAULT_BTS_BUFFER_SIZE;
 
     // Setup fields for BTS debug store area
-    state->ds_area->bts_buffer_base = (u64)xmalloc(state->config.bts_buffer_size);
-    state->ds_area->bts_index = state->ds_area->bts_buffer_base;
-    state->ds_area->bts_absolute_maximum =
-            state->ds_area->bts_buffer_base +
-            state->config.bts_buffer_size + 1;
-    // Not yet support state->ds_area->bts_interrupt_threshold
+    if (setup_bts_buffer(state, request->bts_config.bts_buffer_size ?
+                request->bts_config.bts_buffer_size : DEFAULT_BTS_BUFFER_SIZE))
+    {
+        xprintdbg("LIBIHT-COM: Allocate BTS buffer failed.\n");
+        free_bts_state(state);
+        return -1;
+    }
 
     // Print BTS debug store area info
     xprintdbg("LIBIHT-COM: BTS ds_area pointer: %llx, bts_buffer_base: %llx, "
@@ -161,37 +290,95 @@ s32 enable_bts(struct bts_ioctl_request *request)
                 state->ds_area->bts_index,
                 state->ds_area->bts_absolute_maximum);
 
+    // Another request may have enabled the process meanwhile, share it then
+    xacquire_lock(bts_state_lock, irql_flag);
+    old_state = find_bts_state(pid);
+    if (old_state)
+    {
+        ret = subscribe_session(&old_state->subs, session);
+        xrelease_lock(bts_state_lock, irql_flag);
+        free_bts_state(state);
+
+        if (ret == 0 && session != NULL && !lbr_subscribed(pid, session) &&
+                !bts_shadowed(pid, session))
+            xfor_each_exec_mapping(pid, 0, (u64)-1, session_mmap, session);
+        return ret;
+    }
+
+    subscribe_session(&state->subs, session);
+    xprintdbg("LIBIHT-COM: Insert BTS state for pid %d.\n", pid);
+    xlist_add(state->list, bts_state_head);
 
-    insert_bts_state(state);
     // If the requesting process is the current process, trace it right away
-    if (state->config.pid == xgetcurrent_pid())
+    if (pid == xgetcurrent_pid())
         put_bts(state);
+    xrelease_lock(bts_state_lock, irql_flag);
+
+    // Describe the executable mappings for the symbolization
+    if (session != NULL && !lbr_subscribed(pid, session) &&
+            !bts_shadowed(pid, session))
+        xfor_each_exec_mapping(pid, 0, (u64)-1, session_mmap, session);
     return 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : disable_bts
-// Description  : Disable the BTS tracing for a given process in request.
+// Description  : Unsubscribe the session of the request from the BTS of a
+//                given process in request. The BTS tracing is disabled once
+//                the last session unsubscribes.
 //
-// Inputs       : request - the BTS ioctl request
+// Inputs       : session - the session of the request, can be NULL
+//                request - the BTS ioctl request
 // Outputs      : 0 if successful, -1 if failure
 
-s32 disable_bts(struct bts_ioctl_request *request)
+s32 disable_bts(struct session *session, struct bts_ioctl_request *request)
 {
     struct bts_state *state;
+    char irql_flag[MAX_IRQL_LEN];
+    s32 ret;
+    u32 left;
 
+    xacquire_lock(bts_state_lock, irql_flag);
     state = find_bts_state(request->bts_config.pid);
     if (state == NULL)
     {
+        xrelease_lock(bts_state_lock, irql_flag);
         xprintdbg("LIBIHT-COM: BTS not enabled for pid %d.\n",
                     request->bts_config.pid);
         return -1;
     }
 
-    if (state->config.pid == xgetcurrent_pid())
-        get_bts(state);
-    remove_bts_state(state);
+    // Unlink the state with its last subscriber, so no one subscribes again
+    ret = unsubscribe_session(&state->subs, session);
+    left = state->subs.count;
+    if (ret == 0 && left == 0)
+    {
+        if (state->config.pid == xgetcurrent_pid())
+            get_bts(state);
+        xlist_del(state->list);
+    }
+    xrelease_lock(bts_state_lock, irql_flag);
+
+    if (ret)
+    {
+        xprintdbg("LIBIHT-COM: BTS not enabled for pid %d by the session.\n",
+                    request->bts_config.pid);
+        return -1;
+    }
+
+    // No record of the state comes anymore to lift the bytes it left
+    session_flush(session);
+
+    if (left)
+        return 0;
+
+    // The process may still be traced on another core, stop it before the
+    // buffer is freed
+    xon_each_cpu_arg(stop_bts, state->ds_area);
+    xprintdbg("LIBIHT-COM: Remove BTS state for pid %d.\n",
+                state->config.pid);
+    free_bts_state(state);
     return 0;
 }
 
@@ -205,23 +392,41 @@ s32 disable_bts(struct bts_ioctl_request *request)
 
 s32 dump_bts(struct bts_ioctl_request *request)
 {
-    u64 i, bytes_left, bts_offset;
+    u64 i, bytes_left, bts_offset, capacity, cnt, done;
     struct bts_state *state;
-    struct bts_record *record;
+    struct bts_record *record, *bounce;
     struct bts_data req_buf;
     char irql_flag[MAX_IRQL_LEN];
 
+    // Get a copy of data from userspace buffer before taking the lock
+    if (request->buffer)
+    {
+        bytes_left = xcopy_from_user(&req_buf, request->buffer,
+                                    sizeof(struct bts_data));
+        if (bytes_left)
+        {
+            xprintdbg("LIBIHT-COM: Copy BTS data from user failed.\n");
+            return -1;
+        }
+    }
+
+    bounce = xmalloc(BTS_READ_RECORDS * sizeof(struct bts_record));
+    if (bounce == NULL)
+        return -1;
+
+    // Dump some BTS buffer records
+    xacquire_lock(bts_state_lock, irql_flag);
+
     state = find_bts_state(request->bts_config.pid);
     if (state == NULL)
     {
+        xrelease_lock(bts_state_lock, irql_flag);
+        xfree(bounce);
         xprintdbg("LIBIHT-COM: BTS not enabled for pid %d.\n",
                     request->bts_config.pid);
         return -1;
     }
 
-    // Dump some BTS buffer records
-    xacquire_lock(bts_state_lock, irql_flag);
-
     bts_offset = (state->ds_area->bts_index -
                     state->ds_area->bts_buffer_base) /
                     sizeof(struct bts_record);
@@ -229,7 +434,8 @@ s32 dump_bts(struct bts_ioctl_request *request)
                 state->ds_area->bts_buffer_base,
                 state->ds_area->bts_index,
                 bts_offset);
-    for (i = 0; i < state->config.bts_buffer_size / sizeof(struct bts_record); i++)
+    capacity = state->config.bts_buffer_size / sizeof(struct bts_record);
+    for (i = 0; i < capacity; i++)
     {
         record = (struct bts_record*)state->ds_area->bts_buffer_base + i;
         xprintdbg("LIBIHT-COM: BTS record ptr: 0x%llx.\n", (u64)record);
@@ -237,115 +443,757 @@ s32 dump_bts(struct bts_ioctl_request *request)
                     i, record->from, record->to);
     }
 
-    // Dump the BTS data to userspace buffer
-    // TODO: Try best to support mmap share between user and kernel space
-    if (request->buffer)
+    xrelease_lock(bts_state_lock, irql_flag);
+
+    // Dump the BTS data to userspace buffer
+    // Zero-copy consumers map the BTS buffer through mmap instead
+    if (request->buffer)
+    {
+        // Dump data to userspace buffer ptr
+        // Not yet support state->ds_area->bts_interrupt_threshold
+        req_buf.bts_index = req_buf.bts_buffer_base + bts_offset;
+
+        // Stage the buffer a chunk at a time, user memory may fault
+        for (done = 0; req_buf.bts_buffer_base && done < capacity; done += cnt)
+        {
+            cnt = capacity - done < BTS_READ_RECORDS ?
+                    capacity - done : BTS_READ_RECORDS;
+
+            xacquire_lock(bts_state_lock, irql_flag);
+            state = find_bts_state(request->bts_config.pid);
+            if (state == NULL || state->config.bts_buffer_size !=
+                                    capacity * sizeof(struct bts_record))
+            {
+                xrelease_lock(bts_state_lock, irql_flag);
+                xprintdbg("LIBIHT-COM: BTS buffer changed during the dump.\n");
+                xfree(bounce);
+                return -1;
+            }
+            xmemcpy(bounce, (struct bts_record *)state->ds_area->bts_buffer_base +
+                    done, cnt * sizeof(struct bts_record));
+            xrelease_lock(bts_state_lock, irql_flag);
+
+            bytes_left = xcopy_to_user(req_buf.bts_buffer_base + done, bounce,
+                                        cnt * sizeof(struct bts_record));
+            if (bytes_left)
+            {
+                xprintdbg("LIBIHT-COM: Copy to user failed.\n");
+                xfree(bounce);
+                return -1;
+            }
+        }
+
+        // Copy updated data back to userspace buffer
+        bytes_left = xcopy_to_user(request->buffer, &req_buf,
+                                    sizeof(struct bts_data));
+        if (bytes_left)
+        {
+            xprintdbg("LIBIHT-COM: Copy to user failed.\n");
+            xfree(bounce);
+            return -1;
+        }
+    }
+
+    xfree(bounce);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : config_bts
+// Description  : Configure the BTS trace bits and BTS buffer size for a given
+//                process in request. Before the buffer is swapped, the BTS is
+//                held off and stopped on every core, since the process may
+//                be running on another one.
+//
+// Inputs       : request - the BTS ioctl request
+// Outputs      : 0 if successful, -1 if failure
+
+s32 config_bts(struct bts_ioctl_request *request)
+{
+    struct bts_state *state;
+    char irql_flag[MAX_IRQL_LEN];
+    u64 size, base = 0, old_base = 0, old_size = 0;
+    void *ds_area;
+
+    // The new buffer is allocated outside the lock, since it sleeps
+    size = request->bts_config.bts_buffer_size;
+    size -= size % sizeof(struct bts_record);
+    if (request->bts_config.bts_buffer_size != 0)
+    {
+        base = size ? (u64)xmalloc_pages(size) : 0;
+        if (base == 0)
+        {
+            // The previous buffer is kept if the new one cannot be set up
+            xprintdbg("LIBIHT-COM: Reconfigure BTS buffer failed.\n");
+            return -1;
+        }
+    }
+
+    xacquire_lock(bts_state_lock, irql_flag);
+
+    state = find_bts_state(request->bts_config.pid);
+    if (state == NULL)
+    {
+        xrelease_lock(bts_state_lock, irql_flag);
+        if (base)
+            xfree_pages((void *)base, size);
+        xprintdbg("LIBIHT-COM: BTS not enabled for pid %d.\n",
+                    request->bts_config.pid);
+        return -1;
+    }
+
+    // If the current process is the target process, we need to
+    // disable and re-enable BTS to apply the new configuration
+    if (state->config.pid == xgetcurrent_pid())
+        get_bts(state);
+
+    state->config.bts_config = request->bts_config.bts_config;
+    if (base && size != state->config.bts_buffer_size)
+    {
+        // Keep the BTS from resuming and stop it on the other cores
+        state->reconfig++;
+        ds_area = state->ds_area;
+        xrelease_lock(bts_state_lock, irql_flag);
+
+        xon_each_cpu_arg(stop_bts, ds_area);
+
+        xacquire_lock(bts_state_lock, irql_flag);
+        state = find_bts_state(request->bts_config.pid);
+        if (state == NULL || state->ds_area != ds_area)
+        {
+            // Disabled meanwhile, the state is already freed
+            xrelease_lock(bts_state_lock, irql_flag);
+            xfree_pages((void *)base, size);
+            xprintdbg("LIBIHT-COM: BTS not enabled for pid %d.\n",
+                        request->bts_config.pid);
+            return -1;
+        }
+        if (state->reconfig)
+            state->reconfig--;
+
+        // Drain the records of the old buffer before it is replaced
+        sync_bts_index(state);
+        drain_bts(state);
+
+        // Reconfigure BTS debug store area
+        old_base = state->ds_area->bts_buffer_base;
+        old_size = state->config.bts_buffer_size;
+        install_bts_buffer(state, base, size);
+        base = 0;
+    }
+
+    if (state->config.pid == xgetcurrent_pid())
+        put_bts(state);
+
+    xrelease_lock(bts_state_lock, irql_flag);
+
+    // Free the buffer not in use outside the lock
+    if (old_base)
+        xfree_pages((void *)old_base, old_size);
+    if (base)
+        xfree_pages((void *)base, size);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : read_bts
+// Description  : Read the BTS records written since the cursor in request for
+//                a given process. Records are numbered from the time the BTS
+//                buffer is set up, so the cost is bounded by the new records
+//                instead of the whole buffer. If the hardware has lapped the
+//                cursor, the overwritten records are reported as lost. The
+//                records are staged in a bounce buffer under the lock, at
+//                most `BTS_READ_RECORDS` at a time, and copied to user once
+//                it is released, since user memory may fault.
+//
+// Inputs       : request - the BTS cursor read ioctl request
+// Outputs      : 0 if successful, -1 if failure
+
+s32 read_bts(struct bts_read_request *request)
+{
+    u64 bytes_left, capacity, produced, oldest, slot, cnt, first, end, skip;
+    u64 done;
+    struct bts_state *state;
+    struct bts_cursor req_buf;
+    struct bts_record *records, *bounce;
+    char irql_flag[MAX_IRQL_LEN];
+
+    if (request->buffer == NULL)
+        return -1;
+
+    // Reading the records exposes the control flow, like ptrace does
+    if (!xtrace_allowed(request->bts_config.pid))
+    {
+        xprintdbg("LIBIHT-COM: BTS not permitted for pid %d.\n",
+                    request->bts_config.pid);
+        return -1;
+    }
+
+    // Get a copy of cursor from userspace buffer
+    bytes_left = xcopy_from_user(&req_buf, request->buffer,
+                                    sizeof(struct bts_cursor));
+    if (bytes_left)
+    {
+        xprintdbg("LIBIHT-COM: Copy BTS cursor from user failed.\n");
+        return -1;
+    }
+
+    bounce = xmalloc(BTS_READ_RECORDS * sizeof(struct bts_record));
+    if (bounce == NULL)
+        return -1;
+
+    req_buf.lost = 0;
+    end = (u64)-1;
+    done = 0;
+    do
+    {
+        xacquire_lock(bts_state_lock, irql_flag);
+
+        // The state may be disabled between two chunks
+        state = find_bts_state(request->bts_config.pid);
+        if (state == NULL)
+        {
+            xrelease_lock(bts_state_lock, irql_flag);
+            if (done)
+                break;
+
+            xprintdbg("LIBIHT-COM: BTS not enabled for pid %d.\n",
+                        request->bts_config.pid);
+            xfree(bounce);
+            return -1;
+        }
+
+        // Locate the producer position in the record sequence
+        sync_bts_index(state);
+        records = (struct bts_record *)state->ds_area->bts_buffer_base;
+        capacity = state->config.bts_buffer_size / sizeof(struct bts_record);
+        produced = count_bts_records(state);
+        oldest = produced > capacity ? produced - capacity : 0;
+
+        // A cursor from the future belongs to a buffer before reconfiguration
+        if (req_buf.cursor > produced)
+        {
+            req_buf.cursor = oldest;
+            end = (u64)-1;
+        }
+
+        // Records produced after the first chunk are left to the next read
+        if (end > produced)
+            end = produced;
+
+        if (req_buf.cursor < oldest)
+        {
+            req_buf.lost += oldest - req_buf.cursor;
+            req_buf.cursor = oldest;
+        }
+
+        cnt = end > req_buf.cursor ? end - req_buf.cursor : 0;
+        if (cnt > req_buf.count - done)
+            cnt = req_buf.count - done;
+        if (cnt > BTS_READ_RECORDS)
+            cnt = BTS_READ_RECORDS;
+        if (req_buf.records == NULL)
+            cnt = 0;
+
+        // Stage the records in at most two chunks around the buffer end
+        skip = 0;
+        if (cnt)
+        {
+            slot = req_buf.cursor % capacity;
+            first = capacity - slot < cnt ? capacity - slot : cnt;
+            xmemcpy(bounce, records + slot, first * sizeof(struct bts_record));
+            xmemcpy(bounce + first, records,
+                    (cnt - first) * sizeof(struct bts_record));
+
+            // The process may be running elsewhere, the records the hardware
+            // lapped during the copy are lost instead
+            sync_bts_index(state);
+            produced = count_bts_records(state);
+            oldest = produced > capacity ? produced - capacity : 0;
+            if (oldest > req_buf.cursor)
+                skip = oldest - req_buf.cursor < cnt ?
+                        oldest - req_buf.cursor : cnt;
+        }
+
+        xrelease_lock(bts_state_lock, irql_flag);
+
+        if (cnt > skip)
+        {
+            bytes_left = xcopy_to_user(req_buf.records + done, bounce + skip,
+                                        (cnt - skip) * sizeof(struct bts_record));
+            if (bytes_left)
+            {
+                xprintdbg("LIBIHT-COM: Copy to user failed.\n");
+                xfree(bounce);
+                return -1;
+            }
+        }
+
+        req_buf.lost += skip;
+        req_buf.cursor += cnt;
+        done += cnt - skip;
+    } while (cnt && done < req_buf.count);
+
+    xfree(bounce);
+
+    xprintdbg("LIBIHT-COM: BTS read %lld records up to cursor %lld, lost %lld.\n",
+                done, req_buf.cursor, req_buf.lost);
+    req_buf.count = done;
+
+    // Copy updated cursor back to userspace buffer
+    bytes_left = xcopy_to_user(request->buffer, &req_buf,
+                                sizeof(struct bts_cursor));
+    if (bytes_left)
+    {
+        xprintdbg("LIBIHT-COM: Copy to user failed.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : govern_bts
+// Description  : Set the overhead governor of the BTS of a given process. With
+//                a budget, the BTS is turned off for long enough after each
+//                measurement window over the budget to bring the duty cycled
+//                overhead back within it. With a record cap, the BTS is turned
+//                off for good once the records since this request reach it.
+//                A BTS turned off resumes at the next switch in under the new
+//                governor, and a request all zero leaves the BTS ungoverned.
+//
+// Inputs       : request - the BTS governor ioctl request
+// Outputs      : 0 if successful, -1 if failure
+
+s32 govern_bts(struct bts_governor_request *request)
+{
+    struct bts_state *state;
+    struct bts_governor *gov;
+    char irql_flag[MAX_IRQL_LEN];
+    u64 window;
+    s32 ret = 0;
+
+    // Throttling a process changes what its tracers see, like ptrace does
+    if (!xtrace_allowed(request->pid))
+    {
+        xprintdbg("LIBIHT-COM: BTS not permitted for pid %d.\n", request->pid);
+        return -1;
+    }
+
+    window = (request->period_ns ? request->period_ns :
+                DEFAULT_BTS_GOVERNOR_PERIOD) / BTS_GOVERNOR_TICK_NS;
+    if (window == 0)
+        window = 1;
+    if (window > BTS_GOVERNOR_MAX_WINDOW)
+        window = BTS_GOVERNOR_MAX_WINDOW;
+
+    xacquire_lock(bts_state_lock, irql_flag);
+
+    state = find_bts_state(request->pid);
+    if (state == NULL)
+    {
+        xrelease_lock(bts_state_lock, irql_flag);
+        xprintdbg("LIBIHT-COM: BTS not enabled for pid %d.\n",
+                    request->pid);
+        return -1;
+    }
+
+    gov = &state->governor;
+    gov->budget = request->budget;
+    gov->window = (u32)window;
+    gov->record_cap = request->record_cap;
+    gov->record_cost = request->record_cost ? request->record_cost :
+                        DEFAULT_BTS_RECORD_COST;
+    gov->switch_tsc = state->config.pid == xgetcurrent_pid() ? xrdtsc() : 0;
+    bts_governor_window(state);
+    gov->cap_base = gov->records;
+
+    if (gov->state != BTS_GOVERNOR_ON)
+    {
+        gov->state = BTS_GOVERNOR_ON;
+        bts_governor_report(state, LIBIHT_THROTTLE_ON, 0, 0, 0);
+    }
+
+    // The tick stops itself once no state has a budget left
+    if (gov->budget && !bts_governor_ticking)
+    {
+        ret = xtimer_start(bts_governor_tick, BTS_GOVERNOR_TICK_NS);
+        bts_governor_ticking = ret == 0;
+    }
+
+    xrelease_lock(bts_state_lock, irql_flag);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bts_governor_account
+// Description  : Account a context switch of a governed process to its
+//                governor, i.e. the handler time since `start` and, on switch
+//                out, the time slice it ran. The record cap is checked on
+//                switch out, once the records of the time slice are synced.
+//                Caller should hold the `bts_state_lock`.
+//
+// Inputs       : state - the BTS state
+//                start - the TSC at the handler entry
+//                switch_in - 1 if the process switches in, 0 if out
+// Outputs      : void
+
+void bts_governor_account(struct bts_state *state, u64 start, u32 switch_in)
+{
+    struct bts_governor *gov = &state->governor;
+    u64 now, records;
+
+    if (gov->budget == 0 && gov->record_cap == 0)
+        return;
+
+    now = xrdtsc();
+    gov->cost_tsc += now - start;
+    if (switch_in)
+    {
+        gov->switch_tsc = now;
+        return;
+    }
+
+    if (gov->switch_tsc)
+        gov->run_tsc += start - gov->switch_tsc;
+    gov->switch_tsc = 0;
+
+    if (gov->record_cap && gov->state != BTS_GOVERNOR_CAPPED &&
+        count_bts_records(state) - gov->cap_base >= gov->record_cap)
+    {
+        records = count_bts_records(state) - gov->records;
+        gov->state = BTS_GOVERNOR_CAPPED;
+        bts_governor_report(state, LIBIHT_THROTTLE_CAP,
+                            bts_governor_overhead(state, records), records, 0);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bts_governor_report
+// Description  : Report a decision of the governor to the sessions subscribed
+//                to the BTS, with the measurements of the current window.
+//                Caller should hold the `bts_state_lock`.
+//
+// Inputs       : state - the BTS state
+//                action - the LIBIHT_THROTTLE_* action
+//                overhead - the estimated overhead in per mille
+//                records - the BTS records of the window
+//                off_ns - the time the BTS stays off
+// Outputs      : void
+
+void bts_governor_report(struct bts_state *state, u32 action, u32 overhead,
+                            u64 records, u64 off_ns)
+{
+    struct trace_throttle_record record;
+
+    record.action = action;
+    record.overhead = overhead;
+    record.seq = state->governor.seq++;
+    record.records = records;
+    record.run_tsc = state->governor.run_tsc;
+    record.cost_tsc = state->governor.cost_tsc;
+    record.off_ns = off_ns;
+
+    xprintdbg("LIBIHT-COM: BTS governor action %d for pid %d, overhead %d "
+                "per mille.\n", action, state->config.pid, overhead);
+    subscribers_throttle(&state->subs, state->config.pid, &record);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bts_governor_overhead
+// Description  : Estimate the overhead of the current window of the governor,
+//                the handler time plus `record_cost` cycles for each record,
+//                over the time the process ran. Caller should hold the
+//                `bts_state_lock`.
+//
+// Inputs       : state - the BTS state
+//                records - the BTS records of the window
+// Outputs      : u32 - the estimated overhead in per mille, 0 if not run
+
+u32 bts_governor_overhead(struct bts_state *state, u64 records)
+{
+    struct bts_governor *gov = &state->governor;
+    u64 overhead;
+
+    if (gov->run_tsc == 0)
+        return 0;
+
+    overhead = (gov->cost_tsc + records * gov->record_cost) * 1000 /
+                gov->run_tsc;
+    return overhead > (u32)-1 ? (u32)-1 : (u32)overhead;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bts_governor_window
+// Description  : Start a new measurement window of the governor. The BTS index
+//                is synced first, as the process may be running. Caller
+//                should hold the `bts_state_lock`.
+//
+// Inputs       : state - the BTS state
+// Outputs      : void
+
+void bts_governor_window(struct bts_state *state)
+{
+    struct bts_governor *gov = &state->governor;
+
+    sync_bts_index(state);
+    gov->ticks = gov->window;
+    gov->run_tsc = 0;
+    gov->cost_tsc = 0;
+    gov->records = count_bts_records(state);
+    if (gov->switch_tsc)
+        gov->switch_tsc = xrdtsc();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bts_governor_tick
+// Description  : The periodic tick of the governor, every
+//                `BTS_GOVERNOR_TICK_NS` in interrupt context. At the end of
+//                each window over the budget, the BTS is turned off for a
+//                number of ticks, then back on for a new window. The decision
+//                is taken at the next context switch of the process, so a
+//                process running meanwhile keeps its BTS state until then.
+//                The tick stops once no state has a budget left, and
+//                `govern_bts` starts it again.
+//
+// Inputs       : void
+// Outputs      : u32 - 0 to stop the tick, 1 to keep it running
+
+u32 bts_governor_tick(void)
+{
+    char irql_flag[MAX_IRQL_LEN];
+    struct bts_state *state;
+    struct bts_governor *gov;
+    void *curr_list;
+    u64 offset, now, records, off;
+    u32 overhead, governed = 0;
+
+    xacquire_lock(bts_state_lock, irql_flag);
+
+    // offsetof(st, m) macro implementation of stddef.h
+    offset = (u64)(&((struct bts_state *)0)->list);
+    curr_list = xlist_next(bts_state_head);
+    while (curr_list != NULL && curr_list != bts_state_head)
     {
-        // Get a copy of data from userspace buffer
-        bytes_left = xcopy_from_user(&req_buf, request->buffer,
-                                    sizeof(struct bts_data));
-        if (bytes_left)
+        state = (struct bts_state *)((u64)curr_list - offset);
+        curr_list = xlist_next(curr_list);
+        gov = &state->governor;
+
+        if (gov->budget == 0 || gov->state == BTS_GOVERNOR_CAPPED)
+            continue;
+        governed++;
+        if (gov->ticks > 1)
         {
-            xprintdbg("LIBIHT-COM: Copy BTS data from user failed.\n");
-            xrelease_lock(bts_state_lock, irql_flag);
-            return -1;
+            gov->ticks--;
+            continue;
         }
 
-        // Dump data to userspace buffer ptr
-        // Not yet support state->ds_area->bts_interrupt_threshold
-        req_buf.bts_index = req_buf.bts_buffer_base + bts_offset;
-        if (req_buf.bts_buffer_base)
+        if (gov->state == BTS_GOVERNOR_OFF)
         {
-            bytes_left = xcopy_to_user(req_buf.bts_buffer_base,
-                                        (void *)state->ds_area->bts_buffer_base,
-                                        state->config.bts_buffer_size);
-            if (bytes_left)
-            {
-                xprintdbg("LIBIHT-COM: Copy to user failed.\n");
-                xrelease_lock(bts_state_lock, irql_flag);
-                return -1;
-            }
+            gov->state = BTS_GOVERNOR_ON;
+            bts_governor_window(state);
+            bts_governor_report(state, LIBIHT_THROTTLE_ON, 0, 0, 0);
+            continue;
         }
 
-        // Copy updated data back to userspace buffer
-        bytes_left = xcopy_to_user(request->buffer, &req_buf,
-                                    sizeof(struct bts_data));
-        if (bytes_left)
+        // Account the time slice in progress to the closing window
+        sync_bts_index(state);
+        if (gov->switch_tsc)
         {
-            xprintdbg("LIBIHT-COM: Copy to user failed.\n");
-            xrelease_lock(bts_state_lock, irql_flag);
-            return -1;
+            now = xrdtsc();
+            gov->run_tsc += now - gov->switch_tsc;
+            gov->switch_tsc = now;
+        }
+
+        records = count_bts_records(state) - gov->records;
+        overhead = bts_governor_overhead(state, records);
+        if (overhead <= gov->budget)
+        {
+            bts_governor_window(state);
+            continue;
         }
+
+        // Stay off for long enough that on / (on + off) * overhead = budget
+        off = ((u64)gov->window * (overhead - gov->budget) + gov->budget - 1) /
+                gov->budget;
+        if (off > (u64)gov->window * BTS_GOVERNOR_MAX_OFF)
+            off = (u64)gov->window * BTS_GOVERNOR_MAX_OFF;
+
+        gov->state = BTS_GOVERNOR_OFF;
+        bts_governor_report(state, LIBIHT_THROTTLE_OFF, overhead, records,
+                            off * BTS_GOVERNOR_TICK_NS);
+        bts_governor_window(state);
+        gov->ticks = (u32)off;
     }
 
+    // Decided under the lock, so `govern_bts` sees the tick stopped
+    if (governed == 0)
+        bts_governor_ticking = 0;
+
     xrelease_lock(bts_state_lock, irql_flag);
+    return governed ? 1 : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : setup_bts_buffer
+// Description  : Allocate a new BTS buffer of the given size for a BTS state
+//                and point its debug store area to it. The size is rounded
+//                down to whole records so the hardware wraps exactly at the
+//                end of the buffer. The previous buffer, if any, is freed and
+//                the record sequence restarts from zero. It sleeps, so it is
+//                only used on a state not inserted yet.
+//
+// Inputs       : state - the BTS state
+//                size - the BTS buffer size in bytes
+// Outputs      : 0 if successful, -1 if failure
+
+s32 setup_bts_buffer(struct bts_state *state, u64 size)
+{
+    u64 base;
+
+    size -= size % sizeof(struct bts_record);
+    if (size == 0)
+        return -1;
+
+    base = (u64)xmalloc_pages(size);
+    if (base == 0)
+        return -1;
+
+    if (state->ds_area->bts_buffer_base)
+        xfree_pages((void *)state->ds_area->bts_buffer_base,
+                    state->config.bts_buffer_size);
 
+    install_bts_buffer(state, base, size);
     return 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : config_bts
-// Description  : Configure the BTS trace bits and BTS buffer size for a given
-//                process in request.
+// Function     : install_bts_buffer
+// Description  : Point the debug store area of a BTS state to a BTS buffer of
+//                whole records, and restart the record sequence from zero.
+//                The previous buffer is left to the caller. Caller should hold
+//                the `bts_state_lock` if the state is inserted.
 //
-// Inputs       : request - the BTS ioctl request
-// Outputs      : 0 if successful, -1 if failure
+// Inputs       : state - the BTS state
+//                base - the BTS buffer base
+//                size - the BTS buffer size in bytes
+// Outputs      : void
 
-s32 config_bts(struct bts_ioctl_request *request)
+void install_bts_buffer(struct bts_state *state, u64 base, u64 size)
+{
+    state->config.bts_buffer_size = size;
+    state->ds_area->bts_buffer_base = base;
+    state->ds_area->bts_index = base;
+    state->ds_area->bts_absolute_maximum = base + size;
+    // Not yet support interrupt, keep the threshold out of reach
+    state->ds_area->bts_interrupt_threshold = base + size + 1;
+    state->bts_last_index = base;
+    state->drain_cursor = 0;
+    state->header->bts_index = 0;
+    state->header->bts_wrap_gen = 0;
+    state->header->bts_buffer_size = size;
+    state->governor.records = 0;
+    state->governor.cap_base = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sync_bts_index
+// Description  : Compare the BTS index with the last observed one and count a
+//                buffer wrap if the index went backwards, then publish it as
+//                a record index in the header page. Caller should hold
+//                the `bts_state_lock`. Wraps are only observed on context
+//                switches and reads, so a buffer lapped more than once within
+//                a single time slice is counted as one wrap.
+//
+// Inputs       : state - the BTS state
+// Outputs      : void
+
+void sync_bts_index(struct bts_state *state)
+{
+    if (state->ds_area->bts_index < state->bts_last_index)
+        state->header->bts_wrap_gen++;
+    state->bts_last_index = state->ds_area->bts_index;
+    state->header->bts_index = (state->ds_area->bts_index -
+                                state->ds_area->bts_buffer_base) /
+                                sizeof(struct bts_record);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : count_bts_records
+// Description  : Count the BTS records produced since the BTS buffer is set
+//                up, which is the sequence number of the next record. Caller
+//                should hold the `bts_state_lock` and sync the index first.
+//
+// Inputs       : state - the BTS state
+// Outputs      : u64 - the number of records produced
+
+u64 count_bts_records(struct bts_state *state)
 {
+    u64 capacity;
+
+    capacity = state->config.bts_buffer_size / sizeof(struct bts_record);
+    return state->header->bts_wrap_gen * capacity +
+            (state->ds_area->bts_index - state->ds_area->bts_buffer_base) /
+            sizeof(struct bts_record);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : crash_bts
+// Description  : Freeze the last `LIBIHT_CRASH_BTS_RECORDS` records of the BTS
+//                buffer of a crashing process into a crash capture, oldest
+//                first.
+//
+// Inputs       : pid - the process ID of the crashing process
+//                capture - the crash capture to fill
+// Outputs      : s32 - 0 on success, -1 if the BTS is not enabled for pid
+
+s32 crash_bts(u32 pid, struct crash_capture *capture)
+{
+    char irql_flag[MAX_IRQL_LEN];
     struct bts_state *state;
+    struct bts_record *records;
+    u64 capacity, produced, cnt, slot, first;
 
-    state = find_bts_state(request->bts_config.pid);
+    xacquire_lock(bts_state_lock, irql_flag);
+
+    state = find_bts_state(pid);
     if (state == NULL)
     {
-        xprintdbg("LIBIHT-COM: BTS not enabled for pid %d.\n",
-                    request->bts_config.pid);
+        xrelease_lock(bts_state_lock, irql_flag);
         return -1;
     }
 
-    state->config.bts_config = request->bts_config.bts_config;
-    // If the current process is the target process, we need to
-    // disable and re-enable BTS to apply the new configuration
-    if (xgetcurrent_pid() == request->bts_config.pid)
-    {
-        // TODO: check if it works
-        get_bts(state);
-
-        if (request->bts_config.bts_buffer_size != state->config.bts_buffer_size &&
-            request->bts_config.bts_buffer_size != 0)
-        {
-            state->config.bts_buffer_size = request->bts_config.bts_buffer_size;
-
-            // Reconfigure BTS debug store area
-            xfree((void *)state->ds_area->bts_buffer_base);
-            state->ds_area->bts_buffer_base = (u64)xmalloc(request->bts_config.bts_buffer_size);
-            state->ds_area->bts_index = state->ds_area->bts_buffer_base;
-            state->ds_area->bts_absolute_maximum =
-                    state->ds_area->bts_buffer_base +
-                    request->bts_config.bts_buffer_size + 1;
-        }
+    sync_bts_index(state);
+    records = (struct bts_record *)state->ds_area->bts_buffer_base;
+    capacity = state->config.bts_buffer_size / sizeof(struct bts_record);
+    produced = count_bts_records(state);
 
-        put_bts(state);
-    }
-    else
-    {
-        if (request->bts_config.bts_buffer_size != state->config.bts_buffer_size &&
-            request->bts_config.bts_buffer_size != 0)
-        {
-            state->config.bts_buffer_size = request->bts_config.bts_buffer_size;
-
-            // Reconfigure BTS debug store area
-            xfree((void *)state->ds_area->bts_buffer_base);
-            state->ds_area->bts_buffer_base = (u64)xmalloc(request->bts_config.bts_buffer_size);
-            state->ds_area->bts_index = 0;
-            state->ds_area->bts_absolute_maximum =
-                    state->ds_area->bts_buffer_base +
-                    request->bts_config.bts_buffer_size + 1;
-        }
+    cnt = produced < capacity ? produced : capacity;
+    if (cnt > LIBIHT_CRASH_BTS_RECORDS)
+        cnt = LIBIHT_CRASH_BTS_RECORDS;
 
-    }
+    // Copy the tail out in at most two chunks around the buffer end
+    slot = (produced - cnt) % capacity;
+    first = capacity - slot < cnt ? capacity - slot : cnt;
+    xmemcpy(capture->bts, records + slot, first * sizeof(struct bts_record));
+    xmemcpy(capture->bts + first, records,
+            (cnt - first) * sizeof(struct bts_record));
+    capture->bts_count = cnt;
 
+    xrelease_lock(bts_state_lock, irql_flag);
     return 0;
 }
 
@@ -364,12 +1212,27 @@ struct bts_state *create_bts_state(void)
     state = xmalloc(sizeof(struct bts_state));
     if (state == NULL)
         return NULL;
+    // The header page can be mapped into user space together with the BTS
+    // buffer, the debug store area holds kernel addresses and stays out
+    state->header = xmalloc_pages(XPAGE_SIZE);
     state->ds_area = xmalloc(sizeof(struct ds_area));
-    if (state->ds_area == NULL)
+    if (state->header == NULL || state->ds_area == NULL)
     {
+        if (state->header)
+            xfree_pages(state->header, XPAGE_SIZE);
+        if (state->ds_area)
+            xfree(state->ds_area);
         xfree(state);
         return NULL;
     }
+    xmemset(state->ds_area, 0, sizeof(struct ds_area));
+
+    state->bts_last_index = 0;
+    xmemset(&state->subs, 0, sizeof(struct subscribers));
+    state->drain_cursor = 0;
+    state->reconfig = 0;
+    state->last_cpu = 0;
+    xmemset(&state->governor, 0, sizeof(struct bts_governor));
 
     return state;
 }
@@ -377,20 +1240,19 @@ struct bts_state *create_bts_state(void)
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : find_bts_state
-// Description  : Find a BTS state by pid.
+// Description  : Find a BTS state by pid. Caller should hold the
+//                `bts_state_lock` for as long as it uses the state, which may
+//                be freed as soon as the lock is released.
 //
 // Inputs       : pid - the pid of the target process
 // Outputs      : The BTS state
 
 struct bts_state *find_bts_state(u32 pid)
 {
-    char irql_flag[MAX_IRQL_LEN];
     struct bts_state *curr_state, *ret_state = NULL;
     void *curr_list;
     u64 offset;
 
-    xacquire_lock(bts_state_lock, irql_flag);
-
     // offsetof(st, m) macro implementation of stddef.h
     offset = (u64)(&((struct bts_state *)0)->list);
     curr_list = xlist_next(bts_state_head);
@@ -405,8 +1267,6 @@ struct bts_state *find_bts_state(u32 pid)
         }
     }
 
-    xrelease_lock(bts_state_lock, irql_flag);
-
     return ret_state;
 }
 
@@ -451,12 +1311,29 @@ void remove_bts_state(struct bts_state *old_state)
     xprintdbg("LIBIHT-COM: Remove BTS state for pid %d.\n",
                 old_state->config.pid);
     xlist_del(&old_state->list);
-    xfree((void *)old_state->ds_area->bts_buffer_base);
-    xfree(old_state->ds_area);
-    xfree(old_state);
+    free_bts_state(old_state);
     xrelease_lock(bts_state_lock, irql_flag);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : free_bts_state
+// Description  : Free a BTS state together with its header page and buffer.
+//                Pages still mapped into user space are released on unmap.
+//
+// Inputs       : state - the BTS state
+// Outputs      : void
+
+void free_bts_state(struct bts_state *state)
+{
+    if (state->ds_area->bts_buffer_base)
+        xfree_pages((void *)state->ds_area->bts_buffer_base,
+                    state->config.bts_buffer_size);
+    xfree_pages(state->header, XPAGE_SIZE);
+    xfree(state->ds_area);
+    xfree(state);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : free_bts_state_list
@@ -485,12 +1362,68 @@ void free_bts_state_list(void)
                     curr_state->config.pid);
 
         xlist_del(curr_state->list);
-        xfree((void *)curr_state->ds_area->bts_buffer_base);
-        xfree(curr_state->ds_area);
-        xfree(curr_state);
+        free_bts_state(curr_state);
+    }
+
+    xrelease_lock(bts_state_lock, irql_flag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : release_bts_session
+// Description  : Unsubscribe a session from the BTS states, i.e. enabled
+//                through it or inherited from those, and remove the states
+//                left without subscribers, so no tracing cost outlives the
+//                consumer. States shared with other sessions keep tracing.
+//
+// Inputs       : session - the session
+// Outputs      : void
+
+void release_bts_session(struct session *session)
+{
+    char irql_flag[MAX_IRQL_LEN];
+    char dying_head[MAX_LIST_LEN];
+    struct bts_state *curr_state;
+    void *curr_list;
+    u64 offset;
+
+    xinit_list_head(dying_head);
+    xacquire_lock(bts_state_lock, irql_flag);
+
+    // Stop tracing the releasing process first, like disable_bts does
+    curr_state = find_bts_state(xgetcurrent_pid());
+    if (curr_state && curr_state->subs.count == 1 &&
+        curr_state->subs.sessions[0] == session)
+        get_bts(curr_state);
+
+    // offsetof(st, m) macro implementation of stddef.h
+    offset = (u64)(&((struct bts_state *)0)->list);
+    curr_list = xlist_next(bts_state_head);
+    while (curr_list != NULL && curr_list != bts_state_head)
+    {
+        curr_state = (struct bts_state *)((u64)curr_list - offset);
+        curr_list = xlist_next(curr_list);
+        if (unsubscribe_session(&curr_state->subs, session) ||
+            curr_state->subs.count)
+            continue;
+
+        xprintdbg("LIBIHT-COM: Release BTS state for pid %d\n",
+                    curr_state->config.pid);
+        xlist_del(curr_state->list);
+        xlist_add(curr_state->list, dying_head);
     }
 
     xrelease_lock(bts_state_lock, irql_flag);
+
+    // Stop the removed states still traced on other cores, then free them
+    curr_list = xlist_next(dying_head);
+    while (curr_list != dying_head)
+    {
+        curr_state = (struct bts_state *)((u64)curr_list - offset);
+        curr_list = xlist_next(curr_list);
+        xon_each_cpu_arg(stop_bts, curr_state->ds_area);
+        free_bts_state(curr_state);
+    }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -498,10 +1431,11 @@ void free_bts_state_list(void)
 // Function     : bts_ioctl_handler
 // Description  : The ioctl handler for the BTS.
 //
-// Inputs       : request - the cross platform ioctl request
+// Inputs       : session - the session of the request, can be NULL
+//                request - the cross platform ioctl request
 // Outputs      : 0 if successful, -1 if failure
 
-s32 bts_ioctl_handler(struct xioctl_request *request)
+s32 bts_ioctl_handler(struct session *session, struct xioctl_request *request)
 {
     s32 ret = 0;
 
@@ -511,13 +1445,13 @@ s32 bts_ioctl_handler(struct xioctl_request *request)
     case LIBIHT_IOCTL_ENABLE_BTS:
         xprintdbg("LIBIHT-COM: Enable BTS for pid %d.\n",
                     request->body.bts.bts_config.pid);
-        ret = enable_bts(&request->body.bts);
+        ret = enable_bts(session, &request->body.bts);
         break;
 
     case LIBIHT_IOCTL_DISABLE_BTS:
         xprintdbg("LIBIHT-COM: Disable BTS for pid %d.\n",
                     request->body.bts.bts_config.pid);
-        ret = disable_bts(&request->body.bts);
+        ret = disable_bts(session, &request->body.bts);
         break;
 
     case LIBIHT_IOCTL_DUMP_BTS:
@@ -532,6 +1466,18 @@ s32 bts_ioctl_handler(struct xioctl_request *request)
         ret = config_bts(&request->body.bts);
         break;
 
+    case LIBIHT_IOCTL_READ_BTS:
+        xprintdbg("LIBIHT-COM: Read BTS for pid %d.\n",
+                    request->body.bts_read.bts_config.pid);
+        ret = read_bts(&request->body.bts_read);
+        break;
+
+    case LIBIHT_IOCTL_GOVERN_BTS:
+        xprintdbg("LIBIHT-COM: Govern BTS for pid %d.\n",
+                    request->body.bts_governor.pid);
+        ret = govern_bts(&request->body.bts_governor);
+        break;
+
     default:
         xprintdbg("LIBIHT-COM: Invalid BTS ioctl command.\n");
         ret = -1;
@@ -544,7 +1490,10 @@ s32 bts_ioctl_handler(struct xioctl_request *request)
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : bts_cswitch_handler
-// Description  : The context switch handler for the BTS.
+// Description  : The context switch handler for the BTS. The traced tasks
+//                switching out and in are annotated by switch records, flagged
+//                when the task migrated since its last time slice. The time
+//                spent here for a governed task is charged to its governor.
 //
 // Inputs       : prev_pid - the pid of the previous process
 //                next_pid - the pid of the next process
@@ -553,31 +1502,181 @@ s32 bts_ioctl_handler(struct xioctl_request *request)
 void bts_cswitch_handler(u32 prev_pid, u32 next_pid)
 {
     struct bts_state *prev_state, *next_state;
+    char irql_flag[MAX_IRQL_LEN];
+    u64 start;
+    u32 flags;
+
+    xacquire_lock(bts_state_lock, irql_flag);
 
     prev_state = find_bts_state(prev_pid);
     next_state = find_bts_state(next_pid);
 
     if (prev_state)
     {
+        start = xrdtsc();
         xprintdbg("LIBIHT-COM: BTS context switch from pid %d on core %d\n",
             prev_state->config.pid, xcoreid());
         get_bts(prev_state);
+
+        // Switch out after the last records of the time slice
+        subscribers_switch(&prev_state->subs, prev_pid, LIBIHT_SWITCH_OUT,
+                            next_pid, bts_shadowed);
+        bts_governor_account(prev_state, start, 0);
     }
 
     if (next_state)
     {
+        start = xrdtsc();
         xprintdbg("LIBIHT-COM: BTS context switch to pid %d on core %d\n",
                 next_state->config.pid, xcoreid());
+
+        flags = LIBIHT_SWITCH_IN;
+        if (next_state->last_cpu && next_state->last_cpu != xcoreid() + 1)
+            flags |= LIBIHT_SWITCH_MIGRATED;
+        next_state->last_cpu = xcoreid() + 1;
+        subscribers_switch(&next_state->subs, next_pid, flags, prev_pid,
+                            bts_shadowed);
+
         put_bts(next_state);
+        bts_governor_account(next_state, start, 1);
     }
+
+    xrelease_lock(bts_state_lock, irql_flag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bts_subscribed
+// Description  : Check if a session is subscribed to the BTS of a process.
+//                Caller may hold the LBR state lock, but no other.
+//
+// Inputs       : pid - the process id
+//                session - the session
+// Outputs      : s32 - 1 if subscribed, 0 if not
+
+s32 bts_subscribed(u32 pid, struct session *session)
+{
+    struct bts_state *state;
+    char irql_flag[MAX_IRQL_LEN];
+    s32 ret = 0;
+    u32 i;
+
+    xacquire_lock(bts_state_lock, irql_flag);
+    state = find_bts_state(pid);
+    for (i = 0; state != NULL && i < state->subs.count; i++)
+        if (state->subs.sessions[i] == session)
+            ret = 1;
+    xrelease_lock(bts_state_lock, irql_flag);
+
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bts_shadowed
+// Description  : Check if the switch and mapping records of a process go into
+//                a session through the PT, see `lbr_shadowed`. Caller may hold
+//                the LBR or the BTS state lock.
+//
+// Inputs       : pid - the process id
+//                session - the session
+// Outputs      : s32 - 1 if shadowed, 0 if not
+
+s32 bts_shadowed(u32 pid, struct session *session)
+{
+    return pt_subscribed(pid, session);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : drain_bts_mmap
+// Description  : Fan a mapping record of a process out to the sessions
+//                subscribed to its BTS. Matches the callback of
+//                `xfor_each_exec_mapping`. The state is looked up again for
+//                each record, since it may be disabled during the walk.
+//
+// Inputs       : ctx - unused
+//                pid - the process id
+//                record - the mapping record
+//                path - the path of the mapped file, NUL terminated
+//                path_size - the size of the path, NUL included
+// Outputs      : void
+
+void drain_bts_mmap(void *ctx, u32 pid, struct trace_mmap_record *record,
+                    char *path, u32 path_size)
+{
+    struct bts_state *state;
+    char irql_flag[MAX_IRQL_LEN];
+    u32 i;
+
+    xacquire_lock(bts_state_lock, irql_flag);
+    state = find_bts_state(pid);
+    for (i = 0; state != NULL && i < state->subs.count; i++)
+        if (state->subs.sessions[i] &&
+            !bts_shadowed(pid, state->subs.sessions[i]))
+            session_mmap(state->subs.sessions[i], pid, record, path,
+                            path_size);
+    xrelease_lock(bts_state_lock, irql_flag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bts_mmap_handler
+// Description  : The executable mapping handler for the BTS feature. Called in
+//                the context of the process after it maps code, e.g. by mmap,
+//                mprotect or exec, to describe the new mappings in the range.
+//
+// Inputs       : pid - the process id
+//                start - the start address of the range
+//                end - the end address of the range
+// Outputs      : void
+
+void bts_mmap_handler(u32 pid, u64 start, u64 end)
+{
+    char irql_flag[MAX_IRQL_LEN];
+    struct bts_state *state;
+
+    xacquire_lock(bts_state_lock, irql_flag);
+    state = find_bts_state(pid);
+    xrelease_lock(bts_state_lock, irql_flag);
+    if (state == NULL)
+        return;
+
+    xfor_each_exec_mapping(pid, start, end, drain_bts_mmap, NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bts_exitproc_handler
+// Description  : The process exit handler for the BTS feature. The sessions
+//                subscribed to the BTS of the process are flushed, since its
+//                last records may be left below their watermark.
+//
+// Inputs       : pid - the process id
+// Outputs      : void
+
+void bts_exitproc_handler(u32 pid)
+{
+    char irql_flag[MAX_IRQL_LEN];
+    struct bts_state *state;
+
+    xacquire_lock(bts_state_lock, irql_flag);
+    state = find_bts_state(pid);
+    if (state)
+        subscribers_flush(&state->subs);
+    xrelease_lock(bts_state_lock, irql_flag);
 }
 
 void bts_newproc_handler(u32 parent_pid, u32 child_pid)
 {
     struct bts_state *parent_state, *child_state;
-    // char irql_flag[MAX_IRQL_LEN];
+    char irql_flag[MAX_IRQL_LEN];
+    u64 size;
 
+    xacquire_lock(bts_state_lock, irql_flag);
     parent_state = find_bts_state(parent_pid);
+    size = parent_state ? parent_state->config.bts_buffer_size : 0;
+    xrelease_lock(bts_state_lock, irql_flag);
     if (parent_state == NULL)
         return;
 
@@ -587,16 +1686,42 @@ void bts_newproc_handler(u32 parent_pid, u32 child_pid)
     if (child_state == NULL)
         return;
 
-    child_state->parent = parent_state;
     child_state->config.pid = child_pid;
-    child_state->config.bts_config = parent_state->config.bts_config;
-    child_state->config.bts_buffer_size = parent_state->config.bts_buffer_size;
     // TODO: memcpy or not? overhead? If yes, acquire lock for this operation
-    insert_bts_state(child_state);
+    if (setup_bts_buffer(child_state, size))
+    {
+        free_bts_state(child_state);
+        return;
+    }
+
+    // Inherit the sessions and insert in the same critical section, so a
+    // session released meanwhile is never inherited
+    xacquire_lock(bts_state_lock, irql_flag);
+    parent_state = find_bts_state(parent_pid);
+    if (parent_state == NULL)
+    {
+        xrelease_lock(bts_state_lock, irql_flag);
+        free_bts_state(child_state);
+        return;
+    }
+
+    child_state->parent = parent_state;
+    child_state->config.bts_config = parent_state->config.bts_config;
+    child_state->subs = parent_state->subs;
+
+    // Govern the child like its parent, with measurements of its own
+    child_state->governor.budget = parent_state->governor.budget;
+    child_state->governor.window = parent_state->governor.window;
+    child_state->governor.record_cap = parent_state->governor.record_cap;
+    child_state->governor.record_cost = parent_state->governor.record_cost;
+    child_state->governor.ticks = parent_state->governor.window;
+    xprintdbg("LIBIHT-COM: Insert BTS state for pid %d.\n", child_pid);
+    xlist_add(child_state->list, bts_state_head);
 
     // If the child process is the current process, trace it right away
     if (child_pid == xgetcurrent_pid())
         put_bts(child_state);
+    xrelease_lock(bts_state_lock, irql_flag);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -664,6 +1789,11 @@ s32 bts_init(void)
 
 s32 bts_exit(void)
 {
+    // Stop the governor first, its tick walks the BTS state list
+    xprintdbg("LIBIHT-COM: Stopping BTS governor...\n");
+    xtimer_stop();
+    bts_governor_ticking = 0;
+
     // Flush BTS on each cpu
     xprintdbg("LIBIHT-COM: Flushing BTS for all cpus...\n");
     xon_each_cpu(flush_bts);
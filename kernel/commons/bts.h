@@ -17,6 +17,7 @@
 #include "types.h"
 #include "xplat.h"
 #include "xioctl.h"
+#include "session.h"
 
 // cpp cross compile handler
 #ifdef __cplusplus
@@ -100,6 +101,27 @@ extern "C" {
 // BTS buffer size 0x200 * 2 = 0x400 = 1024 records
 #define DEFAULT_BTS_BUFFER_SIZE        (0x3000 << 1) 
 
+// Maximum BTS records carried by one drained record
+#define BTS_DRAIN_RECORDS       0x100
+
+// Maximum BTS records staged under the lock by one chunk of a cursor read
+#define BTS_READ_RECORDS        0x100
+
+// BTS overhead governor tick 10 ms, the granularity of the duty cycle
+#define BTS_GOVERNOR_TICK_NS    10000000ULL
+
+// BTS overhead governor measurement window 100 ms
+#define DEFAULT_BTS_GOVERNOR_PERIOD    100000000ULL
+
+// Estimated cycles the traced task loses for each BTS record stored
+#define DEFAULT_BTS_RECORD_COST        100
+
+// Longest BTS off time, in measurement windows
+#define BTS_GOVERNOR_MAX_OFF    16
+
+// Longest measurement window 0x100000 ticks, about 3 hours
+#define BTS_GOVERNOR_MAX_WINDOW 0x100000
+
 //
 // Type definitions
 
@@ -116,13 +138,55 @@ struct ds_area
     u64 pebs_interrupt_threshold;   // PEBS placeholder
 };
 
+// Define BTS header page, mapped read-only in front of the BTS buffer
+struct bts_header
+{
+    u64 bts_index;                      // Next record index at the last pause
+    u64 bts_wrap_gen;                   // BTS buffer wrap generation
+    u64 bts_buffer_size;                // BTS buffer size
+};
+
+// BTS overhead governor states
+enum BTS_GOVERNOR_STATE {
+    BTS_GOVERNOR_ON,            // BTS traced, window measured
+    BTS_GOVERNOR_OFF,           // BTS off until the off time elapses
+    BTS_GOVERNOR_CAPPED,        // BTS off for good, the record cap is reached
+};
+
+// Define BTS overhead governor. The overhead of a window is estimated from
+// the handler time spent for the task plus `record_cost` cycles for each BTS
+// record, over the time the task ran. All fields are protected by the
+// `bts_state_lock`.
+struct bts_governor
+{
+    u32 budget;                         // Overhead budget in per mille
+    u32 window;                         // Measurement window in ticks
+    u64 record_cap;                     // Records before disabling, 0 for none
+    u64 record_cost;                    // Estimated cycles per record
+    u32 state;                          // enum BTS_GOVERNOR_STATE
+    u32 ticks;                          // Ticks left in the window or off time
+    u64 run_tsc;                        // Run time of the window
+    u64 cost_tsc;                       // Handler time of the window
+    u64 records;                        // Record count at the window start
+    u64 cap_base;                       // Record count at the governor request
+    u64 switch_tsc;                     // TSC of the switch in, 0 if not running
+    u64 seq;                            // Decisions reported
+};
+
 // Define BTS state
 struct bts_state
 {
     char list[MAX_LIST_LEN];            // Kernel linked list
     struct bts_state *parent;           // Parent bts_state
     struct bts_config config;           // BTS configuration
+    struct bts_header *header;          // BTS header page
     struct ds_area *ds_area;            // Debug Store area pointer
+    u64 bts_last_index;                 // Last observed BTS index
+    struct subscribers subs;            // Sessions sharing the BTS
+    u64 drain_cursor;                   // Sequence number of next to drain
+    u32 reconfig;                       // Reconfigurations stopping the BTS
+    u32 last_cpu;                       // Core of the last switch in + 1, or 0
+    struct bts_governor governor;       // Overhead governor
 };
 
 //
@@ -134,6 +198,9 @@ extern char bts_state_lock[MAX_LOCK_LEN];
 extern char bts_state_head[MAX_LIST_LEN];
 // The head of the bts_state_list.
 
+extern u32 bts_governor_ticking;
+// The governor tick is running.
+
 //
 // Function Prototypes
 
@@ -146,10 +213,26 @@ void put_bts(struct bts_state *state);
 void flush_bts(void);
 // Flush the BTS buffer.
 
-s32 enable_bts(struct bts_ioctl_request *request);
+void stop_bts(void *ds_area);
+// Stop the BTS of the current core if it writes through a debug store area.
+
+void drain_bts(struct bts_state *state);
+// Drain the new BTS records into the session.
+
+s32 bts_subscribed(u32 pid, struct session *session);
+// Check if a session is subscribed to the BTS of a given process.
+
+s32 bts_shadowed(u32 pid, struct session *session);
+// Check if the PT writes the side records of a process to a session.
+
+void drain_bts_mmap(void *ctx, u32 pid, struct trace_mmap_record *record,
+                    char *path, u32 path_size);
+// Drain a mapping record of a given process into its sessions.
+
+s32 enable_bts(struct session *session, struct bts_ioctl_request *request);
 // Enable the BTS.
 
-s32 disable_bts(struct bts_ioctl_request *request);
+s32 disable_bts(struct session *session, struct bts_ioctl_request *request);
 // Disable the BTS.
 
 s32 dump_bts(struct bts_ioctl_request *request);
@@ -158,6 +241,43 @@ s32 dump_bts(struct bts_ioctl_request *request);
 s32 config_bts(struct bts_ioctl_request *request);
 // Configure the BTS trace bits
 
+s32 read_bts(struct bts_read_request *request);
+// Read the BTS records written since the cursor
+
+s32 govern_bts(struct bts_governor_request *request);
+// Set the overhead governor of the BTS
+
+void bts_governor_account(struct bts_state *state, u64 start, u32 switch_in);
+// Account the handler time and run time of a context switch to the governor
+
+void bts_governor_report(struct bts_state *state, u32 action, u32 overhead,
+                            u64 records, u64 off_ns);
+// Report a decision of the governor to the sessions
+
+u32 bts_governor_overhead(struct bts_state *state, u64 records);
+// Estimate the overhead of the window of the governor in per mille
+
+void bts_governor_window(struct bts_state *state);
+// Start a new measurement window of the governor
+
+u32 bts_governor_tick(void);
+// The periodic tick of the governor
+
+s32 setup_bts_buffer(struct bts_state *state, u64 size);
+// Setup the BTS buffer and debug store area of a BTS state
+
+void install_bts_buffer(struct bts_state *state, u64 base, u64 size);
+// Point the debug store area of a BTS state to a BTS buffer
+
+void sync_bts_index(struct bts_state *state);
+// Account BTS buffer wraps since the last observed index
+
+u64 count_bts_records(struct bts_state *state);
+// Count the BTS records produced since the buffer is set up
+
+s32 crash_bts(u32 pid, struct crash_capture *capture);
+// Freeze the tail of the BTS buffer of a crashing process into a crash capture
+
 struct bts_state *create_bts_state(void);
 // Create a new BTS state
 
@@ -170,10 +290,16 @@ void insert_bts_state(struct bts_state *new_state);
 void remove_bts_state(struct bts_state *old_state);
 // Remove the BTS state from the list
 
+void free_bts_state(struct bts_state *state);
+// Free the BTS state and its buffers
+
 void free_bts_state_list(void);
 // Free the BTS state list
 
-s32 bts_ioctl_handler(struct xioctl_request *request);
+void release_bts_session(struct session *session);
+// Remove the BTS states owned by a session
+
+s32 bts_ioctl_handler(struct session *session, struct xioctl_request *request);
 // The ioctl handler for the BTS
 
 void bts_cswitch_handler(u32 prev_pid, u32 next_pid);
@@ -182,6 +308,12 @@ void bts_cswitch_handler(u32 prev_pid, u32 next_pid);
 void bts_newproc_handler(u32 parent_pid, u32 child_pid);
 // The new process handler for the BTS
 
+void bts_mmap_handler(u32 pid, u64 start, u64 end);
+// The executable mapping handler for the BTS
+
+void bts_exitproc_handler(u32 pid);
+// The process exit handler for the BTS
+
 s32 bts_check(void);
 // Check if the BTS is available
 
@@ -0,0 +1,221 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : kernel/commons/crash.c
+//  Description    : This is the implementation of the crash capture for the
+//                   libiht library. The platform signal hook calls in when a
+//                   fatal signal is delivered to a task, in its own context,
+//                   so its live LBR can still be read. The captures are kept
+//                   in a small ring of slots, the newest one wins.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : July 10, 2024
+//
+
+// Include Files
+#include "crash.h"
+#include "lbr.h"
+#include "bts.h"
+
+//
+// Global variables
+
+char crash_lock[MAX_LOCK_LEN];
+struct crash_slot *crash_slots;
+u64 crash_next;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : crash_signal_handler
+// Description  : Freeze the LBR and the tail of the BTS buffer of a process
+//                a fatal signal is delivered to into the next crash slot.
+//                Nothing is captured if neither is enabled for the process.
+//                Runs in the context of the crashing process, possibly with
+//                the signal lock held, so it never sleeps. The owner of the
+//                process is kept with the capture, since the process is gone
+//                by the time it is dumped.
+//
+// Inputs       : pid - the process ID of the crashing process
+//                sig - the fatal signal number
+//                addr - the faulting address, 0 if not a fault
+// Outputs      : void
+
+void crash_signal_handler(u32 pid, u32 sig, u64 addr)
+{
+    char irql_flag[MAX_IRQL_LEN];
+    struct crash_slot *slot;
+    struct crash_capture *capture;
+    s32 lbr_ret, bts_ret;
+    u32 traced;
+
+    if (crash_slots == NULL)
+        return;
+
+    xacquire_lock(lbr_state_lock, irql_flag);
+    traced = find_lbr_state(pid) != NULL;
+    xrelease_lock(lbr_state_lock, irql_flag);
+    if (!traced)
+    {
+        xacquire_lock(bts_state_lock, irql_flag);
+        traced = find_bts_state(pid) != NULL;
+        xrelease_lock(bts_state_lock, irql_flag);
+    }
+    if (!traced)
+        return;
+
+    // Claim the slot, hidden from dump_crash until it is filled
+    xacquire_lock(crash_lock, irql_flag);
+    slot = &crash_slots[crash_next % CRASH_SLOTS];
+    crash_next++;
+    capture = &slot->capture;
+    capture->pid = 0;
+    xrelease_lock(crash_lock, irql_flag);
+
+    slot->owner = xgetcurrent_owner();
+    capture->sig = sig;
+    capture->addr = addr;
+    capture->tsc = xrdtsc();
+    capture->cpu = xcoreid();
+    capture->lbr_tos = 0;
+    capture->lbr_count = 0;
+    capture->bts_count = 0;
+    lbr_ret = crash_lbr(pid, capture);
+    bts_ret = crash_bts(pid, capture);
+
+    xacquire_lock(crash_lock, irql_flag);
+    capture->pid = pid;
+    xrelease_lock(crash_lock, irql_flag);
+
+    xprintdbg("LIBIHT-COM: Crash captured for pid %d, signal %d, lbr %d, "
+                "bts %d\n", pid, sig, lbr_ret == 0, bts_ret == 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_crash
+// Description  : Dump the latest crash capture of a given process, or the
+//                latest one of any process if pid is 0. Only the captures of
+//                the processes the caller could have traced are seen.
+//
+// Inputs       : request - the crash ioctl request
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 dump_crash(struct crash_ioctl_request *request)
+{
+    char irql_flag[MAX_IRQL_LEN];
+    struct crash_capture *capture;
+    struct crash_slot *slot;
+    u64 i, bytes_left, owner = XOWNER_NONE;
+    s32 found = 0;
+
+    if (crash_slots == NULL || request->buffer == NULL)
+        return -1;
+
+    // Copy the slot out of the lock, since copying to user may fault
+    capture = xmalloc(sizeof(struct crash_capture));
+    if (capture == NULL)
+        return -1;
+
+    for (i = 1; i <= CRASH_SLOTS && !found; i++)
+    {
+        xacquire_lock(crash_lock, irql_flag);
+        slot = &crash_slots[(crash_next - i) % CRASH_SLOTS];
+        if (i <= crash_next && slot->capture.pid != 0 &&
+            (request->pid == 0 || slot->capture.pid == request->pid))
+        {
+            xmemcpy(capture, &slot->capture, sizeof(struct crash_capture));
+            owner = slot->owner;
+            found = 1;
+        }
+        xrelease_lock(crash_lock, irql_flag);
+
+        // Checked out of the lock, since checking a privilege may sleep
+        if (found && !xowner_allowed(owner))
+            found = 0;
+    }
+
+    if (!found)
+    {
+        xprintdbg("LIBIHT-COM: No crash captured for pid %d.\n", request->pid);
+        xfree(capture);
+        return -1;
+    }
+
+    bytes_left = xcopy_to_user(request->buffer, capture,
+                                sizeof(struct crash_capture));
+    xfree(capture);
+    if (bytes_left)
+    {
+        xprintdbg("LIBIHT-COM: Copy to user failed.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : crash_ioctl_handler
+// Description  : The ioctl handler for the crash captures.
+//
+// Inputs       : request - the cross platform ioctl request
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 crash_ioctl_handler(struct xioctl_request *request)
+{
+    s32 ret = -1;
+
+    switch (request->cmd)
+    {
+        case LIBIHT_IOCTL_DUMP_CRASH:
+            xprintdbg("LIBIHT-COM: Dump crash for pid %d\n",
+                        request->body.crash.pid);
+            ret = dump_crash(&request->body.crash);
+            break;
+        default:
+            xprintdbg("LIBIHT-COM: Invalid crash ioctl command\n");
+            break;
+    }
+
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : crash_init
+// Description  : Allocate the crash slots up front, since the captures are
+//                taken where allocating is not allowed.
+//
+// Inputs       : void
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 crash_init(void)
+{
+    xprintdbg("LIBIHT-COM: Init crash slots.\n");
+    xinit_lock(crash_lock);
+    crash_next = 0;
+    crash_slots = xmalloc_pages(CRASH_SLOTS * sizeof(struct crash_slot));
+    if (crash_slots == NULL)
+    {
+        xprintdbg("LIBIHT-COM: Allocate crash slots failed.\n");
+        return -1;
+    }
+
+    xmemset(crash_slots, 0, CRASH_SLOTS * sizeof(struct crash_slot));
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : crash_exit
+// Description  : Free the crash slots.
+//
+// Inputs       : void
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 crash_exit(void)
+{
+    if (crash_slots != NULL)
+        xfree_pages(crash_slots, CRASH_SLOTS * sizeof(struct crash_slot));
+    crash_slots = NULL;
+    return 0;
+}
@@ -0,0 +1,70 @@
+#ifndef _COMMONS_CRASH_H
+#define _COMMONS_CRASH_H
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : kernel/commons/crash.h
+//  Description    : This is the header file for the crash capture module. The
+//                   LBR and the tail of the BTS buffer of a traced process are
+//                   frozen when a fatal signal is delivered to it, and kept in
+//                   a slot until they are retrieved or overwritten.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : July 10, 2024
+//
+
+// Include Files
+#include "types.h"
+#include "xplat.h"
+#include "xioctl.h"
+
+// cpp cross compile handler
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+//
+// Library constants
+
+// Number of crash captures kept, the oldest one is overwritten
+#define CRASH_SLOTS             8
+
+//
+// Type definitions
+
+// Define a crash slot, the capture and the owner of the crashed process
+struct crash_slot
+{
+    struct crash_capture capture;       // Crash capture
+    u64 owner;                          // Owner of the crashed process
+};
+
+//
+// Global variables
+
+extern char crash_lock[MAX_LOCK_LEN];
+// The lock for the crash slots.
+
+//
+// Function Prototypes
+
+void crash_signal_handler(u32 pid, u32 sig, u64 addr);
+// Capture the branch history of a process a fatal signal is delivered to.
+
+s32 dump_crash(struct crash_ioctl_request *request);
+// Dump the crash capture of a given process.
+
+s32 crash_ioctl_handler(struct xioctl_request *request);
+// The ioctl handler for the crash captures.
+
+s32 crash_init(void);
+// Initialize the crash slots.
+
+s32 crash_exit(void);
+// Free the crash slots.
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // _COMMONS_CRASH_H
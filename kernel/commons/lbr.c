@@ -15,12 +15,39 @@
 
 // Include Files
 #include "lbr.h"
+#include "bts.h"
+#include "pt.h"
 
 //
 // Global Variables
 
 u64 lbr_capacity;
-// The capacity of the LBR.
+// The largest capacity of the LBR among all cores, the saved entries are
+// sized by it.
+
+u32 lbr_has_info;
+// The LBR of all cores has MSR_LBR_INFO registers.
+
+u32 lbr_has_call_stack;
+// The LBR of all cores supports call-stack mode.
+
+u64 lbr_xsave_size;
+// The largest size of the XSAVE area holding the Arch LBR state, 0 if no core
+// uses XSAVES.
+
+u32 lbr_use_perf;
+// Obtain the LBR through the perf backend instead of the MSRs, set before
+// lbr_init. Perf then switches the LBR with the traced processes along with
+// its other users, and the LBR is published at each perf sample.
+
+u32 lbr_use_bpf;
+// Hand every drained LBR snapshot to the BPF hook as well, set before lbr_init.
+
+struct lbr_cpu *lbr_cpus;
+// The LBR capabilities of each core, indexed by core id.
+
+u32 lbr_cpu_count;
+// The number of entries in lbr_cpus.
 
 char lbr_state_lock[MAX_LOCK_LEN];
 // The lock for lbr_state_list.
@@ -28,6 +55,10 @@ char lbr_state_lock[MAX_LOCK_LEN];
 char lbr_state_head[MAX_LIST_LEN];
 // The head of the lbr_state_list.
 
+u64 lbr_syscall_filter[LIBIHT_SYSCALL_WORDS];
+// The union of the syscall bitmaps of all lbr_states, tested on every syscall
+// entry before looking up the state.
+
 static const struct cpu_to_lbr cpu_lbr_maps[] = {
     {0x5c, 32}, {0x5f, 32}, {0x4e, 32}, {0x5e, 32}, {0x8e, 32}, {0x9e, 32},
     {0x55, 32}, {0x66, 32}, {0x7a, 32}, {0x67, 32}, {0x6a, 32}, {0x6c, 32},
@@ -46,311 +77,1481 @@ static const struct cpu_to_lbr cpu_lbr_maps[] = {
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : get_lbr
-// Description  : Read the LBR registers into kernel maintained datastructure.
-//                And pause the LBR tracing.
+// Function     : lbr_config_flags
+// Description  : Keep the requested LBR configuration flags the CPU supports.
+//
+// Inputs       : flags - the requested LIBIHT_LBR_* flags
+// Outputs      : u32 - the supported flags
+
+u32 lbr_config_flags(u32 flags)
+{
+    u32 supported = 0;
+
+    if (lbr_has_info)
+        supported |= LIBIHT_LBR_INFO;
+    if (lbr_has_call_stack)
+        supported |= LIBIHT_LBR_CALL_STACK;
+    return flags & supported;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lbr_config_select
+// Description  : Get the LBR_SELECT of a configuration. Call-stack mode has
+//                its own selection, which overrides the requested one.
+//
+// Inputs       : flags - the supported LIBIHT_LBR_* flags
+//                lbr_select - the requested LBR_SELECT, 0 for the default
+// Outputs      : u64 - the LBR_SELECT to use
+
+u64 lbr_config_select(u32 flags, u64 lbr_select)
+{
+    if (flags & LIBIHT_LBR_CALL_STACK)
+        return LBR_SELECT_CALL_STACK;
+    return lbr_select ? lbr_select : LBR_SELECT;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lbr_entries_size
+// Description  : Get the size of the saved LBR entries of a state, followed by
+//                their LBR_INFO if the state saves them.
 //
 // Inputs       : state - the LBR state
+// Outputs      : u64 - the size in bytes
+
+u64 lbr_entries_size(struct lbr_state *state)
+{
+    u64 size;
+
+    size = lbr_capacity * sizeof(struct lbr_stack_entry);
+    if (state->config.flags & LIBIHT_LBR_INFO)
+        size += lbr_capacity * sizeof(u64);
+    return size;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lbr_ctl_from_select
+// Description  : Translate a LBR_SELECT into an Arch LBR_CTL. The LBR_SELECT
+//                bits suppress branches, while the LBR_CTL bits capture them.
+//
+// Inputs       : lbr_select - the LBR_SELECT
+// Outputs      : u64 - the LBR_CTL, with LBREn clear
+
+u64 lbr_ctl_from_select(u64 lbr_select)
+{
+    u64 ctl = 0;
+
+    if (!(lbr_select & (1UL << 0)))
+        ctl |= ARCH_LBR_CTL_OS;
+    if (!(lbr_select & (1UL << 1)))
+        ctl |= ARCH_LBR_CTL_USR;
+    if (!(lbr_select & (1UL << 2)))
+        ctl |= ARCH_LBR_CTL_JCC;
+    if (!(lbr_select & (1UL << 3)))
+        ctl |= ARCH_LBR_CTL_REL_CALL;
+    if (!(lbr_select & (1UL << 4)))
+        ctl |= ARCH_LBR_CTL_IND_CALL;
+    if (!(lbr_select & (1UL << 5)))
+        ctl |= ARCH_LBR_CTL_RETURN;
+    if (!(lbr_select & (1UL << 6)))
+        ctl |= ARCH_LBR_CTL_IND_JMP;
+    if (!(lbr_select & (1UL << 7)))
+        ctl |= ARCH_LBR_CTL_REL_JMP;
+    if (!(lbr_select & (1UL << 8)))
+        ctl |= ARCH_LBR_CTL_OTHER;
+    if (lbr_select & (1UL << 9))
+        ctl |= ARCH_LBR_CTL_CALL_STACK;
+
+    return ctl;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lbr_this_cpu
+// Description  : Get the LBR capabilities of the current core. Caller should
+//                stay on the core, e.g. with interrupts or preemption off.
+//
+// Inputs       : void
+// Outputs      : struct lbr_cpu* - the LBR capabilities
+
+struct lbr_cpu *lbr_this_cpu(void)
+{
+    return &lbr_cpus[xcoreid()];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lbr_clear
+// Description  : Clear the paused LBR registers of the current core.
+//
+// Inputs       : cpu - the LBR capabilities of the current core
 // Outputs      : void
 
-void get_lbr(struct lbr_state *state)
+void lbr_clear(struct lbr_cpu *cpu)
 {
     u32 i;
+
+    if (cpu->backend != LBR_BACKEND_LEGACY)
+    {
+        // Writing the depth clears all the Arch LBR entries
+        xwrmsr(MSR_ARCH_LBR_CTL, 0);
+        xwrmsr(MSR_ARCH_LBR_DEPTH, cpu->capacity);
+        return;
+    }
+
+    xwrmsr(MSR_LBR_TOS, 0);
+    for (i = 0; i < cpu->capacity; i++)
+    {
+        xwrmsr(MSR_LBR_NHM_FROM + i, 0);
+        xwrmsr(MSR_LBR_NHM_TO + i, 0);
+        if (cpu->has_info)
+            xwrmsr(MSR_LBR_INFO_0 + i, 0);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lbr_pause
+// Description  : Pause the LBR of the current core, through DEBUGCTL for the
+//                model specific LBR and through LBR_CTL for the Arch LBR.
+//
+// Inputs       : ctl - the control value before the pause
+// Outputs      : s32 - 0 on success, -1 if the LBR is not running
+
+s32 lbr_pause(u64 *ctl)
+{
+    if (lbr_this_cpu()->backend == LBR_BACKEND_LEGACY)
+    {
+        xrdmsr(MSR_IA32_DEBUGCTLMSR, ctl);
+        if (!(*ctl & DEBUGCTLMSR_LBR))
+            return -1;
+        xwrmsr(MSR_IA32_DEBUGCTLMSR, *ctl & ~DEBUGCTLMSR_LBR);
+    }
+    else
+    {
+        xrdmsr(MSR_ARCH_LBR_CTL, ctl);
+        if (!(*ctl & ARCH_LBR_CTL_LBREN))
+            return -1;
+        xwrmsr(MSR_ARCH_LBR_CTL, 0);
+    }
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lbr_resume
+// Description  : Resume the LBR of the current core with a control value from
+//                `lbr_pause` or `lbr_run_ctl`.
+//
+// Inputs       : ctl - the control value
+// Outputs      : void
+
+void lbr_resume(u64 ctl)
+{
+    if (lbr_this_cpu()->backend == LBR_BACKEND_LEGACY)
+        xwrmsr(MSR_IA32_DEBUGCTLMSR, ctl);
+    else
+        xwrmsr(MSR_ARCH_LBR_CTL, ctl);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lbr_run_ctl
+// Description  : Get the control value running the LBR of a given process on
+//                the current core. The Arch LBR filters live in LBR_CTL, so
+//                they are applied by resuming the LBR.
+//
+// Inputs       : state - the LBR state
+// Outputs      : u64 - the control value
+
+u64 lbr_run_ctl(struct lbr_state *state)
+{
     u64 dbgctlmsr;
-    char irql_flag[MAX_IRQL_LEN];
 
-    // Disable LBR
-    xrdmsr(MSR_IA32_DEBUGCTLMSR, &dbgctlmsr);
-    dbgctlmsr &= ~DEBUGCTLMSR_LBR;
-    xwrmsr(MSR_IA32_DEBUGCTLMSR, dbgctlmsr);
+    if (lbr_this_cpu()->backend == LBR_BACKEND_LEGACY)
+    {
+        xrdmsr(MSR_IA32_DEBUGCTLMSR, &dbgctlmsr);
+        return dbgctlmsr | DEBUGCTLMSR_LBR;
+    }
 
-    // Read out LBR registers
-    xacquire_lock(lbr_state_lock, irql_flag);
+    return lbr_ctl_from_select(state->config.lbr_select) | ARCH_LBR_CTL_LBREN;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lbr_save
+// Description  : Save the paused LBR registers of the current core into a
+//                given state, with the format and the number of entries of
+//                the core. The entries past them are cleared. The Arch LBR
+//                has no TOS and keeps the youngest entry first, so its
+//                entries are saved in reverse with the TOS on the last one,
+//                the same layout as the model specific LBR for the consumers.
+//
+// Inputs       : state - the LBR state
+// Outputs      : void
+
+void lbr_save(struct lbr_state *state)
+{
+    struct lbr_cpu *cpu;
+    struct lbr_stack *data;
+    struct arch_lbr_xsave *xsave;
+    u32 i, idx;
 
-    xrdmsr(MSR_LBR_SELECT, &state->config.lbr_select);
-    xrdmsr(MSR_LBR_TOS, &state->data->lbr_tos);
+    cpu = lbr_this_cpu();
+    data = state->data;
+    data->lbr_format = cpu->format;
+    data->lbr_count = cpu->capacity;
 
-    for (i = 0; i < lbr_capacity; i++)
+    if (cpu->capacity < lbr_capacity)
     {
-        xrdmsr(MSR_LBR_NHM_FROM + i, &state->data->entries[i].from);
-        xrdmsr(MSR_LBR_NHM_TO + i, &state->data->entries[i].to);
+        xmemset(data->entries + cpu->capacity, 0,
+                (lbr_capacity - cpu->capacity) *
+                    sizeof(struct lbr_stack_entry));
+        xmemset(data->info + cpu->capacity, 0,
+                (lbr_capacity - cpu->capacity) * sizeof(u64));
     }
 
-    xrelease_lock(lbr_state_lock, irql_flag);
+    if (cpu->backend == LBR_BACKEND_LEGACY)
+    {
+        xrdmsr(MSR_LBR_TOS, &data->lbr_tos);
+        for (i = 0; i < cpu->capacity; i++)
+        {
+            xrdmsr(MSR_LBR_NHM_FROM + i, &data->entries[i].from);
+            xrdmsr(MSR_LBR_NHM_TO + i, &data->entries[i].to);
+            if (state->config.flags & LIBIHT_LBR_INFO)
+                xrdmsr(MSR_LBR_INFO_0 + i, &data->info[i]);
+        }
+        return;
+    }
+
+    data->lbr_tos = cpu->capacity - 1;
+
+    if (cpu->backend == LBR_BACKEND_ARCH_XSAVES)
+    {
+        // The whole stack in a single instruction
+        xsave = state->xsave;
+        xsaves_area(xsave, XFEATURE_MASK_LBR);
+
+        // An LBR in its init state is not written, it is all zero
+        if (!(xsave->xstate_bv & XFEATURE_MASK_LBR))
+            xmemset(xsave->entries, 0,
+                    cpu->capacity * sizeof(struct arch_lbr_entry));
+
+        for (i = 0; i < cpu->capacity; i++)
+        {
+            idx = cpu->capacity - 1 - i;
+            data->entries[idx].from = xsave->entries[i].from;
+            data->entries[idx].to = xsave->entries[i].to;
+            if (state->config.flags & LIBIHT_LBR_INFO)
+                data->info[idx] = xsave->entries[i].info;
+        }
+        return;
+    }
+
+    for (i = 0; i < cpu->capacity; i++)
+    {
+        idx = cpu->capacity - 1 - i;
+        xrdmsr(MSR_ARCH_LBR_FROM_0 + i, &data->entries[idx].from);
+        xrdmsr(MSR_ARCH_LBR_TO_0 + i, &data->entries[idx].to);
+        if (state->config.flags & LIBIHT_LBR_INFO)
+            xrdmsr(MSR_ARCH_LBR_INFO_0 + i, &data->info[idx]);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lbr_restore
+// Description  : Restore the paused LBR registers of the current core from a
+//                given state, the reverse of `lbr_save`. Entries saved on a
+//                core of another format or capacity, e.g. the other core type
+//                of a hybrid CPU, do not fit this core and the LBR starts
+//                over cleared instead. The LBR_SELECT of the model specific
+//                LBR is restored too, the LBR_CTL of the Arch LBR is left to
+//                `lbr_resume`.
+//
+// Inputs       : state - the LBR state
+// Outputs      : void
+
+void lbr_restore(struct lbr_state *state)
+{
+    struct lbr_cpu *cpu;
+    struct lbr_stack *data;
+    struct arch_lbr_xsave *xsave;
+    u32 i, idx;
+    u64 info;
+
+    cpu = lbr_this_cpu();
+    data = state->data;
+
+    if (cpu->backend == LBR_BACKEND_LEGACY)
+        xwrmsr(MSR_LBR_SELECT, state->config.lbr_select);
+
+    if (data->lbr_format != cpu->format || data->lbr_count != cpu->capacity)
+    {
+        lbr_clear(cpu);
+        return;
+    }
+
+    if (cpu->backend == LBR_BACKEND_LEGACY)
+    {
+        xwrmsr(MSR_LBR_TOS, data->lbr_tos);
+        for (i = 0; i < cpu->capacity; i++)
+        {
+            xwrmsr(MSR_LBR_NHM_FROM + i, data->entries[i].from);
+            xwrmsr(MSR_LBR_NHM_TO + i, data->entries[i].to);
+            if (state->config.flags & LIBIHT_LBR_INFO)
+                xwrmsr(MSR_LBR_INFO_0 + i, data->info[i]);
+        }
+        return;
+    }
+
+    if (cpu->backend == LBR_BACKEND_ARCH_XSAVES)
+    {
+        // Build a compacted XSAVE area holding only the LBR state
+        xsave = state->xsave;
+        xsave->xstate_bv = XFEATURE_MASK_LBR;
+        xsave->xcomp_bv = XCOMP_BV_COMPACTED | XFEATURE_MASK_LBR;
+        xsave->lbr_ctl = 0;
+        xsave->lbr_depth = cpu->capacity;
+        xsave->ler_from = 0;
+        xsave->ler_to = 0;
+        xsave->ler_info = 0;
+
+        for (i = 0; i < cpu->capacity; i++)
+        {
+            idx = cpu->capacity - 1 - i;
+            info = (state->config.flags & LIBIHT_LBR_INFO) ?
+                        data->info[idx] : 0;
+            xsave->entries[i].from = data->entries[idx].from;
+            xsave->entries[i].to = data->entries[idx].to;
+            xsave->entries[i].info = info;
+        }
+
+        xrstors_area(xsave, XFEATURE_MASK_LBR);
+        return;
+    }
+
+    for (i = 0; i < cpu->capacity; i++)
+    {
+        idx = cpu->capacity - 1 - i;
+        info = (state->config.flags & LIBIHT_LBR_INFO) ? data->info[idx] : 0;
+        xwrmsr(MSR_ARCH_LBR_FROM_0 + i, data->entries[idx].from);
+        xwrmsr(MSR_ARCH_LBR_TO_0 + i, data->entries[idx].to);
+        xwrmsr(MSR_ARCH_LBR_INFO_0 + i, info);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : get_lbr
+// Description  : Read the LBR registers into kernel maintained datastructure.
+//                And pause the LBR tracing. Nothing is read if the LBR was not
+//                resumed, i.e. the gates of the state were closed, or if perf
+//                switches the LBR. Caller should hold the `lbr_state_lock`.
+//
+// Inputs       : state - the LBR state
+// Outputs      : void
+
+void get_lbr(struct lbr_state *state)
+{
+    u64 ctl;
+
+    if (lbr_use_perf)
+        return;
+
+    // Disable LBR
+    if (lbr_pause(&ctl))
+        return;
+
+    // Read out LBR registers
+    if (lbr_this_cpu()->backend == LBR_BACKEND_LEGACY)
+        xrdmsr(MSR_LBR_SELECT, &state->config.lbr_select);
+    lbr_save(state);
+
+    publish_lbr_snapshot(state, LIBIHT_NO_SYSCALL);
+    drain_lbr(state, LIBIHT_NO_SYSCALL);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : put_lbr
 // Description  : Write the LBR registers from kernel maintained datastructure.
-//                And resume the LBR tracing.
+//                And resume the LBR tracing, unless the gates of all the
+//                sessions subscribed to the state are closed. Nothing is
+//                written if perf switches the LBR. Caller should hold the
+//                `lbr_state_lock`.
 //
 // Inputs       : state - the LBR state
 // Outputs      : void
 
 void put_lbr(struct lbr_state *state)
 {
-    u32 i;
+    if (lbr_use_perf || !subscribers_gate_open(&state->subs))
+        return;
+
+    // Write in LBR registers
+    lbr_restore(state);
+
+    // Enable LBR
+    lbr_resume(lbr_run_ctl(state));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : read_lbr
+// Description  : Read the live LBR of the current process into its state. The
+//                LBR is only paused while the registers are read, and nothing
+//                is read if it is not running, i.e. the gates are closed.
+//                Perf owns the registers of the perf backend, the state keeps
+//                its last sample instead. Caller should hold the
+//                `lbr_state_lock`, which also keeps it on this core.
+//
+// Inputs       : state - the LBR state of the current process
+// Outputs      : s32 - 0 on success, -1 if the LBR is not running or not
+//                sampled yet
+
+s32 read_lbr(struct lbr_state *state)
+{
+    u64 ctl;
+
+    if (lbr_use_perf)
+        return state->data->lbr_count ? 0 : -1;
+
+    if (lbr_pause(&ctl))
+        return -1;
+
+    lbr_save(state);
+
+    // Resume right away, the registers are left untouched
+    lbr_resume(ctl);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : snapshot_lbr
+// Description  : Snapshot the live LBR of the current process into its
+//                snapshot ring and sessions, e.g. at a syscall entry. The
+//                perf backend publishes its samples only, since it has no
+//                live LBR to read. Caller should hold the `lbr_state_lock`.
+//
+// Inputs       : state - the LBR state of the current process
+//                syscall - the syscall entered
+// Outputs      : void
+
+void snapshot_lbr(struct lbr_state *state, u64 syscall)
+{
+    if (!lbr_use_perf && read_lbr(state) == 0)
+    {
+        publish_lbr_snapshot(state, syscall);
+        drain_lbr(state, syscall);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flush_lbr
+// Description  : Flush the LBR stack and registers. Caller should ensure this
+//                function is called with interrupts disabled (either on single
+//                core or with interrupts disabled for that core).
+//
+// Inputs       : void
+// Outputs      : void
+
+void flush_lbr(void)
+{
+    struct lbr_cpu *cpu;
     u64 dbgctlmsr;
     char irql_flag[MAX_IRQL_LEN];
 
-    // Write in LBR registers
+    xlock_core(irql_flag);
+    cpu = lbr_this_cpu();
+
+    // Disable LBR
+    xprintdbg("LIBIHT-COM: Flush LBR on cpu core: %d\n", xcoreid());
+    if (cpu->backend == LBR_BACKEND_LEGACY)
+    {
+        xrdmsr(MSR_IA32_DEBUGCTLMSR, &dbgctlmsr);
+        dbgctlmsr &= ~DEBUGCTLMSR_LBR;
+        xwrmsr(MSR_IA32_DEBUGCTLMSR, dbgctlmsr);
+        xwrmsr(MSR_LBR_SELECT, 0);
+    }
+
+    // Flush LBR registers
+    lbr_clear(cpu);
+
+    xrelease_core(irql_flag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stop_lbr
+// Description  : Stop the LBR of the current core if the process running on
+//                it is no longer traced, i.e. its state was removed while it
+//                ran on this core. Dispatched to each core by
+//                `xon_each_cpu_arg`, nothing is done if perf switches the LBR.
+//
+// Inputs       : arg - unused
+// Outputs      : void
+
+void stop_lbr(void *arg)
+{
+    char irql_flag[MAX_IRQL_LEN];
+    u64 ctl;
+
+    if (lbr_use_perf)
+        return;
+
     xacquire_lock(lbr_state_lock, irql_flag);
+    if (find_lbr_state(xgetcurrent_pid()) == NULL)
+        lbr_pause(&ctl);
+    xrelease_lock(lbr_state_lock, irql_flag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lbr_fill_snapshot
+// Description  : Fill the header of a snapshot record from the saved LBR of a
+//                given process. The caller holds the `lbr_state_lock`.
+//
+// Inputs       : state - the LBR state
+//                snapshot - the snapshot header to fill
+//                syscall - the syscall entered, LIBIHT_NO_SYSCALL if none
+// Outputs      : void
+
+void lbr_fill_snapshot(struct lbr_state *state, struct lbr_snapshot *snapshot,
+                        u64 syscall)
+{
+    snapshot->lbr_tos = state->data->lbr_tos;
+    snapshot->tid = state->config.pid;
+    snapshot->cpu = xcoreid();
+    snapshot->tsc = xrdtsc();
+    snapshot->syscall = syscall;
+    snapshot->flags = state->config.flags & LIBIHT_LBR_INFO;
+    snapshot->lbr_format = state->data->lbr_format;
+    snapshot->lbr_count = state->data->lbr_count;
+}
 
-    xwrmsr(MSR_LBR_SELECT, state->config.lbr_select);
-    xwrmsr(MSR_LBR_TOS, state->data->lbr_tos);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : publish_lbr_snapshot
+// Description  : Publish the saved LBR of a given process into its snapshot
+//                ring. The ring is a single producer single consumer ring
+//                shared with user space, the producer is serialized by the
+//                `lbr_state_lock`. When the consumer falls behind, the
+//                snapshot is dropped and counted instead of overwriting a
+//                slot that may be read. The ring geometry is taken from the
+//                state, since the shared header page is writable by user.
+//
+// Inputs       : state - the LBR state
+//                syscall - the syscall entered, LIBIHT_NO_SYSCALL if none
+// Outputs      : void
+
+void publish_lbr_snapshot(struct lbr_state *state, u64 syscall)
+{
+    struct lbr_ring_header *ring;
+    struct lbr_snapshot *snapshot;
+    u64 head, tail;
+
+    ring = state->ring;
+    if (ring == NULL)
+        return;
+
+    head = ring->head;
+    tail = xload_acquire(&ring->tail);
+    if (head - tail >= state->ring_slots)
+    {
+        ring->dropped++;
+        return;
+    }
+
+    snapshot = (struct lbr_snapshot *)((u64)ring + XPAGE_SIZE +
+                    (head % state->ring_slots) * state->ring_slot_size);
+    lbr_fill_snapshot(state, snapshot, syscall);
+    xmemcpy(snapshot + 1, state->data->entries, lbr_entries_size(state));
+
+    // Make the slot visible before the new head
+    xstore_release(&ring->head, head + 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : drain_lbr
+// Description  : Drain the saved LBR of a given process into the sessions
+//                subscribed to it as a LBR record. Caller should hold the
+//                `lbr_state_lock`, which keeps the sessions subscribed during
+//                the write.
+//
+// Inputs       : state - the LBR state
+//                syscall - the syscall entered, LIBIHT_NO_SYSCALL if none
+// Outputs      : void
+
+void drain_lbr(struct lbr_state *state, u64 syscall)
+{
+    struct lbr_snapshot snapshot;
+    struct session *session;
+    u32 i;
+
+    if (state->subs.count == 0 && !lbr_use_bpf)
+        return;
+
+    lbr_fill_snapshot(state, &snapshot, syscall);
+    if (lbr_use_bpf)
+        xbpf_publish_lbr(&snapshot, state->data->entries,
+                            (u32)lbr_entries_size(state));
+
+    // Fan out the same snapshot, the registers are only read once
+    for (i = 0; i < state->subs.count; i++)
+    {
+        session = state->subs.sessions[i];
+        if (session == NULL || !session_gate_open(session))
+            continue;
+
+        if (session_write(session, LIBIHT_RECORD_LBR, state->config.pid,
+                    &snapshot, sizeof(snapshot), state->data->entries,
+                    (u32)lbr_entries_size(state)))
+            session_lost(session, 1, 0, 0, 0, 0);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : enable_lbr
+// Description  : Enable the LBR feature for the requested process id. The LBR
+//                is drained into the session the request comes from. If the
+//                process is already traced, the session subscribes to the
+//                existing state, which keeps its configuration.
+//
+// Inputs       : session - the session of the request, can be NULL
+//                request - the LBR ioctl request
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 enable_lbr(struct session *session, struct lbr_ioctl_request *request)
+{
+    struct lbr_state *state, *old_state;
+    char irql_flag[MAX_IRQL_LEN];
+    s32 ret;
+    u32 pid;
+
+    pid = request->lbr_config.pid ? request->lbr_config.pid : xgetcurrent_pid();
+
+    // Tracing a process exposes its control flow, like ptrace does
+    if (!xtrace_allowed(pid))
+    {
+        xprintdbg("LIBIHT-COM: LBR not permitted for pid %d\n", pid);
+        return -1;
+    }
+
+    xacquire_lock(lbr_state_lock, irql_flag);
+    state = find_lbr_state(pid);
+    if (state)
+    {
+        ret = subscribe_session(&state->subs, session);
+        xrelease_lock(lbr_state_lock, irql_flag);
+
+        if (ret)
+            xprintdbg("LIBIHT-COM: LBR already enabled for pid %d\n",
+                        request->lbr_config.pid);
+        else
+            xprintdbg("LIBIHT-COM: Share LBR of pid %d with a new session\n",
+                        request->lbr_config.pid);
+
+        // The new subscriber has not seen the mappings yet, unless it
+        // traces the process with another feature already
+        if (ret == 0 && session != NULL && !lbr_shadowed(pid, session))
+            xfor_each_exec_mapping(pid, 0, (u64)-1, session_mmap, session);
+        return ret;
+    }
+    xrelease_lock(lbr_state_lock, irql_flag);
+
+    // The state is created outside the lock, since it sleeps
+    state = create_lbr_state();
+    if (state == NULL)
+    {
+        xprintdbg("LIBIHT-COM: Create LBR state failed\n");
+        return -1;
+    }
+
+    // Setup config fields for LBR state
+    state->parent = NULL;
+    state->config.pid = pid;
+    state->config.flags = lbr_config_flags(request->lbr_config.flags);
+    state->config.lbr_select = lbr_config_select(state->config.flags,
+                                    request->lbr_config.lbr_select);
+
+    // Perf switches the LBR with the process, and samples it
+    if (lbr_use_perf)
+    {
+        state->perf = xperf_lbr_open(state->config.pid,
+                                        state->config.lbr_select,
+                                        LBR_PERF_PERIOD);
+        if (state->perf == NULL)
+        {
+            xprintdbg("LIBIHT-COM: Open perf event for pid %d failed\n",
+                        state->config.pid);
+            free_lbr_state(state);
+            return -1;
+        }
+    }
+
+    // Another request may have enabled the process meanwhile, share it then
+    xacquire_lock(lbr_state_lock, irql_flag);
+    old_state = find_lbr_state(pid);
+    if (old_state)
+    {
+        ret = subscribe_session(&old_state->subs, session);
+        xrelease_lock(lbr_state_lock, irql_flag);
+        free_lbr_state(state);
+
+        if (ret == 0 && session != NULL && !lbr_shadowed(pid, session))
+            xfor_each_exec_mapping(pid, 0, (u64)-1, session_mmap, session);
+        return ret;
+    }
+
+    subscribe_session(&state->subs, session);
+    xprintdbg("LIBIHT-COM: Insert LBR state for pid %d\n", state->config.pid);
+    xlist_add(state->list, lbr_state_head);
+
+    // If the requesting process is the current process, trace it right away
+    if (pid == xgetcurrent_pid())
+        put_lbr(state);
+    xrelease_lock(lbr_state_lock, irql_flag);
+
+    // Describe the executable mappings for the symbolization
+    if (session != NULL && !lbr_shadowed(pid, session))
+        xfor_each_exec_mapping(pid, 0, (u64)-1, session_mmap, session);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : disable_lbr
+// Description  : Unsubscribe the session of the request from the LBR of the
+//                requested process id. The LBR feature is disabled once the
+//                last session unsubscribes.
+//
+// Inputs       : session - the session of the request, can be NULL
+//                request - the LBR ioctl request
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 disable_lbr(struct session *session, struct lbr_ioctl_request *request)
+{
+    struct lbr_state *state;
+    char irql_flag[MAX_IRQL_LEN];
+    s32 ret;
+    u32 left;
+
+    xacquire_lock(lbr_state_lock, irql_flag);
+    state = find_lbr_state(request->lbr_config.pid);
+    if (state == NULL)
+    {
+        xrelease_lock(lbr_state_lock, irql_flag);
+        xprintdbg("LIBIHT-COM: LBR not enabled for pid %d\n",
+                    request->lbr_config.pid);
+        return -1;
+    }
+
+    // Unlink the state with its last subscriber, so no one subscribes again
+    ret = unsubscribe_session(&state->subs, session);
+    left = state->subs.count;
+    if (ret == 0 && left == 0)
+    {
+        if (state->config.pid == xgetcurrent_pid())
+            get_lbr(state);
+        xlist_del(state->list);
+        put_lbr_cfi(state->cfi);
+        state->cfi = NULL;
+    }
+    xrelease_lock(lbr_state_lock, irql_flag);
+
+    if (ret)
+    {
+        xprintdbg("LIBIHT-COM: LBR not enabled for pid %d by the session\n",
+                    request->lbr_config.pid);
+        return -1;
+    }
+
+    // No record of the state comes anymore to lift the bytes it left
+    session_flush(session);
+
+    if (left)
+        return 0;
+
+    // The process may still be traced on another core
+    xon_each_cpu_arg(stop_lbr, NULL);
+    xprintdbg("LIBIHT-COM: Remove LBR state for pid %d\n",
+                state->config.pid);
+    free_lbr_state(state);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stage_lbr
+// Description  : Copy the LBR saved for the given process id into a staging
+//                buffer, so user memory is not touched under the lock. The
+//                LBR is refreshed first if the process is the current one.
+//
+// Inputs       : pid - the process id
+//                stage - the staged LBR, its entries are allocated here and
+//                        freed by the caller on success
+//                flags - the LIBIHT_LBR_* flags of the LBR state
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 stage_lbr(u32 pid, struct lbr_stack *stage, u32 *flags)
+{
+    u64 i;
+    struct lbr_state* state;
+    char irql_flag[MAX_IRQL_LEN];
+
+    stage->entries = xmalloc((sizeof(struct lbr_stack_entry) + sizeof(u64)) *
+                                lbr_capacity);
+    if (stage->entries == NULL)
+        return -1;
+    stage->info = (u64 *)(stage->entries + lbr_capacity);
+
+    xacquire_lock(lbr_state_lock, irql_flag);
+
+    state = find_lbr_state(pid);
+    if (state == NULL)
+    {
+        xrelease_lock(lbr_state_lock, irql_flag);
+        xfree(stage->entries);
+        xprintdbg("LIBIHT-COM: LBR not enabled for pid %d\n", pid);
+        return -1;
+    }
+
+    // Examine if the current process is the owner of the LBR state
+    if (state->config.pid == xgetcurrent_pid())
+    {
+        xprintdbg("LIBIHT-COM: Dump LBR for current process\n");
+        // Get fresh LBR info
+        get_lbr(state);
+        put_lbr(state);
+    }
+
+    // Dump the LBR state
+    xprintdbg("PROC_PID:             %d\n", state->config.pid);
+    xprintdbg("MSR_LBR_SELECT:       0x%llx\n", state->config.lbr_select);
+    xprintdbg("MSR_LBR_TOS:          %lld\n", state->data->lbr_tos);
+
+    for (i = 0; i < lbr_capacity; i++)
+    {
+        xprintdbg("MSR_LBR_NHM_FROM[%2d]: 0x%llx\n", i,
+                    state->data->entries[i].from);
+        xprintdbg("MSR_LBR_NHM_TO  [%2d]: 0x%llx\n", i,
+                    state->data->entries[i].to);
+        if (state->config.flags & LIBIHT_LBR_INFO)
+            xprintdbg("MSR_LBR_INFO    [%2d]: 0x%llx\n", i,
+                        state->data->info[i]);
+    }
+
+    xprintdbg("LIBIHT-COM: LBR info for cpuid: %d\n", xcoreid());
+
+    stage->lbr_tos = state->data->lbr_tos;
+    stage->lbr_format = state->data->lbr_format;
+    stage->lbr_count = state->data->lbr_count;
+    *flags = state->config.flags;
+    xmemcpy(stage->entries, state->data->entries,
+            lbr_capacity * sizeof(struct lbr_stack_entry));
+    xmemcpy(stage->info, state->data->info, lbr_capacity * sizeof(u64));
+
+    xrelease_lock(lbr_state_lock, irql_flag);
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_lbr
+// Description  : Dump the LBR registers for the given process id, into the
+//                `lbr_data` laid out as in the first release. Its buffer has
+//                no length, so at most the `LIBIHT_LBR_DATA_ENTRIES` the
+//                library of that release allocates are dumped.
+//
+// Inputs       : request - the LBR ioctl request
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 dump_lbr(struct lbr_ioctl_request *request)
+{
+    u64 bytes_left, count;
+    u32 flags;
+    struct lbr_data req_buf;
+    struct lbr_stack stage;
+
+    // Get a copy of data from userspace buffer before taking the lock
+    if (request->buffer)
+    {
+        bytes_left = xcopy_from_user(&req_buf, request->buffer,
+                                        sizeof(struct lbr_data));
+        if (bytes_left)
+        {
+            xprintdbg("LIBIHT-COM: Copy LBR data from user failed\n");
+            return -1;
+        }
+    }
+
+    if (stage_lbr(request->lbr_config.pid, &stage, &flags))
+        return -1;
+
+    // Dump the LBR data to userspace buffer
+    if (request->buffer)
+    {
+        // Dump data to userspace entry ptr
+        count = lbr_capacity < LIBIHT_LBR_DATA_ENTRIES ?
+                lbr_capacity : LIBIHT_LBR_DATA_ENTRIES;
+        if (req_buf.entries)
+        {
+            bytes_left = xcopy_to_user(req_buf.entries, stage.entries,
+                                        count * sizeof(struct lbr_stack_entry));
+
+            if (bytes_left)
+            {
+                xprintdbg("LIBIHT-COM: Copy LBR data to user failed\n");
+                xfree(stage.entries);
+                return -1;
+            }
+        }
+
+        // Copy updated data back to userspace buffer
+        req_buf.lbr_tos = stage.lbr_tos;
+        bytes_left = xcopy_to_user(request->buffer, &req_buf,
+                                    sizeof(struct lbr_data));
+        if (bytes_left)
+        {
+            xprintdbg("LIBIHT-COM: Copy LBR data to user failed\n");
+            xfree(stage.entries);
+            return -1;
+        }
+    }
+
+    xfree(stage.entries);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_lbr_info
+// Description  : Dump the LBR registers for the given process id, with the
+//                MSR_LBR_INFO of each entry and the LBR format and number of
+//                entries of the core they were saved on. At most `count`
+//                entries are dumped, the buffers hold the LBR of the deepest
+//                core with `lbr_capacity` of them.
+//
+// Inputs       : request - the LBR dump ioctl request
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 dump_lbr_info(struct lbr_dump_request *request)
+{
+    u64 bytes_left, count;
+    u32 flags;
+    struct lbr_dump req_buf;
+    struct lbr_stack stage;
+
+    if (request->buffer == NULL)
+        return -1;
+
+    // Get a copy of data from userspace buffer before taking the lock
+    bytes_left = xcopy_from_user(&req_buf, request->buffer,
+                                    sizeof(struct lbr_dump));
+    if (bytes_left)
+    {
+        xprintdbg("LIBIHT-COM: Copy LBR dump from user failed\n");
+        return -1;
+    }
+
+    if (stage_lbr(request->lbr_config.pid, &stage, &flags))
+        return -1;
+
+    // Never write past the buffers of the user
+    count = req_buf.count < lbr_capacity ? req_buf.count : lbr_capacity;
+
+    // Dump data to userspace entry ptr
+    if (req_buf.data.entries)
+    {
+        bytes_left = xcopy_to_user(req_buf.data.entries, stage.entries,
+                                    count * sizeof(struct lbr_stack_entry));
+        if (bytes_left)
+        {
+            xprintdbg("LIBIHT-COM: Copy LBR data to user failed\n");
+            xfree(stage.entries);
+            return -1;
+        }
+    }
+
+    // The LBR_INFO are only dumped if the state saves them
+    if (req_buf.info && (flags & LIBIHT_LBR_INFO))
+    {
+        bytes_left = xcopy_to_user(req_buf.info, stage.info,
+                                    count * sizeof(u64));
+        if (bytes_left)
+        {
+            xprintdbg("LIBIHT-COM: Copy LBR info to user failed\n");
+            xfree(stage.entries);
+            return -1;
+        }
+    }
+
+    // Copy updated data back to userspace buffer
+    req_buf.data.lbr_tos = stage.lbr_tos;
+    req_buf.lbr_format = stage.lbr_format;
+    req_buf.lbr_count = stage.lbr_count;
+    req_buf.count = count;
+    req_buf.lbr_capacity = lbr_capacity;
+    bytes_left = xcopy_to_user(request->buffer, &req_buf,
+                                sizeof(struct lbr_dump));
+    xfree(stage.entries);
+    if (bytes_left)
+    {
+        xprintdbg("LIBIHT-COM: Copy LBR dump to user failed\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : config_lbr
+// Description  : Configure the LBR selection bit for the given process in the
+//                request.
+//
+// Inputs       : request - the LBR ioctl request
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 config_lbr(struct lbr_ioctl_request *request)
+{
+    struct lbr_state* state;
+    char irql_flag[MAX_IRQL_LEN];
+    void *perf, *old_perf;
+    u64 lbr_select;
+    u32 pid;
+
+    xacquire_lock(lbr_state_lock, irql_flag);
+    state = find_lbr_state(request->lbr_config.pid);
+    if (state == NULL)
+    {
+        xrelease_lock(lbr_state_lock, irql_flag);
+        xprintdbg("LIBIHT-COM: LBR not enabled for pid %d\n",
+                    request->lbr_config.pid);
+        return -1;
+    }
+
+    if (state->config.pid == xgetcurrent_pid())
+    {
+        get_lbr(state);
+        state->config.flags = lbr_config_flags(request->lbr_config.flags);
+        state->config.lbr_select = lbr_config_select(state->config.flags,
+                                        request->lbr_config.lbr_select);
+        put_lbr(state);
+    }
+    else
+    {
+        state->config.flags = lbr_config_flags(request->lbr_config.flags);
+        state->config.lbr_select = lbr_config_select(state->config.flags,
+                                        request->lbr_config.lbr_select);
+    }
+
+    perf = state->perf;
+    pid = state->config.pid;
+    lbr_select = state->config.lbr_select;
+    xrelease_lock(lbr_state_lock, irql_flag);
+
+    // The perf filters are fixed at open, sample with a new event
+    if (perf)
+    {
+        perf = xperf_lbr_open(pid, lbr_select, LBR_PERF_PERIOD);
+        if (perf == NULL)
+            return -1;
+
+        // The state may be disabled while the event is opened
+        xacquire_lock(lbr_state_lock, irql_flag);
+        state = find_lbr_state(pid);
+        old_perf = perf;
+        if (state)
+        {
+            old_perf = state->perf;
+            state->perf = perf;
+        }
+        xrelease_lock(lbr_state_lock, irql_flag);
+        xperf_lbr_close(old_perf);
+    }
+
+    return 0;
+}
+
+//
+// LBR state (kernel maintained datastructure) helper functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : syscall_lbr
+// Description  : Configure the syscalls at whose entry the LBR of the requested
+//                process is snapshot, an empty bitmap turns it off. The
+//                global filter is rebuilt, so other syscalls only pay a bit
+//                test.
+//
+// Inputs       : request - the LBR syscall request
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 syscall_lbr(struct lbr_syscall_request *request)
+{
+    char irql_flag[MAX_IRQL_LEN];
+    struct lbr_state *state;
+
+    // The snapshots expose the control flow, like ptrace does
+    if (!xtrace_allowed(request->pid))
+    {
+        xprintdbg("LIBIHT-COM: LBR not permitted for pid %d\n", request->pid);
+        return -1;
+    }
 
-    for (i = 0; i < lbr_capacity; i++)
+    xacquire_lock(lbr_state_lock, irql_flag);
+    state = find_lbr_state(request->pid);
+    if (state == NULL)
     {
-        xwrmsr(MSR_LBR_NHM_FROM + i, state->data->entries[i].from);
-        xwrmsr(MSR_LBR_NHM_TO + i, state->data->entries[i].to);
+        xrelease_lock(lbr_state_lock, irql_flag);
+        xprintdbg("LIBIHT-COM: LBR not enabled for pid %d\n", request->pid);
+        return -1;
     }
 
+    xmemcpy(state->syscalls, request->syscalls, sizeof(state->syscalls));
+    update_lbr_syscall_filter();
     xrelease_lock(lbr_state_lock, irql_flag);
 
-    // Enable LBR
-    xrdmsr(MSR_IA32_DEBUGCTLMSR, &dbgctlmsr);
-    dbgctlmsr |= DEBUGCTLMSR_LBR;
-    xwrmsr(MSR_IA32_DEBUGCTLMSR, dbgctlmsr);
+    return 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : flush_lbr
-// Description  : Flush the LBR stack and registers. Caller should ensure this
-//                function is called with interrupts disabled (either on single
-//                core or with interrupts disabled for that core).
+// Function     : update_lbr_syscall_filter
+// Description  : Rebuild the union of the syscall bitmaps, for snapshots and
+//                CFI checks, of all LBR states. Bits of freed states are only
+//                dropped at the next rebuild, they just cost a lookup. Caller
+//                should hold the `lbr_state_lock`.
 //
 // Inputs       : void
 // Outputs      : void
 
-void flush_lbr(void)
+void update_lbr_syscall_filter(void)
 {
+    struct lbr_state *curr_state;
+    void *curr_list;
+    u64 offset;
     u32 i;
-    u64 dbgctlmsr;
-    char irql_flag[MAX_IRQL_LEN];
-
-    xlock_core(irql_flag);
-
-    // Disable LBR
-    xprintdbg("LIBIHT-COM: Flush LBR on cpu core: %d\n", xcoreid());
-    xrdmsr(MSR_IA32_DEBUGCTLMSR, &dbgctlmsr);
-    dbgctlmsr &= ~DEBUGCTLMSR_LBR;
-    xwrmsr(MSR_IA32_DEBUGCTLMSR, dbgctlmsr);
-
-    // Flush LBR registers
-    xwrmsr(MSR_LBR_SELECT, 0);
-    xwrmsr(MSR_LBR_TOS, 0);
 
-    for (i = 0; i < lbr_capacity; i++)
+    // offsetof(st, m) macro implementation of stddef.h
+    offset = (u64)(&((struct lbr_state *)0)->list);
+    xmemset(lbr_syscall_filter, 0, sizeof(lbr_syscall_filter));
+    curr_list = xlist_next(lbr_state_head);
+    while (curr_list != NULL && curr_list != lbr_state_head)
     {
-        xwrmsr(MSR_LBR_NHM_FROM + i, 0);
-        xwrmsr(MSR_LBR_NHM_TO + i, 0);
+        curr_state = (struct lbr_state *)((u64)curr_list - offset);
+        curr_list = xlist_next(curr_list);
+        for (i = 0; i < LIBIHT_SYSCALL_WORDS; i++)
+        {
+            lbr_syscall_filter[i] |= curr_state->syscalls[i];
+            if (curr_state->cfi)
+                lbr_syscall_filter[i] |= curr_state->cfi->syscalls[i];
+        }
     }
-
-    xrelease_core(irql_flag);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : enable_lbr
-// Description  : Enable the LBR feature for the requested process id.
+// Function     : cfi_lbr
+// Description  : Load the CFI policy of the requested process, in the spirit
+//                of PathArmor. At the entry of the selected syscalls, every
+//                edge in the live LBR must be in the allowlist. The allowlist
+//                must be sorted by from then to address, so each edge is
+//                found by binary search.
 //
-// Inputs       : request - the LBR ioctl request
+// Inputs       : request - the LBR CFI request
 // Outputs      : s32 - 0 on success, -1 on failure
 
-s32 enable_lbr(struct lbr_ioctl_request *request)
+s32 cfi_lbr(struct lbr_cfi_request *request)
 {
+    char irql_flag[MAX_IRQL_LEN];
     struct lbr_state *state;
+    struct lbr_cfi *cfi = NULL, *old_cfi;
+    u64 i, size;
 
-    state = find_lbr_state(request->lbr_config.pid);
-    if (state)
+    // A policy can deny the syscalls of the process, like ptrace could
+    if (!xtrace_allowed(request->pid))
     {
-        xprintdbg("LIBIHT-COM: LBR already enabled for pid %d\n",
-                    request->lbr_config.pid);
+        xprintdbg("LIBIHT-COM: LBR not permitted for pid %d\n", request->pid);
         return -1;
     }
 
-    state = create_lbr_state();
+    // The policy is loaded outside the lock, since it sleeps
+    if (request->action != LIBIHT_CFI_OFF)
+    {
+        if (request->action > LIBIHT_CFI_DENY || request->edge_count == 0 ||
+            request->edge_count > LIBIHT_CFI_MAX_EDGES)
+        {
+            xprintdbg("LIBIHT-COM: Invalid CFI policy\n");
+            return -1;
+        }
+
+        cfi = xmalloc(sizeof(struct lbr_cfi));
+        if (cfi == NULL)
+            return -1;
+
+        size = request->edge_count * sizeof(struct lbr_stack_entry);
+        cfi->edges = xmalloc_pages(size);
+        if (cfi->edges == NULL)
+        {
+            xfree(cfi);
+            return -1;
+        }
+
+        if (xcopy_from_user(cfi->edges, request->edges, size))
+        {
+            xprintdbg("LIBIHT-COM: Copy CFI edges from user failed\n");
+            xfree_pages(cfi->edges, size);
+            xfree(cfi);
+            return -1;
+        }
+
+        // Binary search needs the edges sorted
+        for (i = 1; i < request->edge_count; i++)
+        {
+            if (cfi->edges[i - 1].from > cfi->edges[i].from ||
+                (cfi->edges[i - 1].from == cfi->edges[i].from &&
+                    cfi->edges[i - 1].to > cfi->edges[i].to))
+            {
+                xprintdbg("LIBIHT-COM: CFI edges not sorted\n");
+                xfree_pages(cfi->edges, size);
+                xfree(cfi);
+                return -1;
+            }
+        }
+
+        cfi->refs = 1;
+        cfi->action = request->action;
+        cfi->edge_count = request->edge_count;
+        cfi->violations = 0;
+        xmemcpy(cfi->syscalls, request->syscalls, sizeof(cfi->syscalls));
+    }
+
+    xacquire_lock(lbr_state_lock, irql_flag);
+    state = find_lbr_state(request->pid);
     if (state == NULL)
     {
-        xprintdbg("LIBIHT-COM: Create LBR state failed\n");
+        xrelease_lock(lbr_state_lock, irql_flag);
+        xprintdbg("LIBIHT-COM: LBR not enabled for pid %d\n", request->pid);
+        // The policy is not shared yet
+        put_lbr_cfi(cfi);
         return -1;
     }
 
-    // Setup config fields for LBR state
-    state->parent = NULL;
-    state->config.pid = request->lbr_config.pid ?
-                                    request->lbr_config.pid : xgetcurrent_pid();
-    state->config.lbr_select = request->lbr_config.lbr_select ?
-                                    request->lbr_config.lbr_select : LBR_SELECT;
-    insert_lbr_state(state);
+    old_cfi = state->cfi;
+    state->cfi = cfi;
+    put_lbr_cfi(old_cfi);
+    update_lbr_syscall_filter();
+    xrelease_lock(lbr_state_lock, irql_flag);
 
-    // If the requesting process is the current process, trace it right away
-    if (state->config.pid == xgetcurrent_pid())
-        put_lbr(state);
     return 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : disable_lbr
-// Description  : Disable the LBR feature for the requested process id.
+// Function     : put_lbr_cfi
+// Description  : Drop a reference to a CFI policy, and free it with the last
+//                one. Caller should hold the `lbr_state_lock`.
 //
-// Inputs       : request - the LBR ioctl request
-// Outputs      : s32 - 0 on success, -1 on failure
-
+// Inputs       : cfi - the CFI policy, can be NULL
+// Outputs      : void
 
-s32 disable_lbr(struct lbr_ioctl_request *request)
+void put_lbr_cfi(struct lbr_cfi *cfi)
 {
-    struct lbr_state *state;
-
-    state = find_lbr_state(request->lbr_config.pid);
-    if (state == NULL)
-    {
-        xprintdbg("LIBIHT-COM: LBR not enabled for pid %d\n",
-                    request->lbr_config.pid);
-        return -1;
-    }
+    if (cfi == NULL || --cfi->refs)
+        return;
 
-    if (state->config.pid == xgetcurrent_pid())
-        get_lbr(state);
-    remove_lbr_state(state);
-    return 0;
+    xfree_pages(cfi->edges, cfi->edge_count * sizeof(struct lbr_stack_entry));
+    xfree(cfi);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : dump_lbr
-// Description  : Dump the LBR registers for the given process id.
+// Function     : check_lbr_cfi
+// Description  : Check every edge in the live LBR of the current process
+//                against the allowlist of its CFI policy, if the syscall is
+//                selected by it. While the LBR is not running, a policy that
+//                denies checks the LBR saved at the last switch out or sample
+//                instead, and denies the syscall if none was saved, while one
+//                that logs checks nothing. Caller should hold the
+//                `lbr_state_lock`.
 //
-// Inputs       : request - the LBR ioctl request
-// Outputs      : s32 - 0 on success, -1 on failure
+// Inputs       : state - the LBR state of the current process
+//                syscall - the syscall entered
+// Outputs      : s32 - 0 to allow the syscall, -1 to deny it
 
-s32 dump_lbr(struct lbr_ioctl_request *request)
+s32 check_lbr_cfi(struct lbr_state *state, u64 syscall)
 {
-    u64 i, bytes_left;
-    struct lbr_state* state;
-    struct lbr_data req_buf;
-    char irql_flag[MAX_IRQL_LEN];
+    struct lbr_stack_entry *entry, *edge;
+    struct lbr_cfi *cfi;
+    u64 low, high, mid, from;
+    s32 ret = 0;
+    u32 i, skip, live, seen = 0;
 
-    state = find_lbr_state(request->lbr_config.pid);
-    if (state == NULL)
+    cfi = state->cfi;
+    if (cfi == NULL || !((cfi->syscalls[syscall / 64] >> (syscall % 64)) & 1))
+        return 0;
+
+    // A policy that denies must not fail open on an LBR it cannot read
+    live = read_lbr(state) == 0;
+    if (!live && cfi->action != LIBIHT_CFI_DENY)
+        return 0;
+
+    // The allowlist holds addresses, without the flags of formats 3 and 4
+    skip = 0;
+    if (state->data->lbr_format == LBR_FORMAT_EIP_FLAGS)
+        skip = LBR_FROM_FLAGS_EIP;
+    else if (state->data->lbr_format == LBR_FORMAT_EIP_FLAGS2)
+        skip = LBR_FROM_FLAGS_TSX;
+
+    for (i = 0; i < lbr_capacity; i++)
     {
-        xprintdbg("LIBIHT-COM: LBR not enabled for pid %d\n",
-                    request->lbr_config.pid);
-        return -1;
+        entry = &state->data->entries[i];
+        if (entry->from == 0 && entry->to == 0)
+            continue;
+
+        seen++;
+        from = (u64)((s64)(entry->from << skip) >> skip);
+        low = 0;
+        high = cfi->edge_count;
+        while (low < high)
+        {
+            mid = low + (high - low) / 2;
+            edge = &cfi->edges[mid];
+            if (edge->from < from ||
+                (edge->from == from && edge->to < entry->to))
+                low = mid + 1;
+            else
+                high = mid;
+        }
+
+        if (low < cfi->edge_count && cfi->edges[low].from == from &&
+            cfi->edges[low].to == entry->to)
+            continue;
+
+        // The traced process chooses how often it violates the policy
+        cfi->violations++;
+        if (xprint_ratelimit())
+            xprintdbg("LIBIHT-COM: CFI violation for pid %d at syscall %lld, "
+                        "edge 0x%llx -> 0x%llx\n", state->config.pid, syscall,
+                        from, entry->to);
+        if (cfi->action == LIBIHT_CFI_DENY)
+            ret = -1;
+        break;
     }
 
-    // Examine if the current process is the owner of the LBR state
-    if (state->config.pid == xgetcurrent_pid())
+    if (!live && seen == 0)
     {
-        xprintdbg("LIBIHT-COM: Dump LBR for current process\n");
-        // Get fresh LBR info
-        get_lbr(state);
-        put_lbr(state);
+        cfi->violations++;
+        if (xprint_ratelimit())
+            xprintdbg("LIBIHT-COM: CFI unchecked for pid %d at syscall %lld, "
+                        "no LBR saved\n", state->config.pid, syscall);
+        ret = -1;
     }
 
-    xacquire_lock(lbr_state_lock, irql_flag);
+    return ret;
+}
 
-    // Dump the LBR state
-    xprintdbg("PROC_PID:             %d\n", state->config.pid);
-    xprintdbg("MSR_LBR_SELECT:       0x%llx\n", state->config.lbr_select);
-    xprintdbg("MSR_LBR_TOS:          %lld\n", state->data->lbr_tos);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : read_lbr_snapshot
+// Description  : Read the LBR saved for a process as one snapshot record, in
+//                the layout of the snapshot ring and the session records. The
+//                saved LBR is the one of the last context switch or sample, so
+//                the live registers of a running process are not touched. It
+//                may run from a BPF program that interrupted a holder of the
+//                `lbr_state_lock` on this core, so it never spins on the lock.
+//
+// Inputs       : pid - the process ID
+//                buf - the buffer to write the record to, NULL to query size
+//                size - the size of the buffer
+// Outputs      : s64 - the size of the record, or `LBR_SNAPSHOT_NONE` if the
+//                LBR is not enabled for pid, `LBR_SNAPSHOT_SMALL` if the
+//                buffer is too small for the record, `LBR_SNAPSHOT_BUSY` if
+//                the LBR state is locked
+
+s64 read_lbr_snapshot(u32 pid, void *buf, u64 size)
+{
+    struct lbr_state *state;
+    char irql_flag[MAX_IRQL_LEN];
+    u64 record_size;
 
-    for (i = 0; i < lbr_capacity; i++)
+    if (xtry_acquire_lock(lbr_state_lock, irql_flag))
+        return LBR_SNAPSHOT_BUSY;
+
+    state = find_lbr_state(pid);
+    if (state == NULL)
     {
-        xprintdbg("MSR_LBR_NHM_FROM[%2d]: 0x%llx\n", i,
-                    state->data->entries[i].from);
-        xprintdbg("MSR_LBR_NHM_TO  [%2d]: 0x%llx\n", i,
-                    state->data->entries[i].to);
+        xrelease_lock(lbr_state_lock, irql_flag);
+        return LBR_SNAPSHOT_NONE;
     }
 
-    xprintdbg("LIBIHT-COM: LBR info for cpuid: %d\n", xcoreid());
-
-    // Dump the LBR data to userspace buffer
-    if (request->buffer)
+    record_size = sizeof(struct lbr_snapshot) + lbr_entries_size(state);
+    if (buf != NULL)
     {
-        // Get a copy of data from userspace buffer
-        bytes_left = xcopy_from_user(&req_buf, request->buffer,
-                                        sizeof(struct lbr_data));
-        if (bytes_left)
+        if (size < record_size)
         {
-            xprintdbg("LIBIHT-COM: Copy LBR data from user failed\n");
             xrelease_lock(lbr_state_lock, irql_flag);
-            return -1;
-        }
-
-        // Dump data to userspace entry ptr
-        req_buf.lbr_tos = state->data->lbr_tos;
-        if (req_buf.entries)
-        {
-            bytes_left = xcopy_to_user(req_buf.entries,
-                                        state->data->entries,
-                                        lbr_capacity * sizeof(struct lbr_stack_entry));
-
-            if (bytes_left)
-            {
-                xprintdbg("LIBIHT-COM: Copy LBR data to user failed\n");
-                xrelease_lock(lbr_state_lock, irql_flag);
-                return -1;
-            }
+            return LBR_SNAPSHOT_SMALL;
         }
 
-        // Copy updated data back to userspace buffer
-        bytes_left = xcopy_to_user(request->buffer, &req_buf,
-                                    sizeof(struct lbr_data));
-        if (bytes_left)
-        {
-            xprintdbg("LIBIHT-COM: Copy LBR data to user failed\n");
-            xrelease_lock(lbr_state_lock, irql_flag);
-            return -1;
-        }
+        lbr_fill_snapshot(state, buf, LIBIHT_NO_SYSCALL);
+        xmemcpy((struct lbr_snapshot *)buf + 1, state->data->entries,
+                lbr_entries_size(state));
     }
 
     xrelease_lock(lbr_state_lock, irql_flag);
-
-    return 0;
+    return (s64)record_size;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : config_lbr
-// Description  : Configure the LBR selection bit for the given process in the
-//                request.
+// Function     : crash_lbr
+// Description  : Freeze the LBR of a crashing process into a crash capture.
+//                The live LBR is read if it is running on this core, else the
+//                LBR saved at the last context switch is taken.
 //
-// Inputs       : request - the LBR ioctl request
-// Outputs      : s32 - 0 on success, -1 on failure
+// Inputs       : pid - the process ID of the crashing process
+//                capture - the crash capture to fill
+// Outputs      : s32 - 0 on success, -1 if the LBR is not enabled for pid
 
-s32 config_lbr(struct lbr_ioctl_request *request)
+s32 crash_lbr(u32 pid, struct crash_capture *capture)
 {
-    struct lbr_state* state;
+    char irql_flag[MAX_IRQL_LEN];
+    struct lbr_state *state;
+    u64 count;
 
-    state = find_lbr_state(request->lbr_config.pid);
+    xacquire_lock(lbr_state_lock, irql_flag);
+
+    state = find_lbr_state(pid);
     if (state == NULL)
     {
-        xprintdbg("LIBIHT-COM: LBR not enabled for pid %d\n",
-                    request->lbr_config.pid);
+        xrelease_lock(lbr_state_lock, irql_flag);
         return -1;
     }
 
-    if (state->config.pid == xgetcurrent_pid())
-    {
-        get_lbr(state);
-        state->config.lbr_select = request->lbr_config.lbr_select;
-        put_lbr(state);
-    }
-    else
-    {
-        state->config.lbr_select = request->lbr_config.lbr_select;
-    }
+    read_lbr(state);
+    count = state->data->lbr_count < LIBIHT_CRASH_LBR_ENTRIES ?
+            state->data->lbr_count : LIBIHT_CRASH_LBR_ENTRIES;
+    capture->lbr_tos = state->data->lbr_tos;
+    capture->lbr_count = count;
+    xmemcpy(capture->lbr, state->data->entries,
+            count * sizeof(struct lbr_stack_entry));
 
+    xrelease_lock(lbr_state_lock, irql_flag);
     return 0;
 }
 
-//
-// LBR state (kernel maintained datastructure) helper functions
-
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : create_lbr_state
@@ -362,21 +1563,25 @@ s32 config_lbr(struct lbr_ioctl_request *request)
 struct lbr_state* create_lbr_state(void)
 {
     struct lbr_state* state;
-    struct lbr_data* data;
+    struct lbr_stack* data;
     struct lbr_stack_entry* entries;
+    struct lbr_ring_header* ring;
+    u64 slot_size;
 
     state = xmalloc(sizeof(struct lbr_state));
     if (state == NULL)
         return NULL;
 
-    data = xmalloc(sizeof(struct lbr_data));
+    data = xmalloc(sizeof(struct lbr_stack));
     if (data == NULL)
     {
         xfree(state);
         return NULL;
     }
 
-    entries = xmalloc(sizeof(struct lbr_stack_entry) * lbr_capacity);
+    // The LBR_INFO of each entry are kept right after the entries
+    entries = xmalloc((sizeof(struct lbr_stack_entry) + sizeof(u64)) *
+                        lbr_capacity);
     if (entries == NULL)
     {
         xfree(data);
@@ -384,12 +1589,50 @@ struct lbr_state* create_lbr_state(void)
         return NULL;
     }
 
+    // Cache line aligned slots for the snapshot ring
+    slot_size = sizeof(struct lbr_snapshot) +
+                    (sizeof(struct lbr_stack_entry) + sizeof(u64)) * lbr_capacity;
+    slot_size = (slot_size + 63) & ~(u64)63;
+    ring = xmalloc_pages(XPAGE_SIZE + slot_size * LBR_RING_SLOTS);
+    if (ring == NULL)
+    {
+        xfree(entries);
+        xfree(data);
+        xfree(state);
+        return NULL;
+    }
+
     xmemset(state, 0, sizeof(struct lbr_state));
-    xmemset(data, 0, sizeof(struct lbr_data));
-    xmemset(entries, 0, sizeof(struct lbr_stack_entry) * lbr_capacity);
+
+    // XSAVES needs a 64-byte aligned area, a page is enough for 64 entries
+    if (lbr_xsave_size)
+    {
+        state->xsave = xmalloc_pages(XPAGE_SIZE);
+        if (state->xsave == NULL)
+        {
+            xfree_pages(ring, XPAGE_SIZE + slot_size * LBR_RING_SLOTS);
+            xfree(entries);
+            xfree(data);
+            xfree(state);
+            return NULL;
+        }
+        xmemset(state->xsave, 0, XPAGE_SIZE);
+    }
+
+    xmemset(data, 0, sizeof(struct lbr_stack));
+    xmemset(entries, 0, (sizeof(struct lbr_stack_entry) + sizeof(u64)) *
+                            lbr_capacity);
 
     state->data = data;
     data->entries = entries;
+    data->info = (u64 *)(entries + lbr_capacity);
+
+    state->ring = ring;
+    state->ring_slots = LBR_RING_SLOTS;
+    state->ring_slot_size = slot_size;
+    ring->slots = LBR_RING_SLOTS;
+    ring->slot_size = slot_size;
+    ring->lbr_capacity = lbr_capacity;
 
     return state;
 }
@@ -397,20 +1640,19 @@ struct lbr_state* create_lbr_state(void)
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : find_lbr_state
-// Description  : Find the LBR state for the given process id.
+// Description  : Find the LBR state for the given process id. Caller should
+//                hold the `lbr_state_lock` for as long as it uses the state,
+//                which may be freed as soon as the lock is released.
 //
 // Inputs       : pid - the process id
 // Outputs      : struct lbr_state* - the LBR state
 
 struct lbr_state* find_lbr_state(u32 pid)
 {
-    char irql_flag[MAX_IRQL_LEN];
     struct lbr_state *curr_state, *ret_state = NULL;
     void *curr_list;
     u64 offset;
 
-    xacquire_lock(lbr_state_lock, irql_flag);
-
     // offsetof(st, m) macro implementation of stddef.h
     offset = (u64)(&((struct lbr_state *)0)->list);
     curr_list = xlist_next(lbr_state_head);
@@ -425,8 +1667,6 @@ struct lbr_state* find_lbr_state(u32 pid)
         }
     }
 
-    xrelease_lock(lbr_state_lock, irql_flag);
-
     return ret_state;
 }
 
@@ -460,40 +1700,109 @@ void insert_lbr_state(struct lbr_state* new_state)
 // Inputs       : old_state - the old LBR state
 // Outputs      : void
 
-void remove_lbr_state(struct lbr_state* old_state)
-{
-    char irql_flag[MAX_IRQL_LEN];
+void remove_lbr_state(struct lbr_state* old_state)
+{
+    char irql_flag[MAX_IRQL_LEN];
+
+    if (old_state == NULL)
+        return;
+
+    xacquire_lock(lbr_state_lock, irql_flag);
+    xprintdbg("LIBIHT-COM: Remove LBR state for pid %d\n",
+                old_state->config.pid);
+    xlist_del(old_state->list);
+    free_lbr_state(old_state);
+    xrelease_lock(lbr_state_lock, irql_flag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : free_lbr_state
+// Description  : Free the LBR state together with its data and snapshot ring.
+//                Ring pages still mapped into user space are released on
+//                unmap. Caller should hold the `lbr_state_lock`, or have
+//                dropped the CFI policy of the state already.
+//
+// Inputs       : state - the LBR state
+// Outputs      : void
+
+void free_lbr_state(struct lbr_state *state)
+{
+    put_lbr_cfi(state->cfi);
+    if (state->perf)
+        xperf_lbr_close(state->perf);
+    if (state->xsave)
+        xfree_pages(state->xsave, XPAGE_SIZE);
+    xfree_pages(state->ring,
+                XPAGE_SIZE + state->ring_slots * state->ring_slot_size);
+    xfree(state->data->entries);
+    xfree(state->data);
+    xfree(state);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : free_lbr_state_list
+// Description  : Free the LBR state list.
+//
+// Inputs       : void
+// Outputs      : void
+
+void free_lbr_state_list(void)
+{
+    char irql_flag[MAX_IRQL_LEN];
+    struct lbr_state *curr_state;
+    void *curr_list;
+    u64 offset;
+
+    xacquire_lock(lbr_state_lock, irql_flag);
+
+    // offsetof(st, m) macro implementation of stddef.h
+    offset = (u64)(&((struct lbr_state *)0)->list);
+    curr_list = xlist_next(lbr_state_head);
+    while (curr_list != NULL && curr_list != lbr_state_head)
+    {
+        curr_state = (struct lbr_state *)((u64)curr_list - offset);
+        curr_list = xlist_next(curr_list);
+        xprintdbg("LIBIHT-COM: Free LBR state for pid %d\n",
+                    curr_state->config.pid);
 
-    if (old_state == NULL)
-        return;
+        xlist_del(curr_state->list);
+        free_lbr_state(curr_state);
+    }
 
-    xacquire_lock(lbr_state_lock, irql_flag);
-    xprintdbg("LIBIHT-COM: Remove LBR state for pid %d\n",
-                old_state->config.pid);
-    xlist_del(old_state->list);
-    xfree(old_state->data->entries);
-    xfree(old_state->data);
-    xfree(old_state);
     xrelease_lock(lbr_state_lock, irql_flag);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : free_lbr_state_list
-// Description  : Free the LBR state list.
+// Function     : release_lbr_session
+// Description  : Unsubscribe a session from the LBR states, i.e. enabled
+//                through it or inherited from those, and remove the states
+//                left without subscribers, so no tracing cost outlives the
+//                consumer. States shared with other sessions keep tracing.
 //
-// Inputs       : void
+// Inputs       : session - the session
 // Outputs      : void
 
-void free_lbr_state_list(void)
+void release_lbr_session(struct session *session)
 {
     char irql_flag[MAX_IRQL_LEN];
+    char dying_head[MAX_LIST_LEN];
     struct lbr_state *curr_state;
     void *curr_list;
     u64 offset;
+    u32 dying = 0;
 
+    xinit_list_head(dying_head);
     xacquire_lock(lbr_state_lock, irql_flag);
 
+    // Stop tracing the releasing process first, like disable_lbr does
+    curr_state = find_lbr_state(xgetcurrent_pid());
+    if (curr_state && curr_state->subs.count == 1 &&
+        curr_state->subs.sessions[0] == session)
+        get_lbr(curr_state);
+
     // offsetof(st, m) macro implementation of stddef.h
     offset = (u64)(&((struct lbr_state *)0)->list);
     curr_list = xlist_next(lbr_state_head);
@@ -501,16 +1810,32 @@ void free_lbr_state_list(void)
     {
         curr_state = (struct lbr_state *)((u64)curr_list - offset);
         curr_list = xlist_next(curr_list);
-        xprintdbg("LIBIHT-COM: Free LBR state for pid %d\n",
-                    curr_state->config.pid);
+        if (unsubscribe_session(&curr_state->subs, session) ||
+            curr_state->subs.count)
+            continue;
 
+        xprintdbg("LIBIHT-COM: Release LBR state for pid %d\n",
+                    curr_state->config.pid);
         xlist_del(curr_state->list);
-        xfree(curr_state->data->entries);
-        xfree(curr_state->data);
-        xfree(curr_state);
+        put_lbr_cfi(curr_state->cfi);
+        curr_state->cfi = NULL;
+        xlist_add(curr_state->list, dying_head);
+        dying++;
     }
 
     xrelease_lock(lbr_state_lock, irql_flag);
+
+    // Stop the removed states still traced on other cores, then free them
+    // outside the lock, since closing perf sleeps
+    if (dying)
+        xon_each_cpu_arg(stop_lbr, NULL);
+    curr_list = xlist_next(dying_head);
+    while (curr_list != dying_head)
+    {
+        curr_state = (struct lbr_state *)((u64)curr_list - offset);
+        curr_list = xlist_next(curr_list);
+        free_lbr_state(curr_state);
+    }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -518,10 +1843,11 @@ void free_lbr_state_list(void)
 // Function     : lbr_ioctl_handler
 // Description  : The ioctl handler for the LBR feature.
 //
-// Inputs       : request - the LBR ioctl request
+// Inputs       : session - the session of the request, can be NULL
+//                request - the LBR ioctl request
 // Outputs      : s32 - 0 on success, -1 on failure
 
-s32 lbr_ioctl_handler(struct xioctl_request *request)
+s32 lbr_ioctl_handler(struct session *session, struct xioctl_request *request)
 {
     s32 ret = 0;
 
@@ -531,12 +1857,12 @@ s32 lbr_ioctl_handler(struct xioctl_request *request)
         case LIBIHT_IOCTL_ENABLE_LBR:
             xprintdbg("LIBIHT-COM: Enable LBR for pid %d\n",
                         request->body.lbr.lbr_config.pid);
-            ret = enable_lbr(&request->body.lbr);
+            ret = enable_lbr(session, &request->body.lbr);
             break;
         case LIBIHT_IOCTL_DISABLE_LBR:
             xprintdbg("LIBIHT-COM: Disable LBR for pid %d\n",
                         request->body.lbr.lbr_config.pid);
-            ret = disable_lbr(&request->body.lbr);
+            ret = disable_lbr(session, &request->body.lbr);
             break;
         case LIBIHT_IOCTL_DUMP_LBR:
             xprintdbg("LIBIHT-COM: Dump LBR for pid %d\n",
@@ -548,6 +1874,21 @@ s32 lbr_ioctl_handler(struct xioctl_request *request)
                         request->body.lbr.lbr_config.pid);
             ret = config_lbr(&request->body.lbr);
             break;
+        case LIBIHT_IOCTL_SYSCALL_LBR:
+            xprintdbg("LIBIHT-COM: Syscall LBR for pid %d\n",
+                        request->body.lbr_syscall.pid);
+            ret = syscall_lbr(&request->body.lbr_syscall);
+            break;
+        case LIBIHT_IOCTL_CFI_LBR:
+            xprintdbg("LIBIHT-COM: CFI LBR for pid %d\n",
+                        request->body.lbr_cfi.pid);
+            ret = cfi_lbr(&request->body.lbr_cfi);
+            break;
+        case LIBIHT_IOCTL_DUMP_LBR_INFO:
+            xprintdbg("LIBIHT-COM: Dump LBR info for pid %d\n",
+                        request->body.lbr_dump.lbr_config.pid);
+            ret = dump_lbr_info(&request->body.lbr_dump);
+            break;
         default:
             xprintdbg("LIBIHT-COM: Invalid LBR ioctl command\n");
             ret = -1;
@@ -560,7 +1901,9 @@ s32 lbr_ioctl_handler(struct xioctl_request *request)
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : lbr_cswitch_handler
-// Description  : The context switch handler for the LBR feature.
+// Description  : The context switch handler for the LBR feature. The traced
+//                tasks switching out and in are annotated by switch records,
+//                flagged when the task migrated since its last time slice.
 //
 // Inputs       : prev_pid - the previous process id
 //                next_pid - the next process id
@@ -569,6 +1912,10 @@ s32 lbr_ioctl_handler(struct xioctl_request *request)
 void lbr_cswitch_handler(u32 prev_pid, u32 next_pid)
 {
     struct lbr_state *prev_state, *next_state;
+    char irql_flag[MAX_IRQL_LEN];
+    u32 flags;
+
+    xacquire_lock(lbr_state_lock, irql_flag);
 
     prev_state = find_lbr_state(prev_pid);
     next_state = find_lbr_state(next_pid);
@@ -578,14 +1925,28 @@ void lbr_cswitch_handler(u32 prev_pid, u32 next_pid)
         xprintdbg("LIBIHT-COM: LBR context switch from pid %d on cpu core %d\n",
                     prev_state->config.pid, xcoreid());
         get_lbr(prev_state);
+
+        // Switch out after the last snapshot of the time slice
+        subscribers_switch(&prev_state->subs, prev_pid, LIBIHT_SWITCH_OUT,
+                            next_pid, lbr_shadowed);
     }
 
     if (next_state)
     {
         xprintdbg("LIBIHT-COM: LBR context switch to pid %d on cpu core %d\n",
                     next_state->config.pid, xcoreid());
+
+        flags = LIBIHT_SWITCH_IN;
+        if (next_state->last_cpu && next_state->last_cpu != xcoreid() + 1)
+            flags |= LIBIHT_SWITCH_MIGRATED;
+        next_state->last_cpu = xcoreid() + 1;
+        subscribers_switch(&next_state->subs, next_pid, flags, prev_pid,
+                            lbr_shadowed);
+
         put_lbr(next_state);
     }
+
+    xrelease_lock(lbr_state_lock, irql_flag);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -602,7 +1963,9 @@ void lbr_newproc_handler(u32 parent_pid, u32 child_pid)
     struct lbr_state *parent_state, *child_state;
     char irql_flag[MAX_IRQL_LEN];
 
+    xacquire_lock(lbr_state_lock, irql_flag);
     parent_state = find_lbr_state(parent_pid);
+    xrelease_lock(lbr_state_lock, irql_flag);
     if (parent_state == NULL)
         return;
 
@@ -612,60 +1975,478 @@ void lbr_newproc_handler(u32 parent_pid, u32 child_pid)
     if (child_state == NULL)
         return;
 
+    // The parent may be disabled while the child state is created
     xacquire_lock(lbr_state_lock, irql_flag);
+    parent_state = find_lbr_state(parent_pid);
+    if (parent_state == NULL)
+    {
+        xrelease_lock(lbr_state_lock, irql_flag);
+        free_lbr_state(child_state);
+        return;
+    }
+
     // Copy parent state to child state
     child_state->parent = parent_state;
     child_state->config.pid = child_pid;
     child_state->config.lbr_select = parent_state->config.lbr_select;
-    xmemcpy(child_state->data, parent_state->data,
-                sizeof(struct lbr_data) +
-                    lbr_capacity * sizeof(struct lbr_stack_entry));
-    xrelease_lock(lbr_state_lock, irql_flag);
-    insert_lbr_state(child_state);
+    child_state->config.flags = parent_state->config.flags;
+    child_state->subs = parent_state->subs;
+    xmemcpy(child_state->syscalls, parent_state->syscalls,
+                sizeof(child_state->syscalls));
+    child_state->cfi = parent_state->cfi;
+    if (child_state->cfi)
+        child_state->cfi->refs++;
+    child_state->data->lbr_tos = parent_state->data->lbr_tos;
+    child_state->data->lbr_format = parent_state->data->lbr_format;
+    child_state->data->lbr_count = parent_state->data->lbr_count;
+    xmemcpy(child_state->data->entries, parent_state->data->entries,
+                lbr_entries_size(parent_state));
+    // Insert in the same critical section, so a session released meanwhile
+    // is never inherited
+    xprintdbg("LIBIHT-COM: Insert LBR state for pid %d\n", child_pid);
+    xlist_add(child_state->list, lbr_state_head);
 
     // If the child process is the current process, trace it right away
     if (child_pid == xgetcurrent_pid())
         put_lbr(child_state);
+    xrelease_lock(lbr_state_lock, irql_flag);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : lbr_check
-// Description  : Check if the LBR feature is available on the current CPU.
-//                And set the global variable `lbr_capacity`.
+// Function     : lbr_perf_handler
+// Description  : Publish a branch stack sample of the perf backend into the
+//                snapshot ring and sessions of the sampled thread. The
+//                branches come youngest first, like the Arch LBR, so they are
+//                saved in reverse with the TOS on the last one.
 //
-// Inputs       : void
-// Outputs      : s32 - 0 on success, -1 on failure
+// Inputs       : tid - the thread sampled
+//                nr - the number of branches
+//                entries - the branches, youngest first
+//                info - the flags of each branch, in the LBR_INFO layout
+// Outputs      : void
 
-s32 lbr_check(void)
+void lbr_perf_handler(u32 tid, u32 nr, struct lbr_stack_entry *entries,
+                        u64 *info)
+{
+    struct lbr_state *state;
+    struct lbr_stack *data;
+    char irql_flag[MAX_IRQL_LEN];
+    u32 i, idx;
+
+    if (nr == 0)
+        return;
+    if (nr > lbr_capacity)
+        nr = (u32)lbr_capacity;
+
+    xacquire_lock(lbr_state_lock, irql_flag);
+
+    state = find_lbr_state(tid);
+    if (state == NULL || !subscribers_gate_open(&state->subs))
+    {
+        xrelease_lock(lbr_state_lock, irql_flag);
+        return;
+    }
+
+    data = state->data;
+    xmemset(data->entries, 0, lbr_entries_size(state));
+    for (i = 0; i < nr; i++)
+    {
+        idx = nr - 1 - i;
+        data->entries[idx] = entries[i];
+        if (state->config.flags & LIBIHT_LBR_INFO)
+            data->info[idx] = info[i];
+    }
+    data->lbr_tos = nr - 1;
+    data->lbr_format = LIBIHT_LBR_FORMAT_PERF;
+    data->lbr_count = nr;
+
+    publish_lbr_snapshot(state, LIBIHT_NO_SYSCALL);
+    drain_lbr(state, LIBIHT_NO_SYSCALL);
+
+    xrelease_lock(lbr_state_lock, irql_flag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lbr_subscribed
+// Description  : Check if a session is subscribed to the LBR of a process.
+//                Caller should not hold any trace state lock.
+//
+// Inputs       : pid - the process id
+//                session - the session
+// Outputs      : s32 - 1 if subscribed, 0 if not
+
+s32 lbr_subscribed(u32 pid, struct session *session)
+{
+    struct lbr_state *state;
+    char irql_flag[MAX_IRQL_LEN];
+    s32 ret = 0;
+    u32 i;
+
+    xacquire_lock(lbr_state_lock, irql_flag);
+    state = find_lbr_state(pid);
+    for (i = 0; state != NULL && i < state->subs.count; i++)
+        if (state->subs.sessions[i] == session)
+            ret = 1;
+    xrelease_lock(lbr_state_lock, irql_flag);
+
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lbr_shadowed
+// Description  : Check if the switch and mapping records of a process go into
+//                a session through another feature. A session tracing a process
+//                with several features gets them from the last one dispatched
+//                at a switch, PT then BTS then LBR, so a switch out follows the
+//                trace of every feature. Caller may hold the LBR state lock.
+//
+// Inputs       : pid - the process id
+//                session - the session
+// Outputs      : s32 - 1 if shadowed, 0 if not
+
+s32 lbr_shadowed(u32 pid, struct session *session)
+{
+    return bts_subscribed(pid, session) || pt_subscribed(pid, session);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : drain_lbr_mmap
+// Description  : Fan a mapping record of a process out to the sessions
+//                subscribed to its LBR. Matches the callback of
+//                `xfor_each_exec_mapping`. The state is looked up again for
+//                each record, since it may be disabled during the walk.
+//
+// Inputs       : ctx - unused
+//                pid - the process id
+//                record - the mapping record
+//                path - the path of the mapped file, NUL terminated
+//                path_size - the size of the path, NUL included
+// Outputs      : void
+
+void drain_lbr_mmap(void *ctx, u32 pid, struct trace_mmap_record *record,
+                    char *path, u32 path_size)
+{
+    struct lbr_state *state;
+    char irql_flag[MAX_IRQL_LEN];
+    u32 i;
+
+    xacquire_lock(lbr_state_lock, irql_flag);
+    state = find_lbr_state(pid);
+    for (i = 0; state != NULL && i < state->subs.count; i++)
+        if (state->subs.sessions[i] &&
+            !lbr_shadowed(pid, state->subs.sessions[i]))
+            session_mmap(state->subs.sessions[i], pid, record, path,
+                            path_size);
+    xrelease_lock(lbr_state_lock, irql_flag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lbr_mmap_handler
+// Description  : The executable mapping handler for the LBR feature. Called in
+//                the context of the process after it maps code, e.g. by mmap,
+//                mprotect or exec, to describe the new mappings in the range.
+//
+// Inputs       : pid - the process id
+//                start - the start address of the range
+//                end - the end address of the range
+// Outputs      : void
+
+void lbr_mmap_handler(u32 pid, u64 start, u64 end)
+{
+    char irql_flag[MAX_IRQL_LEN];
+    struct lbr_state *state;
+
+    xacquire_lock(lbr_state_lock, irql_flag);
+    state = find_lbr_state(pid);
+    xrelease_lock(lbr_state_lock, irql_flag);
+    if (state == NULL)
+        return;
+
+    xfor_each_exec_mapping(pid, start, end, drain_lbr_mmap, NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lbr_exitproc_handler
+// Description  : The process exit handler for the LBR feature. The sessions
+//                subscribed to the LBR of the process are flushed, since its
+//                last records may be left below their watermark.
+//
+// Inputs       : pid - the process id
+// Outputs      : void
+
+void lbr_exitproc_handler(u32 pid)
+{
+    char irql_flag[MAX_IRQL_LEN];
+    struct lbr_state *state;
+
+    xacquire_lock(lbr_state_lock, irql_flag);
+    state = find_lbr_state(pid);
+    if (state)
+        subscribers_flush(&state->subs);
+    xrelease_lock(lbr_state_lock, irql_flag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lbr_syscall_handler
+// Description  : The syscall entry handler for the LBR feature. Called in the
+//                context of the process entering the syscall, which is
+//                snapshot if the syscall is in the bitmap of its state, and
+//                checked against its CFI policy if sensitive.
+//
+// Inputs       : pid - the process id
+//                syscall - the syscall number
+//                sensitive - the syscall arguments are worth a CFI check
+// Outputs      : s32 - 0 to allow the syscall, -1 to deny it
+
+s32 lbr_syscall_handler(u32 pid, u64 syscall, u32 sensitive)
+{
+    char irql_flag[MAX_IRQL_LEN];
+    struct lbr_state *state;
+    s32 ret = 0;
+
+    // Fast path for every other syscall
+    if (syscall >= LIBIHT_SYSCALL_MAX ||
+        !((lbr_syscall_filter[syscall / 64] >> (syscall % 64)) & 1))
+        return 0;
+
+    xacquire_lock(lbr_state_lock, irql_flag);
+
+    state = find_lbr_state(pid);
+    if (state != NULL)
+    {
+        if ((state->syscalls[syscall / 64] >> (syscall % 64)) & 1)
+            snapshot_lbr(state, syscall);
+        if (sensitive)
+            ret = check_lbr_cfi(state, syscall);
+    }
+
+    xrelease_lock(lbr_state_lock, irql_flag);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lbr_probe_arch
+// Description  : Probe the Architectural LBR of the current core, whose depth
+//                and features are enumerated. The LBR is saved with XSAVES if
+//                the OS enabled the LBR state component in IA32_XSS, one MSR
+//                at a time otherwise.
+//
+// Inputs       : cpu - the LBR capabilities to fill
+// Outputs      : s32 - 0 on success, -1 if the Arch LBR is not available
+
+s32 lbr_probe_arch(struct lbr_cpu *cpu)
+{
+    u32 eax, ebx, ecx, edx;
+    u32 depths, i;
+    u64 xss, size;
+
+    xprobe->cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    if (eax < 0x1c)
+        return -1;
+
+    xprobe->cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+    if (!(edx & X64_FEATURE_ARCH_LBR))
+        return -1;
+
+    // Each bit n of the depth bitmap is a supported depth of 8 * (n + 1)
+    xprobe->cpuid(0x1c, 0, &eax, &ebx, &ecx, &edx);
+    depths = eax & ARCH_LBR_DEPTH_MASK;
+    if (depths == 0)
+        return -1;
+    for (i = 7; !(depths & (1U << i)); i--)
+        ;
+
+    cpu->backend = LBR_BACKEND_ARCH;
+    cpu->format = LIBIHT_LBR_FORMAT_ARCH;
+    cpu->capacity = 8 * (i + 1);
+    cpu->has_info = 1;
+    cpu->has_call_stack = (ebx & ARCH_LBR_CALL_STACK) != 0;
+    cpu->xsave_size = 0;
+
+    // XSAVES support, and the supervisor LBR state in IA32_XSS
+    xprobe->cpuid(0xd, 1, &eax, &ebx, &ecx, &edx);
+    if ((eax & X64_FEATURE_XSAVES) && (ecx & XFEATURE_MASK_LBR))
+    {
+        xprobe->rdmsr(MSR_IA32_XSS, &xss);
+        xprobe->cpuid(0xd, XFEATURE_LBR, &eax, &ebx, &ecx, &edx);
+
+        // The state component must hold all the entries, within a page
+        size = sizeof(struct arch_lbr_xsave) +
+                    cpu->capacity * sizeof(struct arch_lbr_entry);
+        if ((xss & XFEATURE_MASK_LBR) &&
+            eax >= size - XSAVE_COMPONENT_OFFSET && size <= XPAGE_SIZE)
+        {
+            cpu->backend = LBR_BACKEND_ARCH_XSAVES;
+            cpu->xsave_size = (u32)size;
+        }
+    }
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lbr_probe_model
+// Description  : Probe the model specific LBR of the current core, whose
+//                depth is looked up by CPU model and whose format is reported
+//                by the perf capabilities.
+//
+// Inputs       : cpu - the LBR capabilities to fill
+// Outputs      : s32 - 0 on success, -1 if the CPU model is unknown
+
+s32 lbr_probe_model(struct lbr_cpu *cpu)
 {
     u32 cpuinfo[4] = { 0 };
     u32 family, model;
-    u64 i;
+    u64 i, perf_cap;
 
-    xcpuid(1, &cpuinfo[0], &cpuinfo[1], &cpuinfo[2], &cpuinfo[3]);
+    xprobe->cpuid(1, 0, &cpuinfo[0], &cpuinfo[1], &cpuinfo[2], &cpuinfo[3]);
 
     family = ((cpuinfo[0] >> 8) & 0xF) + ((cpuinfo[0] >> 20) & 0xFF);
     model = ((cpuinfo[0] >> 4) & 0xF) | ((cpuinfo[0] >> 12) & 0xF0);
 
+    cpu->backend = LBR_BACKEND_LEGACY;
+    cpu->format = 0;
+    cpu->capacity = 0;
+    cpu->has_info = 0;
+    cpu->has_call_stack = 0;
+    cpu->xsave_size = 0;
+
     // Identify CPU model
     for (i = 0; i < sizeof(cpu_lbr_maps) / sizeof(cpu_lbr_maps[0]); ++i)
     {
         if (model == cpu_lbr_maps[i].model)
         {
-            lbr_capacity = cpu_lbr_maps[i].lbr_capacity;
+            cpu->capacity = cpu_lbr_maps[i].lbr_capacity;
             break;
         }
     }
 
-    xprintdbg("LIBIHT-COM: DisplayFamily_DisplayModel - %x_%xH\n",
-                    family, model);
+    // The LBR format is reported by the perf capabilities, if present
+    if (cpuinfo[2] & X64_FEATURE_PDCM)
+    {
+        xprobe->rdmsr(MSR_IA32_PERF_CAPABILITIES, &perf_cap);
+        cpu->format = (u32)(perf_cap & PERF_CAP_LBR_FMT);
+        cpu->has_info = cpu->format >= LBR_FORMAT_INFO;
+        cpu->has_call_stack = cpu->format >= LBR_FORMAT_EIP_FLAGS2;
+    }
+
+    if (cpu->capacity == 0)
+    {
+        xprintdbg("LIBIHT-COM: DisplayFamily_DisplayModel - %x_%xH not "
+                    "found\n", family, model);
+        return -1;
+    }
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lbr_probe_cpu
+// Description  : Probe the LBR capabilities of the current core, preferring
+//                the Arch LBR. Run on each core, since the core types of
+//                hybrid CPUs may have different LBR. Only the xplat probing
+//                backend is used, so an injected backend drives the result.
+//
+// Inputs       : void
+// Outputs      : void
+
+void lbr_probe_cpu(void)
+{
+    struct lbr_cpu *cpu;
+    u32 id;
+
+    id = xcoreid();
+    if (id >= lbr_cpu_count)
+        return;
+
+    cpu = &lbr_cpus[id];
+    if (lbr_probe_arch(cpu))
+        lbr_probe_model(cpu);
+    cpu->probed = 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lbr_check
+// Description  : Check if the LBR feature is available on all the cores, and
+//                set the global LBR capabilities from the per core ones. The
+//                saved entries are sized by the largest capacity, and a flag
+//                is only honored if the LBR of every core supports it. It
+//                can be run again to probe with another backend set by
+//                xset_probe_ops, as long as no LBR state is sized yet.
+//
+// Inputs       : void
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 lbr_check(void)
+{
+    struct lbr_cpu *cpu;
+    u32 i;
+
+    // Drop the capabilities of an earlier probe
+    if (lbr_cpus)
+    {
+        xfree(lbr_cpus);
+        lbr_cpus = NULL;
+    }
+
+    lbr_cpu_count = xcore_count();
+    lbr_cpus = xmalloc(lbr_cpu_count * sizeof(struct lbr_cpu));
+    if (lbr_cpus == NULL)
+        return -1;
+    xmemset(lbr_cpus, 0, lbr_cpu_count * sizeof(struct lbr_cpu));
+
+    xon_each_cpu(lbr_probe_cpu);
+
+    lbr_capacity = 0;
+    lbr_xsave_size = 0;
+    lbr_has_info = 1;
+    lbr_has_call_stack = 1;
+    for (i = 0; i < lbr_cpu_count; i++)
+    {
+        cpu = &lbr_cpus[i];
+
+        // Core ids not online were not probed
+        if (!cpu->probed)
+            continue;
+
+        xprintdbg("LIBIHT-COM: LBR on cpu core %d - capacity %d, format "
+                    "0x%x, backend %d\n", i, cpu->capacity, cpu->format,
+                    cpu->backend);
+        if (cpu->capacity == 0)
+        {
+            xprintdbg("LIBIHT-COM: CPU model not found\n");
+            xfree(lbr_cpus);
+            lbr_cpus = NULL;
+            return -1;
+        }
+
+        if (cpu->capacity > lbr_capacity)
+            lbr_capacity = cpu->capacity;
+        if (cpu->xsave_size > lbr_xsave_size)
+            lbr_xsave_size = cpu->xsave_size;
+        lbr_has_info &= cpu->has_info;
+        lbr_has_call_stack &= cpu->has_call_stack;
+    }
+
     xprintdbg("LIBIHT-COM: LBR capacity - %ld\n", lbr_capacity);
+    xprintdbg("LIBIHT-COM: LBR info - %d, call stack - %d\n",
+                lbr_has_info, lbr_has_call_stack);
 
     if (lbr_capacity == 0)
     {
-        // Model name not found
-        xprintdbg("LIBIHT-COM: CPU model not found\n");
+        xfree(lbr_cpus);
+        lbr_cpus = NULL;
         return -1;
     }
 
@@ -692,6 +2473,19 @@ s32 lbr_init(void)
     xinit_lock(lbr_state_lock);
     xinit_list_head(lbr_state_head);
 
+    // Perf owns the LBR, nothing to flush
+    if (lbr_use_perf)
+    {
+        if (xperf_init(lbr_perf_handler))
+        {
+            xprintdbg("LIBIHT-COM: LBR perf backend not available\n");
+            xfree(lbr_cpus);
+            lbr_cpus = NULL;
+            return -1;
+        }
+        return 0;
+    }
+
     // Flush LBR on each cpu
     xprintdbg("LIBIHT-COM: Flushing LBR for all cpus...\n");
     xon_each_cpu(flush_lbr);
@@ -709,13 +2503,23 @@ s32 lbr_init(void)
 
 s32 lbr_exit(void)
 {
-    // Flush LBR on each cpu
-    xprintdbg("LIBIHT-COM: Flushing LBR for all cpus...\n");
-    xon_each_cpu(flush_lbr);
+    // Flush LBR on each cpu, unless perf owns it
+    if (!lbr_use_perf)
+    {
+        xprintdbg("LIBIHT-COM: Flushing LBR for all cpus...\n");
+        xon_each_cpu(flush_lbr);
+    }
 
     // Free all LBR state
     xprintdbg("LIBIHT-COM: Freeing LBR state list...\n");
     free_lbr_state_list();
 
+    // Release the perf events of the states
+    if (lbr_use_perf)
+        xperf_exit();
+
+    xfree(lbr_cpus);
+    lbr_cpus = NULL;
+
     return 0;
 }
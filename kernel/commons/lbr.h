@@ -16,6 +16,7 @@
 #include "types.h"
 #include "xplat.h"
 #include "xioctl.h"
+#include "session.h"
 
 // cpp cross compile handler
 #ifdef __cplusplus
@@ -46,6 +47,101 @@ extern "C" {
 #define MSR_LBR_NHM_TO          0x000006c0
 #endif
 
+#ifndef MSR_LBR_INFO_0
+#define MSR_LBR_INFO_0          0x00000dc0
+#endif
+
+#ifndef MSR_IA32_PERF_CAPABILITIES
+#define MSR_IA32_PERF_CAPABILITIES  0x00000345
+#endif
+
+// LBR format in MSR_IA32_PERF_CAPABILITIES, call-stack mode exists since 4
+// and MSR_LBR_INFO since 5
+#define PERF_CAP_LBR_FMT        0x3f
+#define LBR_FORMAT_EIP_FLAGS    0x03
+#define LBR_FORMAT_EIP_FLAGS2   0x04
+#define LBR_FORMAT_INFO         0x05
+
+// Flag bits on top of MSR_LBR_FROM in place of its sign extension, the
+// mispredict bit of format 3 and the mispredict and TSX bits of format 4
+#define LBR_FROM_FLAGS_EIP      1
+#define LBR_FROM_FLAGS_TSX      3
+
+// Intel-defined CPU features, CPUID level 0x00000001 (ECX)
+#define X64_FEATURE_PDCM        (1U << 15)
+
+// Architectural LBR related constants, enumerated by CPUID leaf 0x1c
+#ifndef MSR_ARCH_LBR_CTL
+#define MSR_ARCH_LBR_CTL        0x000014ce
+#endif
+
+#ifndef MSR_ARCH_LBR_DEPTH
+#define MSR_ARCH_LBR_DEPTH      0x000014cf
+#endif
+
+#ifndef MSR_ARCH_LBR_FROM_0
+#define MSR_ARCH_LBR_FROM_0     0x00001500
+#endif
+
+#ifndef MSR_ARCH_LBR_TO_0
+#define MSR_ARCH_LBR_TO_0       0x00001600
+#endif
+
+#ifndef MSR_ARCH_LBR_INFO_0
+#define MSR_ARCH_LBR_INFO_0     0x00001200
+#endif
+
+#ifndef MSR_IA32_XSS
+#define MSR_IA32_XSS            0x00000da0
+#endif
+
+// Intel-defined CPU features, CPUID level 0x00000007:0 (EDX)
+#define X64_FEATURE_ARCH_LBR    (1U << 19)
+
+// Intel-defined CPU features, CPUID level 0x0000000d:1 (EAX)
+#define X64_FEATURE_XSAVES      (1U <<  3)
+
+// CPUID level 0x0000001c, supported depths (EAX) and call-stack mode (EBX)
+#define ARCH_LBR_DEPTH_MASK     0xff
+#define ARCH_LBR_CALL_STACK     (1U <<  2)
+
+// Arch LBR state component of the XSAVE area, managed by XSAVES/XRSTORS
+#define XFEATURE_LBR            15
+#define XFEATURE_MASK_LBR       (1ULL << XFEATURE_LBR)
+#define XCOMP_BV_COMPACTED      (1ULL << 63)
+#define XSAVE_COMPONENT_OFFSET  576     // Legacy region and XSAVE header
+
+/* Bit Field     Bit Offset  Access  Description
+ *
+ * LBREn         0   R/W     When set, enable the LBR
+ * OS            1   R/W     When set, capture branches ending in ring 0
+ * USR           2   R/W     When set, capture branches ending in ring >0
+ * CALL_STACK    3   R/W     When set, push calls and pop returns
+ * Reserved      15:4        Must be zero
+ * JCC           16  R/W     When set, capture conditional branches
+ * NEAR_REL_JMP  17  R/W     When set, capture near relative jumps
+ * NEAR_IND_JMP  18  R/W     When set, capture near indirect jumps
+ * NEAR_REL_CALL 19  R/W     When set, capture near relative calls
+ * NEAR_IND_CALL 20  R/W     When set, capture near indirect calls
+ * NEAR_RET      21  R/W     When set, capture near returns
+ * OTHER_BRANCH  22  R/W     When set, capture the other branches
+ * Reserved      63:23       Must be zero
+ *
+ * Unlike LBR_SELECT, the branch filters select what is captured, the
+ * LBR_CTL is translated from the LBR_SELECT of the configuration.
+ */
+#define ARCH_LBR_CTL_LBREN      (1ULL <<  0)
+#define ARCH_LBR_CTL_OS         (1ULL <<  1)
+#define ARCH_LBR_CTL_USR        (1ULL <<  2)
+#define ARCH_LBR_CTL_CALL_STACK (1ULL <<  3)
+#define ARCH_LBR_CTL_JCC        (1ULL << 16)
+#define ARCH_LBR_CTL_REL_JMP    (1ULL << 17)
+#define ARCH_LBR_CTL_IND_JMP    (1ULL << 18)
+#define ARCH_LBR_CTL_REL_CALL   (1ULL << 19)
+#define ARCH_LBR_CTL_IND_CALL   (1ULL << 20)
+#define ARCH_LBR_CTL_RETURN     (1ULL << 21)
+#define ARCH_LBR_CTL_OTHER      (1ULL << 22)
+
 #ifndef DEBUGCTLMSR_LBR
 #define DEBUGCTLMSR_LBR         (1UL <<  0)
 #endif
@@ -61,23 +157,73 @@ extern "C" {
  * NEAR_IND_JMP  6   R/W     When set, do not capture near indirect jumps
  * NEAR_REL_JMP  7   R/W     When set, do not capture near relative jumps
  * FAR_BRANCH    8   R/W     When set, do not capture far branches
- * Reserved      63:9        Must be zero
+ * EN_CALLSTACK  9   R/W     When set, push calls and pop returns (Haswell+)
+ * Reserved      63:10       Must be zero
  *
  * Default selection bit set to:
  * 0x1 = 00000001   --> capture branches occuring in ring >0
  */
 #define LBR_SELECT              (1UL <<  0)
 
+/* Call-stack mode selection, the LBR is kept as the stack of the calls not
+ * yet returned, so only the calls and returns are captured:
+ * 0x3c5 = 1111000101   --> capture near calls and returns in ring >0, as a
+ *                          call stack
+ */
+#define LBR_SELECT_CALL_STACK   (LBR_SELECT | (1UL << 2) | (1UL << 6) | \
+                                    (1UL << 7) | (1UL << 8) | (1UL << 9))
+
+// Number of snapshots kept in the LBR snapshot ring of each state
+#define LBR_RING_SLOTS          64
+
+// Branches between two samples of the perf backend
+#define LBR_PERF_PERIOD         0x10000
+
+// Failures of a LBR snapshot read
+#define LBR_SNAPSHOT_NONE       -1      // LBR not enabled for the process
+#define LBR_SNAPSHOT_SMALL      -2      // Buffer too small for the record
+#define LBR_SNAPSHOT_BUSY       -3      // LBR state locked
+
 //
 // Type definitions
 
+// Define the LBR saved for a state
+struct lbr_stack
+{
+    u64 lbr_tos;                      // MSR_LBR_TOS
+    struct lbr_stack_entry *entries;  // LBR stack entries
+    u64 *info;                        // MSR_LBR_INFO of each entry
+    u32 lbr_format;                   // LBR format of the core saving them
+    u32 lbr_count;                    // LBR entries of the core saving them
+};
+
+// Define LBR CFI policy, shared by a state and the children inheriting it
+struct lbr_cfi
+{
+    u32 refs;                         // States sharing the policy
+    u32 action;                       // enum LBR_CFI_ACTION
+    u64 syscalls[LIBIHT_SYSCALL_WORDS]; // Syscalls to check at entry
+    u64 edge_count;                   // Number of allowed edges
+    struct lbr_stack_entry *edges;    // Allowed edges, sorted
+    u64 violations;                   // Violations seen
+};
+
 // Define LBR state
 struct lbr_state
 {
     char list[MAX_LIST_LEN];          // Kernel linked list
     struct lbr_state *parent;         // Parent lbr_state
     struct lbr_config config;         // LBR configuration
-    struct lbr_data *data;            // LBR data
+    struct lbr_stack *data;           // LBR data
+    struct lbr_ring_header *ring;     // LBR snapshot ring, shared with user
+    u64 ring_slots;                   // Number of slots in the ring
+    u64 ring_slot_size;               // Size of each slot in the ring
+    struct subscribers subs;          // Sessions sharing the LBR
+    u64 syscalls[LIBIHT_SYSCALL_WORDS]; // Syscalls to snapshot at entry
+    struct lbr_cfi *cfi;              // CFI policy, can be NULL
+    u32 last_cpu;                     // Core of the last switch in + 1, or 0
+    struct arch_lbr_xsave *xsave;     // XSAVE area, NULL without XSAVES
+    void *perf;                       // Perf event, NULL without perf backend
 };
 
 // CPU - LBR map
@@ -87,11 +233,76 @@ struct cpu_to_lbr
     u32 lbr_capacity;   // LBR capacity
 };
 
+// LBR backends
+enum LBR_BACKEND
+{
+    LBR_BACKEND_LEGACY,               // Model specific LBR, one MSR at a time
+    LBR_BACKEND_ARCH,                 // Arch LBR, one MSR at a time
+    LBR_BACKEND_ARCH_XSAVES,          // Arch LBR, saved with XSAVES/XRSTORS
+};
+
+// Define LBR capabilities of a core, they differ between the core types of
+// hybrid CPUs
+struct lbr_cpu
+{
+    u32 probed;                       // The core has been probed
+    u32 backend;                      // enum LBR_BACKEND
+    u32 format;                       // LBR format, or LIBIHT_LBR_FORMAT_ARCH
+    u32 capacity;                     // LBR entries, 0 if not available
+    u32 has_info;                     // MSR_LBR_INFO registers
+    u32 has_call_stack;               // Call-stack mode
+    u32 xsave_size;                   // XSAVE area size, 0 without XSAVES
+};
+
+// Define Arch LBR entry in the XSAVE area
+struct arch_lbr_entry
+{
+    u64 from;                         // IA32_LBR_x_FROM_IP
+    u64 to;                           // IA32_LBR_x_TO_IP
+    u64 info;                         // IA32_LBR_x_INFO
+};
+
+// Define XSAVE area in compacted format holding only the Arch LBR state
+struct arch_lbr_xsave
+{
+    u8 legacy[512];                   // Legacy region, unused
+    u64 xstate_bv;                    // XSAVE header
+    u64 xcomp_bv;
+    u8 reserved[48];
+    u64 lbr_ctl;                      // Arch LBR state component
+    u64 lbr_depth;
+    u64 ler_from;
+    u64 ler_to;
+    u64 ler_info;
+    struct arch_lbr_entry entries[0]; // Entry 0 is the youngest
+};
+
 //
 // Global variables
 
 extern u64 lbr_capacity;
-// The capacity of the LBR.
+// The largest capacity of the LBR among all cores.
+
+extern u32 lbr_has_info;
+// The LBR of all cores has MSR_LBR_INFO registers.
+
+extern u32 lbr_has_call_stack;
+// The LBR of all cores supports call-stack mode.
+
+extern u64 lbr_xsave_size;
+// The largest size of the XSAVE area holding the Arch LBR state.
+
+extern u32 lbr_use_perf;
+// Obtain the LBR through the perf backend instead of the MSRs.
+
+extern u32 lbr_use_bpf;
+// Hand every drained LBR snapshot to the BPF hook as well.
+
+extern struct lbr_cpu *lbr_cpus;
+// The LBR capabilities of each core.
+
+extern u32 lbr_cpu_count;
+// The number of entries in lbr_cpus.
 
 extern char lbr_state_lock[MAX_LOCK_LEN];
 // The lock for lbr_state_list.
@@ -99,9 +310,45 @@ extern char lbr_state_lock[MAX_LOCK_LEN];
 extern char lbr_state_head[MAX_LIST_LEN];
 // The head of the lbr_state_list.
 
+extern u64 lbr_syscall_filter[LIBIHT_SYSCALL_WORDS];
+// The union of the syscall bitmaps of all lbr_states.
+
 //
 // Function Prototypes
 
+u32 lbr_config_flags(u32 flags);
+// Keep the LBR configuration flags the CPU supports.
+
+u64 lbr_config_select(u32 flags, u64 lbr_select);
+// Get the LBR_SELECT of a LBR configuration.
+
+u64 lbr_entries_size(struct lbr_state *state);
+// Get the size of the saved LBR entries of a given process.
+
+u64 lbr_ctl_from_select(u64 lbr_select);
+// Translate a LBR_SELECT into an Arch LBR_CTL.
+
+struct lbr_cpu *lbr_this_cpu(void);
+// Get the LBR capabilities of the current core.
+
+void lbr_clear(struct lbr_cpu *cpu);
+// Clear the paused LBR registers of the current core.
+
+s32 lbr_pause(u64 *ctl);
+// Pause the LBR of the current core.
+
+void lbr_resume(u64 ctl);
+// Resume the LBR of the current core.
+
+u64 lbr_run_ctl(struct lbr_state *state);
+// Get the LBR control value resuming a given process.
+
+void lbr_save(struct lbr_state *state);
+// Save the paused LBR registers of the current core.
+
+void lbr_restore(struct lbr_state *state);
+// Restore the paused LBR registers of the current core.
+
 void get_lbr(struct lbr_state *state);
 // Get the LBR of a given process.
 
@@ -111,18 +358,78 @@ void put_lbr(struct lbr_state *state);
 void flush_lbr(void);
 // Flush the LBR.
 
-s32 enable_lbr(struct lbr_ioctl_request *request);
+void stop_lbr(void *arg);
+// Stop the LBR of the current core if its process is no longer traced.
+
+s32 read_lbr(struct lbr_state *state);
+// Read the live LBR of the current process into its state.
+
+void snapshot_lbr(struct lbr_state *state, u64 syscall);
+// Snapshot the live LBR of the current process without saving it.
+
+void lbr_fill_snapshot(struct lbr_state *state, struct lbr_snapshot *snapshot,
+                        u64 syscall);
+// Fill the header of a snapshot record from the saved LBR of a given process.
+
+void publish_lbr_snapshot(struct lbr_state *state, u64 syscall);
+// Publish the saved LBR of a given process into its snapshot ring.
+
+void drain_lbr(struct lbr_state *state, u64 syscall);
+// Drain the saved LBR of a given process into its session.
+
+void lbr_perf_handler(u32 tid, u32 nr, struct lbr_stack_entry *entries,
+                        u64 *info);
+// Publish a branch stack sample of the perf backend.
+
+s32 lbr_subscribed(u32 pid, struct session *session);
+// Check if a session is subscribed to the LBR of a given process.
+
+s32 lbr_shadowed(u32 pid, struct session *session);
+// Check if another feature writes the side records of a process to a session.
+
+void drain_lbr_mmap(void *ctx, u32 pid, struct trace_mmap_record *record,
+                    char *path, u32 path_size);
+// Drain a mapping record of a given process into its sessions.
+
+s32 enable_lbr(struct session *session, struct lbr_ioctl_request *request);
 // Enable the LBR.
 
-s32 disable_lbr(struct lbr_ioctl_request *request);
+s32 disable_lbr(struct session *session, struct lbr_ioctl_request *request);
 // Disable the LBR.
 
+s32 stage_lbr(u32 pid, struct lbr_stack *stage, u32 *flags);
+// Copy the LBR saved for a given process into a staging buffer.
+
 s32 dump_lbr(struct lbr_ioctl_request *request);
 // Dump the LBR of a given process.
 
+s32 dump_lbr_info(struct lbr_dump_request *request);
+// Dump the LBR of a given process with the MSR_LBR_INFO and format.
+
 s32 config_lbr(struct lbr_ioctl_request *request);
 // Configure the LBR.
 
+s32 syscall_lbr(struct lbr_syscall_request *request);
+// Configure the syscalls to snapshot the LBR at.
+
+void update_lbr_syscall_filter(void);
+// Rebuild the union of the syscall bitmaps of all lbr_states.
+
+s32 cfi_lbr(struct lbr_cfi_request *request);
+// Load the CFI policy of a given process.
+
+void put_lbr_cfi(struct lbr_cfi *cfi);
+// Drop a reference to a CFI policy.
+
+s32 check_lbr_cfi(struct lbr_state *state, u64 syscall);
+// Check the live LBR of the current process against its CFI policy.
+
+s64 read_lbr_snapshot(u32 pid, void *buf, u64 size);
+// Read the LBR saved for a process as one snapshot record.
+
+s32 crash_lbr(u32 pid, struct crash_capture *capture);
+// Freeze the LBR of a crashing process into a crash capture.
+
 struct lbr_state *create_lbr_state(void);
 // Create a new lbr_state.
 
@@ -135,10 +442,16 @@ void insert_lbr_state(struct lbr_state *new_state);
 void remove_lbr_state(struct lbr_state *old_state);
 // Remove a lbr_state from the lbr_state_list.
 
+void free_lbr_state(struct lbr_state *state);
+// Free a lbr_state and its buffers.
+
 void free_lbr_state_list(void);
 // Free the lbr_state_list.
 
-s32 lbr_ioctl_handler(struct xioctl_request *request);
+void release_lbr_session(struct session *session);
+// Remove the lbr_states owned by a session.
+
+s32 lbr_ioctl_handler(struct session *session, struct xioctl_request *request);
 // The ioctl handler for the LBR.
 
 void lbr_cswitch_handler(u32 prev_pid, u32 next_pid);
@@ -147,9 +460,27 @@ void lbr_cswitch_handler(u32 prev_pid, u32 next_pid);
 void lbr_newproc_handler(u32 parent_pid, u32 child_pid);
 // The new process handler for the LBR.
 
+s32 lbr_syscall_handler(u32 pid, u64 syscall, u32 sensitive);
+// The syscall entry handler for the LBR.
+
+void lbr_mmap_handler(u32 pid, u64 start, u64 end);
+// The executable mapping handler for the LBR.
+
+void lbr_exitproc_handler(u32 pid);
+// The process exit handler for the LBR.
+
 s32 lbr_check(void);
 // Check if the LBR is available.
 
+s32 lbr_probe_arch(struct lbr_cpu *cpu);
+// Probe the Architectural LBR of the current core.
+
+s32 lbr_probe_model(struct lbr_cpu *cpu);
+// Probe the model specific LBR of the current core.
+
+void lbr_probe_cpu(void);
+// Probe the LBR capabilities of the current core.
+
 s32 lbr_init(void);
 // Initialize the LBR.
 
@@ -0,0 +1,1577 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : kernel/commons/pt.c
+//  Description    : This is the implementation of the PT (Intel Processor
+//                   Trace) feature for the libiht library. See associated
+//                   documentation for more information.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : July 10, 2024
+//
+
+// Include Files
+#include "pt.h"
+#include "lbr.h"
+#include "bts.h"
+
+//
+// Global Variables
+char pt_state_lock[MAX_LOCK_LEN];
+// Lock for pt state list
+
+char pt_state_head[MAX_LIST_LEN];
+// Head of pt state list
+
+u32 pt_range_count;
+// Number of IP filter ranges of the cores
+
+u32 pt_has_cr3_filter;
+// The cores support CR3 filtering
+
+u64 pt_ctl_supported;
+// RTIT_CTL bits the cores support
+
+u32 pt_mtc_freqs;
+// Bitmap of the MTC periods the cores support
+
+u32 pt_cyc_thresholds;
+// Bitmap of the CYC thresholds the cores support
+
+u32 pt_psb_freqs;
+// Bitmap of the PSB frequencies the cores support
+
+u32 pt_linear_bits;
+// Linear address width of the cores
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : get_pt
+// Description  : Pause the PT tracing and save its output position, then
+//                drain the packet bytes of the time slice. The output position
+//                is only saved if the PT was tracing on this core, i.e. it was
+//                put and not skipped by a closed gate. Caller should hold the
+//                `pt_state_lock`.
+//
+// Inputs       : state - the PT state
+// Outputs      : void
+
+void get_pt(struct pt_state *state)
+{
+    u64 rtit_ctl;
+
+    // Disable PT, which also flushes the packets buffered in the core
+    xrdmsr(MSR_IA32_RTIT_CTL, &rtit_ctl);
+    if (rtit_ctl & RTIT_CTL_TRACE_EN)
+    {
+        xwrmsr(MSR_IA32_RTIT_CTL, rtit_ctl & ~RTIT_CTL_TRACE_EN);
+        xrdmsr(MSR_IA32_RTIT_OUTPUT_MASK, &state->output_mask);
+        xrdmsr(MSR_IA32_RTIT_STATUS, &state->status);
+        if (state->status & RTIT_STATUS_ERROR)
+            xprintdbg("LIBIHT-COM: PT operational error for pid %d, "
+                        "status: %llx.\n", state->config.pid, state->status);
+    }
+
+    // Account the buffer wraps happened during this time slice
+    sync_pt_offset(state);
+    drain_pt(state);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : put_pt
+// Description  : Restore the output position and the filters of the PT, then
+//                resume the PT tracing, unless the gates of all the sessions
+//                subscribed to the state are closed or its buffer is being
+//                reconfigured. The RTIT MSRs can only be written with the PT
+//                disabled. Caller should hold the `pt_state_lock`.
+//
+// Inputs       : state - the PT state
+// Outputs      : void
+
+void put_pt(struct pt_state *state)
+{
+    u64 rtit_ctl;
+    u32 i;
+
+    if (!subscribers_gate_open(&state->subs) || state->reconfig)
+        return;
+
+    xrdmsr(MSR_IA32_RTIT_CTL, &rtit_ctl);
+    if (rtit_ctl & RTIT_CTL_TRACE_EN)
+        xwrmsr(MSR_IA32_RTIT_CTL, rtit_ctl & ~RTIT_CTL_TRACE_EN);
+
+    // Setup ToPA output at the saved position
+    xwrmsr(MSR_IA32_RTIT_OUTPUT_BASE, xvirt_to_phys(state->topa));
+    xwrmsr(MSR_IA32_RTIT_OUTPUT_MASK, state->output_mask);
+    xwrmsr(MSR_IA32_RTIT_STATUS,
+            state->status & ~(RTIT_STATUS_ERROR | RTIT_STATUS_STOPPED));
+
+    // Setup filters
+    if (state->rtit_ctl & RTIT_CTL_CR3_FILTER)
+        xwrmsr(MSR_IA32_RTIT_CR3_MATCH, state->cr3);
+    for (i = 0; i < LIBIHT_PT_MAX_RANGES; i++)
+    {
+        if (!(state->rtit_ctl & RTIT_CTL_ADDR_CFG(i)))
+            continue;
+        xwrmsr(MSR_IA32_RTIT_ADDR0_A + 2 * i, state->config.ranges[i].start);
+        xwrmsr(MSR_IA32_RTIT_ADDR0_B + 2 * i, state->config.ranges[i].end);
+    }
+
+    // Enable PT
+    xwrmsr(MSR_IA32_RTIT_CTL, state->rtit_ctl | RTIT_CTL_TRACE_EN);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flush_pt
+// Description  : Stop the PT of the current core. Caller should ensure this
+//                function is called with interrupts disabled (either on single
+//                core or with interrupts disabled for that core).
+//
+// Inputs       : void
+// Outputs      : void
+
+void flush_pt(void)
+{
+    u64 rtit_ctl;
+    char irql_flag[MAX_IRQL_LEN];
+
+    xlock_core(irql_flag);
+
+    // Disable PT
+    xprintdbg("LIBIHT-COM: Flush PT on cpu core: %d...\n", xcoreid());
+    xrdmsr(MSR_IA32_RTIT_CTL, &rtit_ctl);
+    if (rtit_ctl & RTIT_CTL_TRACE_EN)
+        xwrmsr(MSR_IA32_RTIT_CTL, rtit_ctl & ~RTIT_CTL_TRACE_EN);
+
+    xrelease_core(irql_flag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stop_pt
+// Description  : Stop the PT of the current core if it writes to a given ToPA
+//                table, i.e. the PT of a process running on this core while
+//                its state is removed or its buffer reconfigured, and save
+//                its output position. Dispatched to each core by
+//                `xon_each_cpu_arg`.
+//
+// Inputs       : arg - the `struct pt_stop`
+// Outputs      : void
+
+void stop_pt(void *arg)
+{
+    struct pt_stop *stop = arg;
+    u64 rtit_ctl, output_base;
+
+    xrdmsr(MSR_IA32_RTIT_CTL, &rtit_ctl);
+    if (!(rtit_ctl & RTIT_CTL_TRACE_EN))
+        return;
+
+    xrdmsr(MSR_IA32_RTIT_OUTPUT_BASE, &output_base);
+    if (output_base != stop->output_base)
+        return;
+
+    xwrmsr(MSR_IA32_RTIT_CTL, rtit_ctl & ~RTIT_CTL_TRACE_EN);
+    xrdmsr(MSR_IA32_RTIT_OUTPUT_MASK, &stop->output_mask);
+    xrdmsr(MSR_IA32_RTIT_STATUS, &stop->status);
+    stop->stopped = 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : drain_pt
+// Description  : Drain the PT packet bytes produced since the last drain into
+//                the session as PT records, split at the buffer end and at
+//                `PT_DRAIN_BYTES`. Bytes overwritten by the hardware before
+//                being drained are reported as lost, so a consumer resyncs at
+//                the next PSB. Every subscribed session gets the same bytes.
+//                Caller should hold the `pt_state_lock`.
+//
+// Inputs       : state - the PT state
+// Outputs      : void
+
+void drain_pt(struct pt_state *state)
+{
+    u64 capacity, produced, oldest, slot, cnt;
+    struct session *session;
+    u32 i;
+
+    if (state->subs.count == 0)
+        return;
+
+    capacity = state->config.pt_buffer_size;
+    produced = count_pt_bytes(state);
+    oldest = produced > capacity ? produced - capacity : 0;
+
+    if (state->drain_cursor < oldest)
+    {
+        for (i = 0; i < state->subs.count; i++)
+            if (state->subs.sessions[i] &&
+                session_gate_open(state->subs.sessions[i]))
+                session_lost(state->subs.sessions[i], 0, 0, 0, 0,
+                                oldest - state->drain_cursor);
+        state->drain_cursor = oldest;
+    }
+
+    while (state->drain_cursor < produced)
+    {
+        slot = state->drain_cursor % capacity;
+        cnt = produced - state->drain_cursor;
+        if (cnt > capacity - slot)
+            cnt = capacity - slot;
+        if (cnt > PT_DRAIN_BYTES)
+            cnt = PT_DRAIN_BYTES;
+
+        for (i = 0; i < state->subs.count; i++)
+        {
+            session = state->subs.sessions[i];
+            if (session == NULL || !session_gate_open(session))
+                continue;
+
+            if (session_write(session, LIBIHT_RECORD_PT, state->config.pid,
+                                state->buffer + slot, (u32)cnt, NULL, 0))
+                session_lost(session, 0, 0, 0, 0, cnt);
+        }
+        state->drain_cursor += cnt;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_subscribed
+// Description  : Check if a session is subscribed to the PT of a process.
+//                Caller may hold the LBR or the BTS state lock.
+//
+// Inputs       : pid - the process id
+//                session - the session
+// Outputs      : s32 - 1 if subscribed, 0 if not
+
+s32 pt_subscribed(u32 pid, struct session *session)
+{
+    struct pt_state *state;
+    char irql_flag[MAX_IRQL_LEN];
+    s32 ret = 0;
+    u32 i;
+
+    xacquire_lock(pt_state_lock, irql_flag);
+    state = find_pt_state(pid);
+    for (i = 0; state != NULL && i < state->subs.count; i++)
+        if (state->subs.sessions[i] == session)
+            ret = 1;
+    xrelease_lock(pt_state_lock, irql_flag);
+
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : drain_pt_mmap
+// Description  : Fan a mapping record of a process out to the sessions
+//                subscribed to its PT. Matches the callback of
+//                `xfor_each_exec_mapping`. The state is looked up again for
+//                each record, since it may be disabled during the walk.
+//
+// Inputs       : ctx - unused
+//                pid - the process id
+//                record - the mapping record
+//                path - the path of the mapped file, NUL terminated
+//                path_size - the size of the path, NUL included
+// Outputs      : void
+
+void drain_pt_mmap(void *ctx, u32 pid, struct trace_mmap_record *record,
+                    char *path, u32 path_size)
+{
+    struct pt_state *state;
+    char irql_flag[MAX_IRQL_LEN];
+    u32 i;
+
+    xacquire_lock(pt_state_lock, irql_flag);
+    state = find_pt_state(pid);
+    for (i = 0; state != NULL && i < state->subs.count; i++)
+        if (state->subs.sessions[i])
+            session_mmap(state->subs.sessions[i], pid, record, path,
+                            path_size);
+    xrelease_lock(pt_state_lock, irql_flag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : enable_pt
+// Description  : Enable the PT. The packet stream is drained into the session
+//                the request comes from. If the process is already traced, the
+//                session subscribes to the existing state, which keeps its
+//                configuration and buffer.
+//
+// Inputs       : session - the session of the request, can be NULL
+//                request - the PT ioctl request
+// Outputs      : 0 if successful, -1 if failure
+
+s32 enable_pt(struct session *session, struct pt_ioctl_request *request)
+{
+    struct pt_state *state, *old_state;
+    char irql_flag[MAX_IRQL_LEN];
+    s32 ret;
+    u32 pid;
+
+    // The RTIT MSRs fault on the cores without PT
+    if (pt_check())
+    {
+        xprintdbg("LIBIHT-COM: PT is not supported or available.\n");
+        return -1;
+    }
+
+    // Tracing the kernel exposes its control flow, only to the privileged
+    if ((request->pt_config.rtit_ctl & RTIT_CTL_OS) && !xperfmon_capable())
+    {
+        xprintdbg("LIBIHT-COM: PT kernel tracing not permitted.\n");
+        return -1;
+    }
+
+    // Filters the MSRs reject would fault at the next switch in
+    if (check_pt_config(&request->pt_config))
+    {
+        xprintdbg("LIBIHT-COM: PT filters invalid for pid %d.\n",
+                    request->pt_config.pid);
+        return -1;
+    }
+
+    pid = request->pt_config.pid ? request->pt_config.pid : xgetcurrent_pid();
+
+    // Tracing a process exposes its control flow, like ptrace does
+    if (!xtrace_allowed(pid))
+    {
+        xprintdbg("LIBIHT-COM: PT not permitted for pid %d.\n", pid);
+        return -1;
+    }
+
+    xacquire_lock(pt_state_lock, irql_flag);
+    state = find_pt_state(pid);
+    if (state)
+    {
+        ret = subscribe_session(&state->subs, session);
+        xrelease_lock(pt_state_lock, irql_flag);
+
+        if (ret)
+            xprintdbg("LIBIHT-COM: PT already enabled for pid %d.\n",
+                        request->pt_config.pid);
+        else
+            xprintdbg("LIBIHT-COM: Share PT of pid %d with a new session.\n",
+                        request->pt_config.pid);
+
+        // The new subscriber has not seen the mappings yet, unless it
+        // traces the process with another feature already
+        if (ret == 0 && session != NULL && !lbr_subscribed(pid, session) &&
+                !bts_subscribed(pid, session))
+            xfor_each_exec_mapping(pid, 0, (u64)-1, session_mmap, session);
+        return ret;
+    }
+    xrelease_lock(pt_state_lock, irql_flag);
+
+    // The state is created outside the lock, since it sleeps
+    state = create_pt_state();
+    if (state == NULL)
+    {
+        xprintdbg("LIBIHT-COM: Create PT state failed.\n");
+        return -1;
+    }
+
+    // Setup fields for PT state
+    state->parent = NULL;
+    state->config = request->pt_config;
+    state->config.pid = pid;
+    state->config.rtit_ctl = request->pt_config.rtit_ctl ?
+                request->pt_config.rtit_ctl : DEFAULT_PT_CONFIG;
+    state->rtit_ctl = pt_ctl_from_config(&state->config);
+    if (state->rtit_ctl & RTIT_CTL_CR3_FILTER)
+        state->cr3 = resolve_pt_cr3(pid, state->config.cr3_match);
+
+    // Setup fields for PT output
+    if (setup_pt_buffer(state, request->pt_config.pt_buffer_size ?
+                request->pt_config.pt_buffer_size : DEFAULT_PT_BUFFER_SIZE))
+    {
+        xprintdbg("LIBIHT-COM: Allocate PT buffer failed.\n");
+        free_pt_state(state);
+        return -1;
+    }
+
+    // Print PT output info
+    xprintdbg("LIBIHT-COM: PT rtit_ctl: %llx, topa: %llx, buffer: %llx, "
+                "size: %llx, cr3: %llx.\n",
+                state->rtit_ctl, (u64)state->topa, (u64)state->buffer,
+                state->config.pt_buffer_size, state->cr3);
+
+    // Another request may have enabled the process meanwhile, share it then
+    xacquire_lock(pt_state_lock, irql_flag);
+    old_state = find_pt_state(pid);
+    if (old_state)
+    {
+        ret = subscribe_session(&old_state->subs, session);
+        xrelease_lock(pt_state_lock, irql_flag);
+        free_pt_state(state);
+
+        if (ret == 0 && session != NULL && !lbr_subscribed(pid, session) &&
+                !bts_subscribed(pid, session))
+            xfor_each_exec_mapping(pid, 0, (u64)-1, session_mmap, session);
+        return ret;
+    }
+
+    subscribe_session(&state->subs, session);
+    xprintdbg("LIBIHT-COM: Insert PT state for pid %d.\n", pid);
+    xlist_add(state->list, pt_state_head);
+
+    // If the requesting process is the current process, trace it right away
+    if (pid == xgetcurrent_pid())
+        put_pt(state);
+    xrelease_lock(pt_state_lock, irql_flag);
+
+    // Describe the executable mappings for the symbolization
+    if (session != NULL && !lbr_subscribed(pid, session) &&
+            !bts_subscribed(pid, session))
+        xfor_each_exec_mapping(pid, 0, (u64)-1, session_mmap, session);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : disable_pt
+// Description  : Unsubscribe the session of the request from the PT of a given
+//                process in request. The PT tracing is disabled once the last
+//                session unsubscribes.
+//
+// Inputs       : session - the session of the request, can be NULL
+//                request - the PT ioctl request
+// Outputs      : 0 if successful, -1 if failure
+
+s32 disable_pt(struct session *session, struct pt_ioctl_request *request)
+{
+    struct pt_state *state;
+    struct pt_stop stop;
+    char irql_flag[MAX_IRQL_LEN];
+    s32 ret;
+    u32 left;
+
+    xacquire_lock(pt_state_lock, irql_flag);
+    state = find_pt_state(request->pt_config.pid);
+    if (state == NULL)
+    {
+        xrelease_lock(pt_state_lock, irql_flag);
+        xprintdbg("LIBIHT-COM: PT not enabled for pid %d.\n",
+                    request->pt_config.pid);
+        return -1;
+    }
+
+    // Unlink the state with its last subscriber, so no one subscribes again
+    ret = unsubscribe_session(&state->subs, session);
+    left = state->subs.count;
+    if (ret == 0 && left == 0)
+    {
+        if (state->config.pid == xgetcurrent_pid())
+            get_pt(state);
+        xlist_del(state->list);
+    }
+    xrelease_lock(pt_state_lock, irql_flag);
+
+    if (ret)
+    {
+        xprintdbg("LIBIHT-COM: PT not enabled for pid %d by the session.\n",
+                    request->pt_config.pid);
+        return -1;
+    }
+
+    // No record of the state comes anymore to lift the bytes it left
+    session_flush(session);
+
+    if (left)
+        return 0;
+
+    // The process may still be traced on another core, stop it before the
+    // buffer is freed
+    xmemset(&stop, 0, sizeof(struct pt_stop));
+    stop.output_base = xvirt_to_phys(state->topa);
+    xon_each_cpu_arg(stop_pt, &stop);
+    xprintdbg("LIBIHT-COM: Remove PT state for pid %d.\n",
+                state->config.pid);
+    free_pt_state(state);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : config_pt
+// Description  : Configure the PT trace bits, filters and output buffer size
+//                for a given process in request. A new buffer restarts the
+//                packet stream from zero. Before the buffer is swapped, the PT
+//                is held off and stopped on every core, since the process may
+//                be running on another one.
+//
+// Inputs       : request - the PT ioctl request
+// Outputs      : 0 if successful, -1 if failure
+
+s32 config_pt(struct pt_ioctl_request *request)
+{
+    struct pt_state *state;
+    struct pt_config config;
+    struct pt_stop stop;
+    char irql_flag[MAX_IRQL_LEN];
+    u64 size, rtit_ctl, cr3 = 0, old_size = 0;
+    u8 *buffer = NULL, *old_buffer = NULL;
+    u64 *topa;
+    u32 current;
+
+    // Tracing a process exposes its control flow, like ptrace does
+    if (!xtrace_allowed(request->pt_config.pid))
+    {
+        xprintdbg("LIBIHT-COM: PT not permitted for pid %d.\n",
+                    request->pt_config.pid);
+        return -1;
+    }
+
+    // Tracing the kernel exposes its control flow, only to the privileged
+    if ((request->pt_config.rtit_ctl & RTIT_CTL_OS) && !xperfmon_capable())
+    {
+        xprintdbg("LIBIHT-COM: PT kernel tracing not permitted.\n");
+        return -1;
+    }
+
+    // Filters the MSRs reject would fault at the next switch in
+    if (check_pt_config(&request->pt_config))
+    {
+        xprintdbg("LIBIHT-COM: PT filters invalid for pid %d.\n",
+                    request->pt_config.pid);
+        return -1;
+    }
+
+    // The new buffer and CR3 are set up outside the lock, since they sleep
+    size = XPAGE_ALIGN(request->pt_config.pt_buffer_size);
+    if (request->pt_config.pt_buffer_size != 0)
+    {
+        if (size / XPAGE_SIZE <= PT_TOPA_ENTRIES)
+            buffer = xmalloc_pages(size);
+        if (buffer == NULL)
+        {
+            // The previous buffer is kept if the new one cannot be set up
+            xprintdbg("LIBIHT-COM: Reconfigure PT buffer failed.\n");
+            return -1;
+        }
+    }
+
+    config = request->pt_config;
+    if (config.rtit_ctl == 0)
+        config.rtit_ctl = DEFAULT_PT_CONFIG;
+    rtit_ctl = pt_ctl_from_config(&config);
+    if (rtit_ctl & RTIT_CTL_CR3_FILTER)
+        cr3 = resolve_pt_cr3(config.pid, config.cr3_match);
+
+    xacquire_lock(pt_state_lock, irql_flag);
+
+    state = find_pt_state(request->pt_config.pid);
+    if (state == NULL)
+    {
+        xrelease_lock(pt_state_lock, irql_flag);
+        if (buffer)
+            xfree_pages(buffer, size);
+        xprintdbg("LIBIHT-COM: PT not enabled for pid %d.\n",
+                    request->pt_config.pid);
+        return -1;
+    }
+
+    // If the current process is the target process, we need to
+    // disable and re-enable PT to apply the new configuration
+    current = state->config.pid == xgetcurrent_pid();
+    if (current)
+        get_pt(state);
+
+    state->config.rtit_ctl = config.rtit_ctl;
+    state->config.range_count = config.range_count;
+    state->config.cr3_match = config.cr3_match;
+    xmemcpy(state->config.ranges, config.ranges,
+            sizeof(state->config.ranges));
+    state->rtit_ctl = rtit_ctl;
+    state->cr3 = cr3;
+
+    if (buffer && size != state->config.pt_buffer_size)
+    {
+        // Keep the PT from resuming and stop it on the other cores
+        state->reconfig++;
+        topa = state->topa;
+        xmemset(&stop, 0, sizeof(struct pt_stop));
+        stop.output_base = xvirt_to_phys(topa);
+        xrelease_lock(pt_state_lock, irql_flag);
+
+        xon_each_cpu_arg(stop_pt, &stop);
+
+        xacquire_lock(pt_state_lock, irql_flag);
+        state = find_pt_state(request->pt_config.pid);
+        if (state == NULL || state->topa != topa)
+        {
+            // Disabled meanwhile, the state is already freed
+            xrelease_lock(pt_state_lock, irql_flag);
+            xfree_pages(buffer, size);
+            xprintdbg("LIBIHT-COM: PT not enabled for pid %d.\n",
+                        request->pt_config.pid);
+            return -1;
+        }
+        if (state->reconfig)
+            state->reconfig--;
+
+        // Drain the packets of the old buffer before it is replaced
+        if (stop.stopped)
+        {
+            state->output_mask = stop.output_mask;
+            state->status = stop.status;
+        }
+        sync_pt_offset(state);
+        drain_pt(state);
+
+        // Reconfigure PT output
+        old_buffer = state->buffer;
+        old_size = state->config.pt_buffer_size;
+        install_pt_buffer(state, buffer, size);
+        buffer = NULL;
+    }
+
+    if (current)
+        put_pt(state);
+
+    xrelease_lock(pt_state_lock, irql_flag);
+
+    // Free the buffer not in use outside the lock
+    if (old_buffer)
+        xfree_pages(old_buffer, old_size);
+    if (buffer)
+        xfree_pages(buffer, size);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : read_pt
+// Description  : Read the PT packet bytes written since the cursor in request
+//                for a given process. Bytes are numbered from the time the PT
+//                buffer is set up. If the hardware has lapped the cursor, the
+//                overwritten bytes are reported as lost and the consumer
+//                should resync at the next PSB. The position of a process
+//                running elsewhere is the one of its last switch out. The
+//                bytes are staged in a bounce buffer under the lock, at most
+//                `PT_READ_BYTES` at a time, and copied to user once it is
+//                released, since user memory may fault.
+//
+// Inputs       : request - the PT cursor read ioctl request
+// Outputs      : 0 if successful, -1 if failure
+
+s32 read_pt(struct pt_read_request *request)
+{
+    u64 bytes_left, capacity, produced, oldest, slot, cnt, first, end, done;
+    struct pt_state *state;
+    struct pt_cursor req_buf;
+    u8 *bounce;
+    char irql_flag[MAX_IRQL_LEN];
+
+    if (request->buffer == NULL)
+        return -1;
+
+    // Reading the packets exposes the control flow, like ptrace does
+    if (!xtrace_allowed(request->pt_config.pid))
+    {
+        xprintdbg("LIBIHT-COM: PT not permitted for pid %d.\n",
+                    request->pt_config.pid);
+        return -1;
+    }
+
+    // Get a copy of cursor from userspace buffer
+    bytes_left = xcopy_from_user(&req_buf, request->buffer,
+                                    sizeof(struct pt_cursor));
+    if (bytes_left)
+    {
+        xprintdbg("LIBIHT-COM: Copy PT cursor from user failed.\n");
+        return -1;
+    }
+
+    bounce = xmalloc(PT_READ_BYTES);
+    if (bounce == NULL)
+        return -1;
+
+    // The output position of the current process is only known once paused
+    xacquire_lock(pt_state_lock, irql_flag);
+    state = find_pt_state(request->pt_config.pid);
+    if (state && state->config.pid == xgetcurrent_pid())
+    {
+        get_pt(state);
+        put_pt(state);
+    }
+    xrelease_lock(pt_state_lock, irql_flag);
+
+    req_buf.lost = 0;
+    end = (u64)-1;
+    done = 0;
+    do
+    {
+        xacquire_lock(pt_state_lock, irql_flag);
+
+        // The state may be disabled between two chunks
+        state = find_pt_state(request->pt_config.pid);
+        if (state == NULL)
+        {
+            xrelease_lock(pt_state_lock, irql_flag);
+            if (done)
+                break;
+
+            xprintdbg("LIBIHT-COM: PT not enabled for pid %d.\n",
+                        request->pt_config.pid);
+            xfree(bounce);
+            return -1;
+        }
+
+        // Locate the producer position in the byte stream
+        sync_pt_offset(state);
+        capacity = state->config.pt_buffer_size;
+        produced = count_pt_bytes(state);
+        oldest = produced > capacity ? produced - capacity : 0;
+
+        // A cursor from the future belongs to a buffer before reconfiguration
+        if (req_buf.cursor > produced)
+        {
+            req_buf.cursor = oldest;
+            end = (u64)-1;
+        }
+
+        // Bytes produced after the first chunk are left to the next read
+        if (end > produced)
+            end = produced;
+
+        if (req_buf.cursor < oldest)
+        {
+            req_buf.lost += oldest - req_buf.cursor;
+            req_buf.cursor = oldest;
+        }
+
+        cnt = end > req_buf.cursor ? end - req_buf.cursor : 0;
+        if (cnt > req_buf.count - done)
+            cnt = req_buf.count - done;
+        if (cnt > PT_READ_BYTES)
+            cnt = PT_READ_BYTES;
+        if (req_buf.data == NULL)
+            cnt = 0;
+
+        // Stage the bytes in at most two chunks around the buffer end
+        if (cnt)
+        {
+            slot = req_buf.cursor % capacity;
+            first = capacity - slot < cnt ? capacity - slot : cnt;
+            xmemcpy(bounce, state->buffer + slot, first);
+            xmemcpy(bounce + first, state->buffer, cnt - first);
+        }
+
+        xrelease_lock(pt_state_lock, irql_flag);
+
+        if (cnt)
+        {
+            bytes_left = xcopy_to_user(req_buf.data + done, bounce, cnt);
+            if (bytes_left)
+            {
+                xprintdbg("LIBIHT-COM: Copy to user failed.\n");
+                xfree(bounce);
+                return -1;
+            }
+        }
+
+        req_buf.cursor += cnt;
+        done += cnt;
+    } while (cnt && done < req_buf.count);
+
+    xfree(bounce);
+
+    xprintdbg("LIBIHT-COM: PT read %lld bytes up to cursor %lld, lost %lld.\n",
+                done, req_buf.cursor, req_buf.lost);
+    req_buf.count = done;
+
+    // Copy updated cursor back to userspace buffer
+    bytes_left = xcopy_to_user(request->buffer, &req_buf,
+                                sizeof(struct pt_cursor));
+    if (bytes_left)
+    {
+        xprintdbg("LIBIHT-COM: Copy to user failed.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : check_pt_config
+// Description  : Check the filters of a PT configuration before they reach the
+//                MSRs, which fault on a reserved bit. The CR3 to match must
+//                leave its low bits clear, and each IP filter range in use
+//                must have canonical addresses for the linear address width
+//                of the cores.
+//
+// Inputs       : config - the PT configuration
+// Outputs      : 0 if valid, -1 if not
+
+s32 check_pt_config(struct pt_config *config)
+{
+    u64 start, end;
+    u32 i, shift;
+
+    if (config->cr3_match & RTIT_CR3_MATCH_RESERVED)
+        return -1;
+
+    // A canonical address is the sign extension of its last linear bit
+    shift = 64 - pt_linear_bits;
+    for (i = 0; i < config->range_count && i < pt_range_count &&
+                i < LIBIHT_PT_MAX_RANGES; i++)
+    {
+        start = config->ranges[i].start;
+        end = config->ranges[i].end;
+        if ((u64)((s64)(start << shift) >> shift) != start ||
+            (u64)((s64)(end << shift) >> shift) != end)
+            return -1;
+    }
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_ctl_from_config
+// Description  : Build the MSR_IA32_RTIT_CTL of a PT configuration. The bits
+//                the module owns are replaced: the output goes to the ToPA,
+//                and each IP filter range in use, up to the ranges of the
+//                cores, traces only within itself. The bits and frequency
+//                values the cores do not advertise in CPUID are dropped, since
+//                writing them faults.
+//
+// Inputs       : config - the PT configuration
+// Outputs      : u64 - the MSR_IA32_RTIT_CTL, without TraceEn
+
+u64 pt_ctl_from_config(struct pt_config *config)
+{
+    u64 rtit_ctl;
+    u32 i;
+
+    rtit_ctl = config->rtit_ctl & ~PT_CONFIG_RESERVED & pt_ctl_supported;
+
+    // Drop the frequency values the cores do not support
+    if (!(pt_mtc_freqs & (1U << ((rtit_ctl & RTIT_CTL_MTC_FREQ) >>
+                                    RTIT_CTL_MTC_FREQ_SHIFT))))
+        rtit_ctl &= ~RTIT_CTL_MTC_FREQ;
+    if (!(pt_cyc_thresholds & (1U << ((rtit_ctl & RTIT_CTL_CYC_THRESH) >>
+                                        RTIT_CTL_CYC_THRESH_SHIFT))))
+        rtit_ctl &= ~RTIT_CTL_CYC_THRESH;
+    if (!(pt_psb_freqs & (1U << ((rtit_ctl & RTIT_CTL_PSB_FREQ) >>
+                                    RTIT_CTL_PSB_FREQ_SHIFT))))
+        rtit_ctl &= ~RTIT_CTL_PSB_FREQ;
+
+    rtit_ctl |= RTIT_CTL_TOPA;
+    for (i = 0; i < config->range_count && i < pt_range_count &&
+                i < LIBIHT_PT_MAX_RANGES; i++)
+        rtit_ctl |= RTIT_CTL_ADDR_FILTER(i);
+
+    return rtit_ctl;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : resolve_pt_cr3
+// Description  : Resolve the CR3 matched by the PT of a process, the one in
+//                its configuration or else the page table root of the process.
+//                The latter changes on exec and is resolved again then. It may
+//                sleep, so it must not be called with the `pt_state_lock`
+//                held.
+//
+// Inputs       : pid - the process id
+//                cr3_match - the CR3 configured, 0 if none
+// Outputs      : u64 - the CR3 to match
+
+u64 resolve_pt_cr3(u32 pid, u64 cr3_match)
+{
+    return cr3_match ? cr3_match : xgetpid_cr3(pid);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : setup_pt_buffer
+// Description  : Allocate a new PT output buffer of the given size for a PT
+//                state and describe it by its ToPA table. The size is rounded
+//                up to whole pages. The previous buffer, if any, is freed and
+//                the byte stream restarts from zero. It sleeps, so it is only
+//                used on a state not inserted yet.
+//
+// Inputs       : state - the PT state
+//                size - the PT buffer size in bytes
+// Outputs      : 0 if successful, -1 if failure
+
+s32 setup_pt_buffer(struct pt_state *state, u64 size)
+{
+    u8 *buffer;
+    u64 pages;
+
+    size = XPAGE_ALIGN(size);
+    pages = size / XPAGE_SIZE;
+    if (pages == 0 || pages > PT_TOPA_ENTRIES)
+        return -1;
+
+    buffer = xmalloc_pages(size);
+    if (buffer == NULL)
+        return -1;
+
+    if (state->buffer)
+        xfree_pages(state->buffer, state->config.pt_buffer_size);
+
+    install_pt_buffer(state, buffer, size);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : install_pt_buffer
+// Description  : Describe a PT output buffer of whole pages by the ToPA table
+//                of a PT state, and restart the byte stream from zero. Each
+//                page gets an entry of its own, so the buffer need not be
+//                physically contiguous, and the last entry links back to the
+//                table for a circular output. The previous buffer is left to
+//                the caller. Caller should hold the `pt_state_lock` if the
+//                state is inserted.
+//
+// Inputs       : state - the PT state
+//                buffer - the PT buffer
+//                size - the PT buffer size in bytes
+// Outputs      : void
+
+void install_pt_buffer(struct pt_state *state, u8 *buffer, u64 size)
+{
+    u64 i, pages;
+
+    // 4K entries, the size field is 0
+    pages = size / XPAGE_SIZE;
+    for (i = 0; i < pages; i++)
+        state->topa[i] = xvirt_to_phys(buffer + i * XPAGE_SIZE);
+    state->topa[pages] = xvirt_to_phys(state->topa) | TOPA_END;
+
+    state->config.pt_buffer_size = size;
+    state->buffer = buffer;
+    state->output_mask = RTIT_OUTPUT_MASK_LOWER;
+    state->status = 0;
+    state->pt_last_offset = 0;
+    state->drain_cursor = 0;
+    state->header->pt_offset = 0;
+    state->header->pt_wrap_gen = 0;
+    state->header->pt_buffer_size = size;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sync_pt_offset
+// Description  : Locate the output offset from the saved output mask, i.e. the
+//                ToPA entry and the offset within it, and count a buffer wrap
+//                if the offset went backwards. Caller should hold the
+//                `pt_state_lock`. Wraps are only observed on context switches
+//                and reads, so a buffer lapped more than once within a single
+//                time slice is counted as one wrap.
+//
+// Inputs       : state - the PT state
+// Outputs      : void
+
+void sync_pt_offset(struct pt_state *state)
+{
+    u64 offset;
+
+    offset = ((state->output_mask >> RTIT_OUTPUT_TABLE_SHIFT) &
+                RTIT_OUTPUT_TABLE_MASK) * XPAGE_SIZE +
+                (state->output_mask >> RTIT_OUTPUT_OFF_SHIFT);
+    if (offset < state->pt_last_offset)
+        state->header->pt_wrap_gen++;
+    state->pt_last_offset = offset;
+    state->header->pt_offset = offset;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : count_pt_bytes
+// Description  : Count the PT packet bytes produced since the PT buffer is set
+//                up, which is the stream offset of the next byte. Caller
+//                should hold the `pt_state_lock` and sync the offset first.
+//
+// Inputs       : state - the PT state
+// Outputs      : u64 - the number of bytes produced
+
+u64 count_pt_bytes(struct pt_state *state)
+{
+    return state->header->pt_wrap_gen * state->config.pt_buffer_size +
+            state->header->pt_offset;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : create_pt_state
+// Description  : Create a new PT state.
+//
+// Inputs       : void
+// Outputs      : The new PT state
+
+struct pt_state *create_pt_state(void)
+{
+    struct pt_state *state;
+
+    state = xmalloc(sizeof(struct pt_state));
+    if (state == NULL)
+        return NULL;
+    xmemset(state, 0, sizeof(struct pt_state));
+
+    // The header page can be mapped into user space together with the PT
+    // buffer, the ToPA table stays in the kernel
+    state->header = xmalloc_pages(XPAGE_SIZE);
+    state->topa = xmalloc_pages(XPAGE_SIZE);
+    if (state->header == NULL || state->topa == NULL)
+    {
+        if (state->header)
+            xfree_pages(state->header, XPAGE_SIZE);
+        if (state->topa)
+            xfree_pages(state->topa, XPAGE_SIZE);
+        xfree(state);
+        return NULL;
+    }
+
+    state->output_mask = RTIT_OUTPUT_MASK_LOWER;
+
+    return state;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : find_pt_state
+// Description  : Find a PT state by pid. Caller should hold the
+//                `pt_state_lock` for as long as it uses the state, which may
+//                be freed as soon as the lock is released.
+//
+// Inputs       : pid - the pid of the target process
+// Outputs      : The PT state
+
+struct pt_state *find_pt_state(u32 pid)
+{
+    struct pt_state *curr_state, *ret_state = NULL;
+    void *curr_list;
+    u64 offset;
+
+    // offsetof(st, m) macro implementation of stddef.h
+    offset = (u64)(&((struct pt_state *)0)->list);
+    curr_list = xlist_next(pt_state_head);
+    while (curr_list != NULL && curr_list != pt_state_head)
+    {
+        curr_state = (struct pt_state *)((u64)curr_list - offset);
+        curr_list = xlist_next(curr_list);
+        if (curr_state->config.pid == pid)
+        {
+            ret_state = curr_state;
+            break;
+        }
+    }
+
+    return ret_state;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : insert_pt_state
+// Description  : Insert a new PT state into the list.
+//
+// Inputs       : new_state - the new PT state
+// Outputs      : void
+
+void insert_pt_state(struct pt_state *new_state)
+{
+    char irql_flag[MAX_IRQL_LEN];
+
+    if (new_state == NULL)
+        return;
+
+    xacquire_lock(pt_state_lock, irql_flag);
+    xprintdbg("LIBIHT-COM: Insert PT state for pid %d.\n",
+                new_state->config.pid);
+    xlist_add(new_state->list, pt_state_head);
+    xrelease_lock(pt_state_lock, irql_flag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : free_pt_state
+// Description  : Free a PT state together with its header page, ToPA table
+//                and buffer. Pages still mapped into user space are released
+//                on unmap.
+//
+// Inputs       : state - the PT state
+// Outputs      : void
+
+void free_pt_state(struct pt_state *state)
+{
+    if (state->buffer)
+        xfree_pages(state->buffer, state->config.pt_buffer_size);
+    xfree_pages(state->topa, XPAGE_SIZE);
+    xfree_pages(state->header, XPAGE_SIZE);
+    xfree(state);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : free_pt_state_list
+// Description  : Free the PT state list.
+//
+// Inputs       : void
+// Outputs      : void
+
+void free_pt_state_list(void)
+{
+    char irql_flag[MAX_IRQL_LEN];
+    struct pt_state *curr_state;
+    void *curr_list;
+    u64 offset;
+
+    xacquire_lock(pt_state_lock, irql_flag);
+
+    // offsetof(st, m) macro implementation of stddef.h
+    offset = (u64)(&((struct pt_state *)0)->list);
+    curr_list = xlist_next(pt_state_head);
+    while (curr_list != NULL && curr_list != pt_state_head)
+    {
+        curr_state = (struct pt_state *)((u64)curr_list - offset);
+        curr_list = xlist_next(curr_list);
+        xprintdbg("LIBIHT-COM: Free PT state for pid %d.\n",
+                    curr_state->config.pid);
+
+        xlist_del(curr_state->list);
+        free_pt_state(curr_state);
+    }
+
+    xrelease_lock(pt_state_lock, irql_flag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : release_pt_session
+// Description  : Unsubscribe a session from the PT states, i.e. enabled
+//                through it or inherited from those, and remove the states
+//                left without subscribers. States shared with other sessions
+//                keep tracing.
+//
+// Inputs       : session - the session
+// Outputs      : void
+
+void release_pt_session(struct session *session)
+{
+    char irql_flag[MAX_IRQL_LEN];
+    char dying_head[MAX_LIST_LEN];
+    struct pt_state *curr_state;
+    struct pt_stop stop;
+    void *curr_list;
+    u64 offset;
+
+    xinit_list_head(dying_head);
+    xacquire_lock(pt_state_lock, irql_flag);
+
+    // Stop tracing the releasing process first, like disable_pt does
+    curr_state = find_pt_state(xgetcurrent_pid());
+    if (curr_state && curr_state->subs.count == 1 &&
+        curr_state->subs.sessions[0] == session)
+        get_pt(curr_state);
+
+    // offsetof(st, m) macro implementation of stddef.h
+    offset = (u64)(&((struct pt_state *)0)->list);
+    curr_list = xlist_next(pt_state_head);
+    while (curr_list != NULL && curr_list != pt_state_head)
+    {
+        curr_state = (struct pt_state *)((u64)curr_list - offset);
+        curr_list = xlist_next(curr_list);
+        if (unsubscribe_session(&curr_state->subs, session) ||
+            curr_state->subs.count)
+            continue;
+
+        xprintdbg("LIBIHT-COM: Release PT state for pid %d\n",
+                    curr_state->config.pid);
+        xlist_del(curr_state->list);
+        xlist_add(curr_state->list, dying_head);
+    }
+
+    xrelease_lock(pt_state_lock, irql_flag);
+
+    // Stop the removed states still traced on other cores, then free them
+    curr_list = xlist_next(dying_head);
+    while (curr_list != dying_head)
+    {
+        curr_state = (struct pt_state *)((u64)curr_list - offset);
+        curr_list = xlist_next(curr_list);
+        xmemset(&stop, 0, sizeof(struct pt_stop));
+        stop.output_base = xvirt_to_phys(curr_state->topa);
+        xon_each_cpu_arg(stop_pt, &stop);
+        free_pt_state(curr_state);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_ioctl_handler
+// Description  : The ioctl handler for the PT.
+//
+// Inputs       : session - the session of the request, can be NULL
+//                request - the cross platform ioctl request
+// Outputs      : 0 if successful, -1 if failure
+
+s32 pt_ioctl_handler(struct session *session, struct xioctl_request *request)
+{
+    s32 ret = 0;
+
+    xprintdbg("LIBIHT-COM: PT ioctl command %d.\n", request->cmd);
+    switch (request->cmd)
+    {
+    case LIBIHT_IOCTL_ENABLE_PT:
+        xprintdbg("LIBIHT-COM: Enable PT for pid %d.\n",
+                    request->body.pt.pt_config.pid);
+        ret = enable_pt(session, &request->body.pt);
+        break;
+
+    case LIBIHT_IOCTL_DISABLE_PT:
+        xprintdbg("LIBIHT-COM: Disable PT for pid %d.\n",
+                    request->body.pt.pt_config.pid);
+        ret = disable_pt(session, &request->body.pt);
+        break;
+
+    case LIBIHT_IOCTL_CONFIG_PT:
+        xprintdbg("LIBIHT-COM: Config PT for pid %d.\n",
+                    request->body.pt.pt_config.pid);
+        ret = config_pt(&request->body.pt);
+        break;
+
+    case LIBIHT_IOCTL_READ_PT:
+        xprintdbg("LIBIHT-COM: Read PT for pid %d.\n",
+                    request->body.pt_read.pt_config.pid);
+        ret = read_pt(&request->body.pt_read);
+        break;
+
+    default:
+        xprintdbg("LIBIHT-COM: Invalid PT ioctl command.\n");
+        ret = -1;
+        break;
+    }
+
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_cswitch_handler
+// Description  : The context switch handler for the PT. The traced tasks
+//                switching out and in are annotated by switch records, flagged
+//                when the task migrated since its last time slice.
+//
+// Inputs       : prev_pid - the pid of the previous process
+//                next_pid - the pid of the next process
+// Outputs      : void
+
+void pt_cswitch_handler(u32 prev_pid, u32 next_pid)
+{
+    struct pt_state *prev_state, *next_state;
+    char irql_flag[MAX_IRQL_LEN];
+    u32 flags;
+
+    xacquire_lock(pt_state_lock, irql_flag);
+
+    prev_state = find_pt_state(prev_pid);
+    next_state = find_pt_state(next_pid);
+
+    if (prev_state)
+    {
+        xprintdbg("LIBIHT-COM: PT context switch from pid %d on core %d\n",
+            prev_state->config.pid, xcoreid());
+        get_pt(prev_state);
+
+        // Switch out after the last packets of the time slice
+        subscribers_switch(&prev_state->subs, prev_pid, LIBIHT_SWITCH_OUT,
+                            next_pid, NULL);
+    }
+
+    if (next_state)
+    {
+        xprintdbg("LIBIHT-COM: PT context switch to pid %d on core %d\n",
+                next_state->config.pid, xcoreid());
+
+        flags = LIBIHT_SWITCH_IN;
+        if (next_state->last_cpu && next_state->last_cpu != xcoreid() + 1)
+            flags |= LIBIHT_SWITCH_MIGRATED;
+        next_state->last_cpu = xcoreid() + 1;
+        subscribers_switch(&next_state->subs, next_pid, flags, prev_pid,
+                            NULL);
+
+        put_pt(next_state);
+    }
+
+    xrelease_lock(pt_state_lock, irql_flag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_newproc_handler
+// Description  : The new process handler for the PT. The child is traced with
+//                the configuration of its parent into a buffer of its own, and
+//                its CR3 filter follows its own address space unless a CR3 is
+//                configured.
+//
+// Inputs       : parent_pid - the pid of the parent process
+//                child_pid - the pid of the child process
+// Outputs      : void
+
+void pt_newproc_handler(u32 parent_pid, u32 child_pid)
+{
+    struct pt_state *parent_state, *child_state;
+    struct pt_config config;
+    char irql_flag[MAX_IRQL_LEN];
+    u64 rtit_ctl;
+
+    xacquire_lock(pt_state_lock, irql_flag);
+    parent_state = find_pt_state(parent_pid);
+    if (parent_state == NULL)
+    {
+        xrelease_lock(pt_state_lock, irql_flag);
+        return;
+    }
+    config = parent_state->config;
+    rtit_ctl = parent_state->rtit_ctl;
+    xrelease_lock(pt_state_lock, irql_flag);
+
+    xprintdbg("LIBIHT-COM: PT new process %d parent pid %d\n",
+            child_pid, parent_pid);
+    child_state = create_pt_state();
+    if (child_state == NULL)
+        return;
+
+    child_state->config = config;
+    child_state->config.pid = child_pid;
+    child_state->rtit_ctl = rtit_ctl;
+    if (child_state->rtit_ctl & RTIT_CTL_CR3_FILTER)
+        child_state->cr3 = resolve_pt_cr3(child_pid,
+                                            child_state->config.cr3_match);
+    if (setup_pt_buffer(child_state, child_state->config.pt_buffer_size))
+    {
+        free_pt_state(child_state);
+        return;
+    }
+
+    // Inherit the sessions and insert in the same critical section, so a
+    // session released meanwhile is never inherited
+    xacquire_lock(pt_state_lock, irql_flag);
+    parent_state = find_pt_state(parent_pid);
+    if (parent_state == NULL)
+    {
+        xrelease_lock(pt_state_lock, irql_flag);
+        free_pt_state(child_state);
+        return;
+    }
+
+    child_state->parent = parent_state;
+    child_state->subs = parent_state->subs;
+    xprintdbg("LIBIHT-COM: Insert PT state for pid %d.\n", child_pid);
+    xlist_add(child_state->list, pt_state_head);
+
+    // If the child process is the current process, trace it right away
+    if (child_pid == xgetcurrent_pid())
+        put_pt(child_state);
+    xrelease_lock(pt_state_lock, irql_flag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_mmap_handler
+// Description  : The executable mapping handler for the PT feature. Called in
+//                the context of the process after it maps code, e.g. by mmap,
+//                mprotect or exec, to describe the new mappings in the range.
+//                An exec replaces the address space, so the CR3 filter
+//                following it is resolved again.
+//
+// Inputs       : pid - the process id
+//                start - the start address of the range
+//                end - the end address of the range
+// Outputs      : void
+
+void pt_mmap_handler(u32 pid, u64 start, u64 end)
+{
+    char irql_flag[MAX_IRQL_LEN];
+    struct pt_state *state;
+    u32 follow;
+    u64 cr3;
+
+    xacquire_lock(pt_state_lock, irql_flag);
+    state = find_pt_state(pid);
+    follow = state && (state->rtit_ctl & RTIT_CTL_CR3_FILTER) &&
+                !state->config.cr3_match;
+    xrelease_lock(pt_state_lock, irql_flag);
+    if (state == NULL)
+        return;
+
+    xfor_each_exec_mapping(pid, start, end, drain_pt_mmap, NULL);
+
+    if (!follow)
+        return;
+
+    cr3 = resolve_pt_cr3(pid, 0);
+    xacquire_lock(pt_state_lock, irql_flag);
+    state = find_pt_state(pid);
+    if (state && state->cr3 != cr3)
+    {
+        state->cr3 = cr3;
+        if (pid == xgetcurrent_pid())
+        {
+            get_pt(state);
+            put_pt(state);
+        }
+    }
+    xrelease_lock(pt_state_lock, irql_flag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_exitproc_handler
+// Description  : The process exit handler for the PT feature. The sessions
+//                subscribed to the PT of the process are flushed, since its
+//                last records may be left below their watermark.
+//
+// Inputs       : pid - the process id
+// Outputs      : void
+
+void pt_exitproc_handler(u32 pid)
+{
+    char irql_flag[MAX_IRQL_LEN];
+    struct pt_state *state;
+
+    xacquire_lock(pt_state_lock, irql_flag);
+    state = find_pt_state(pid);
+    if (state)
+        subscribers_flush(&state->subs);
+    xrelease_lock(pt_state_lock, irql_flag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_check
+// Description  : Check if the PT is available with the ToPA output it writes
+//                to, and probe the filters of the cores.
+//
+// Inputs       : void
+// Outputs      : 0 if successful, -1 if failure
+
+s32 pt_check(void)
+{
+    u32 cpuinfo[4] = { 0 };
+    u32 ip_filter;
+
+    xcpuid_count(7, 0, &cpuinfo[0], &cpuinfo[1], &cpuinfo[2], &cpuinfo[3]);
+
+    // Check if PT is supported
+    if (!(cpuinfo[1] & X64_FEATURE_INTEL_PT))
+        return -1;
+
+    // Check if multi-entry ToPA output is supported
+    xcpuid_count(0x14, 0, &cpuinfo[0], &cpuinfo[1], &cpuinfo[2], &cpuinfo[3]);
+    if (!(cpuinfo[2] & PT_CAP_TOPA) || !(cpuinfo[2] & PT_CAP_TOPA_MULTI))
+        return -1;
+
+    pt_has_cr3_filter = (cpuinfo[1] & PT_CAP_CR3_FILTER) ? 1 : 0;
+    ip_filter = cpuinfo[1] & PT_CAP_IP_FILTER;
+
+    // Collect the RTIT_CTL bits the cores support, the others fault
+    pt_ctl_supported = PT_CONFIG_BASE;
+    if (cpuinfo[1] & PT_CAP_CR3_FILTER)
+        pt_ctl_supported |= RTIT_CTL_CR3_FILTER;
+    if (cpuinfo[1] & PT_CAP_PSB_CYC)
+        pt_ctl_supported |= RTIT_CTL_CYC_EN | RTIT_CTL_CYC_THRESH |
+                            RTIT_CTL_PSB_FREQ;
+    if (cpuinfo[1] & PT_CAP_MTC)
+        pt_ctl_supported |= RTIT_CTL_MTC_EN | RTIT_CTL_MTC_FREQ;
+    if (cpuinfo[1] & PT_CAP_PTWRITE)
+        pt_ctl_supported |= RTIT_CTL_PTW_EN | RTIT_CTL_FUP_ON_PTW;
+    if (cpuinfo[1] & PT_CAP_POWER_EVT)
+        pt_ctl_supported |= RTIT_CTL_PWR_EVT_EN;
+
+    // Only the zero values are known to be valid without the sub-leaf
+    pt_range_count = 0;
+    pt_mtc_freqs = 1;
+    pt_cyc_thresholds = 1;
+    pt_psb_freqs = 1;
+    if (cpuinfo[0] >= 1)
+    {
+        xcpuid_count(0x14, 1, &cpuinfo[0], &cpuinfo[1], &cpuinfo[2],
+                        &cpuinfo[3]);
+        if (ip_filter)
+            pt_range_count = cpuinfo[0] & PT_CAP_RANGES_MASK;
+        pt_mtc_freqs = (cpuinfo[0] >> PT_CAP_BITMAP_SHIFT) | 1;
+        pt_cyc_thresholds = (cpuinfo[1] & PT_CAP_BITMAP_MASK) | 1;
+        pt_psb_freqs = (cpuinfo[1] >> PT_CAP_BITMAP_SHIFT) | 1;
+    }
+
+    // The IP filter ranges must be canonical for the linear address width
+    pt_linear_bits = DEFAULT_LINEAR_BITS;
+    xcpuid_count(CPUID_EXT_MAX_LEAF, 0, &cpuinfo[0], &cpuinfo[1],
+                    &cpuinfo[2], &cpuinfo[3]);
+    if (cpuinfo[0] >= CPUID_ADDR_SIZES)
+    {
+        xcpuid_count(CPUID_ADDR_SIZES, 0, &cpuinfo[0], &cpuinfo[1],
+                        &cpuinfo[2], &cpuinfo[3]);
+        if ((cpuinfo[0] >> CPUID_LINEAR_BITS_SHIFT) & CPUID_LINEAR_BITS_MASK)
+            pt_linear_bits = (cpuinfo[0] >> CPUID_LINEAR_BITS_SHIFT) &
+                                CPUID_LINEAR_BITS_MASK;
+    }
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_init
+// Description  : Initialize the PT.
+//
+// Inputs       : void
+// Outputs      : 0 if successful, -1 if failure
+
+s32 pt_init(void)
+{
+    xprintdbg("LIBIHT-COM: Init PT related structs.\n");
+    xinit_lock(pt_state_lock);
+    xinit_list_head(pt_state_head);
+
+    // Check if PT is supported and available
+    if (pt_check())
+    {
+        xprintdbg("LIBIHT-COM: PT is not supported or available.\n");
+        return -1;
+    }
+
+    xprintdbg("LIBIHT-COM: PT with %d IP filter ranges, CR3 filter %d.\n",
+                pt_range_count, pt_has_cr3_filter);
+
+    // Flush PT on each cpu
+    xprintdbg("LIBIHT-COM: Flushing PT for all cpus...\n");
+    xon_each_cpu(flush_pt);
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_exit
+// Description  : Exit the PT.
+//
+// Inputs       : void
+// Outputs      : 0 if successful, -1 if failure
+
+s32 pt_exit(void)
+{
+    // Flush PT on each cpu, if the cores have the RTIT MSRs
+    xprintdbg("LIBIHT-COM: Flushing PT for all cpus...\n");
+    if (pt_check() == 0)
+        xon_each_cpu(flush_pt);
+
+    // Free pt_state_list
+    xprintdbg("LIBIHT-COM: Freeing PT state list.\n");
+    free_pt_state_list();
+
+    return 0;
+}
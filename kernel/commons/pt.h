@@ -0,0 +1,329 @@
+#ifndef _COMMONS_PT_H_
+#define _COMMONS_PT_H_
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : kernel/commons/pt.h
+//  Description    : This is the header file for the PT (Intel Processor Trace)
+//                   module, which is used to capture the complete control flow
+//                   of a given process as a packet stream. Some of the macros
+//                   and constants are adapted from the Linux kernel source
+//                   code.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : July 10, 2024
+//
+
+// Include Files
+#include "types.h"
+#include "xplat.h"
+#include "xioctl.h"
+#include "session.h"
+
+// cpp cross compile handler
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+//
+// Library constants
+
+// Intel-defined CPU features, CPUID level 0x00000007:0 (EBX)
+#define X64_FEATURE_INTEL_PT    (1U << 25)
+
+// Intel PT capabilities, CPUID level 0x00000014:0 (EBX)
+#define PT_CAP_CR3_FILTER       (1U <<  0)
+#define PT_CAP_PSB_CYC          (1U <<  1)
+#define PT_CAP_IP_FILTER        (1U <<  2)
+#define PT_CAP_MTC              (1U <<  3)
+#define PT_CAP_PTWRITE          (1U <<  4)
+#define PT_CAP_POWER_EVT        (1U <<  5)
+
+// Intel PT capabilities, CPUID level 0x00000014:0 (ECX)
+#define PT_CAP_TOPA             (1U <<  0)
+#define PT_CAP_TOPA_MULTI       (1U <<  1)
+
+// Intel PT capabilities, CPUID level 0x00000014:1 (EAX), and the bitmaps of
+// the supported MTC periods, in EAX, and CYC thresholds and PSB frequencies,
+// in EBX
+#define PT_CAP_RANGES_MASK      0x7
+#define PT_CAP_BITMAP_MASK      0xffff
+#define PT_CAP_BITMAP_SHIFT     16
+
+// Linear address width, CPUID level 0x80000008 (EAX), 48 bits without it
+#define CPUID_EXT_MAX_LEAF      0x80000000
+#define CPUID_ADDR_SIZES        0x80000008
+#define CPUID_LINEAR_BITS_SHIFT 8
+#define CPUID_LINEAR_BITS_MASK  0xff
+#define DEFAULT_LINEAR_BITS     48
+
+// MSR related constants
+#ifndef MSR_IA32_RTIT_OUTPUT_BASE
+#define MSR_IA32_RTIT_OUTPUT_BASE       0x00000560
+#endif
+#ifndef MSR_IA32_RTIT_OUTPUT_MASK
+#define MSR_IA32_RTIT_OUTPUT_MASK       0x00000561
+#endif
+#ifndef MSR_IA32_RTIT_CTL
+#define MSR_IA32_RTIT_CTL               0x00000570
+#endif
+#ifndef MSR_IA32_RTIT_STATUS
+#define MSR_IA32_RTIT_STATUS            0x00000571
+#endif
+#ifndef MSR_IA32_RTIT_CR3_MATCH
+#define MSR_IA32_RTIT_CR3_MATCH         0x00000572
+#endif
+#ifndef MSR_IA32_RTIT_ADDR0_A
+#define MSR_IA32_RTIT_ADDR0_A           0x00000580
+#endif
+#ifndef MSR_IA32_RTIT_ADDR0_B
+#define MSR_IA32_RTIT_ADDR0_B           0x00000581
+#endif
+
+// MSR_IA32_RTIT_CTL bits
+#define RTIT_CTL_TRACE_EN       (1ULL <<  0)
+#define RTIT_CTL_CYC_EN         (1ULL <<  1)
+#define RTIT_CTL_OS             (1ULL <<  2)
+#define RTIT_CTL_USR            (1ULL <<  3)
+#define RTIT_CTL_PWR_EVT_EN     (1ULL <<  4)
+#define RTIT_CTL_FUP_ON_PTW     (1ULL <<  5)
+#define RTIT_CTL_FABRIC_EN      (1ULL <<  6)
+#define RTIT_CTL_CR3_FILTER     (1ULL <<  7)
+#define RTIT_CTL_TOPA           (1ULL <<  8)
+#define RTIT_CTL_MTC_EN         (1ULL <<  9)
+#define RTIT_CTL_TSC_EN         (1ULL << 10)
+#define RTIT_CTL_DIS_RETC       (1ULL << 11)
+#define RTIT_CTL_PTW_EN         (1ULL << 12)
+#define RTIT_CTL_BRANCH_EN      (1ULL << 13)
+#define RTIT_CTL_MTC_FREQ       (0xfULL << 14)
+#define RTIT_CTL_CYC_THRESH     (0xfULL << 19)
+#define RTIT_CTL_PSB_FREQ       (0xfULL << 24)
+#define RTIT_CTL_ADDR_CFG(n)    (0xfULL << (32 + 4 * (n)))
+#define RTIT_CTL_ADDR_FILTER(n) (1ULL << (32 + 4 * (n)))
+
+// MSR_IA32_RTIT_CR3_MATCH reserved bits
+#define RTIT_CR3_MATCH_RESERVED 0x1fULL
+
+// MSR_IA32_RTIT_STATUS bits
+#define RTIT_STATUS_ERROR       (1ULL <<  4)
+#define RTIT_STATUS_STOPPED     (1ULL <<  5)
+
+// MSR_IA32_RTIT_OUTPUT_MASK layout with ToPA output
+#define RTIT_OUTPUT_MASK_LOWER  0x7fULL
+#define RTIT_OUTPUT_TABLE_SHIFT 7
+#define RTIT_OUTPUT_TABLE_MASK  0x1ffffffULL
+#define RTIT_OUTPUT_OFF_SHIFT   32
+
+// Table of Physical Addresses (ToPA) entry bits, the 4K size is encoded 0
+#define TOPA_END                (1ULL <<  0)
+#define TOPA_INT                (1ULL <<  2)
+#define TOPA_STOP               (1ULL <<  4)
+
+// ToPA entries in the table page, the last one links back to the table
+#define PT_TOPA_ENTRIES         (XPAGE_SIZE / sizeof(u64) - 1)
+
+// Trace the branches of user mode with timestamps by default
+#define DEFAULT_PT_CONFIG       (RTIT_CTL_BRANCH_EN | RTIT_CTL_USR | \
+                                    RTIT_CTL_TSC_EN)
+
+// RTIT_CTL bits every core with PT supports, the others depend on CPUID
+#define PT_CONFIG_BASE          (RTIT_CTL_OS | RTIT_CTL_USR | \
+                                    RTIT_CTL_TSC_EN | RTIT_CTL_DIS_RETC | \
+                                    RTIT_CTL_BRANCH_EN)
+
+// RTIT_CTL frequency fields, each encoding a value of a CPUID bitmap
+#define RTIT_CTL_MTC_FREQ_SHIFT     14
+#define RTIT_CTL_CYC_THRESH_SHIFT   19
+#define RTIT_CTL_PSB_FREQ_SHIFT     24
+
+// RTIT_CTL bits the module owns
+#define PT_CONFIG_RESERVED      (RTIT_CTL_TRACE_EN | RTIT_CTL_FABRIC_EN | \
+                                    RTIT_CTL_TOPA | RTIT_CTL_ADDR_CFG(0) | \
+                                    RTIT_CTL_ADDR_CFG(1) | RTIT_CTL_ADDR_CFG(2) | \
+                                    RTIT_CTL_ADDR_CFG(3))
+
+// PT output buffer size 0x40000 = 256 KiB, at most PT_TOPA_ENTRIES pages
+#define DEFAULT_PT_BUFFER_SIZE  0x40000
+
+// Maximum packet bytes carried by one drained record
+#define PT_DRAIN_BYTES          0x1000
+
+// Maximum PT packet bytes staged under the lock by one chunk of a cursor read
+#define PT_READ_BYTES           0x1000
+
+//
+// Type definitions
+
+// Define PT header page, mapped read-only in front of the PT output buffer
+struct pt_header
+{
+    u64 pt_offset;                      // Output offset at the last pause
+    u64 pt_wrap_gen;                    // PT buffer wrap generation
+    u64 pt_buffer_size;                 // PT buffer size
+};
+
+// Define PT state
+struct pt_state
+{
+    char list[MAX_LIST_LEN];            // Kernel linked list
+    struct pt_state *parent;            // Parent pt_state
+    struct pt_config config;            // PT configuration
+    struct pt_header *header;           // PT header page
+    u8 *buffer;                         // PT output buffer
+    u64 *topa;                          // ToPA table page
+    u64 rtit_ctl;                       // MSR_IA32_RTIT_CTL, without TraceEn
+    u64 cr3;                            // CR3 matched, the configured one or
+                                        // the page table root of the process
+    u64 output_mask;                    // Saved MSR_IA32_RTIT_OUTPUT_MASK
+    u64 status;                         // Saved MSR_IA32_RTIT_STATUS
+    u64 pt_last_offset;                 // Last observed output offset
+    struct subscribers subs;            // Sessions sharing the PT
+    u64 drain_cursor;                   // Stream offset of next to drain
+    u32 last_cpu;                       // Core of the last switch in + 1, or 0
+    u32 reconfig;                       // Reconfigurations stopping the PT
+};
+
+// Define a remote PT stop, dispatched to each core by `xon_each_cpu_arg`
+struct pt_stop
+{
+    u64 output_base;                    // ToPA table of the PT to stop
+    u64 output_mask;                    // Saved MSR_IA32_RTIT_OUTPUT_MASK
+    u64 status;                         // Saved MSR_IA32_RTIT_STATUS
+    u32 stopped;                        // The PT was stopped on a core
+};
+
+//
+// Global Variables
+
+extern char pt_state_lock[MAX_LOCK_LEN];
+// The lock for pt_state_list.
+
+extern char pt_state_head[MAX_LIST_LEN];
+// The head of the pt_state_list.
+
+extern u32 pt_range_count;
+// The number of IP filter ranges of the cores.
+
+extern u32 pt_has_cr3_filter;
+// The cores support CR3 filtering.
+
+extern u64 pt_ctl_supported;
+// The RTIT_CTL bits the cores support.
+
+extern u32 pt_mtc_freqs;
+// The bitmap of the MTC periods the cores support.
+
+extern u32 pt_cyc_thresholds;
+// The bitmap of the CYC thresholds the cores support.
+
+extern u32 pt_psb_freqs;
+// The bitmap of the PSB frequencies the cores support.
+
+extern u32 pt_linear_bits;
+// The linear address width of the cores.
+
+//
+// Function Prototypes
+
+void get_pt(struct pt_state *state);
+// Pause the PT and save its output position.
+
+void put_pt(struct pt_state *state);
+// Restore the output position and filters of the PT and resume it.
+
+void flush_pt(void);
+// Stop the PT of the current core.
+
+void stop_pt(void *arg);
+// Stop the PT of the current core if it writes to a given ToPA table.
+
+void drain_pt(struct pt_state *state);
+// Drain the new PT packet bytes into the session.
+
+s32 pt_subscribed(u32 pid, struct session *session);
+// Check if a session is subscribed to the PT of a given process.
+
+void drain_pt_mmap(void *ctx, u32 pid, struct trace_mmap_record *record,
+                    char *path, u32 path_size);
+// Drain a mapping record of a given process into its sessions.
+
+s32 enable_pt(struct session *session, struct pt_ioctl_request *request);
+// Enable the PT.
+
+s32 disable_pt(struct session *session, struct pt_ioctl_request *request);
+// Disable the PT.
+
+s32 config_pt(struct pt_ioctl_request *request);
+// Configure the PT trace bits and filters.
+
+s32 read_pt(struct pt_read_request *request);
+// Read the PT packet bytes written since the cursor
+
+s32 check_pt_config(struct pt_config *config);
+// Check the filters of a PT configuration against the MSR reserved bits
+
+u64 pt_ctl_from_config(struct pt_config *config);
+// Build the MSR_IA32_RTIT_CTL of a PT configuration
+
+u64 resolve_pt_cr3(u32 pid, u64 cr3_match);
+// Resolve the CR3 matched by the PT of a process
+
+s32 setup_pt_buffer(struct pt_state *state, u64 size);
+// Setup the PT output buffer and ToPA table of a PT state
+
+void install_pt_buffer(struct pt_state *state, u8 *buffer, u64 size);
+// Describe a PT output buffer by the ToPA table of a PT state
+
+void sync_pt_offset(struct pt_state *state);
+// Account PT buffer wraps since the last observed offset
+
+u64 count_pt_bytes(struct pt_state *state);
+// Count the PT packet bytes produced since the buffer is set up
+
+struct pt_state *create_pt_state(void);
+// Create a new PT state
+
+struct pt_state *find_pt_state(u32 pid);
+// Find the PT state by pid
+
+void insert_pt_state(struct pt_state *new_state);
+// Insert the PT state into the list
+
+void free_pt_state(struct pt_state *state);
+// Free the PT state and its buffers
+
+void free_pt_state_list(void);
+// Free the PT state list
+
+void release_pt_session(struct session *session);
+// Remove the PT states owned by a session
+
+s32 pt_ioctl_handler(struct session *session, struct xioctl_request *request);
+// The ioctl handler for the PT
+
+void pt_cswitch_handler(u32 prev_pid, u32 next_pid);
+// The context switch handler for the PT
+
+void pt_newproc_handler(u32 parent_pid, u32 child_pid);
+// The new process handler for the PT
+
+void pt_mmap_handler(u32 pid, u64 start, u64 end);
+// The executable mapping handler for the PT
+
+void pt_exitproc_handler(u32 pid);
+// The process exit handler for the PT
+
+s32 pt_check(void);
+// Check if the PT is available
+
+s32 pt_init(void);
+// Initialize the PT
+
+s32 pt_exit(void);
+// Exit the PT
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // _COMMONS_PT_H_
@@ -0,0 +1,750 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : kernel/commons/session.c
+//  Description    : This is the implementation of the session for the libiht
+//                   library. Producers (context switch handlers) append
+//                   records into the drain buffer of the session, and the
+//                   platform device streams them out to the reader. The drain
+//                   buffer never overwrites unread bytes, a record that does
+//                   not fit is dropped and reported by a lost record later.
+//                   The traced process publishes markers into the control
+//                   page, they are drained in order at the next switch out,
+//                   after the trace of the time slice.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : July 10, 2024
+//
+
+// Include Files
+#include "session.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : create_session
+// Description  : Create a new session with the default drain buffer size and
+//                watermark.
+//
+// Inputs       : void
+// Outputs      : struct session* - the newly created session
+
+struct session *create_session(void)
+{
+    struct session *session;
+    u64 i;
+
+    session = xmalloc(sizeof(struct session));
+    if (session == NULL)
+        return NULL;
+
+    xmemset(session, 0, sizeof(struct session));
+    session->control = xmalloc_pages(XPAGE_SIZE);
+    if (session->control == NULL)
+    {
+        xfree(session);
+        return NULL;
+    }
+
+    session->buffer = xmalloc_pages(DEFAULT_SESSION_BUFFER_SIZE);
+    if (session->buffer == NULL)
+    {
+        xfree_pages(session->control, XPAGE_SIZE);
+        xfree(session);
+        return NULL;
+    }
+
+    xmemset(session->control, 0, XPAGE_SIZE);
+    session->control->gate = LIBIHT_GATE_OPEN;
+    for (i = 0; i < LIBIHT_MARKER_SLOTS; i++)
+        session->control->markers[i].seq = i;
+
+    session->buffer_size = DEFAULT_SESSION_BUFFER_SIZE;
+    session->watermark = DEFAULT_SESSION_WATERMARK;
+    xinit_lock(session->lock);
+    xinit_waitq(session->waitq);
+
+    return session;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : free_session
+// Description  : Free a session, its control page and drain buffer. Caller
+//                should ensure no trace state refers to the session anymore.
+//                A control page still mapped into user space is released on
+//                unmap.
+//
+// Inputs       : session - the session
+// Outputs      : void
+
+void free_session(struct session *session)
+{
+    xdestroy_waitq(session->waitq);
+    xfree_pages(session->buffer, session->buffer_size);
+    xfree_pages(session->control, XPAGE_SIZE);
+    xfree(session);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : session_copy
+// Description  : Copy data into the drain buffer at a stream position, split
+//                around the buffer end. Caller should hold the session lock.
+//
+// Inputs       : session - the session
+//                pos - the stream position
+//                src - the source data
+//                size - the size of the data
+// Outputs      : void
+
+void session_copy(struct session *session, u64 pos, void *src, u64 size)
+{
+    u64 offset, first;
+
+    offset = pos % session->buffer_size;
+    first = session->buffer_size - offset < size ?
+                session->buffer_size - offset : size;
+    xmemcpy(session->buffer + offset, src, first);
+    if (first < size)
+        xmemcpy(session->buffer, (u8 *)src + first, size - first);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : session_write
+// Description  : Write a record made of a header and up to two data chunks
+//                into the drain buffer, and wake up the readers once the
+//                readable bytes reach the watermark. Pending drops are
+//                reported by a lost record ahead of it. Safe to call from the
+//                context switch handlers.
+//
+// Inputs       : session - the session
+//                type - the record type
+//                tid - the thread id of the traced task
+//                data0 - the first data chunk
+//                size0 - the size of the first data chunk
+//                data1 - the second data chunk, can be NULL
+//                size1 - the size of the second data chunk
+// Outputs      : s32 - 0 on success, -1 if the drain buffer is full
+
+s32 session_write(struct session *session, u16 type, u32 tid,
+                    void *data0, u32 size0, void *data1, u32 size1)
+{
+    struct trace_record_header header;
+    u64 size, lost_size, need;
+    s32 ready;
+    char irql_flag[MAX_IRQL_LEN];
+
+    header.reserved = 0;
+    header.tid = tid;
+    header.cpu = xcoreid();
+    header.tsc = xrdtsc();
+
+    size = sizeof(header) + size0 + size1;
+    size = (size + SESSION_RECORD_ALIGN - 1) & ~(u64)(SESSION_RECORD_ALIGN - 1);
+    lost_size = sizeof(header) + sizeof(struct trace_lost_record);
+
+    xacquire_lock(session->lock, irql_flag);
+
+    need = size;
+    if (session->lost.lbr_snapshots || session->lost.bts_records ||
+        session->lost.markers || session->lost.mmaps ||
+        session->lost.switches || session->lost.pt_bytes)
+        need += lost_size;
+    if (session->buffer_size - (session->head - session->tail) < need)
+    {
+        xrelease_lock(session->lock, irql_flag);
+        return -1;
+    }
+
+    // Report the drops before the record
+    if (need != size)
+    {
+        header.type = LIBIHT_RECORD_LOST;
+        header.size = (u32)lost_size;
+        session_copy(session, session->head, &header, sizeof(header));
+        session_copy(session, session->head + sizeof(header), &session->lost,
+                        sizeof(struct trace_lost_record));
+        session->head += lost_size;
+        xmemset(&session->lost, 0, sizeof(struct trace_lost_record));
+    }
+
+    header.type = type;
+    header.size = (u32)size;
+    session_copy(session, session->head, &header, sizeof(header));
+    if (size0)
+        session_copy(session, session->head + sizeof(header), data0, size0);
+    if (size1)
+        session_copy(session, session->head + sizeof(header) + size0,
+                        data1, size1);
+    session->head += size;
+
+    ready = session->head - session->tail >= session->watermark ||
+            session->flush;
+    xrelease_lock(session->lock, irql_flag);
+
+    if (ready)
+        xwake_up(session->waitq);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : session_drain_markers
+// Description  : Drain the markers published in the control page into the
+//                drain buffer as marker records, in the order they were
+//                claimed. The tail is kept by the kernel, user can only make
+//                it drain garbage markers, at most one ring per call. Caller
+//                should hold the session lock.
+//
+// Inputs       : session - the session
+// Outputs      : void
+
+void session_drain_markers(struct session *session)
+{
+    struct trace_record_header header;
+    struct trace_marker marker;
+    struct session_marker_slot *slot;
+    u64 size, i;
+
+    size = sizeof(header) + sizeof(marker);
+    for (i = 0; i < LIBIHT_MARKER_SLOTS; i++)
+    {
+        slot = &session->control->markers[session->marker_tail %
+                                            LIBIHT_MARKER_SLOTS];
+        if (xload_acquire(&slot->seq) != session->marker_tail + 1)
+            break;
+
+        header.type = LIBIHT_RECORD_MARKER;
+        header.reserved = 0;
+        header.size = (u32)size;
+        header.tid = slot->tid;
+        header.cpu = slot->cpu;
+        header.tsc = slot->tsc;
+        marker.tag = slot->tag;
+
+        // Hand the slot back to the producers
+        xstore_release(&slot->seq, session->marker_tail + LIBIHT_MARKER_SLOTS);
+        session->marker_tail++;
+
+        if (session->buffer_size - (session->head - session->tail) < size)
+        {
+            session->lost.markers++;
+            continue;
+        }
+
+        session_copy(session, session->head, &header, sizeof(header));
+        session_copy(session, session->head + sizeof(header), &marker,
+                        sizeof(marker));
+        session->head += size;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : session_lost
+// Description  : Account the trace data dropped before reaching the drain
+//                buffer. It is reported by the next written record.
+//
+// Inputs       : session - the session
+//                lbr_snapshots - the number of LBR snapshots dropped
+//                bts_records - the number of BTS records dropped
+//                mmaps - the number of mapping records dropped
+//                switches - the number of switch records dropped
+//                pt_bytes - the number of PT packet bytes dropped
+// Outputs      : void
+
+void session_lost(struct session *session, u64 lbr_snapshots, u64 bts_records,
+                    u64 mmaps, u64 switches, u64 pt_bytes)
+{
+    char irql_flag[MAX_IRQL_LEN];
+
+    xacquire_lock(session->lock, irql_flag);
+    session->lost.lbr_snapshots += lbr_snapshots;
+    session->lost.bts_records += bts_records;
+    session->lost.mmaps += mmaps;
+    session->lost.switches += switches;
+    session->lost.pt_bytes += pt_bytes;
+    xrelease_lock(session->lock, irql_flag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : session_mmap
+// Description  : Write a mapping record of a traced process into the drain
+//                buffer of a session. Mapping records are side-band data for
+//                symbolization, so they are written even if the gate is
+//                closed. Matches the callback of `xfor_each_exec_mapping`.
+//
+// Inputs       : session - the session
+//                pid - the process ID of the traced process
+//                record - the mapping record
+//                path - the path of the mapped file, NUL terminated
+//                path_size - the size of the path, NUL included
+// Outputs      : void
+
+void session_mmap(void *session, u32 pid, struct trace_mmap_record *record,
+                    char *path, u32 path_size)
+{
+    if (session_write(session, LIBIHT_RECORD_MMAP, pid, record,
+                        sizeof(struct trace_mmap_record), path, path_size))
+        session_lost(session, 0, 0, 1, 0, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : session_readable
+// Description  : Check if the readable bytes in the drain buffer reach the
+//                watermark of the session, or if a record is partially read.
+//                Records are written whole, so the rest of it is buffered.
+//                Once the session is flushed, any unread byte is readable.
+//                Nothing is readable while another reader holds a chunk,
+//                which wakes up the readers once it is released.
+//
+// Inputs       : session - the session
+// Outputs      : s32 - 1 if readable, 0 if not
+
+s32 session_readable(struct session *session)
+{
+    s32 ready;
+    char irql_flag[MAX_IRQL_LEN];
+
+    xacquire_lock(session->lock, irql_flag);
+    ready = !session->reading &&
+            (session->head - session->tail >= session->watermark ||
+            session->record_end > session->tail ||
+            (session->flush && session->head != session->tail));
+    xrelease_lock(session->lock, irql_flag);
+
+    return ready;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : session_pending
+// Description  : Check if the drain buffer holds any unread bytes, whatever
+//                the watermark, e.g. for a reader that does not wait.
+//
+// Inputs       : session - the session
+// Outputs      : s32 - 1 if any byte is unread, 0 if not
+
+s32 session_pending(struct session *session)
+{
+    s32 pending;
+    char irql_flag[MAX_IRQL_LEN];
+
+    xacquire_lock(session->lock, irql_flag);
+    pending = session->head != session->tail;
+    xrelease_lock(session->lock, irql_flag);
+
+    return pending;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : session_flush
+// Description  : Make the unread bytes of the drain buffer readable below the
+//                watermark, and wake up the readers. Called once a trace state
+//                of the session is gone or its process exits, since no record
+//                may come to lift the bytes left over the watermark. The
+//                session stays flushed until the watermark is configured
+//                again, so the last records, e.g. the switch out of an exiting
+//                process, are not held back either.
+//
+// Inputs       : session - the session, can be NULL
+// Outputs      : void
+
+void session_flush(struct session *session)
+{
+    s32 pending;
+    char irql_flag[MAX_IRQL_LEN];
+
+    if (session == NULL)
+        return;
+
+    xacquire_lock(session->lock, irql_flag);
+    session->flush = 1;
+    pending = session->head != session->tail;
+    xrelease_lock(session->lock, irql_flag);
+
+    if (pending)
+        xwake_up(session->waitq);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : session_peek
+// Description  : Get the contiguous readable chunk of the drain buffer. The
+//                chunk stays valid until it is released by session_consume,
+//                since producers never overwrite unread bytes. Only one
+//                reader can hold a chunk at a time.
+//
+// Inputs       : session - the session
+//                chunk - the returned chunk pointer
+// Outputs      : u64 - the size of the chunk, 0 if empty or being read
+
+u64 session_peek(struct session *session, void **chunk)
+{
+    u64 offset, size;
+    char irql_flag[MAX_IRQL_LEN];
+
+    xacquire_lock(session->lock, irql_flag);
+
+    size = 0;
+    if (!session->reading && session->head != session->tail)
+    {
+        offset = session->tail % session->buffer_size;
+        size = session->head - session->tail;
+        if (size > session->buffer_size - offset)
+            size = session->buffer_size - offset;
+        *chunk = session->buffer + offset;
+        session->reading = 1;
+    }
+
+    xrelease_lock(session->lock, irql_flag);
+
+    return size;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : session_consume
+// Description  : Consume the bytes from a chunk got by session_peek and
+//                release the chunk. The record boundaries are followed along,
+//                so a partially read record is told apart. The readers that
+//                waited for the chunk are woken up if bytes are left.
+//
+// Inputs       : session - the session
+//                size - the number of bytes consumed, 0 to only release
+// Outputs      : void
+
+void session_consume(struct session *session, u64 size)
+{
+    struct trace_record_header header;
+    u64 offset, first;
+    s32 pending;
+    char irql_flag[MAX_IRQL_LEN];
+
+    xacquire_lock(session->lock, irql_flag);
+
+    // The headers are read before the tail passes them, they may be split
+    // around the buffer end
+    while (session->record_end < session->tail + size)
+    {
+        offset = session->record_end % session->buffer_size;
+        first = session->buffer_size - offset < sizeof(header) ?
+                    session->buffer_size - offset : sizeof(header);
+        xmemcpy(&header, session->buffer + offset, first);
+        if (first < sizeof(header))
+            xmemcpy((u8 *)&header + first, session->buffer,
+                    sizeof(header) - first);
+        session->record_end += header.size;
+    }
+
+    session->tail += size;
+    session->reading = 0;
+    pending = session->head != session->tail;
+    xrelease_lock(session->lock, irql_flag);
+
+    if (pending)
+        xwake_up(session->waitq);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : config_session
+// Description  : Configure the watermark and the drain buffer size of the
+//                session, at most `MAX_SESSION_BUFFER_SIZE`. Resizing the
+//                drain buffer discards unread bytes. A
+//                flushed session holds its bytes back to the watermark again.
+//
+// Inputs       : session - the session
+//                request - the session ioctl request
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 config_session(struct session *session,
+                    struct session_ioctl_request *request)
+{
+    u8 *buffer = NULL, *old_buffer = NULL;
+    u64 size, old_size = 0;
+    char irql_flag[MAX_IRQL_LEN];
+
+    // The size comes from user, it is bounded before it is allocated
+    if (request->session_config.buffer_size > MAX_SESSION_BUFFER_SIZE)
+    {
+        xprintdbg("LIBIHT-COM: Session buffer size too large\n");
+        return -1;
+    }
+
+    size = XPAGE_ALIGN(request->session_config.buffer_size);
+    if (size && size != session->buffer_size)
+    {
+        buffer = xmalloc_pages(size);
+        if (buffer == NULL)
+        {
+            xprintdbg("LIBIHT-COM: Allocate session buffer failed\n");
+            return -1;
+        }
+    }
+
+    xacquire_lock(session->lock, irql_flag);
+
+    if (buffer)
+    {
+        if (session->reading)
+        {
+            xrelease_lock(session->lock, irql_flag);
+            xfree_pages(buffer, size);
+            return -1;
+        }
+
+        // Swap the buffer, free the old one outside the lock
+        old_buffer = session->buffer;
+        old_size = session->buffer_size;
+        session->buffer = buffer;
+        session->buffer_size = size;
+        session->head = session->tail = session->record_end = 0;
+    }
+
+    session->watermark = request->session_config.watermark ?
+            request->session_config.watermark : DEFAULT_SESSION_WATERMARK;
+    if (session->watermark > session->buffer_size)
+        session->watermark = session->buffer_size;
+    session->flush = 0;
+
+    xrelease_lock(session->lock, irql_flag);
+
+    if (old_buffer)
+        xfree_pages(old_buffer, old_size);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : session_gate_open
+// Description  : Check if the tracing gate of the session is open. The gate is
+//                flipped by user with a plain store into the control page, so
+//                any value other than closed opens it.
+//
+// Inputs       : session - the session, can be NULL
+// Outputs      : s32 - 1 if open or no session, 0 if closed
+
+s32 session_gate_open(struct session *session)
+{
+    if (session == NULL)
+        return 1;
+
+    return xload_acquire(&session->control->gate) != LIBIHT_GATE_CLOSED;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : subscribers_gate_open
+// Description  : Check if the tracing gate of any subscriber of a trace state
+//                is open, i.e. if the state should be traced at all. Caller
+//                should hold the lock of the trace state.
+//
+// Inputs       : subs - the subscribers of the trace state
+// Outputs      : s32 - 1 if any gate is open, 0 if all closed
+
+s32 subscribers_gate_open(struct subscribers *subs)
+{
+    u32 i;
+
+    for (i = 0; i < subs->count; i++)
+        if (session_gate_open(subs->sessions[i]))
+            return 1;
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : subscribers_switch
+// Description  : Write a switch record of a traced task into the subscribers
+//                of its trace state with an open tracing gate. The markers
+//                are drained ahead of a switch out, by then the trace of the
+//                time slice they were emitted in is drained too. A session
+//                tracing the task with several features gets the record once,
+//                from the feature the shadowed callback leaves it to. Caller
+//                should hold the lock of the trace state.
+//
+// Inputs       : subs - the subscribers of the trace state
+//                tid - the thread id of the traced task
+//                flags - the LIBIHT_SWITCH_* flags
+//                other_tid - the thread id switched to or from
+//                shadowed - check if another feature writes the record into a
+//                           session, can be NULL
+// Outputs      : void
+
+void subscribers_switch(struct subscribers *subs, u32 tid, u32 flags,
+                        u32 other_tid,
+                        s32 (*shadowed)(u32 pid, struct session *session))
+{
+    struct trace_switch_record record;
+    struct session *session;
+    char irql_flag[MAX_IRQL_LEN];
+    u32 i;
+
+    record.flags = flags;
+    record.other_tid = other_tid;
+
+    for (i = 0; i < subs->count; i++)
+    {
+        session = subs->sessions[i];
+        if (session == NULL || !session_gate_open(session))
+            continue;
+        if (shadowed != NULL && shadowed(tid, session))
+            continue;
+
+        if (!(flags & LIBIHT_SWITCH_IN))
+        {
+            xacquire_lock(session->lock, irql_flag);
+            session_drain_markers(session);
+            xrelease_lock(session->lock, irql_flag);
+        }
+
+        if (session_write(session, LIBIHT_RECORD_SWITCH, tid, &record,
+                            sizeof(record), NULL, 0))
+            session_lost(session, 0, 0, 0, 1, 0);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : subscribers_throttle
+// Description  : Write a throttle record of a traced task into the subscribers
+//                of its trace state with an open tracing gate. Throttle records
+//                are numbered, so a consumer tells the ones dropped on a full
+//                buffer from the gaps. Caller should hold the lock of the trace
+//                state.
+//
+// Inputs       : subs - the subscribers of the trace state
+//                tid - the thread id of the traced task
+//                record - the throttle record
+// Outputs      : void
+
+void subscribers_throttle(struct subscribers *subs, u32 tid,
+                            struct trace_throttle_record *record)
+{
+    struct session *session;
+    u32 i;
+
+    for (i = 0; i < subs->count; i++)
+    {
+        session = subs->sessions[i];
+        if (session == NULL || !session_gate_open(session))
+            continue;
+
+        session_write(session, LIBIHT_RECORD_THROTTLE, tid, record,
+                        sizeof(*record), NULL, 0);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : subscribers_flush
+// Description  : Flush the sessions subscribed to a trace state, e.g. when its
+//                process exits. Caller should hold the lock of the trace
+//                state.
+//
+// Inputs       : subs - the subscribers of the trace state
+// Outputs      : void
+
+void subscribers_flush(struct subscribers *subs)
+{
+    u32 i;
+
+    for (i = 0; i < subs->count; i++)
+        session_flush(subs->sessions[i]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : subscribe_session
+// Description  : Subscribe a session to a trace state. Caller should hold the
+//                lock of the trace state.
+//
+// Inputs       : subs - the subscribers of the trace state
+//                session - the session, can be NULL
+// Outputs      : s32 - 0 on success, -1 if already subscribed or full
+
+s32 subscribe_session(struct subscribers *subs, struct session *session)
+{
+    u32 i;
+
+    for (i = 0; i < subs->count; i++)
+        if (subs->sessions[i] == session)
+            return -1;
+
+    if (subs->count == MAX_SUBSCRIBERS)
+        return -1;
+
+    subs->sessions[subs->count++] = session;
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unsubscribe_session
+// Description  : Unsubscribe a session from a trace state. Caller should hold
+//                the lock of the trace state, and free the state once no
+//                subscriber is left.
+//
+// Inputs       : subs - the subscribers of the trace state
+//                session - the session, can be NULL
+// Outputs      : s32 - 0 on success, -1 if not subscribed
+
+s32 unsubscribe_session(struct subscribers *subs, struct session *session)
+{
+    u32 i;
+
+    for (i = 0; i < subs->count; i++)
+    {
+        if (subs->sessions[i] != session)
+            continue;
+
+        // Order does not matter, move the last one in
+        subs->sessions[i] = subs->sessions[--subs->count];
+        subs->sessions[subs->count] = NULL;
+        return 0;
+    }
+
+    return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : session_ioctl_handler
+// Description  : The ioctl handler for the session.
+//
+// Inputs       : session - the session of the request
+//                request - the cross platform ioctl request
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 session_ioctl_handler(struct session *session,
+                            struct xioctl_request *request)
+{
+    s32 ret = 0;
+
+    xprintdbg("LIBIHT-COM: Session ioctl command %d.\n", request->cmd);
+    if (session == NULL)
+    {
+        xprintdbg("LIBIHT-COM: No session for the request\n");
+        return -1;
+    }
+
+    switch (request->cmd)
+    {
+        case LIBIHT_IOCTL_CONFIG_SESSION:
+            xprintdbg("LIBIHT-COM: Config session watermark %lld\n",
+                        request->body.session.session_config.watermark);
+            ret = config_session(session, &request->body.session);
+            break;
+        default:
+            xprintdbg("LIBIHT-COM: Invalid session ioctl command\n");
+            ret = -1;
+            break;
+    }
+
+    return ret;
+}
@@ -0,0 +1,152 @@
+#ifndef _COMMONS_SESSION_H
+#define _COMMONS_SESSION_H
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : kernel/commons/session.h
+//  Description    : This is the header file for the session module. A session
+//                   belongs to an opened device file, the trace states enabled
+//                   through it drain their records into the session buffer,
+//                   which is streamed to user space as a byte stream.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : July 10, 2024
+//
+
+// Include Files
+#include "types.h"
+#include "xplat.h"
+#include "xioctl.h"
+
+// cpp cross compile handler
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+//
+// Library constants
+
+// Session drain buffer size 0x10000 = 64 KiB
+#define DEFAULT_SESSION_BUFFER_SIZE     0x10000
+
+// Max session drain buffer size 0x400000 = 4 MiB, physically contiguous
+#define MAX_SESSION_BUFFER_SIZE         0x400000
+
+// Signal readiness as soon as any record is readable
+#define DEFAULT_SESSION_WATERMARK       1
+
+// Streamed records are padded to this alignment
+#define SESSION_RECORD_ALIGN            8
+
+// Max number of sessions sharing one trace state
+#define MAX_SUBSCRIBERS                 8
+
+//
+// Type definitions
+
+// Define session
+struct session
+{
+    char lock[MAX_LOCK_LEN];            // Lock for the drain buffer
+    char waitq[MAX_WAITQ_LEN];          // Wait queue for the readers
+    struct session_control *control;    // Control page, shared with user
+    u8 *buffer;                         // Drain buffer
+    u64 buffer_size;                    // Drain buffer size
+    u64 head;                           // Bytes ever written
+    u64 tail;                           // Bytes ever read
+    u64 record_end;                     // End of the record at the tail
+    u64 watermark;                      // Readable bytes to signal readiness
+    u64 marker_tail;                    // Next marker position to drain
+    u32 reading;                        // A reader is copying out the buffer
+    u32 flush;                          // Readable below the watermark
+    struct trace_lost_record lost;      // Drops not yet reported
+};
+
+// Define the sessions subscribed to a trace state. The state is traced once
+// and its records fan out to every subscriber, each reading at its own pace
+// from its own drain buffer. The state lives as long as it has subscribers.
+struct subscribers
+{
+    u32 count;                                  // Number of subscribers
+    struct session *sessions[MAX_SUBSCRIBERS];  // Subscribed sessions
+};
+
+//
+// Function Prototypes
+
+struct session *create_session(void);
+// Create a new session.
+
+void free_session(struct session *session);
+// Free a session and its drain buffer.
+
+void session_copy(struct session *session, u64 pos, void *src, u64 size);
+// Copy data into the drain buffer at a stream position.
+
+s32 session_write(struct session *session, u16 type, u32 tid,
+                    void *data0, u32 size0, void *data1, u32 size1);
+// Write a record made of up to two chunks into the drain buffer.
+
+void session_drain_markers(struct session *session);
+// Drain the markers published in the control page into the drain buffer.
+
+void session_lost(struct session *session, u64 lbr_snapshots, u64 bts_records,
+                    u64 mmaps, u64 switches, u64 pt_bytes);
+// Account the trace data dropped before reaching the drain buffer.
+
+void session_mmap(void *session, u32 pid, struct trace_mmap_record *record,
+                    char *path, u32 path_size);
+// Write a mapping record into the drain buffer.
+
+s32 session_readable(struct session *session);
+// Check if the readable bytes in the drain buffer reach the watermark.
+
+s32 session_pending(struct session *session);
+// Check if the drain buffer holds any unread bytes.
+
+void session_flush(struct session *session);
+// Make the unread bytes of the drain buffer readable below the watermark.
+
+u64 session_peek(struct session *session, void **chunk);
+// Get the contiguous readable chunk of the drain buffer.
+
+void session_consume(struct session *session, u64 size);
+// Consume the bytes from a chunk got by session_peek.
+
+s32 config_session(struct session *session,
+                    struct session_ioctl_request *request);
+// Configure the session.
+
+s32 session_gate_open(struct session *session);
+// Check if the tracing gate of the session is open.
+
+s32 subscribers_gate_open(struct subscribers *subs);
+// Check if the tracing gate of any subscriber is open.
+
+void subscribers_switch(struct subscribers *subs, u32 tid, u32 flags,
+                        u32 other_tid,
+                        s32 (*shadowed)(u32 pid, struct session *session));
+// Write a switch record into the sessions with an open tracing gate.
+
+void subscribers_throttle(struct subscribers *subs, u32 tid,
+                            struct trace_throttle_record *record);
+// Write a throttle record into the sessions with an open tracing gate.
+
+void subscribers_flush(struct subscribers *subs);
+// Flush the sessions subscribed to a trace state.
+
+s32 subscribe_session(struct subscribers *subs, struct session *session);
+// Subscribe a session to a trace state.
+
+s32 unsubscribe_session(struct subscribers *subs, struct session *session);
+// Unsubscribe a session from a trace state.
+
+s32 session_ioctl_handler(struct session *session,
+                            struct xioctl_request *request);
+// The ioctl handler for the session.
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // _COMMONS_SESSION_H
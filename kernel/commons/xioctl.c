@@ -0,0 +1,174 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : kernel/commons/xioctl.c
+//  Description    : This is the implementation of the cross platform IOCTL
+//                   dispatch for the libiht library. Platform devices copy in
+//                   the request and hand it over here.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : July 10, 2024
+//
+
+// Include Files
+#include "xioctl.h"
+#include "lbr.h"
+#include "bts.h"
+#include "pt.h"
+#include "session.h"
+#include "crash.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xioctl_handler
+// Description  : Dispatch a request to the handler of its feature by the
+//                command code range. The LBR and BTS own two ranges each,
+//                the commands of the first release and the ones added after.
+//                A reserved code within a range is rejected by the handler.
+//
+// Inputs       : session - the session of the request, can be NULL
+//                request - the cross platform ioctl request
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 xioctl_handler(struct session *session, struct xioctl_request *request)
+{
+    s32 ret;
+
+    if (request->cmd <= LIBIHT_IOCTL_LBR_END ||
+        (request->cmd >= LIBIHT_IOCTL_LBR_EXT_BASE &&
+         request->cmd <= LIBIHT_IOCTL_LBR_EXT_END))
+    {
+        // LBR request
+        xprintdbg("LIBIHT-COM: LBR request\n");
+        ret = lbr_ioctl_handler(session, request);
+    }
+    else if (request->cmd <= LIBIHT_IOCTL_BTS_END ||
+             (request->cmd >= LIBIHT_IOCTL_BTS_EXT_BASE &&
+              request->cmd <= LIBIHT_IOCTL_BTS_EXT_END))
+    {
+        // BTS request
+        xprintdbg("LIBIHT-COM: BTS request\n");
+        ret = bts_ioctl_handler(session, request);
+    }
+    else if (request->cmd >= LIBIHT_IOCTL_PT_BASE &&
+             request->cmd <= LIBIHT_IOCTL_PT_END)
+    {
+        // PT request
+        xprintdbg("LIBIHT-COM: PT request\n");
+        ret = pt_ioctl_handler(session, request);
+    }
+    else if (request->cmd >= LIBIHT_IOCTL_SESSION_BASE &&
+             request->cmd <= LIBIHT_IOCTL_SESSION_END)
+    {
+        // Session request
+        xprintdbg("LIBIHT-COM: Session request\n");
+        ret = session_ioctl_handler(session, request);
+    }
+    else if (request->cmd >= LIBIHT_IOCTL_CRASH_BASE &&
+             request->cmd <= LIBIHT_IOCTL_CRASH_END)
+    {
+        // Crash request
+        xprintdbg("LIBIHT-COM: Crash request\n");
+        ret = crash_ioctl_handler(request);
+    }
+    else if (request->cmd == LIBIHT_IOCTL_BATCH)
+    {
+        // Batch request
+        xprintdbg("LIBIHT-COM: Batch request\n");
+        ret = batch_ioctl_handler(session, &request->body.batch);
+    }
+    else
+    {
+        // Unknown request
+        xprintdbg("LIBIHT-COM: Unknown request\n");
+        ret = -1;
+    }
+
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : batch_ioctl_handler
+// Description  : Dispatch the sub-requests of a batch request in order, and
+//                report the status of each one in the results array. The
+//                sub-requests are copied in `XIOCTL_BATCH_CHUNK` at a time,
+//                so a batch of any size costs one syscall. A failed
+//                sub-request does not stop the rest. Nested batches are
+//                rejected. A pending signal stops the batch between chunks,
+//                the results of the unprocessed sub-requests are left as is.
+//
+// Inputs       : session - the session of the request, can be NULL
+//                request - the batch ioctl request
+// Outputs      : s32 - 0 if the batch is processed, -1 on failure
+
+s32 batch_ioctl_handler(struct session *session,
+                        struct batch_ioctl_request *request)
+{
+    struct xioctl_request *requests;
+    s32 *results;
+    u64 i, cnt, done;
+    s32 ret = 0;
+
+    if (request->requests == NULL || request->results == NULL)
+        return -1;
+
+    requests = xmalloc(sizeof(struct xioctl_request) * XIOCTL_BATCH_CHUNK);
+    results = xmalloc(sizeof(s32) * XIOCTL_BATCH_CHUNK);
+    if (requests == NULL || results == NULL)
+    {
+        xprintdbg("LIBIHT-COM: Allocate batch buffer failed\n");
+        if (requests)
+            xfree(requests);
+        if (results)
+            xfree(results);
+        return -1;
+    }
+
+    xprintdbg("LIBIHT-COM: Batch of %lld requests\n", request->count);
+    for (done = 0; done < request->count; done += cnt)
+    {
+        // A batch is user sized, let it be interrupted and rescheduled
+        if (done)
+        {
+            if (xsignal_pending())
+            {
+                xprintdbg("LIBIHT-COM: Batch interrupted after %lld "
+                            "requests\n", done);
+                ret = -1;
+                break;
+            }
+            xcond_resched();
+        }
+
+        cnt = request->count - done;
+        if (cnt > XIOCTL_BATCH_CHUNK)
+            cnt = XIOCTL_BATCH_CHUNK;
+
+        if (xcopy_from_user(requests, request->requests + done,
+                            sizeof(struct xioctl_request) * cnt))
+        {
+            xprintdbg("LIBIHT-COM: Copy batch requests from user failed\n");
+            ret = -1;
+            break;
+        }
+
+        for (i = 0; i < cnt; i++)
+        {
+            if (requests[i].cmd == LIBIHT_IOCTL_BATCH)
+                results[i] = -1;
+            else
+                results[i] = xioctl_handler(session, &requests[i]);
+        }
+
+        if (xcopy_to_user(request->results + done, results, sizeof(s32) * cnt))
+        {
+            xprintdbg("LIBIHT-COM: Copy batch results to user failed\n");
+            ret = -1;
+            break;
+        }
+    }
+
+    xfree(results);
+    xfree(requests);
+    return ret;
+}
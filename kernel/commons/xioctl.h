@@ -17,6 +17,9 @@
 
 //
 // Library constants
+// The command codes are part of the ABI. The LBR and BTS commands of the
+// first release keep their values, and every later range starts at a fixed
+// base with room to grow, so adding a command never renumbers another.
 enum IOCTL {
     LIBIHT_IOCTL_BASE,          // Placeholder
 
@@ -33,8 +36,60 @@ enum IOCTL {
     LIBIHT_IOCTL_DUMP_BTS,
     LIBIHT_IOCTL_CONFIG_BTS,
     LIBIHT_IOCTL_BTS_END,       // End of BTS
+
+    // LBR, continued
+    LIBIHT_IOCTL_LBR_EXT_BASE = 0x10,   // Placeholder
+    LIBIHT_IOCTL_SYSCALL_LBR,
+    LIBIHT_IOCTL_CFI_LBR,
+    LIBIHT_IOCTL_DUMP_LBR_INFO,
+    LIBIHT_IOCTL_LBR_EXT_END = 0x1f,    // End of LBR, continued
+
+    // BTS, continued
+    LIBIHT_IOCTL_BTS_EXT_BASE = 0x20,   // Placeholder
+    LIBIHT_IOCTL_READ_BTS,
+    LIBIHT_IOCTL_GOVERN_BTS,
+    LIBIHT_IOCTL_BTS_EXT_END = 0x2f,    // End of BTS, continued
+
+    // PT
+    LIBIHT_IOCTL_PT_BASE = 0x30,        // Placeholder
+    LIBIHT_IOCTL_ENABLE_PT,
+    LIBIHT_IOCTL_DISABLE_PT,
+    LIBIHT_IOCTL_CONFIG_PT,
+    LIBIHT_IOCTL_READ_PT,
+    LIBIHT_IOCTL_PT_END = 0x3f,         // End of PT
+
+    // Session
+    LIBIHT_IOCTL_SESSION_BASE = 0x40,   // Placeholder
+    LIBIHT_IOCTL_CONFIG_SESSION,
+    LIBIHT_IOCTL_SESSION_END = 0x4f,    // End of session
+
+    // Crash
+    LIBIHT_IOCTL_CRASH_BASE = 0x50,     // Placeholder
+    LIBIHT_IOCTL_DUMP_CRASH,
+    LIBIHT_IOCTL_CRASH_END = 0x5f,      // End of crash
+
+    // Batch
+    LIBIHT_IOCTL_BATCH_BASE = 0x60,     // Placeholder
+    LIBIHT_IOCTL_BATCH,
+    LIBIHT_IOCTL_BATCH_END = 0x6f,      // End of batch
+};
+
+// Sub-requests of a batch copied in at a time
+#define XIOCTL_BATCH_CHUNK          16
+
+// mmap regions, selected by the mmap offset LIBIHT_MMAP_OFFSET(type, pid)
+enum MMAP_TYPE {
+    LIBIHT_MMAP_BASE,           // Placeholder
+    LIBIHT_MMAP_BTS,            // BTS header page followed by the BTS buffer
+    LIBIHT_MMAP_LBR,            // LBR ring header page followed by the slots
+    LIBIHT_MMAP_SESSION,        // Session control page, pid is ignored
+    LIBIHT_MMAP_PT,             // PT header page followed by the PT buffer
 };
 
+#define LIBIHT_MMAP_PAGE_SIZE       0x1000
+#define LIBIHT_MMAP_OFFSET(type, pid) \
+    ((((u64)(type) << 32) | (u32)(pid)) * LIBIHT_MMAP_PAGE_SIZE)
+
 //
 // LBR Type definitions
 
@@ -45,14 +100,34 @@ struct lbr_stack_entry
     u64 to;     // Retrieve from MSR_LBR_NHM_TO + offset
 };
 
+// LBR configuration flags
+#define LIBIHT_LBR_INFO             0x1     // Save MSR_LBR_INFO, Skylake+
+#define LIBIHT_LBR_CALL_STACK       0x2     // Call-stack mode, Haswell+
+
+// MSR_LBR_INFO bit fields
+#define LIBIHT_LBR_INFO_MISPRED     (1ULL << 63)    // Branch mispredicted
+#define LIBIHT_LBR_INFO_IN_TX       (1ULL << 62)    // Branch in a transaction
+#define LIBIHT_LBR_INFO_ABORT       (1ULL << 61)    // Transaction abort
+#define LIBIHT_LBR_INFO_CYCLES      0xffffULL       // Cycles since last branch
+
+// LBR format of the saved entries, the MSR_IA32_PERF_CAPABILITIES LBR format
+// for the model specific LBR
+#define LIBIHT_LBR_FORMAT_ARCH      0xff    // Architectural LBR
+#define LIBIHT_LBR_FORMAT_PERF      0xfe    // Perf sample, flags in LBR_INFO
+
 // Define LBR configuration
 struct lbr_config
 {
     u32 pid;                          // Process ID
+    u32 flags;                        // LIBIHT_LBR_* flags
     u64 lbr_select;                   // MSR_LBR_SELECT
 };
 
-// Define LBR data
+// LBR entries the buffer of a `lbr_data` holds, the deepest model specific
+// LBR the first release knew of
+#define LIBIHT_LBR_DATA_ENTRIES     32
+
+// Define LBR data, laid out as in the first release
 struct lbr_data
 {
     u64 lbr_tos;                      // MSR_LBR_TOS
@@ -65,6 +140,82 @@ struct lbr_ioctl_request{
     struct lbr_data *buffer;
 };
 
+// Define LBR dump, the LBR data followed by the fields added since
+struct lbr_dump
+{
+    struct lbr_data data;             // LBR data
+    u64 *info;                        // MSR_LBR_INFO of each entry, can be NULL
+    u32 lbr_format;                   // LBR format of the core saving them
+    u32 lbr_count;                    // LBR entries of the core saving them
+    u64 count;                        // Entries capacity in, entries dumped out
+    u64 lbr_capacity;                 // LBR entries of the deepest core
+};
+
+// Define the LBR dump IOCTL structure
+struct lbr_dump_request{
+    struct lbr_config lbr_config;
+    struct lbr_dump *buffer;
+};
+
+// Syscall numbers covered by the syscall snapshot bitmap
+#define LIBIHT_SYSCALL_MAX          512
+#define LIBIHT_SYSCALL_WORDS        (LIBIHT_SYSCALL_MAX / 64)
+
+// Snapshot syscall number when the LBR is saved on context switch
+#define LIBIHT_NO_SYSCALL           ((u64)-1)
+
+// Define LBR snapshot, each ring slot holds one followed by the LBR entries,
+// then by the MSR_LBR_INFO of each entry if flagged LIBIHT_LBR_INFO
+struct lbr_snapshot
+{
+    u64 lbr_tos;                      // MSR_LBR_TOS
+    u32 tid;                          // Thread id of the traced task
+    u32 cpu;                          // Core id the LBR is saved on
+    u64 tsc;                          // Timestamp counter at save
+    u64 syscall;                      // Syscall entered, or LIBIHT_NO_SYSCALL
+    u64 flags;                        // LIBIHT_LBR_INFO if LBR_INFO follow
+    u32 lbr_format;                   // LBR format of the core saving them
+    u32 lbr_count;                    // LBR entries of the core saving them
+};
+
+// Define the LBR syscall snapshot IOCTL structure
+struct lbr_syscall_request
+{
+    u32 pid;                                // Process ID
+    u64 syscalls[LIBIHT_SYSCALL_WORDS];     // Syscalls to snapshot at entry
+};
+
+// Action of the LBR CFI check on a violation
+enum LBR_CFI_ACTION {
+    LIBIHT_CFI_OFF,             // No check, drop the policy
+    LIBIHT_CFI_LOG,             // Log the violating edge
+    LIBIHT_CFI_DENY,            // Log and fail the syscall with EPERM
+};
+
+// Max number of edges in a CFI allowlist
+#define LIBIHT_CFI_MAX_EDGES        0x10000
+
+// Define the LBR CFI IOCTL structure
+struct lbr_cfi_request
+{
+    u32 pid;                                // Process ID
+    u32 action;                             // enum LBR_CFI_ACTION
+    u64 syscalls[LIBIHT_SYSCALL_WORDS];     // Syscalls to check at entry
+    u64 edge_count;                         // Number of allowed edges
+    struct lbr_stack_entry *edges;          // Allowed edges, sorted
+};
+
+// Define LBR snapshot ring header page, the slots follow right after it
+struct lbr_ring_header
+{
+    u64 head;                         // Next slot to publish (producer)
+    u64 tail;                         // Next slot to consume (consumer)
+    u64 slots;                        // Number of slots
+    u64 slot_size;                    // Size of each slot in bytes
+    u64 lbr_capacity;                 // LBR entries in each slot
+    u64 dropped;                      // Snapshots dropped while ring full
+};
+
 //
 // BTS Type definitions
 
@@ -99,16 +250,289 @@ struct bts_ioctl_request{
     struct bts_data *buffer;
 };
 
+// Define BTS cursor, records are numbered from 0 since the buffer is set up
+struct bts_cursor
+{
+    u64 cursor;                     // Sequence number of next record to read
+    u64 lost;                       // Records overwritten before being read
+    u64 count;                      // Records capacity in, records read out
+    struct bts_record *records;     // Records buffer
+};
+
+// Define the bts cursor read IOCTL structure
+struct bts_read_request{
+    struct bts_config bts_config;
+    struct bts_cursor *buffer;
+};
+
+// Define the BTS overhead governor IOCTL structure, all zero to ungovern
+struct bts_governor_request
+{
+    u32 pid;                        // Process ID
+    u32 budget;                     // Overhead budget in per mille, 0 for none
+    u64 period_ns;                  // Measurement window, 0 for the default
+    u64 record_cap;                 // Records before disabling, 0 for none
+    u64 record_cost;                // Cycles per record, 0 for the default
+};
+
+//
+// PT Type definitions
+
+// Max number of PT IP filter ranges, the cores may support fewer
+#define LIBIHT_PT_MAX_RANGES        4
+
+// Define PT IP filter range, both ends included
+struct pt_range
+{
+    u64 start;                      // First address traced
+    u64 end;                        // Last address traced
+};
+
+// Define PT configuration
+struct pt_config
+{
+    u32 pid;                        // Process ID
+    u32 range_count;                // IP filter ranges in use, 0 for none
+    u64 rtit_ctl;                   // MSR_IA32_RTIT_CTL
+    u64 pt_buffer_size;             // PT buffer size
+    u64 cr3_match;                  // CR3 to filter on, 0 for the process one
+    struct pt_range ranges[LIBIHT_PT_MAX_RANGES]; // IP filter ranges
+};
+
+// Define the pt IOCTL structure
+struct pt_ioctl_request{
+    struct pt_config pt_config;
+};
+
+// Define PT cursor, packet bytes are numbered from 0 since the buffer is set up
+struct pt_cursor
+{
+    u64 cursor;                     // Stream offset of next byte to read
+    u64 lost;                       // Bytes overwritten before being read
+    u64 count;                      // Bytes capacity in, bytes read out
+    u8 *data;                       // Packet bytes buffer
+};
+
+// Define the pt cursor read IOCTL structure
+struct pt_read_request{
+    struct pt_config pt_config;
+    struct pt_cursor *buffer;
+};
+
+//
+// Crash Type definitions
+
+// Max LBR entries and BTS records frozen by a crash capture, the LBR entries
+// of the deepest Arch LBR
+#define LIBIHT_CRASH_LBR_ENTRIES    64
+#define LIBIHT_CRASH_BTS_RECORDS    0x100
+
+// Define crash capture, the branch history of a task frozen at the delivery
+// of a fatal signal
+struct crash_capture
+{
+    u32 pid;                        // Process ID of the crashed task
+    u32 sig;                        // Fatal signal number
+    u64 addr;                       // Faulting address, 0 if not a fault
+    u64 tsc;                        // Timestamp counter at capture
+    u32 cpu;                        // Core id the capture is taken on
+    u32 reserved;                   // Reserved for future use
+    u64 lbr_tos;                    // MSR_LBR_TOS
+    u64 lbr_count;                  // Valid LBR entries
+    struct lbr_stack_entry lbr[LIBIHT_CRASH_LBR_ENTRIES];
+    u64 bts_count;                  // Valid BTS records, oldest first
+    struct bts_record bts[LIBIHT_CRASH_BTS_RECORDS];
+};
+
+// Define the crash IOCTL structure
+struct crash_ioctl_request
+{
+    u32 pid;                        // Process ID, 0 for the latest crash
+    struct crash_capture *buffer;   // Capture buffer
+};
+
+//
+// Session Type definitions
+
+// Record types streamed through `read()` on a session file descriptor
+enum TRACE_RECORD_TYPE {
+    LIBIHT_RECORD_BASE,         // Placeholder
+    LIBIHT_RECORD_LBR,          // lbr_snapshot followed by the LBR entries
+    LIBIHT_RECORD_BTS,          // Array of bts_record
+    LIBIHT_RECORD_LOST,         // trace_lost_record
+    LIBIHT_RECORD_MARKER,       // trace_marker, tid/cpu/tsc of the emitter
+    LIBIHT_RECORD_MMAP,         // trace_mmap_record followed by the path
+    LIBIHT_RECORD_SWITCH,       // trace_switch_record
+    LIBIHT_RECORD_THROTTLE,     // trace_throttle_record
+    LIBIHT_RECORD_PT,           // PT packet bytes
+};
+
+// Define trace record header, every streamed record starts with one
+struct trace_record_header
+{
+    u16 type;                       // Record type
+    u16 reserved;                   // Reserved for future use
+    u32 size;                       // Record size in bytes, header included
+    u32 tid;                        // Thread id of the traced task
+    u32 cpu;                        // Core id the record is produced on
+    u64 tsc;                        // Timestamp counter at production
+};
+
+// Define lost record, emitted before the next record after drops
+struct trace_lost_record
+{
+    u64 lbr_snapshots;              // LBR snapshots dropped
+    u64 bts_records;                // BTS records dropped or overwritten
+    u64 markers;                    // Markers dropped
+    u64 mmaps;                      // Mapping records dropped
+    u64 switches;                   // Switch records dropped
+    u64 pt_bytes;                   // PT packet bytes dropped or overwritten
+};
+
+// Define marker record, a tag emitted by the traced process
+struct trace_marker
+{
+    u64 tag;                        // User defined tag, e.g. request id
+};
+
+// Max size of a build id and of a path in a mapping record
+#define LIBIHT_BUILD_ID_SIZE        20
+#define LIBIHT_MMAP_PATH_MAX        256
+
+// Define mapping record, an executable file mapping of the traced task. The
+// NUL terminated path follows right after it.
+struct trace_mmap_record
+{
+    u64 start;                      // Start address of the mapping
+    u64 end;                        // End address of the mapping
+    u64 pgoff;                      // File offset of the start address
+    u32 build_id_size;              // Build id size, 0 if not found
+    u8 build_id[LIBIHT_BUILD_ID_SIZE]; // GNU build id of the file
+};
+
+// Switch record flags
+#define LIBIHT_SWITCH_OUT           0x0     // The traced task leaves the core
+#define LIBIHT_SWITCH_IN            0x1     // The traced task enters the core
+#define LIBIHT_SWITCH_MIGRATED      0x2     // Entered another core than last
+
+// Define switch record, the header carries the tid, core and time of the
+// switch, so on-CPU intervals can be rebuilt from the trace stream alone
+struct trace_switch_record
+{
+    u32 flags;                      // LIBIHT_SWITCH_* flags
+    u32 other_tid;                  // Next tid on switch out, prev on switch in
+};
+
+// Throttle record actions
+#define LIBIHT_THROTTLE_OFF         0x0     // BTS off, the window over budget
+#define LIBIHT_THROTTLE_ON          0x1     // BTS back on after the off time
+#define LIBIHT_THROTTLE_CAP         0x2     // BTS disabled at the record cap
+
+// Define throttle record, a decision of the BTS overhead governor along with
+// the measurements of the window it is based on
+struct trace_throttle_record
+{
+    u32 action;                     // LIBIHT_THROTTLE_* action
+    u32 overhead;                   // Estimated overhead in per mille
+    u64 seq;                        // Decision number, gaps are lost decisions
+    u64 records;                    // BTS records of the window
+    u64 run_tsc;                    // Run time of the window in TSC ticks
+    u64 cost_tsc;                   // Handler time of the window in TSC ticks
+    u64 off_ns;                     // Time BTS stays off, 0 unless throttled
+};
+
+// Session tracing gate values, stored by user into the session control page
+#define LIBIHT_GATE_CLOSED          0
+#define LIBIHT_GATE_OPEN            1
+
+// Number of marker slots in the session control page
+#define LIBIHT_MARKER_SLOTS         64
+
+// Define marker slot. A producer claims the slot at `marker_head` when its
+// seq equals that position, fills it, then publishes seq = position + 1. The
+// kernel hands it back with seq = position + LIBIHT_MARKER_SLOTS.
+struct session_marker_slot
+{
+    u64 seq;                        // Slot sequence number
+    u64 tag;                        // User defined tag
+    u64 tsc;                        // Timestamp counter at emission
+    u32 tid;                        // Thread id of the emitter
+    u32 cpu;                        // Core id of the emitter
+};
+
+// Define session control page, shared writable with user. The gate is
+// honored by the kernel at the next context switch or drain, and markers
+// are drained at the next switch out, after the trace of the time slice.
+struct session_control
+{
+    u64 gate;                       // LIBIHT_GATE_OPEN to trace (default)
+    u64 marker_head;                // Next marker position to claim
+    u64 reserved[6];                // Keep the slots cache line aligned
+    struct session_marker_slot markers[LIBIHT_MARKER_SLOTS];
+};
+
+// Define session configuration
+struct session_config
+{
+    u64 watermark;                  // Readable bytes to signal readiness
+    u64 buffer_size;                // Drain buffer size, 0 to keep current
+};
+
+// Define the session IOCTL structure
+struct session_ioctl_request{
+    struct session_config session_config;
+};
+
 //
 // xIOCTL Type definitions
 
+struct xioctl_request;
+
+// Define the batch IOCTL structure
+struct batch_ioctl_request{
+    u64 count;                          // Number of sub-requests
+    struct xioctl_request *requests;    // Sub-requests, batch not allowed
+    s32 *results;                       // Status of each sub-request
+};
+
 // Define the xIOCTL structure
 struct xioctl_request{
     enum IOCTL cmd;
     union {
         struct lbr_ioctl_request lbr;
+        struct lbr_dump_request lbr_dump;
+        struct lbr_syscall_request lbr_syscall;
+        struct lbr_cfi_request lbr_cfi;
         struct bts_ioctl_request bts;
+        struct bts_read_request bts_read;
+        struct bts_governor_request bts_governor;
+        struct pt_ioctl_request pt;
+        struct pt_read_request pt_read;
+        struct session_ioctl_request session;
+        struct crash_ioctl_request crash;
+        struct batch_ioctl_request batch;
     } body;
 };
 
+//
+// Function Prototypes
+
+// cpp cross compile handler
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+struct session;
+
+s32 xioctl_handler(struct session *session, struct xioctl_request *request);
+// Dispatch a request to the handler of its feature.
+
+s32 batch_ioctl_handler(struct session *session,
+                        struct batch_ioctl_request *request);
+// Dispatch the sub-requests of a batch request.
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
 #endif // _COMMONS_XIOCTL_H
\ No newline at end of file
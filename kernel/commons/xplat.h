@@ -16,6 +16,10 @@
 #include "types.h"
 #include "debug.h"
 
+struct trace_mmap_record;
+struct lbr_stack_entry;
+struct lbr_snapshot;
+
 // cpp cross compile handler
 #ifdef __cplusplus
 extern "C" {
@@ -27,6 +31,31 @@ extern "C" {
 #define MAX_IRQL_LEN    0x10    // Maximum length of OS irql struct
 #define MAX_LOCK_LEN    0x20    // Maximum length of OS lock struct
 #define MAX_LIST_LEN    0x20    // Maximum length of OS list struct
+#define MAX_WAITQ_LEN   0x80    // Maximum length of OS wait queue struct
+
+#define XOWNER_NONE     ((u64)-1)   // Owner only traced with the privilege
+
+#define XPAGE_SIZE      0x1000  // Size of a memory page
+#define XPAGE_ALIGN(size)   (((size) + XPAGE_SIZE - 1) & ~((u64)XPAGE_SIZE - 1))
+
+//
+// Type definitions
+
+// CPU feature probing backend, the hardware one by default. Another backend
+// can be injected to feed CPUID and MSR values, e.g. per core type, to the
+// feature detection.
+struct xprobe_ops
+{
+    void (*cpuid)(u32 func_id, u32 sub_id, u32 *eax, u32 *ebx, u32 *ecx,
+                    u32 *edx);
+    void (*rdmsr)(u32 msr, u64 *val);
+};
+
+//
+// Global variables
+
+extern struct xprobe_ops *xprobe;
+// The CPU feature probing backend in use.
 
 //
 // Function Prototypes
@@ -40,6 +69,12 @@ void *xmalloc(u64 size);
 void xfree(void *ptr);
 // Cross platform kernel free function.
 
+void *xmalloc_pages(u64 size);
+// Cross platform kernel page aligned and zeroed malloc function.
+
+void xfree_pages(void *ptr, u64 size);
+// Cross platform kernel page aligned free function.
+
 u64 xcopy_from_user(void *dst, void *src, u64 cnt);
 // Cross platform kernel copy from user function.
 
@@ -52,6 +87,9 @@ void *xmemset(void *ptr, s32 c, u64 cnt);
 void *xmemcpy(void *dst, void *src, u64 cnt);
 // Cross platform kernel memcpy function.
 
+u64 xvirt_to_phys(void *addr);
+// Cross platform kernel virtual to physical address function.
+
 //
 // CPU core, hardware, register read/write functions
 
@@ -70,15 +108,55 @@ void xrdmsr(u32 msr, u64 *val);
 u32  xcoreid(void);
 // Cross platform get core id function.
 
+u32  xcore_count(void);
+// Cross platform get number of core ids function.
+
 u32 xgetcurrent_pid(void);
 // Cross platform get current user process pid function.
 
+u32 xtrace_allowed(u32 pid);
+// Cross platform check of the permission to trace a process function.
+
+u64 xgetcurrent_owner(void);
+// Cross platform get the owner of the current process function.
+
+u32 xowner_allowed(u64 owner);
+// Cross platform check of the permission to trace an owner function.
+
 void xcpuid(u32 func_id, u32 *eax, u32 *ebx, u32 *ecx, u32 *edx);
 // Cross platform cpuid function.
 
+void xcpuid_count(u32 func_id, u32 sub_id, u32 *eax, u32 *ebx, u32 *ecx,
+                    u32 *edx);
+// Cross platform cpuid with sub-leaf function.
+
+void xsaves_area(void *area, u64 mask);
+// Cross platform XSAVES of supervisor states function.
+
+void xrstors_area(void *area, u64 mask);
+// Cross platform XRSTORS of supervisor states function.
+
 void xon_each_cpu(void (*func)(void));
 // Cross platform on each cpu dispatch function.
 
+void xon_each_cpu_arg(void (*func)(void *), void *arg);
+// Cross platform on each cpu dispatch with an argument function.
+
+void xset_probe_ops(struct xprobe_ops *ops);
+// Cross platform set CPU feature probing backend function.
+
+u64 xrdtsc(void);
+// Cross platform read timestamp counter function.
+
+//
+// Memory ordering functions
+
+u64 xload_acquire(u64 *ptr);
+// Cross platform load with acquire semantics function.
+
+void xstore_release(u64 *ptr, u64 val);
+// Cross platform store with release semantics function.
+
 //
 // Lock functions
 
@@ -88,9 +166,24 @@ void xinit_lock(void *lock);
 void xacquire_lock(void *lock, void *old_irql);
 // Cross platform acquire lock function.
 
+s32 xtry_acquire_lock(void *lock, void *old_irql);
+// Cross platform acquire lock without spinning function.
+
 void xrelease_lock(void *lock, void *new_irql);
 // Cross platform release lock function.
 
+//
+// Wait queue functions
+
+void xinit_waitq(void *waitq);
+// Cross platform init wait queue function.
+
+void xwake_up(void *waitq);
+// Cross platform wake up wait queue function, safe in any context.
+
+void xdestroy_waitq(void *waitq);
+// Cross platform destroy wait queue function.
+
 //
 // List functions
 
@@ -109,12 +202,68 @@ void *xlist_next(void *entry);
 void *xlist_prev(void *entry);
 // Cross platform list prev function.
 
+//
+// Process functions
+
+void xfor_each_exec_mapping(u32 pid, u64 start, u64 end,
+                            void (*func)(void *ctx, u32 pid,
+                                struct trace_mmap_record *record,
+                                char *path, u32 path_size),
+                            void *ctx);
+// Cross platform executable file mappings of a process walk function.
+
+u64 xgetpid_cr3(u32 pid);
+// Cross platform get page table root of a process function.
+
+u32 xperfmon_capable(void);
+// Cross platform check of the privilege to trace the kernel function.
+
+void xcond_resched(void);
+// Cross platform yield the core if a reschedule is due function.
+
+u32 xsignal_pending(void);
+// Cross platform check of a pending signal of the current thread function.
+
+//
+// Timer functions
+
+s32 xtimer_start(u32 (*func)(void), u64 period_ns);
+// Cross platform start periodic timer function.
+
+void xtimer_stop(void);
+// Cross platform stop periodic timer function.
+
+//
+// Perf functions
+
+s32 xperf_init(void (*func)(u32 tid, u32 nr, struct lbr_stack_entry *entries,
+                            u64 *info));
+// Cross platform perf backend init function.
+
+void xperf_exit(void);
+// Cross platform perf backend exit function.
+
+void *xperf_lbr_open(u32 pid, u64 lbr_select, u64 period);
+// Cross platform open branch stack sampling event function.
+
+void xperf_lbr_close(void *event);
+// Cross platform close branch stack sampling event function.
+
+//
+// BPF functions
+
+void xbpf_publish_lbr(struct lbr_snapshot *snapshot, void *entries, u32 size);
+// Cross platform hand LBR snapshot to BPF programs function.
+
 //
 // Debug functions (will be moved to debug.h)
 
 void xprintdbg(const char *format, ...);
 // Cross platform print kernel debug message function.
 
+u32 xprint_ratelimit(void);
+// Cross platform check if a rate limited debug message may print function.
+
 #ifdef __cplusplus
 }
 #endif // __cplusplus
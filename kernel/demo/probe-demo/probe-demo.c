@@ -0,0 +1,381 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : kernel/demo/probe-demo/probe-demo.c
+//  Description    : This is the main program for the probe-demo program. It
+//                   runs the LBR feature detection of the kernel module
+//                   offline, on the CPUID and MSR values of simulated cores
+//                   injected with xset_probe_ops, and checks the backend,
+//                   capacity and format it finds on each core. The cores of a
+//                   hybrid CPU are simulated as two core types. Every CPU is
+//                   probed again with the same lbr_check, so it also checks
+//                   that the detection does not keep the result of an
+//                   earlier probe. The exit status is the number of failed
+//                   checks, `-v` prints the debug messages of the detection.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : July 10, 2024
+//
+
+// Include Files
+#include "xplat_probe.h"
+#include "../../commons/lbr.h"
+#include <stdio.h>
+#include <string.h>
+
+//
+// Type definitions
+
+// CPUID and MSR values of a simulated core type
+struct probe_core
+{
+    u32 max_leaf;                     // CPUID.0:EAX
+    u32 leaf1_eax;                    // CPUID.1:EAX, family and model
+    u32 leaf1_ecx;                    // CPUID.1:ECX, PDCM
+    u32 leaf7_edx;                    // CPUID.7.0:EDX, Arch LBR
+    u32 leaf1c_eax;                   // CPUID.1C:EAX, Arch LBR depths
+    u32 leaf1c_ebx;                   // CPUID.1C:EBX, Arch LBR features
+    u32 leafd1_eax;                   // CPUID.D.1:EAX, XSAVES
+    u32 leafd1_ecx;                   // CPUID.D.1:ECX, supervisor states
+    u32 leafd_lbr_eax;                // CPUID.D.F:EAX, LBR state size
+    u64 perf_cap;                     // MSR_IA32_PERF_CAPABILITIES
+    u64 xss;                          // MSR_IA32_XSS
+};
+
+// LBR capabilities expected on a core type
+struct probe_expect
+{
+    u32 backend;                      // enum LBR_BACKEND
+    u32 format;                       // LBR format, or LIBIHT_LBR_FORMAT_ARCH
+    u32 capacity;                     // LBR entries
+};
+
+// Simulated CPU, the first `first_cores` cores are of the first type and the
+// others of the second type
+struct probe_cpu
+{
+    const char *name;                 // CPU name
+    u32 core_count;                   // Number of cores
+    u32 first_cores;                  // Cores of the first type
+    struct probe_core types[2];       // CPUID and MSR values of each type
+    struct probe_expect expect[2];    // Capabilities expected of each type
+    s32 check;                        // Expected lbr_check result
+    u64 capacity;                     // Expected lbr_capacity
+    u32 has_info;                     // Expected lbr_has_info
+    u32 has_call_stack;               // Expected lbr_has_call_stack
+};
+
+//
+// Global variables
+
+struct probe_cpu *probe_cpu;
+// The CPU being probed.
+
+//
+// Probing backend
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : probe_this_core
+// Description  : Get the CPUID and MSR values of the simulated core the
+//                detection runs on.
+//
+// Inputs       : void
+// Outputs      : struct probe_core* - the values of its core type
+
+struct probe_core *probe_this_core(void)
+{
+    return &probe_cpu->types[xcoreid() < probe_cpu->first_cores ? 0 : 1];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : probe_cpuid
+// Description  : Feed the CPUID leaves of the current simulated core, the
+//                leaves not simulated read as 0.
+//
+// Inputs       : func_id - function id.
+//                sub_id - sub-leaf id.
+// Outputs      : eax, ebx, ecx, edx - registers.
+
+void probe_cpuid(u32 func_id, u32 sub_id, u32 *eax, u32 *ebx, u32 *ecx,
+                    u32 *edx)
+{
+    struct probe_core *core = probe_this_core();
+
+    *eax = *ebx = *ecx = *edx = 0;
+    if (func_id > core->max_leaf)
+        return;
+
+    if (func_id == 0)
+        *eax = core->max_leaf;
+    else if (func_id == 1)
+    {
+        *eax = core->leaf1_eax;
+        *ecx = core->leaf1_ecx;
+    }
+    else if (func_id == 7 && sub_id == 0)
+        *edx = core->leaf7_edx;
+    else if (func_id == 0x1c)
+    {
+        *eax = core->leaf1c_eax;
+        *ebx = core->leaf1c_ebx;
+    }
+    else if (func_id == 0xd && sub_id == 1)
+    {
+        *eax = core->leafd1_eax;
+        *ecx = core->leafd1_ecx;
+    }
+    else if (func_id == 0xd && sub_id == XFEATURE_LBR)
+        *eax = core->leafd_lbr_eax;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : probe_rdmsr
+// Description  : Feed the MSRs of the current simulated core, the MSRs not
+//                simulated read as 0.
+//
+// Inputs       : msr - msr address.
+// Outputs      : val - the value read.
+
+void probe_rdmsr(u32 msr, u64 *val)
+{
+    struct probe_core *core = probe_this_core();
+
+    if (msr == MSR_IA32_PERF_CAPABILITIES)
+        *val = core->perf_cap;
+    else if (msr == MSR_IA32_XSS)
+        *val = core->xss;
+    else
+        *val = 0;
+}
+
+struct xprobe_ops probe_ops = { probe_cpuid, probe_rdmsr };
+// The probing backend of the simulated cores.
+
+//
+// Core types
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : model_core
+// Description  : Set up a core type with a model specific LBR.
+//
+// Inputs       : core - the core type
+//                model - the DisplayModel of family 6
+//                format - the LBR format in the perf capabilities
+// Outputs      : void
+
+void model_core(struct probe_core *core, u32 model, u32 format)
+{
+    memset(core, 0, sizeof(*core));
+    core->max_leaf = 0x16;
+    core->leaf1_eax = ((model >> 4) << 16) | (6 << 8) | ((model & 0xf) << 4);
+    core->leaf1_ecx = X64_FEATURE_PDCM;
+    core->perf_cap = format;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : arch_core
+// Description  : Set up a core type with an Architectural LBR, saved with
+//                XSAVES if the OS enabled its state component.
+//
+// Inputs       : core - the core type
+//                depth - the deepest LBR depth, a multiple of 8 up to 64
+//                call_stack - call-stack mode supported
+//                xsaves - LBR state component enabled in IA32_XSS
+// Outputs      : void
+
+void arch_core(struct probe_core *core, u32 depth, u32 call_stack, u32 xsaves)
+{
+    memset(core, 0, sizeof(*core));
+    core->max_leaf = 0x20;
+    core->leaf1_eax = (0x8 << 16) | (6 << 8) | (0xf << 4);
+    core->leaf1_ecx = X64_FEATURE_PDCM;
+    core->leaf7_edx = X64_FEATURE_ARCH_LBR;
+    core->leaf1c_eax = (1U << (depth / 8)) - 1;
+    core->leaf1c_ebx = call_stack ? ARCH_LBR_CALL_STACK : 0;
+    core->leafd1_eax = X64_FEATURE_XSAVES;
+    core->leafd1_ecx = (u32)XFEATURE_MASK_LBR;
+    core->leafd_lbr_eax = sizeof(struct arch_lbr_xsave) +
+                            depth * sizeof(struct arch_lbr_entry) -
+                            XSAVE_COMPONENT_OFFSET;
+    core->xss = xsaves ? XFEATURE_MASK_LBR : 0;
+}
+
+//
+// Checks
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : expect_u64
+// Description  : Check a probed value.
+//
+// Inputs       : cpu - the CPU name
+//                what - the value name
+//                got - the probed value
+//                want - the expected value
+// Outputs      : int - 1 if it differs, 0 otherwise
+
+int expect_u64(const char *cpu, const char *what, u64 got, u64 want)
+{
+    if (got == want)
+        return 0;
+
+    printf("FAIL %s: %s is %llu, expected %llu\n", cpu, what, got, want);
+    return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : probe
+// Description  : Probe a simulated CPU and check the capabilities found on
+//                each core and overall.
+//
+// Inputs       : cpu - the simulated CPU
+// Outputs      : int - the number of failed checks
+
+int probe(struct probe_cpu *cpu)
+{
+    struct probe_expect *expect;
+    char what[64];
+    int failed = 0;
+    s32 ret;
+    u32 i;
+
+    probe_cpu = cpu;
+    xprobe_core_count = cpu->core_count;
+    xset_probe_ops(&probe_ops);
+    ret = lbr_check();
+    xset_probe_ops(NULL);
+
+    failed += expect_u64(cpu->name, "lbr_check", (u64)(s64)ret,
+                            (u64)(s64)cpu->check);
+    if (ret || cpu->check)
+        goto out;
+
+    for (i = 0; i < cpu->core_count; i++)
+    {
+        expect = &cpu->expect[i < cpu->first_cores ? 0 : 1];
+
+        snprintf(what, sizeof(what), "core %u backend", i);
+        failed += expect_u64(cpu->name, what, lbr_cpus[i].backend,
+                                expect->backend);
+        snprintf(what, sizeof(what), "core %u format", i);
+        failed += expect_u64(cpu->name, what, lbr_cpus[i].format,
+                                expect->format);
+        snprintf(what, sizeof(what), "core %u capacity", i);
+        failed += expect_u64(cpu->name, what, lbr_cpus[i].capacity,
+                                expect->capacity);
+    }
+
+    failed += expect_u64(cpu->name, "lbr_capacity", lbr_capacity,
+                            cpu->capacity);
+    failed += expect_u64(cpu->name, "lbr_has_info", lbr_has_info,
+                            cpu->has_info);
+    failed += expect_u64(cpu->name, "lbr_has_call_stack", lbr_has_call_stack,
+                            cpu->has_call_stack);
+
+out:
+    if (!failed)
+        printf("PASS %s\n", cpu->name);
+    return failed;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : Probe each simulated CPU twice, in turn.
+//
+// Inputs       : argc - the number of arguments
+//                argv - the arguments, `-v` for the debug messages
+// Outputs      : int - the number of failed checks
+
+int main(int argc, char *argv[])
+{
+    struct probe_cpu cpus[6];
+    int failed = 0;
+    u32 i, n = 0;
+
+    if (argc > 1 && strcmp(argv[1], "-v") == 0)
+        xprobe_verbose = 1;
+
+    memset(cpus, 0, sizeof(cpus));
+
+    // Haswell, 16 entries with call-stack mode but no LBR_INFO
+    cpus[n].name = "Haswell";
+    cpus[n].core_count = cpus[n].first_cores = 4;
+    model_core(&cpus[n].types[0], 0x3c, LBR_FORMAT_EIP_FLAGS2);
+    cpus[n].expect[0] = (struct probe_expect){ LBR_BACKEND_LEGACY,
+                                                LBR_FORMAT_EIP_FLAGS2, 16 };
+    cpus[n].capacity = 16;
+    cpus[n].has_call_stack = 1;
+    n++;
+
+    // Skylake, 32 entries with LBR_INFO
+    cpus[n].name = "Skylake";
+    cpus[n].core_count = cpus[n].first_cores = 8;
+    model_core(&cpus[n].types[0], 0x5e, LBR_FORMAT_INFO);
+    cpus[n].expect[0] = (struct probe_expect){ LBR_BACKEND_LEGACY,
+                                                LBR_FORMAT_INFO, 32 };
+    cpus[n].capacity = 32;
+    cpus[n].has_info = 1;
+    cpus[n].has_call_stack = 1;
+    n++;
+
+    // Sapphire Rapids, 64 entries of Arch LBR saved with XSAVES
+    cpus[n].name = "Sapphire Rapids";
+    cpus[n].core_count = cpus[n].first_cores = 8;
+    arch_core(&cpus[n].types[0], 64, 1, 1);
+    cpus[n].expect[0] = (struct probe_expect){ LBR_BACKEND_ARCH_XSAVES,
+                                                LIBIHT_LBR_FORMAT_ARCH, 64 };
+    cpus[n].capacity = 64;
+    cpus[n].has_info = 1;
+    cpus[n].has_call_stack = 1;
+    n++;
+
+    // Hybrid, 64 entries deep P-cores saved with XSAVES, and 32 entries deep
+    // E-cores without call-stack mode or XSAVES
+    cpus[n].name = "Hybrid Arch LBR";
+    cpus[n].core_count = 12;
+    cpus[n].first_cores = 4;
+    arch_core(&cpus[n].types[0], 64, 1, 1);
+    arch_core(&cpus[n].types[1], 32, 0, 0);
+    cpus[n].expect[0] = (struct probe_expect){ LBR_BACKEND_ARCH_XSAVES,
+                                                LIBIHT_LBR_FORMAT_ARCH, 64 };
+    cpus[n].expect[1] = (struct probe_expect){ LBR_BACKEND_ARCH,
+                                                LIBIHT_LBR_FORMAT_ARCH, 32 };
+    cpus[n].capacity = 64;
+    cpus[n].has_info = 1;
+    n++;
+
+    // Hybrid, Arch LBR P-cores and model specific LBR E-cores with the
+    // format of the perf capabilities
+    cpus[n].name = "Hybrid Arch and model LBR";
+    cpus[n].core_count = 6;
+    cpus[n].first_cores = 2;
+    arch_core(&cpus[n].types[0], 32, 1, 0);
+    model_core(&cpus[n].types[1], 0x96, LBR_FORMAT_EIP_FLAGS2);
+    cpus[n].expect[0] = (struct probe_expect){ LBR_BACKEND_ARCH,
+                                                LIBIHT_LBR_FORMAT_ARCH, 32 };
+    cpus[n].expect[1] = (struct probe_expect){ LBR_BACKEND_LEGACY,
+                                                LBR_FORMAT_EIP_FLAGS2, 32 };
+    cpus[n].capacity = 32;
+    cpus[n].has_call_stack = 1;
+    n++;
+
+    // Unknown model without Arch LBR, the LBR is not available
+    cpus[n].name = "Unknown model";
+    cpus[n].core_count = cpus[n].first_cores = 2;
+    model_core(&cpus[n].types[0], 0x01, 0);
+    cpus[n].check = -1;
+    n++;
+
+    // The second round checks that nothing is kept from an earlier probe
+    for (i = 0; i < 2 * n; i++)
+        failed += probe(&cpus[i % n]);
+
+    xfree(lbr_cpus);
+    return failed;
+}
@@ -0,0 +1,382 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : kernel/demo/probe-demo/xplat_probe.c
+//  Description    : This is the user space implementation of the cross
+//                   platform functions for the probe-demo program. The cores
+//                   are simulated one after another on the calling thread, so
+//                   the per core feature detection of the kernel module runs
+//                   offline. Only the functions the detection uses do real
+//                   work, the others are never reached and do nothing.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : July 10, 2024
+//
+
+// Include Files
+#include "xplat_probe.h"
+#include "../../commons/lbr.h"
+#include "../../commons/bts.h"
+#include "../../commons/pt.h"
+#include <cpuid.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//
+// Cross-platform global variables
+
+struct xprobe_ops xprobe_hw = { xcpuid_count, xrdmsr };
+// The CPU feature probing backend of the host, without MSR access.
+
+struct xprobe_ops *xprobe = &xprobe_hw;
+// The CPU feature probing backend in use.
+
+//
+// Global variables
+
+u32 xprobe_core_count = 1;
+// The number of simulated cores.
+
+u32 xprobe_verbose = 0;
+// Print the debug messages of the kernel module code.
+
+u32 xprobe_core = 0;
+// The simulated core the calling thread runs as.
+
+//
+// Memory management functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xmalloc
+// Description  : Cross platform kernel malloc function.
+//
+// Inputs       : size - size of memory to be allocated.
+// Outputs      : void* - pointer to the allocated memory.
+
+void *xmalloc(u64 size)
+{
+    return malloc(size);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xfree
+// Description  : Cross platform kernel free function.
+//
+// Inputs       : ptr - pointer to the memory to be freed.
+// Outputs      : void
+
+void xfree(void *ptr)
+{
+    free(ptr);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xmalloc_pages
+// Description  : Cross platform kernel page aligned and zeroed malloc
+//                function.
+//
+// Inputs       : size - size of memory to be allocated.
+// Outputs      : void* - pointer to the allocated memory.
+
+void *xmalloc_pages(u64 size)
+{
+    void *ptr;
+
+    size = XPAGE_ALIGN(size);
+    ptr = aligned_alloc(XPAGE_SIZE, size);
+    if (ptr)
+        memset(ptr, 0, size);
+    return ptr;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xfree_pages
+// Description  : Cross platform kernel page aligned free function.
+//
+// Inputs       : ptr - pointer to the memory to be freed.
+//                size - size of the memory.
+// Outputs      : void
+
+void xfree_pages(void *ptr, u64 size)
+{
+    free(ptr);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xcopy_from_user
+// Description  : Cross platform kernel copy from user function. The simulated
+//                kernel shares the address space of its user.
+//
+// Inputs       : dst - destination address.
+//                src - source address.
+//                cnt - number of bytes to copy.
+// Outputs      : u64 - number of bytes not copied.
+
+u64 xcopy_from_user(void *dst, void *src, u64 cnt)
+{
+    memcpy(dst, src, cnt);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xcopy_to_user
+// Description  : Cross platform kernel copy to user function. The simulated
+//                kernel shares the address space of its user.
+//
+// Inputs       : dst - destination address.
+//                src - source address.
+//                cnt - number of bytes to copy.
+// Outputs      : u64 - number of bytes not copied.
+
+u64 xcopy_to_user(void *dst, void *src, u64 cnt)
+{
+    memcpy(dst, src, cnt);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xmemset
+// Description  : Cross platform kernel memset function.
+//
+// Inputs       : ptr - pointer to the memory.
+//                c - value to be set.
+//                cnt - number of bytes to be set.
+// Outputs      : void* - pointer to the memory.
+
+void *xmemset(void *ptr, s32 c, u64 cnt)
+{
+    return memset(ptr, c, cnt);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xmemcpy
+// Description  : Cross platform kernel memcpy function.
+//
+// Inputs       : dst - destination address.
+//                src - source address.
+//                cnt - number of bytes to copy.
+// Outputs      : void* - destination address.
+
+void *xmemcpy(void *dst, void *src, u64 cnt)
+{
+    return memcpy(dst, src, cnt);
+}
+
+//
+// CPU core, hardware, register read/write functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xrdmsr
+// Description  : Cross platform read msr function. User space has no access
+//                to the MSRs, so they all read as 0.
+//
+// Inputs       : msr - msr address.
+// Outputs      : val - the value read.
+
+void xrdmsr(u32 msr, u64 *val)
+{
+    *val = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xcoreid
+// Description  : Cross platform get core id function. Get the simulated core
+//                id.
+//
+// Inputs       : void
+// Outputs      : u32 - current core id.
+
+u32 xcoreid(void)
+{
+    return xprobe_core;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xcore_count
+// Description  : Cross platform get number of core ids function. Every core
+//                id is below this number.
+//
+// Inputs       : void
+// Outputs      : u32 - number of core ids.
+
+u32 xcore_count(void)
+{
+    return xprobe_core_count;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xcpuid_count
+// Description  : Cross platform cpuid with sub-leaf function, of the host.
+//
+// Inputs       : func_id - function id.
+//                sub_id - sub-leaf id.
+// Outputs      : eax, ebx, ecx, edx - registers.
+
+void xcpuid_count(u32 func_id, u32 sub_id, u32 *eax, u32 *ebx, u32 *ecx,
+                    u32 *edx)
+{
+    __cpuid_count(func_id, sub_id, *eax, *ebx, *ecx, *edx);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xon_each_cpu
+// Description  : Cross platform on each cpu function. Run the function as
+//                each simulated core in turn.
+//
+// Inputs       : func - function to be run.
+// Outputs      : void
+
+void xon_each_cpu(void (*func)(void))
+{
+    for (xprobe_core = 0; xprobe_core < xprobe_core_count; xprobe_core++)
+        func();
+    xprobe_core = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xon_each_cpu_arg
+// Description  : Cross platform on each cpu function with an argument. Run
+//                the function as each simulated core in turn.
+//
+// Inputs       : func - function to be run.
+//                arg - argument passed to the function.
+// Outputs      : void
+
+void xon_each_cpu_arg(void (*func)(void *), void *arg)
+{
+    for (xprobe_core = 0; xprobe_core < xprobe_core_count; xprobe_core++)
+        func(arg);
+    xprobe_core = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xset_probe_ops
+// Description  : Cross platform set CPU feature probing backend function.
+//                NULL restores the host backend.
+//
+// Inputs       : ops - the probing backend.
+// Outputs      : void
+
+void xset_probe_ops(struct xprobe_ops *ops)
+{
+    xprobe = ops ? ops : &xprobe_hw;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xprintdbg
+// Description  : Cross platform print kernel debug message function, only
+//                printed in verbose mode.
+//
+// Inputs       : format - format string.
+//                ... - arguments.
+// Outputs      : void
+
+void xprintdbg(const char *format, ...)
+{
+    va_list args;
+
+    if (!xprobe_verbose)
+        return;
+
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xprint_ratelimit
+// Description  : Cross platform check if a rate limited debug message may
+//                print function.
+//
+// Inputs       : void
+// Outputs      : u32 - always true.
+
+u32 xprint_ratelimit(void)
+{
+    return 1;
+}
+
+//
+// The simulated cores have no registers, processes, locks or sessions behind
+// them. The functions below are only linked in by the tracing paths of the
+// kernel module code, which the feature detection never reaches.
+
+void xlock_core(void *old_irql) {}
+void xrelease_core(void *new_irql) {}
+void xwrmsr(u32 msr, u64 val) {}
+u32 xgetcurrent_pid(void) { return 0; }
+u32 xtrace_allowed(u32 pid) { return 0; }
+void xsaves_area(void *area, u64 mask) {}
+void xrstors_area(void *area, u64 mask) {}
+u64 xrdtsc(void) { return 0; }
+u64 xload_acquire(u64 *ptr) { return *ptr; }
+void xstore_release(u64 *ptr, u64 val) { *ptr = val; }
+
+void xinit_lock(void *lock) {}
+void xacquire_lock(void *lock, void *old_irql) {}
+s32 xtry_acquire_lock(void *lock, void *old_irql) { return 1; }
+void xrelease_lock(void *lock, void *new_irql) {}
+
+void xinit_list_head(void *list) {}
+void xlist_add(void *new_entry, void *head) {}
+void xlist_del(void *entry) {}
+void *xlist_next(void *entry) { return entry; }
+
+void xfor_each_exec_mapping(u32 pid, u64 start, u64 end,
+                            void (*func)(void *ctx, u32 pid,
+                                struct trace_mmap_record *record,
+                                char *path, u32 path_size),
+                            void *ctx) {}
+
+s32 xperf_init(void (*func)(u32 tid, u32 nr, struct lbr_stack_entry *entries,
+                            u64 *info)) { return -1; }
+void xperf_exit(void) {}
+void *xperf_lbr_open(u32 pid, u64 lbr_select, u64 period) { return NULL; }
+void xperf_lbr_close(void *event) {}
+void xbpf_publish_lbr(struct lbr_snapshot *snapshot, void *entries,
+                        u32 size) {}
+
+s32 session_write(struct session *session, u16 type, u32 tid,
+                    void *data0, u32 size0, void *data1, u32 size1)
+{
+    return -1;
+}
+void session_lost(struct session *session, u64 lbr_snapshots, u64 bts_records,
+                    u64 mmaps, u64 switches, u64 pt_bytes) {}
+void session_mmap(void *session, u32 pid, struct trace_mmap_record *record,
+                    char *path, u32 path_size) {}
+void session_flush(struct session *session) {}
+s32 session_gate_open(struct session *session) { return 0; }
+s32 subscribers_gate_open(struct subscribers *subs) { return 0; }
+void subscribers_switch(struct subscribers *subs, u32 tid, u32 flags,
+                        u32 other_tid,
+                        s32 (*shadowed)(u32 pid, struct session *session)) {}
+void subscribers_flush(struct subscribers *subs) {}
+s32 subscribe_session(struct subscribers *subs, struct session *session)
+{
+    return -1;
+}
+s32 unsubscribe_session(struct subscribers *subs, struct session *session)
+{
+    return -1;
+}
+s32 bts_subscribed(u32 pid, struct session *session) { return 0; }
+s32 pt_subscribed(u32 pid, struct session *session) { return 0; }
@@ -0,0 +1,28 @@
+#ifndef _PROBE_DEMO_XPLAT_PROBE_H
+#define _PROBE_DEMO_XPLAT_PROBE_H
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : kernel/demo/probe-demo/xplat_probe.h
+//  Description    : This is the header file for the user space cross platform
+//                   functions of the probe-demo program. The cores are
+//                   simulated, so the feature detection of the kernel module
+//                   runs offline on the CPUID and MSR values injected with
+//                   xset_probe_ops.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : July 10, 2024
+//
+
+#include "../../commons/xplat.h"
+
+//
+// Global variables
+
+extern u32 xprobe_core_count;
+// The number of simulated cores.
+
+extern u32 xprobe_verbose;
+// Print the debug messages of the kernel module code.
+
+#endif // _PROBE_DEMO_XPLAT_PROBE_H
@@ -14,6 +14,7 @@
 // Includes Files
 #include "../../commons/lbr.h"
 #include "../../commons/bts.h"
+#include "../../commons/pt.h"
 #include "../../commons/types.h"
 #include "../../commons/debug.h"
 #include "../infinity_hook/imports.hpp"
@@ -56,6 +57,15 @@ NTSTATUS device_create(PDRIVER_OBJECT driver_obj);
 NTSTATUS device_remove(PDRIVER_OBJECT driver_obj);
 // This function is used to remove a device object
 
+NTSTATUS device_open(PDEVICE_OBJECT device_obj, PIRP Irp);
+// This function is used to create a session for an opened handle
+
+NTSTATUS device_cleanup(PDEVICE_OBJECT device_obj, PIRP Irp);
+// This function is used to remove the trace states owned by a session
+
+NTSTATUS device_close(PDEVICE_OBJECT device_obj, PIRP Irp);
+// This function is used to free the session of a closed handle
+
 NTSTATUS device_ioctl(PDEVICE_OBJECT device_obj, PIRP Irp);
 // This function is used to handle IOCTL requests
 
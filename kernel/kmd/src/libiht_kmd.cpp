@@ -94,6 +94,7 @@ VOID create_proc_notify(PEPROCESS proc, HANDLE proc_id,
         // Process is being created
         lbr_newproc_handler((u32)(UINT_PTR)create_info->ParentProcessId, (u32)proc_id);
         bts_newproc_handler((u32)(UINT_PTR)create_info->ParentProcessId, (u32)proc_id);
+        pt_newproc_handler((u32)(UINT_PTR)create_info->ParentProcessId, (u32)proc_id);
     }
     else
     {
@@ -120,6 +121,7 @@ void __fastcall cswitch_call_back(u32 new_proc, u32 old_proc)
 {
     lbr_cswitch_handler(old_proc, new_proc);
     bts_cswitch_handler(old_proc, new_proc);
+    pt_cswitch_handler(old_proc, new_proc);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -185,6 +187,9 @@ NTSTATUS device_create(PDRIVER_OBJECT driver_obj)
     for (ULONG i = 0; i <= IRP_MJ_MAXIMUM_FUNCTION; i++) {
         driver_obj->MajorFunction[i] = device_default;
     }
+    driver_obj->MajorFunction[IRP_MJ_CREATE] = device_open;
+    driver_obj->MajorFunction[IRP_MJ_CLEANUP] = device_cleanup;
+    driver_obj->MajorFunction[IRP_MJ_CLOSE] = device_close;
     driver_obj->MajorFunction[IRP_MJ_DEVICE_CONTROL] = device_ioctl;
 
     // Create device object
@@ -226,6 +231,104 @@ NTSTATUS device_remove(PDRIVER_OBJECT driver_obj)
     return STATUS_SUCCESS;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : device_open
+// Description  : This function is used to handle the create request from user
+//                interactive helper. Each opened handle gets its own session.
+//
+// Inputs       : device_obj - the device object
+//                Irp - the I/O request packet
+// Outputs      : NTSTATUS - the status of the create request
+
+NTSTATUS device_open(PDEVICE_OBJECT device_obj, PIRP Irp)
+{
+    PIO_STACK_LOCATION irp_stack;
+    struct session *session;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    UNREFERENCED_PARAMETER(device_obj);
+
+    irp_stack = IoGetCurrentIrpStackLocation(Irp);
+    session = create_session();
+    if (session == NULL)
+        status = STATUS_INSUFFICIENT_RESOURCES;
+    irp_stack->FileObject->FsContext = session;
+
+    Irp->IoStatus.Status = status;
+    Irp->IoStatus.Information = 0;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return status;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : device_cleanup
+// Description  : This function is used to handle the cleanup request when the
+//                last handle of a file object is closed, including when the
+//                owning process is terminated. The trace states owned by the
+//                session are removed.
+//
+// Inputs       : device_obj - the device object
+//                Irp - the I/O request packet
+// Outputs      : NTSTATUS - the status of the cleanup request
+
+NTSTATUS device_cleanup(PDEVICE_OBJECT device_obj, PIRP Irp)
+{
+    PIO_STACK_LOCATION irp_stack;
+    struct session *session;
+
+    UNREFERENCED_PARAMETER(device_obj);
+
+    irp_stack = IoGetCurrentIrpStackLocation(Irp);
+    session = (struct session*)irp_stack->FileObject->FsContext;
+    if (session != NULL)
+    {
+        release_lbr_session(session);
+        release_bts_session(session);
+        release_pt_session(session);
+    }
+
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+    Irp->IoStatus.Information = 0;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return STATUS_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : device_close
+// Description  : This function is used to handle the close request when the
+//                file object is released. The session is freed.
+//
+// Inputs       : device_obj - the device object
+//                Irp - the I/O request packet
+// Outputs      : NTSTATUS - the status of the close request
+
+NTSTATUS device_close(PDEVICE_OBJECT device_obj, PIRP Irp)
+{
+    PIO_STACK_LOCATION irp_stack;
+    struct session *session;
+
+    UNREFERENCED_PARAMETER(device_obj);
+
+    irp_stack = IoGetCurrentIrpStackLocation(Irp);
+    session = (struct session*)irp_stack->FileObject->FsContext;
+    if (session != NULL)
+    {
+        free_session(session);
+        irp_stack->FileObject->FsContext = NULL;
+    }
+
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+    Irp->IoStatus.Information = 0;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return STATUS_SUCCESS;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : device_ioctl
@@ -241,6 +344,7 @@ NTSTATUS device_ioctl(PDEVICE_OBJECT device_obj, PIRP Irp)
     PIO_STACK_LOCATION irp_stack;
     ULONG ioctl_cmd;
     struct xioctl_request* request;
+    struct session* session;
     u64 request_size;
     NTSTATUS status = STATUS_SUCCESS;
 
@@ -263,27 +367,18 @@ NTSTATUS device_ioctl(PDEVICE_OBJECT device_obj, PIRP Irp)
         return status;
     }
 
-    // Process request
-    if (request->cmd <= LIBIHT_IOCTL_LBR_END)
+    // Process request within the session of the file object
+    session = (struct session*)irp_stack->FileObject->FsContext;
+    if (request->cmd > LIBIHT_IOCTL_BATCH_END)
+    {
+        // Unknown request
+        xprintdbg("LIBIHT-KMD: Unknown request\n");
+        status = STATUS_INVALID_DEVICE_REQUEST;
+    }
+    else if (xioctl_handler(session, request) != 0)
     {
-        // LBR request
-        xprintdbg("LIBIHT-KMD: LBR request\n");
-        if (lbr_ioctl_handler(request) != 0)
-            status = STATUS_UNSUCCESSFUL;
+        status = STATUS_UNSUCCESSFUL;
     }
-	else if (request->cmd <= LIBIHT_IOCTL_BTS_END)
-	{
-		// BTS request
-		xprintdbg("LIBIHT-KMD: BTS request\n");
-		if (bts_ioctl_handler(request) != 0)
-			status = STATUS_UNSUCCESSFUL;
-	}
-	else
-	{
-		// Unknown request
-		xprintdbg("LIBIHT-KMD: Unknown request\n");
-		status = STATUS_INVALID_DEVICE_REQUEST;
-	}
 
     // Complete the request
     Irp->IoStatus.Status = status;
@@ -360,6 +455,9 @@ NTSTATUS DriverEntry(PDRIVER_OBJECT driver_obj, PUNICODE_STRING reg_path)
     // Init BTS
     bts_init();
 
+    // Init PT
+    pt_init();
+
     xprintdbg("LIBIHT-KMD: Initialized\n");
     return STATUS_SUCCESS;
 }
@@ -381,6 +479,9 @@ NTSTATUS DriverExit(PDRIVER_OBJECT driver_obj)
 
     xprintdbg("LIBIHT-KMD: Exiting...\n");
 
+    // Exit PT
+    pt_exit();
+
     // Exit BTS
     bts_exit();
 
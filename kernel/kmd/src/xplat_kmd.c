@@ -15,6 +15,33 @@
 // Cross-platform global variables
 const unsigned long g_tag = 'XPLT';
 
+struct xprobe_ops xprobe_hw = { xcpuid_count, xrdmsr };
+// The hardware CPU feature probing backend.
+
+struct xprobe_ops *xprobe = &xprobe_hw;
+// The CPU feature probing backend in use.
+
+KTIMER xtimer;
+// The periodic timer.
+
+KDPC xtimer_dpc;
+// The DPC running the callback of the periodic timer.
+
+u32 (*xtimer_func)(void);
+// The callback of the periodic timer, NULL if not set up.
+
+LONG xtimer_period;
+// The period of the periodic timer in milliseconds.
+
+volatile LONG xtimer_gen;
+// The number of starts of the periodic timer.
+
+volatile LONG64 xprint_window;
+// The interrupt time the window of the rate limited messages began at.
+
+volatile LONG xprint_count;
+// The rate limited messages in the current window.
+
 //
 // Cross-platform functions
 
@@ -49,6 +76,36 @@ void xfree(void *ptr)
     ExFreePool(ptr);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xmalloc_pages
+// Description  : Cross platform kernel page aligned malloc function. Allocate
+//                zeroed memory from the kernel heap, allocations of a page or
+//                more are page aligned.
+//
+// Inputs       : size - size of the memory to be allocated.
+// Outputs      : void* - pointer to the allocated memory.
+
+void* xmalloc_pages(u64 size)
+{
+    return ExAllocatePool2(POOL_FLAG_NON_PAGED, XPAGE_ALIGN(size), g_tag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xfree_pages
+// Description  : Cross platform kernel page aligned free function.
+//
+// Inputs       : ptr - pointer to the memory to be freed.
+//                size - size of the memory to be freed.
+// Outputs      : void
+
+void xfree_pages(void *ptr, u64 size)
+{
+    UNREFERENCED_PARAMETER(size);
+    ExFreePool(ptr);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : xcopy_from_user
@@ -138,6 +195,20 @@ void* xmemcpy(void* dst, void* src, u64 cnt)
     return memcpy(dst, src, cnt);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xvirt_to_phys
+// Description  : Cross platform kernel virtual to physical address function.
+//                Only valid for the memory allocated by `xmalloc_pages`.
+//
+// Inputs       : addr - the kernel virtual address.
+// Outputs      : u64 - the physical address.
+
+u64 xvirt_to_phys(void *addr)
+{
+    return MmGetPhysicalAddress(addr).QuadPart;
+}
+
 //
 // CPU core, hardware, register read/write functions
 
@@ -209,6 +280,20 @@ u32 xcoreid(void)
     return KeGetCurrentProcessorNumberEx(0);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xcore_count
+// Description  : Cross platform get number of core ids function. Every core
+//                id is below this number.
+//
+// Inputs       : void
+// Outputs      : u32 - number of core ids.
+
+u32 xcore_count(void)
+{
+    return KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : xgetcurrent_pid
@@ -223,6 +308,82 @@ u32 xgetcurrent_pid(void)
     return (u32)(ULONG_PTR)PsGetCurrentProcessId();
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xtrace_allowed
+// Description  : Cross platform check of the permission to trace a process,
+//                i.e. the requesting thread may open it for reading its
+//                memory. Must be called at PASSIVE_LEVEL in the context of the
+//                request.
+//
+// Inputs       : pid - the process id
+// Outputs      : u32 - 1 if the current process may trace it, else 0
+
+u32 xtrace_allowed(u32 pid)
+{
+    PEPROCESS process;
+    HANDLE handle;
+    NTSTATUS status;
+
+    if (!NT_SUCCESS(PsLookupProcessByProcessId((HANDLE)(ULONG_PTR)pid,
+                                                &process)))
+        return 0;
+
+    // The access check runs against the token of the requesting thread
+    status = ObOpenObjectByPointer(process, 0, NULL, PROCESS_VM_READ,
+                                    *PsProcessType, UserMode, &handle);
+    ObDereferenceObject(process);
+    if (!NT_SUCCESS(status))
+        return 0;
+
+    ZwClose(handle);
+    return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xgetcurrent_owner
+// Description  : Cross platform get the owner of the current process, i.e.
+//                the logon session of its primary token, so it can be checked
+//                by `xowner_allowed` once the process is gone.
+//
+// Inputs       : void
+// Outputs      : u64 - the owner, or XOWNER_NONE
+
+u64 xgetcurrent_owner(void)
+{
+    PACCESS_TOKEN token;
+    LUID luid;
+    u64 owner = XOWNER_NONE;
+
+    token = PsReferencePrimaryToken(PsGetCurrentProcess());
+    if (NT_SUCCESS(SeQueryAuthenticationIdToken(token, &luid)))
+        owner = ((u64)(u32)luid.HighPart << 32) | luid.LowPart;
+    PsDereferencePrimaryToken(token);
+
+    return owner;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xowner_allowed
+// Description  : Cross platform check of the permission to trace the
+//                processes of an owner from `xgetcurrent_owner`, the same
+//                logon session, or the debug privilege of the requesting
+//                thread. Must be called in the context of the request.
+//
+// Inputs       : owner - the owner
+// Outputs      : u32 - 1 if the current process may trace it, else 0
+
+u32 xowner_allowed(u64 owner)
+{
+    if (SeSinglePrivilegeCheck(RtlConvertLongToLuid(SE_DEBUG_PRIVILEGE),
+                                UserMode))
+        return 1;
+
+    return owner != XOWNER_NONE && owner == xgetcurrent_owner();
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : xcpuid
@@ -241,6 +402,58 @@ void xcpuid(u32 func_id, u32 *eax, u32 *ebx, u32 *ecx, u32 *edx)
     *edx = regs[3];
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xcpuid_count
+// Description  : Cross platform cpuid with sub-leaf function. Get the cpuid
+//                information of a sub-leaf.
+//
+// Inputs       : func_id - cpuid function id.
+//                sub_id - cpuid sub-leaf id.
+// Outputs      : void
+
+void xcpuid_count(u32 func_id, u32 sub_id, u32 *eax, u32 *ebx, u32 *ecx,
+                    u32 *edx)
+{
+    s32 regs[4];
+    __cpuidex(regs, func_id, sub_id);
+    *eax = regs[0];
+    *ebx = regs[1];
+    *ecx = regs[2];
+    *edx = regs[3];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xsaves_area
+// Description  : Cross platform XSAVES function. Save the supervisor states
+//                of the mask into a 64-byte aligned area in compacted format.
+//
+// Inputs       : area - the XSAVE area.
+//                mask - the state components to save.
+// Outputs      : void
+
+void xsaves_area(void *area, u64 mask)
+{
+    _xsaves64(area, mask);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xrstors_area
+// Description  : Cross platform XRSTORS function. Restore the supervisor
+//                states of the mask from a 64-byte aligned area in compacted
+//                format.
+//
+// Inputs       : area - the XSAVE area.
+//                mask - the state components to restore.
+// Outputs      : void
+
+void xrstors_area(void *area, u64 mask)
+{
+    _xrstors64(area, mask);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : xon_each_cpu
@@ -255,6 +468,82 @@ void xon_each_cpu(void (*func)(void))
     KeIpiGenericCall((PKIPI_BROADCAST_WORKER)func, 0);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xon_each_cpu_arg
+// Description  : Cross platform on each cpu dispatch function with an
+//                argument. Dispatch a function to each cpu and wait for all of
+//                them. It must not be called with a state lock held.
+//
+// Inputs       : func - function to be dispatched.
+//                arg - argument passed to the function.
+// Outputs      : void
+
+void xon_each_cpu_arg(void (*func)(void *), void *arg)
+{
+    KeIpiGenericCall((PKIPI_BROADCAST_WORKER)func, (ULONG_PTR)arg);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xset_probe_ops
+// Description  : Cross platform set CPU feature probing backend function.
+//                NULL restores the hardware backend.
+//
+// Inputs       : ops - the probing backend.
+// Outputs      : void
+
+void xset_probe_ops(struct xprobe_ops *ops)
+{
+    xprobe = ops ? ops : &xprobe_hw;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xrdtsc
+// Description  : Cross platform read timestamp counter function.
+//
+// Inputs       : void
+// Outputs      : u64 - current timestamp counter.
+
+u64 xrdtsc(void)
+{
+    return __rdtsc();
+}
+
+//
+// Memory ordering functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xload_acquire
+// Description  : Cross platform load acquire function. Read a value that is
+//                published by another core, later accesses are not reordered
+//                before it.
+//
+// Inputs       : ptr - pointer to the value.
+// Outputs      : u64 - the value read.
+
+u64 xload_acquire(u64 *ptr)
+{
+    return (u64)ReadAcquire64((LONG64 *)ptr);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xstore_release
+// Description  : Cross platform store release function. Publish a value to
+//                another core, earlier accesses are not reordered after it.
+//
+// Inputs       : ptr - pointer to the value.
+//                val - value to be stored.
+// Outputs      : void
+
+void xstore_release(u64 *ptr, u64 val)
+{
+    WriteRelease64((LONG64 *)ptr, (LONG64)val);
+}
+
 //
 // Lock functions
 
@@ -285,6 +574,29 @@ void xacquire_lock(void *lock, void *old_irql)
     KeAcquireSpinLock((PKSPIN_LOCK)lock, (PKIRQL)old_irql);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xtry_acquire_lock
+// Description  : Cross platform acquire lock without spinning function. Acquire
+//                a lock if it is free, e.g. from a context that may have
+//                interrupted its holder on the same core.
+//
+// Inputs       : lock     - pointer to the lock to be acquired.
+//                old_irql - pointer to the old IRQL.
+// Outputs      : s32 - 0 if acquired, -1 if the lock is held.
+
+s32 xtry_acquire_lock(void *lock, void *old_irql)
+{
+    KeRaiseIrql(DISPATCH_LEVEL, (PKIRQL)old_irql);
+    if (!KeTryToAcquireSpinLockAtDpcLevel((PKSPIN_LOCK)lock))
+    {
+        KeLowerIrql(*(PKIRQL)old_irql);
+        return -1;
+    }
+
+    return 0;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : xrelease_lock
@@ -299,6 +611,51 @@ void xrelease_lock(void *lock, void *new_irql)
     KeReleaseSpinLock((PKSPIN_LOCK)lock, *(PKIRQL)new_irql);
 }
 
+//
+// Wait queue functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xinit_waitq
+// Description  : Cross platform init wait queue function. Initialize a wait
+//                queue as a synchronization event.
+//
+// Inputs       : waitq - pointer to the wait queue to be initialized.
+// Outputs      : void
+
+void xinit_waitq(void *waitq)
+{
+    KeInitializeEvent((PRKEVENT)waitq, SynchronizationEvent, FALSE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xwake_up
+// Description  : Cross platform wake up wait queue function. Signal the event,
+//                callable at IRQL <= DISPATCH_LEVEL.
+//
+// Inputs       : waitq - pointer to the wait queue.
+// Outputs      : void
+
+void xwake_up(void *waitq)
+{
+    KeSetEvent((PRKEVENT)waitq, IO_NO_INCREMENT, FALSE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xdestroy_waitq
+// Description  : Cross platform destroy wait queue function. Nothing to be
+//                released for an event.
+//
+// Inputs       : waitq - pointer to the wait queue.
+// Outputs      : void
+
+void xdestroy_waitq(void *waitq)
+{
+    UNREFERENCED_PARAMETER(waitq);
+}
+
 //
 // List functions
 
@@ -372,6 +729,292 @@ void* xlist_prev(void* entry)
     return (void *)((PLIST_ENTRY)entry)->Blink;
 }
 
+//
+// Process functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xfor_each_exec_mapping
+// Description  : Cross platform executable mapping walk function. Mapping
+//                records are not supported on Windows yet, nothing is walked.
+//
+// Inputs       : pid - the process id
+//                start - the start address of the range
+//                end - the end address of the range
+//                func - function to be called on each mapping
+//                ctx - context passed to the function
+// Outputs      : void
+
+void xfor_each_exec_mapping(u32 pid, u64 start, u64 end,
+                            void (*func)(void *ctx, u32 pid,
+                                struct trace_mmap_record *record,
+                                char *path, u32 path_size),
+                            void *ctx)
+{
+    UNREFERENCED_PARAMETER(pid);
+    UNREFERENCED_PARAMETER(start);
+    UNREFERENCED_PARAMETER(end);
+    UNREFERENCED_PARAMETER(func);
+    UNREFERENCED_PARAMETER(ctx);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xgetpid_cr3
+// Description  : Cross platform get page table root function. Attach to the
+//                process to read the CR3 it runs with. Must be called at
+//                PASSIVE_LEVEL.
+//
+// Inputs       : pid - the process id
+// Outputs      : u64 - the page table root, 0 if the process is not found
+
+u64 xgetpid_cr3(u32 pid)
+{
+    PEPROCESS process;
+    KAPC_STATE apc_state;
+    u64 cr3;
+
+    if (!NT_SUCCESS(PsLookupProcessByProcessId((HANDLE)(ULONG_PTR)pid,
+                                                &process)))
+        return 0;
+
+    KeStackAttachProcess(process, &apc_state);
+    cr3 = __readcr3();
+    KeUnstackDetachProcess(&apc_state);
+    ObDereferenceObject(process);
+
+    return cr3;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xperfmon_capable
+// Description  : Cross platform check of the privilege to trace the kernel,
+//                i.e. the debug privilege of the requesting thread. Must be
+//                called in the context of the request.
+//
+// Inputs       : void
+// Outputs      : u32 - 1 if the current process may trace the kernel, else 0
+
+u32 xperfmon_capable(void)
+{
+    return SeSinglePrivilegeCheck(RtlConvertLongToLuid(SE_DEBUG_PRIVILEGE),
+                                    UserMode) ? 1 : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xcond_resched
+// Description  : Cross platform yield the core if a reschedule is due
+//                function. Threads are preempted at PASSIVE_LEVEL, nothing to
+//                do on Windows.
+//
+// Inputs       : void
+// Outputs      : void
+
+void xcond_resched(void)
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xsignal_pending
+// Description  : Cross platform check of a pending signal of the current
+//                thread function. Windows has no signals, the closest is a
+//                thread being terminated.
+//
+// Inputs       : void
+// Outputs      : u32 - 1 if the thread is terminating, else 0
+
+u32 xsignal_pending(void)
+{
+    return PsIsThreadTerminating(PsGetCurrentThread()) ? 1 : 0;
+}
+
+//
+// Timer functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xtimer_routine
+// Description  : The DPC routine of the periodic timer, run the callback at
+//                DISPATCH_LEVEL, and cancel the timer if the callback stops
+//                it. A timer started again meanwhile is set again.
+//
+// Inputs       : dpc - the DPC
+//                context - the DPC context, unused
+//                arg1 - unused
+//                arg2 - unused
+// Outputs      : void
+
+void xtimer_routine(PKDPC dpc, PVOID context, PVOID arg1, PVOID arg2)
+{
+    LARGE_INTEGER due;
+    LONG gen;
+
+    UNREFERENCED_PARAMETER(dpc);
+    UNREFERENCED_PARAMETER(context);
+    UNREFERENCED_PARAMETER(arg1);
+    UNREFERENCED_PARAMETER(arg2);
+
+    gen = ReadAcquire(&xtimer_gen);
+    if (xtimer_func())
+        return;
+
+    KeCancelTimer(&xtimer);
+    if (ReadAcquire(&xtimer_gen) != gen)
+    {
+        due.QuadPart = -(LONGLONG)xtimer_period * 10000;
+        KeSetTimerEx(&xtimer, due, xtimer_period, &xtimer_dpc);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xtimer_start
+// Description  : Cross platform start periodic timer function. Call `func`
+//                every `period_ns` at DISPATCH_LEVEL, rounded to milliseconds
+//                as KeSetTimerEx takes the period in milliseconds, until it
+//                returns 0. Callers serialize the start and stop, and only
+//                start the timer again once `func` has decided to return 0.
+//
+// Inputs       : func - the callback, returning 0 to stop the timer
+//                period_ns - the period in nanoseconds
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 xtimer_start(u32 (*func)(void), u64 period_ns)
+{
+    LARGE_INTEGER due;
+
+    if (func == NULL || period_ns == 0)
+        return -1;
+
+    if (xtimer_func == NULL)
+    {
+        xtimer_period = (LONG)(period_ns / 1000000);
+        if (xtimer_period == 0)
+            xtimer_period = 1;
+
+        xtimer_func = func;
+        KeInitializeTimer(&xtimer);
+        KeInitializeDpc(&xtimer_dpc, xtimer_routine, NULL);
+    }
+
+    // The DPC stopping the timer sets it again if it sees a new start
+    InterlockedIncrement(&xtimer_gen);
+
+    // Relative due time in 100ns units
+    due.QuadPart = -(LONGLONG)xtimer_period * 10000;
+    KeSetTimerEx(&xtimer, due, xtimer_period, &xtimer_dpc);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xtimer_stop
+// Description  : Cross platform stop periodic timer function. Wait for the
+//                queued callbacks to finish.
+//
+// Inputs       : void
+// Outputs      : void
+
+void xtimer_stop(void)
+{
+    if (xtimer_func == NULL)
+        return;
+
+    KeCancelTimer(&xtimer);
+    KeFlushQueuedDpcs();
+    xtimer_func = NULL;
+}
+
+//
+// Perf functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xperf_init
+// Description  : Cross platform perf backend init function. Windows has no
+//                in-kernel branch stack sampling to share the LBR with, so
+//                the perf backend is not available.
+//
+// Inputs       : func - the callback receiving the branch stack samples
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 xperf_init(void (*func)(u32 tid, u32 nr, struct lbr_stack_entry *entries,
+                            u64 *info))
+{
+    UNREFERENCED_PARAMETER(func);
+    return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xperf_exit
+// Description  : Cross platform perf backend exit function. Nothing to do on
+//                Windows.
+//
+// Inputs       : void
+// Outputs      : void
+
+void xperf_exit(void)
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xperf_lbr_open
+// Description  : Cross platform open branch stack sampling event function.
+//                Not available on Windows.
+//
+// Inputs       : pid - the process id
+//                lbr_select - the LBR_SELECT filtering the branches
+//                period - the branches between two samples
+// Outputs      : void * - the event, NULL on failure
+
+void *xperf_lbr_open(u32 pid, u64 lbr_select, u64 period)
+{
+    UNREFERENCED_PARAMETER(pid);
+    UNREFERENCED_PARAMETER(lbr_select);
+    UNREFERENCED_PARAMETER(period);
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xperf_lbr_close
+// Description  : Cross platform close branch stack sampling event function.
+//                Not available on Windows.
+//
+// Inputs       : event - the event
+// Outputs      : void
+
+void xperf_lbr_close(void *event)
+{
+    UNREFERENCED_PARAMETER(event);
+}
+
+//
+// BPF functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xbpf_publish_lbr
+// Description  : Cross platform hand LBR snapshot to BPF programs function.
+//                Not available on Windows.
+//
+// Inputs       : snapshot - the snapshot header
+//                entries - the LBR entries following the header
+//                size - the size of the entries
+// Outputs      : void
+
+void xbpf_publish_lbr(struct lbr_snapshot *snapshot, void *entries, u32 size)
+{
+    UNREFERENCED_PARAMETER(snapshot);
+    UNREFERENCED_PARAMETER(entries);
+    UNREFERENCED_PARAMETER(size);
+}
+
 //
 // Debug functions
 
@@ -391,3 +1034,27 @@ void xprintdbg(const char *format, ...)
     vDbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, format, args);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xprint_ratelimit
+// Description  : Cross platform check if a rate limited debug message may
+//                print function. Allows 10 messages every 5 seconds, like the
+//                default rate limit of Linux.
+//
+// Inputs       : void
+// Outputs      : u32 - 1 if the message may print, 0 if suppressed
+
+u32 xprint_ratelimit(void)
+{
+    LONG64 now, window;
+
+    // Interrupt time in 100ns units
+    now = (LONG64)KeQueryInterruptTime();
+    window = ReadAcquire64(&xprint_window);
+    if (now - window >= 5 * 10000000LL &&
+        InterlockedCompareExchange64(&xprint_window, now, window) == window)
+        InterlockedExchange(&xprint_count, 0);
+
+    return InterlockedIncrement(&xprint_count) <= 10;
+}
+
@@ -13,8 +13,12 @@
 //
 // Include Files
 #include "headers_lkm.h"
+#include "xplat_lkm.h"
 #include "../../commons/lbr.h"
 #include "../../commons/bts.h"
+#include "../../commons/pt.h"
+#include "../../commons/session.h"
+#include "../../commons/crash.h"
 #include "../../commons/types.h"
 #include "../../commons/debug.h"
 
@@ -22,10 +26,43 @@
 // Library constants
 
 // Check Linux kernel version.
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+#define HAVE_KERNEL_SIGINFO
+#endif
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
 #define HAVE_PROC_OPS
 #endif
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+#define HAVE_PROC_READ_ITER
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+#define HAVE_URING_CMD
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+#define HAVE_VM_FLAGS_SET
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0) && \
+    IS_ENABLED(CONFIG_DEBUG_INFO_BTF_MODULES)
+#define HAVE_BPF_KFUNC
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+#define HAVE_COPY_SPLICE_READ
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+#define HAVE_IO_URING_SQE_CMD
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+#define HAVE_BTF_KFUNCS_START
+#endif
+
 // Device name
 #define DEVICE_NAME "libiht-info"
 
@@ -36,6 +73,12 @@
 //
 // Type definitions
 
+// io_uring command payload, placed in the command area of the SQE
+struct libiht_uring_cmd
+{
+    u64 request;        // User address of the struct xioctl_request
+};
+
 // Tracepoint table
 struct tracepoint_table
 {
@@ -69,6 +112,24 @@ void tp_sched_switch_handler(void *data, bool preempt,
 void tp_new_task_handler(void *data, struct task_struct *task);
 // This function is called when the task_newtask tracepoint is hit.
 
+void tp_process_exit_handler(void *data, struct task_struct *task);
+// This function is called when the sched_process_exit tracepoint is hit.
+
+void tp_sys_enter_handler(void *data, struct pt_regs *regs, long id);
+// This function is called when the sys_enter tracepoint is hit.
+
+void tp_sys_exit_handler(void *data, struct pt_regs *regs, long ret);
+// This function is called when the sys_exit tracepoint is hit.
+
+#ifdef HAVE_KERNEL_SIGINFO
+void tp_signal_deliver_handler(void *data, int sig, struct kernel_siginfo *info,
+                                struct k_sigaction *ka);
+#else
+void tp_signal_deliver_handler(void *data, int sig, struct siginfo *info,
+                                struct k_sigaction *ka);
+#endif
+// This function is called when the signal_deliver tracepoint is hit.
+
 int device_open(struct inode *inode, struct file *file_ptr);
 // This function is used to open the device.
 
@@ -79,14 +140,65 @@ ssize_t device_read(struct file *file_ptr, char *buffer, size_t length,
                         loff_t *offset);
 // This function is used to read from the device.
 
+ssize_t device_read_iter(struct kiocb *iocb, struct iov_iter *to);
+// This function is used to read from the device into an iterator.
+
 ssize_t device_write(struct file *file_ptr, const char *buffer, size_t length,
                         loff_t *offset);
 // This function is used to write to the device.
 
+__poll_t device_poll(struct file *file_ptr, poll_table *wait);
+// This function is used to poll the readiness of the device.
+
+int device_fasync(int fd, struct file *file_ptr, int on);
+// This function is used to enable or disable SIGIO of the device.
+
 long device_ioctl(struct file *file_ptr, unsigned int ioctl_cmd,
                     unsigned long ioctl_param);
 // This function is used to handle IOCTL requests.
 
+#ifdef HAVE_URING_CMD
+int device_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags);
+// This function is used to handle io_uring command requests.
+#endif
+
+long device_request(struct session *session, struct xioctl_request *user_request);
+// This function is used to dispatch a request from ioctl or io_uring.
+
+int device_mmap(struct file *file_ptr, struct vm_area_struct *vma);
+// This function is used to map trace buffers into user space.
+
+unsigned long pin_pages(struct page **pages, unsigned long max, void *kaddr,
+                        unsigned long size);
+// This function is used to take a reference to the kernel pages of a range.
+
+int mmap_pages(struct vm_area_struct *vma, struct page **pages,
+                unsigned long count);
+// This function is used to insert pinned kernel pages into a user mapping.
+
+int mmap_bts(struct vm_area_struct *vma, u32 pid);
+// This function is used to map the BTS header page and buffer of a process.
+
+int mmap_pt(struct vm_area_struct *vma, u32 pid);
+// This function is used to map the PT header page and buffer of a process.
+
+int mmap_lbr(struct vm_area_struct *vma, u32 pid);
+// This function is used to map the LBR snapshot ring of a process.
+
+int mmap_session(struct vm_area_struct *vma, struct session *session);
+// This function is used to map the control page of a session.
+
+#ifdef HAVE_BPF_KFUNC
+__bpf_kfunc s64 bpf_libiht_lbr_size(void);
+// This function is used to query the LBR snapshot size of the current task.
+
+__bpf_kfunc s64 bpf_libiht_lbr_read(void *buf, u32 buf__sz);
+// This function is used to read the saved LBR of the current task from BPF.
+#endif
+
+int register_kfuncs(void);
+// This function is used to register the kfuncs for BPF programs.
+
 int __init libiht_lkm_init(void);
 // This function is called when the module is loaded.
 
@@ -100,23 +212,85 @@ void __exit libiht_lkm_exit(void);
 static struct proc_ops libiht_ops = {
     .proc_open = device_open,
     .proc_release = device_release,
+#ifdef HAVE_PROC_READ_ITER
+    .proc_read_iter = device_read_iter,
+#else
     .proc_read = device_read,
+#endif
     .proc_write = device_write,
-    .proc_ioctl = device_ioctl};
+    .proc_poll = device_poll,
+    .proc_ioctl = device_ioctl,
+    .proc_mmap = device_mmap};
 #else
 static struct file_operations libiht_ops = {
     .open = device_open,
     .release = device_release,
-    .read = device_read,
+    .read_iter = device_read_iter,
+    .splice_read = generic_file_splice_read,
     .write = device_write,
-    .unlocked_ioctl = device_ioctl};
+    .poll = device_poll,
+    .fasync = device_fasync,
+    .unlocked_ioctl = device_ioctl,
+    .mmap = device_mmap};
 #endif
 
+// The proc_ops lacks fasync and uring_cmd, the misc device offers the full
+// file operations
+static struct file_operations libiht_dev_ops = {
+    .owner = THIS_MODULE,
+    .open = device_open,
+    .release = device_release,
+    .read_iter = device_read_iter,
+#ifdef HAVE_COPY_SPLICE_READ
+    .splice_read = copy_splice_read,
+#else
+    .splice_read = generic_file_splice_read,
+#endif
+    .write = device_write,
+    .poll = device_poll,
+    .fasync = device_fasync,
+    .unlocked_ioctl = device_ioctl,
+#ifdef HAVE_URING_CMD
+    .uring_cmd = device_uring_cmd,
+#endif
+    .mmap = device_mmap};
+
+// Misc device, shows up as /dev/DEVICE_NAME
+struct miscdevice libiht_misc = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = DEVICE_NAME,
+    .fops = &libiht_dev_ops,
+    .mode = 0666};
+
 // Structures for installing the tracepoint hooks.
 struct tracepoint_table traces[] = {
     {.name = "sched_switch", .func = tp_sched_switch_handler},
-    {.name = "task_newtask", .func = tp_new_task_handler}
+    {.name = "task_newtask", .func = tp_new_task_handler},
+    {.name = "sched_process_exit", .func = tp_process_exit_handler},
+    {.name = "sys_enter", .func = tp_sys_enter_handler},
+    {.name = "sys_exit", .func = tp_sys_exit_handler},
+    {.name = "signal_deliver", .func = tp_signal_deliver_handler}
 };
 
+#ifdef HAVE_BPF_KFUNC
+// Kfuncs callable from BPF tracing programs
+#ifdef HAVE_BTF_KFUNCS_START
+BTF_KFUNCS_START(libiht_kfunc_ids)
+#else
+BTF_SET8_START(libiht_kfunc_ids)
+#endif
+BTF_ID_FLAGS(func, bpf_libiht_lbr_size)
+BTF_ID_FLAGS(func, bpf_libiht_lbr_read)
+#ifdef HAVE_BTF_KFUNCS_START
+BTF_KFUNCS_END(libiht_kfunc_ids)
+#else
+BTF_SET8_END(libiht_kfunc_ids)
+#endif
+
+static const struct btf_kfunc_id_set libiht_kfunc_set = {
+    .owner = THIS_MODULE,
+    .set = &libiht_kfunc_ids};
+#endif
+
 
 #endif // _LIBIHT_LKM_H
\ No newline at end of file
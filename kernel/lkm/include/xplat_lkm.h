@@ -0,0 +1,107 @@
+#ifndef _XPLAT_LKM_H
+#define _XPLAT_LKM_H
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : kernel/lkm/include/xplat_lkm.h
+//  Description    : This is the header file for the Linux specific structures
+//                   behind the opaque cross platform structures in `xplat.h`.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : July 10, 2024
+//
+
+// Include Files
+#include "headers_lkm.h"
+#include "../../commons/xioctl.h"
+
+//
+// Library constants
+
+// Check Linux kernel version.
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+#define HAVE_KMAP_LOCAL
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0)
+#define HAVE_VMA_ITERATOR
+#define HAVE_PERF_SAMPLE_FLAGS
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+#define HAVE_HRTIMER_SETUP
+#endif
+
+// Most branches in a perf branch stack, the deepest Arch LBR
+#define XPERF_MAX_BRANCHES      64
+
+//
+// Type definitions
+
+// Define wait queue behind `char waitq[MAX_WAITQ_LEN]`. Producers run in the
+// context switch handlers with the runqueue lock held, so the wake up is
+// deferred to an irq_work instead of waking up the readers in place.
+struct xwaitq
+{
+    wait_queue_head_t head;             // Readers blocked in read and poll
+    struct irq_work work;               // Deferred wake up
+    struct fasync_struct *fasync;       // Readers asked for SIGIO
+};
+
+// Define branch stack sample of a core. The overflow handler runs in NMI,
+// so the sample is copied out and handed over to an irq_work, which runs the
+// perf backend callback with the locks usable.
+struct xperf_sample
+{
+    struct irq_work work;               // Deferred callback
+    u32 busy;                           // Sample not consumed yet
+    u32 tid;                            // Thread sampled
+    u32 nr;                             // Branches in the sample
+    struct lbr_stack_entry entries[XPERF_MAX_BRANCHES]; // Youngest first
+    u64 info[XPERF_MAX_BRANCHES];       // LBR_INFO layout of the flags
+};
+
+// Define branch stack sampling event. The event is released from a work,
+// since it may be closed with spinlocks held.
+struct xperf_event
+{
+    struct perf_event *event;           // Kernel counter
+    struct work_struct release;         // Deferred release
+};
+
+//
+// Global variables
+
+DECLARE_PER_CPU(u32, xbpf_busy);
+// The core is running the BPF snapshot hook with the LBR state locked.
+
+//
+// Function prototypes
+
+void xwaitq_work(struct irq_work *work);
+// This function is used to wake up the readers of a wait queue.
+
+void xparse_build_id(struct file *file, struct trace_mmap_record *record);
+// This function is used to read the GNU build id of a mapped ELF file.
+
+enum hrtimer_restart xtimer_handler(struct hrtimer *timer);
+// This function is used to run the callback of the periodic timer.
+
+void xperf_overflow(struct perf_event *event, struct perf_sample_data *data,
+                    struct pt_regs *regs);
+// This function is used to copy out the branch stack of a perf sample.
+
+void xperf_work(struct irq_work *work);
+// This function is used to hand a branch stack sample to the perf backend.
+
+void xperf_release(struct work_struct *work);
+// This function is used to release a branch stack sampling event.
+
+u64 xperf_branch_type(u64 lbr_select);
+// This function is used to translate a LBR_SELECT into perf branch filters.
+
+void libiht_lbr_snapshot(struct lbr_snapshot *snapshot, void *entries,
+                            u32 size);
+// This function is the attach point of BPF programs consuming LBR snapshots.
+
+#endif // _XPLAT_LKM_H
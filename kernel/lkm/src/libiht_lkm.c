@@ -19,6 +19,20 @@ MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Thomason Zhao");
 MODULE_DESCRIPTION("Intel Hardware Trace Library - Linux Kernel Module");
 
+//
+// Module parameters
+
+static bool perf_backend;
+module_param(perf_backend, bool, 0444);
+MODULE_PARM_DESC(perf_backend,
+    "Obtain the LBR through perf events instead of raw MSRs, to coexist with "
+    "other perf users");
+
+static bool bpf_snapshots;
+module_param(bpf_snapshots, bool, 0444);
+MODULE_PARM_DESC(bpf_snapshots,
+    "Hand every LBR snapshot to the libiht_lbr_snapshot hook for BPF programs");
+
 //
 // Tracepoint table helpers
 
@@ -66,7 +80,10 @@ void register_tracepoints(void) {
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : unregister_tracepoints
-// Description  : This function is used to unregister tracepoints.
+// Description  : This function is used to unregister tracepoints. It returns
+//                once the handlers running on other cores have returned,
+//                including the syscall ones that may sleep, so the states
+//                they use can be freed afterwards.
 //
 // Inputs       : void
 // Outputs      : void
@@ -81,6 +98,9 @@ void unregister_tracepoints(void) {
             traces[i].tp = NULL;
         }
     }
+
+    // Wait for the handlers still running, they use the module states
+    tracepoint_synchronize_unregister();
 }
 
 //
@@ -104,6 +124,7 @@ void tp_sched_switch_handler(void *data, bool preempt,
 {
     lbr_cswitch_handler(prev_task->pid, next_task->pid);
     bts_cswitch_handler(prev_task->pid, next_task->pid);
+    pt_cswitch_handler(prev_task->pid, next_task->pid);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -120,6 +141,142 @@ void tp_new_task_handler(void *data, struct task_struct *task)
 {
     lbr_newproc_handler(task->real_parent->pid, task->pid);
     bts_newproc_handler(task->real_parent->pid, task->pid);
+    pt_newproc_handler(task->real_parent->pid, task->pid);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tp_process_exit_handler
+// Description  : This function is the handler for the sched_process_exit
+//                event. It will be called when a task exits, so the records
+//                it left below the watermark of its sessions become readable.
+//
+// Inputs       : data - the data
+//                task - the exiting task
+// Outputs      : void
+
+void tp_process_exit_handler(void *data, struct task_struct *task)
+{
+    lbr_exitproc_handler(task->pid);
+    bts_exitproc_handler(task->pid);
+    pt_exitproc_handler(task->pid);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tp_sys_enter_handler
+// Description  : This function is the handler for the sys_enter event. It will
+//                be called in the context of a process entering a syscall. A
+//                denied syscall is skipped and fails with EPERM, since the
+//                syscall number is read again after the tracepoint. The
+//                syscall bitmaps use the x86-64 numbers, so the ia32 syscalls
+//                are not snapshot nor checked.
+//
+// Inputs       : data - the data
+//                regs - the user registers
+//                id - the syscall number
+// Outputs      : void
+
+void tp_sys_enter_handler(void *data, struct pt_regs *regs, long id)
+{
+    u32 sensitive = 1;
+
+    if (id < 0 || in_compat_syscall())
+        return;
+
+    // Memory syscalls are only sensitive when they ask for PROT_EXEC
+    if (id == __NR_mmap || id == __NR_mprotect || id == __NR_pkey_mprotect)
+        sensitive = (regs->dx & PROT_EXEC) != 0;
+
+    if (lbr_syscall_handler(current->pid, (u64)id, sensitive))
+    {
+        regs->orig_ax = -1;
+        regs->ax = -EPERM;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tp_sys_exit_handler
+// Description  : This function is the handler for the sys_exit event. It will
+//                be called in the context of a process leaving a syscall. The
+//                code it mapped by mmap, mprotect or exec is described to the
+//                sessions, the arguments are still in the saved registers.
+//                The ia32 syscalls are numbered differently and skipped.
+//
+// Inputs       : data - the data
+//                regs - the user registers
+//                ret - the syscall return value
+// Outputs      : void
+
+void tp_sys_exit_handler(void *data, struct pt_regs *regs, long ret)
+{
+    u64 start, end;
+
+    if (IS_ERR_VALUE(ret) || in_compat_syscall())
+        return;
+
+    switch (regs->orig_ax)
+    {
+        case __NR_mmap:
+            if (!(regs->dx & PROT_EXEC))
+                return;
+            start = (u64)ret;
+            end = start + regs->si;
+            break;
+        case __NR_mprotect:
+        case __NR_pkey_mprotect:
+            if (!(regs->dx & PROT_EXEC))
+                return;
+            start = regs->di;
+            end = start + regs->si;
+            break;
+        case __NR_execve:
+        case __NR_execveat:
+            start = 0;
+            end = (u64)-1;
+            break;
+        default:
+            return;
+    }
+
+    lbr_mmap_handler(current->pid, start, end);
+    bts_mmap_handler(current->pid, start, end);
+    pt_mmap_handler(current->pid, start, end);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tp_signal_deliver_handler
+// Description  : This function is the handler for the signal_deliver event. It
+//                will be called in the context of the process a signal is
+//                delivered to. Signals left to their default action that dump
+//                core are fatal, so the branch history is captured here.
+//
+// Inputs       : data - the data
+//                sig - the signal number
+//                info - the signal information
+//                ka - the signal action
+// Outputs      : void
+
+#ifdef HAVE_KERNEL_SIGINFO
+void tp_signal_deliver_handler(void *data, int sig, struct kernel_siginfo *info,
+                                struct k_sigaction *ka)
+#else
+void tp_signal_deliver_handler(void *data, int sig, struct siginfo *info,
+                                struct k_sigaction *ka)
+#endif
+{
+    u64 addr = 0;
+
+    if (ka->sa.sa_handler != SIG_DFL || !sig_kernel_coredump(sig))
+        return;
+
+    // Only the fault signals carry a meaningful address
+    if (sig == SIGSEGV || sig == SIGBUS || sig == SIGILL || sig == SIGFPE)
+        addr = (u64)info->si_addr;
+
+    crash_signal_handler(current->pid, (u32)sig, addr);
 }
 
 //
@@ -129,16 +286,23 @@ void tp_new_task_handler(void *data, struct task_struct *task)
 //
 // Function     : device_open
 // Description  : This function is used to handle open request for the device
-//                process.
+//                process. Each opened file gets its own session, the trace
+//                states enabled through it are streamed out by read.
 //
 // Inputs       : inode - the inode
 //                file_ptr - the file pointer
-// Outputs      : int - status of the open. 0 if success, -1 if fail.
+// Outputs      : int - status of the open. 0 if success, error code if fail.
 
 int device_open(struct inode *inode, struct file *file_ptr)
 {
-    // Reserved for future use
+    struct session *session;
+
     xprintdbg(KERN_INFO "LIBIHT_LKM: device_open\n");
+    session = create_session();
+    if (session == NULL)
+        return -ENOMEM;
+
+    file_ptr->private_data = session;
     return 0;
 }
 
@@ -146,7 +310,10 @@ int device_open(struct inode *inode, struct file *file_ptr)
 //
 // Function     : device_release
 // Description  : This function is used to handle close request for the device
-//                process.
+//                process. The session unsubscribes from its trace states, the
+//                ones left without subscribers are removed and the session is
+//                freed, so a consumer that exits or crashes never leaves its
+//                processes traced.
 //
 // Inputs       : inode - the inode
 //                file_ptr - the file pointer
@@ -154,8 +321,14 @@ int device_open(struct inode *inode, struct file *file_ptr)
 
 int device_release(struct inode *inode, struct file *file_ptr)
 {
-    // Reserved for future use
+    struct session *session = file_ptr->private_data;
+
     xprintdbg(KERN_INFO "LIBIHT_LKM: device_release\n");
+    release_lbr_session(session);
+    release_bts_session(session);
+    release_pt_session(session);
+    device_fasync(-1, file_ptr, 0);
+    free_session(session);
     return 0;
 }
 
@@ -163,20 +336,100 @@ int device_release(struct inode *inode, struct file *file_ptr)
 //
 // Function     : device_read
 // Description  : This function is used to read handle request for the device
-//                process.
+//                process. It wraps the user buffer into an iterator for
+//                device_read_iter, for the kernels without proc_read_iter.
 //
 // Inputs       : file_ptr - the file pointer
 //                buffer - the buffer
 //                length - the length
 //                offset - the offset
-// Outputs      : ssize_t - the size of the read
+// Outputs      : ssize_t - the size of the read, error code if fail
 
 ssize_t device_read(struct file *file_ptr, char *buffer, size_t length,
                         loff_t *offset)
 {
-    // Reserved for future use
-    xprintdbg(KERN_INFO "LIBIHT_LKM: device_read\n");
-    return 0;
+    struct iovec iov = {.iov_base = buffer, .iov_len = length};
+    struct kiocb kiocb;
+    struct iov_iter iter;
+
+    init_sync_kiocb(&kiocb, file_ptr);
+    iov_iter_init(&iter, READ, &iov, 1, length);
+    return device_read_iter(&kiocb, &iter);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : device_read_iter
+// Description  : This function is used to read handle request for the device
+//                process. It streams the records drained into the session,
+//                see `struct trace_record_header`. It blocks until the
+//                readable bytes reach the watermark, or the session is
+//                flushed, and for another reader to release the buffer,
+//                while a non-blocking read returns whatever is buffered or
+//                -EAGAIN. A record may be split across reads, the rest
+//                of a partially read record is returned without waiting. Pipe
+//                iterators are supported, so the session can be spliced into
+//                a pipe without passing through user space.
+//
+// Inputs       : iocb - the kernel io control block
+//                to - the destination iterator
+// Outputs      : ssize_t - the size of the read, error code if fail
+
+ssize_t device_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct file *file_ptr = iocb->ki_filp;
+    struct session *session = file_ptr->private_data;
+    struct xwaitq *waitq = (struct xwaitq *)session->waitq;
+    void *chunk;
+    size_t copied = 0, done;
+    u64 size;
+    bool nonblock;
+    int ret;
+
+    nonblock = (file_ptr->f_flags & O_NONBLOCK) ||
+                (iocb->ki_flags & IOCB_NOWAIT);
+    do
+    {
+        // A non-blocking read takes the bytes below the watermark too
+        if (nonblock)
+        {
+            if (!session_pending(session))
+                return -EAGAIN;
+        }
+        else
+        {
+            // Wait for the readable bytes to reach the watermark, or for
+            // nothing if a record is partially read
+            ret = wait_event_interruptible(waitq->head,
+                                            session_readable(session));
+            if (ret)
+                return ret;
+        }
+
+        while (iov_iter_count(to))
+        {
+            size = session_peek(session, &chunk);
+            if (size == 0)
+                break;
+
+            done = copy_to_iter(chunk, size, to);
+            session_consume(session, done);
+            copied += done;
+            if (done < size)
+            {
+                // Destination is full or faulted
+                if (copied == 0)
+                    return -EFAULT;
+                break;
+            }
+        }
+
+        // Another reader took the chunk first, wait for it to be released
+    } while (copied == 0 && iov_iter_count(to) && !nonblock);
+
+    if (copied == 0 && iov_iter_count(to))
+        return -EAGAIN;
+    return copied;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -199,6 +452,44 @@ ssize_t device_write(struct file *file_ptr, const char *buffer, size_t length,
     return 0;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : device_poll
+// Description  : This function is used to handle poll request for the device
+//                process. The device is readable once the readable bytes of
+//                the session reach the watermark, or the session is flushed.
+//
+// Inputs       : file_ptr - the file pointer
+//                wait - the poll table
+// Outputs      : __poll_t - the poll event mask
+
+__poll_t device_poll(struct file *file_ptr, poll_table *wait)
+{
+    struct session *session = file_ptr->private_data;
+
+    poll_wait(file_ptr, &((struct xwaitq *)session->waitq)->head, wait);
+    return session_readable(session) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : device_fasync
+// Description  : This function is used to handle fasync request for the device
+//                process. SIGIO is sent when the watermark is reached.
+//
+// Inputs       : fd - the file descriptor
+//                file_ptr - the file pointer
+//                on - enable or disable
+// Outputs      : int - status of the fasync. 0 if success, error code if fail.
+
+int device_fasync(int fd, struct file *file_ptr, int on)
+{
+    struct session *session = file_ptr->private_data;
+
+    return fasync_helper(fd, file_ptr, on,
+                            &((struct xwaitq *)session->waitq)->fasync);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : device_ioctl
@@ -212,14 +503,61 @@ ssize_t device_write(struct file *file_ptr, const char *buffer, size_t length,
 
 long device_ioctl(struct file *file_ptr, unsigned int ioctl_cmd,
                     unsigned long ioctl_param)
+{
+    return device_request(file_ptr->private_data,
+                            (struct xioctl_request *)ioctl_param);
+}
+
+#ifdef HAVE_URING_CMD
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : device_uring_cmd
+// Description  : This function is used to handle io_uring command request for
+//                the device process. The command carries the same request as
+//                ioctl, so requests can be submitted in batches and completed
+//                asynchronously. The request is processed inline and its
+//                status is posted as the completion result.
+//
+// Inputs       : ioucmd - the io_uring command
+//                issue_flags - the io_uring issue flags
+// Outputs      : int - the status of the request
+
+int device_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+    const struct libiht_uring_cmd *cmd;
+
+    if (ioucmd->cmd_op != LIBIHT_LKM_IOCTL_BASE)
+        return -ENOTTY;
+
+#ifdef HAVE_IO_URING_SQE_CMD
+    cmd = io_uring_sqe_cmd(ioucmd->sqe);
+#else
+    cmd = ioucmd->cmd;
+#endif
+
+    return device_request(ioucmd->file->private_data,
+                    (struct xioctl_request *)(unsigned long)READ_ONCE(cmd->request));
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : device_request
+// Description  : This function is used to copy in and dispatch a request from
+//                the ioctl or io_uring command of the device process.
+//
+// Inputs       : session - the session of the opened file
+//                user_request - the user space request
+// Outputs      : long - the status of the request
+
+long device_request(struct session *session, struct xioctl_request *user_request)
 {
     struct xioctl_request request;
     unsigned long request_size_left;
     long ret_val = 0;
 
     // Copy user request
-    request_size_left = copy_from_user(&request, 
-                        (struct xioctl_request *)ioctl_param,
+    request_size_left = copy_from_user(&request, user_request,
                         sizeof(struct xioctl_request));
     if (request_size_left != 0)
     {
@@ -229,31 +567,398 @@ long device_ioctl(struct file *file_ptr, unsigned int ioctl_cmd,
     }
 
     // Process request
-    if (request.cmd <= LIBIHT_IOCTL_LBR_END)
+    if (request.cmd > LIBIHT_IOCTL_BATCH_END)
     {
-        // LBR request
-        xprintdbg(KERN_INFO "LIBIHT-LKM: LBR request\n");
-        ret_val = lbr_ioctl_handler(&request);
+        // Unknown request
+        xprintdbg(KERN_INFO "LIBIHT-LKM: Unknown request\n");
+        return -EINVAL;
     }
-    else if (request.cmd <= LIBIHT_IOCTL_BTS_END)
+    ret_val = xioctl_handler(session, &request);
+
+    return ret_val;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : device_mmap
+// Description  : This function is used to handle mmap request for the device
+//                process. The mmap offset selects the region type and the
+//                process id, see `LIBIHT_MMAP_OFFSET`.
+//
+// Inputs       : file_ptr - the file pointer
+//                vma - the user virtual memory area
+// Outputs      : int - status of the mmap. 0 if success, error code if fail.
+
+int device_mmap(struct file *file_ptr, struct vm_area_struct *vma)
+{
+    u32 type, pid;
+
+    type = (u32)(vma->vm_pgoff >> 32);
+    pid = (u32)(vma->vm_pgoff & 0xffffffff);
+    xprintdbg(KERN_INFO "LIBIHT-LKM: mmap region %d for pid %d\n", type, pid);
+
+    // The trace of another process is only mapped to those allowed to trace it
+    if (type != LIBIHT_MMAP_SESSION && pid && !xtrace_allowed(pid))
+        return -EPERM;
+
+    switch (type)
     {
-        // BTS request
-        xprintdbg(KERN_INFO "LIBIHT-LKM: BTS request\n");
-        ret_val = bts_ioctl_handler(&request);
+        case LIBIHT_MMAP_BTS:
+            return mmap_bts(vma, pid ? pid : current->pid);
+        case LIBIHT_MMAP_LBR:
+            return mmap_lbr(vma, pid ? pid : current->pid);
+        case LIBIHT_MMAP_SESSION:
+            return mmap_session(vma, file_ptr->private_data);
+        case LIBIHT_MMAP_PT:
+            return mmap_pt(vma, pid ? pid : current->pid);
+        default:
+            return -EINVAL;
     }
-    else
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pin_pages
+// Description  : This function is used to take a reference to each kernel
+//                page of a range, so the pages stay valid while they are
+//                inserted into a user mapping after the lock of their trace
+//                state is released. It never sleeps.
+//
+// Inputs       : pages - the array to fill with the pages
+//                max - the size of the array
+//                kaddr - the page aligned kernel address
+//                size - the size to be pinned
+// Outputs      : unsigned long - the number of pages pinned
+
+unsigned long pin_pages(struct page **pages, unsigned long max, void *kaddr,
+                        unsigned long size)
+{
+    unsigned long i;
+
+    for (i = 0; i < max && i < PAGE_ALIGN(size) / PAGE_SIZE; i++)
     {
-        // Unknown request
-        xprintdbg(KERN_INFO "LIBIHT-LKM: Unknown request\n");
-        ret_val = -EINVAL;
+        pages[i] = virt_to_page((char *)kaddr + i * PAGE_SIZE);
+        get_page(pages[i]);
     }
 
-    return ret_val;
+    return i;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mmap_pages
+// Description  : This function is used to insert pinned kernel pages into a
+//                user mapping, then drop the pins. Each inserted page holds a
+//                reference, so the pages stay valid until unmapped even if the
+//                trace state is freed.
+//
+// Inputs       : vma - the user virtual memory area
+//                pages - the pinned pages
+//                count - the number of pages
+// Outputs      : int - status of the mapping. 0 if success, error code if fail.
+
+int mmap_pages(struct vm_area_struct *vma, struct page **pages,
+                unsigned long count)
+{
+    unsigned long i;
+    int ret = 0;
+
+    for (i = 0; i < count; i++)
+    {
+        if (ret == 0)
+            ret = vm_insert_page(vma, vma->vm_start + i * PAGE_SIZE, pages[i]);
+        put_page(pages[i]);
+    }
+
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mmap_bts
+// Description  : This function is used to map the BTS header page followed by
+//                the BTS buffer of a process read-only into user space.
+//                Mappings are not updated when the buffer is reconfigured.
+//                The pages are pinned under the `bts_state_lock` and inserted
+//                once it is released, since inserting them may sleep.
+//
+// Inputs       : vma - the user virtual memory area
+//                pid - the process id
+// Outputs      : int - status of the mapping. 0 if success, error code if fail.
+
+int mmap_bts(struct vm_area_struct *vma, u32 pid)
+{
+    struct bts_state *state;
+    struct page **pages;
+    unsigned long size, count;
+    char irql_flag[MAX_IRQL_LEN];
+    int ret;
+
+    // Trace buffers are only written by hardware
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+#ifdef HAVE_VM_FLAGS_SET
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+    size = vma->vm_end - vma->vm_start;
+    pages = kvmalloc_array(size / PAGE_SIZE, sizeof(struct page *), GFP_KERNEL);
+    if (pages == NULL)
+        return -ENOMEM;
+
+    xacquire_lock(bts_state_lock, irql_flag);
+
+    state = find_bts_state(pid);
+    if (state == NULL)
+    {
+        xrelease_lock(bts_state_lock, irql_flag);
+        kvfree(pages);
+        xprintdbg(KERN_INFO "LIBIHT-LKM: BTS not enabled for pid %d\n", pid);
+        return -ENOENT;
+    }
+
+    if (size > PAGE_SIZE + PAGE_ALIGN(state->config.bts_buffer_size))
+    {
+        xrelease_lock(bts_state_lock, irql_flag);
+        kvfree(pages);
+        return -EINVAL;
+    }
+
+    count = pin_pages(pages, size / PAGE_SIZE, state->header, PAGE_SIZE);
+    count += pin_pages(pages + count, size / PAGE_SIZE - count,
+                        (void *)state->ds_area->bts_buffer_base, state->config.bts_buffer_size);
+
+    xrelease_lock(bts_state_lock, irql_flag);
+
+    ret = mmap_pages(vma, pages, count);
+    kvfree(pages);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mmap_pt
+// Description  : This function is used to map the PT header page followed by
+//                the PT output buffer of a process read-only into user space.
+//                Mappings are not updated when the buffer is reconfigured.
+//                The pages are pinned under the `pt_state_lock` and inserted
+//                once it is released, since inserting them may sleep.
+//
+// Inputs       : vma - the user virtual memory area
+//                pid - the process id
+// Outputs      : int - status of the mapping. 0 if success, error code if fail.
+
+int mmap_pt(struct vm_area_struct *vma, u32 pid)
+{
+    struct pt_state *state;
+    struct page **pages;
+    unsigned long size, count;
+    char irql_flag[MAX_IRQL_LEN];
+    int ret;
+
+    // Trace buffers are only written by hardware
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+#ifdef HAVE_VM_FLAGS_SET
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+    size = vma->vm_end - vma->vm_start;
+    pages = kvmalloc_array(size / PAGE_SIZE, sizeof(struct page *), GFP_KERNEL);
+    if (pages == NULL)
+        return -ENOMEM;
+
+    xacquire_lock(pt_state_lock, irql_flag);
+
+    state = find_pt_state(pid);
+    if (state == NULL)
+    {
+        xrelease_lock(pt_state_lock, irql_flag);
+        kvfree(pages);
+        xprintdbg(KERN_INFO "LIBIHT-LKM: PT not enabled for pid %d\n", pid);
+        return -ENOENT;
+    }
+
+    if (size > PAGE_SIZE + PAGE_ALIGN(state->config.pt_buffer_size))
+    {
+        xrelease_lock(pt_state_lock, irql_flag);
+        kvfree(pages);
+        return -EINVAL;
+    }
+
+    count = pin_pages(pages, size / PAGE_SIZE, state->header, PAGE_SIZE);
+    count += pin_pages(pages + count, size / PAGE_SIZE - count,
+                        state->buffer, state->config.pt_buffer_size);
+
+    xrelease_lock(pt_state_lock, irql_flag);
+
+    ret = mmap_pages(vma, pages, count);
+    kvfree(pages);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mmap_lbr
+// Description  : This function is used to map the LBR snapshot ring of a
+//                process into user space. The mapping is writable, since the
+//                consumer publishes its tail index in the header page. The
+//                pages are pinned under the `lbr_state_lock` and inserted once
+//                it is released, since inserting them may sleep.
+//
+// Inputs       : vma - the user virtual memory area
+//                pid - the process id
+// Outputs      : int - status of the mapping. 0 if success, error code if fail.
+
+int mmap_lbr(struct vm_area_struct *vma, u32 pid)
+{
+    struct lbr_state *state;
+    struct page **pages;
+    unsigned long size, count;
+    char irql_flag[MAX_IRQL_LEN];
+    int ret;
+
+    size = vma->vm_end - vma->vm_start;
+    pages = kvmalloc_array(size / PAGE_SIZE, sizeof(struct page *), GFP_KERNEL);
+    if (pages == NULL)
+        return -ENOMEM;
+
+    xacquire_lock(lbr_state_lock, irql_flag);
+
+    state = find_lbr_state(pid);
+    if (state == NULL)
+    {
+        xrelease_lock(lbr_state_lock, irql_flag);
+        kvfree(pages);
+        xprintdbg(KERN_INFO "LIBIHT-LKM: LBR not enabled for pid %d\n", pid);
+        return -ENOENT;
+    }
+
+    if (size > PAGE_SIZE + PAGE_ALIGN(state->ring_slots * state->ring_slot_size))
+    {
+        xrelease_lock(lbr_state_lock, irql_flag);
+        kvfree(pages);
+        return -EINVAL;
+    }
+
+    count = pin_pages(pages, size / PAGE_SIZE, state->ring,
+                        PAGE_SIZE + state->ring_slots * state->ring_slot_size);
+
+    xrelease_lock(lbr_state_lock, irql_flag);
+
+    ret = mmap_pages(vma, pages, count);
+    kvfree(pages);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mmap_session
+// Description  : This function is used to map the control page of the session
+//                into user space. The mapping is writable, since the traced
+//                process flips the tracing gate with a plain store.
+//
+// Inputs       : vma - the user virtual memory area
+//                session - the session of the file
+// Outputs      : int - status of the mapping. 0 if success, error code if fail.
+
+int mmap_session(struct vm_area_struct *vma, struct session *session)
+{
+    struct page *page;
+
+    if (vma->vm_end - vma->vm_start > PAGE_SIZE)
+        return -EINVAL;
+
+    // The control page lives as long as the file
+    pin_pages(&page, 1, session->control, PAGE_SIZE);
+    return mmap_pages(vma, &page, 1);
 }
 
 //
 // Module initialization and cleanup functions
 
+//
+// BPF kfuncs
+
+#ifdef HAVE_BPF_KFUNC
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bpf_libiht_lbr_size
+// Description  : Kfunc querying the size of the LBR snapshot record of the
+//                current task, to size the buffer of bpf_libiht_lbr_read.
+//
+// Inputs       : void
+// Outputs      : s64 - the size of the record, -ENOENT if the LBR is not
+//                enabled for the current task, -EBUSY if the LBR state is
+//                locked
+
+__bpf_kfunc s64 bpf_libiht_lbr_size(void)
+{
+    s64 ret;
+
+    // The LBR state lock is not NMI safe, and the hook already holds it
+    if (in_nmi() || this_cpu_read(xbpf_busy))
+        return -EBUSY;
+
+    ret = read_lbr_snapshot(current->pid, NULL, 0);
+    if (ret == LBR_SNAPSHOT_BUSY)
+        return -EBUSY;
+    return ret < 0 ? -ENOENT : ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bpf_libiht_lbr_read
+// Description  : Kfunc reading the saved LBR of the current task into a BPF
+//                buffer, as a lbr_snapshot followed by the LBR entries and,
+//                with LIBIHT_LBR_INFO, the LBR_INFO array.
+//
+// Inputs       : buf - the buffer, a map value or stack memory
+//                buf__sz - the size of the buffer
+// Outputs      : s64 - the size of the record, -ENOENT if the LBR is not
+//                enabled for the current task, -ENOSPC if the buffer is too
+//                small, -EBUSY if the LBR state is locked
+
+__bpf_kfunc s64 bpf_libiht_lbr_read(void *buf, u32 buf__sz)
+{
+    s64 ret;
+
+    if (in_nmi() || this_cpu_read(xbpf_busy))
+        return -EBUSY;
+
+    // A program attached within a holder of the lock must not spin on it
+    ret = read_lbr_snapshot(current->pid, buf, buf__sz);
+    if (ret == LBR_SNAPSHOT_BUSY)
+        return -EBUSY;
+    if (ret == LBR_SNAPSHOT_SMALL)
+        return -ENOSPC;
+    return ret < 0 ? -ENOENT : ret;
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : register_kfuncs
+// Description  : Register the kfuncs for BPF tracing programs. The kfuncs are
+//                only available with module BTF, and are unregistered along
+//                with the module BTF on unload.
+//
+// Inputs       : void
+// Outputs      : int - 0 if success, error code if fail
+
+int register_kfuncs(void)
+{
+#ifdef HAVE_BPF_KFUNC
+    return register_btf_kfunc_id_set(BPF_PROG_TYPE_TRACING, &libiht_kfunc_set);
+#else
+    return 0;
+#endif
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : libiht_lkm_init
@@ -276,18 +981,41 @@ int __init libiht_lkm_init(void)
         return -1;
     }
 
+    // Create the misc device for the file operations proc lacks
+    xprintdbg(KERN_INFO "LIBIHT-LKM: Registering misc device...\n");
+    if (misc_register(&libiht_misc)) {
+        xprintdbg(KERN_INFO "LIBIHT-LKM: Register misc device failed\n");
+        proc_remove(proc_entry);
+        return -1;
+    }
+
     // Register tracepoint hooks for context swtich and fork
     xprintdbg(KERN_INFO "LIBIHT_LKM: Registering tracepoints...\n");
     register_tracepoints();
 
     // Init LBR
     xprintdbg(KERN_INFO "LIBIHT_LKM: Initilizing LBR...\n");
+    lbr_use_perf = perf_backend;
+    lbr_use_bpf = bpf_snapshots;
     lbr_init();
 
+    // Expose the saved LBR to BPF programs
+    xprintdbg(KERN_INFO "LIBIHT_LKM: Registering kfuncs...\n");
+    if (register_kfuncs())
+        xprintdbg(KERN_INFO "LIBIHT-LKM: Register kfuncs failed\n");
+
     // Init BTS
     xprintdbg(KERN_INFO "LIBIHT_LKM: Initilizing BTS...\n");
     bts_init();
 
+    // Init PT
+    xprintdbg(KERN_INFO "LIBIHT_LKM: Initilizing PT...\n");
+    pt_init();
+
+    // Init crash slots
+    xprintdbg(KERN_INFO "LIBIHT_LKM: Initilizing crash slots...\n");
+    crash_init();
+
     xprintdbg(KERN_INFO "LIBIHT_LKM: Initilized\n");
     return 0;
 }
@@ -306,6 +1034,18 @@ void __exit libiht_lkm_exit(void)
 {
     xprintdbg(KERN_INFO "LIBIHT_LKM: Exiting...\n");
 
+    // Unregister tracepoints first, so no handler runs while exiting
+    xprintdbg(KERN_INFO "LIBIHT_LKM: Unregistering tracepoints...\n");
+    unregister_tracepoints();
+
+    // Exit crash slots
+    xprintdbg(KERN_INFO "LIBIHT_LKM: Exiting crash slots...\n");
+    crash_exit();
+
+    // Exit PT
+    xprintdbg(KERN_INFO "LIBIHT_LKM: Exiting PT...\n");
+    pt_exit();
+
     // Exit BTS
     xprintdbg(KERN_INFO "LIBIHT_LKM: Exiting BTS...\n");
     bts_exit();
@@ -314,9 +1054,9 @@ void __exit libiht_lkm_exit(void)
     xprintdbg(KERN_INFO "LIBIHT_LKM: Exiting LBR...\n");
     lbr_exit();
 
-    // Unregister tracepoints
-    xprintdbg(KERN_INFO "LIBIHT_LKM: Unregistering tracepoints...\n");
-    unregister_tracepoints();
+    // Remove the misc device
+    xprintdbg(KERN_INFO "LIBIHT_LKM: Removing misc device...\n");
+    misc_deregister(&libiht_misc);
 
     // Remove the helper process if exist
     xprintdbg(KERN_INFO "LIBIHT_LKM: Removing helper process...\n");
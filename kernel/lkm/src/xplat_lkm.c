@@ -9,7 +9,44 @@
 //
 
 #include "../../commons/xplat.h"
+#include "../../commons/xioctl.h"
 #include "../include/headers_lkm.h"
+#include "../include/xplat_lkm.h"
+
+//
+// Cross-platform global variables
+
+struct xprobe_ops xprobe_hw = { xcpuid_count, xrdmsr };
+// The hardware CPU feature probing backend.
+
+struct xprobe_ops *xprobe = &xprobe_hw;
+// The CPU feature probing backend in use.
+
+struct hrtimer xtimer;
+// The periodic timer.
+
+u32 (*xtimer_func)(void);
+// The callback of the periodic timer, NULL if not set up.
+
+u64 xtimer_period;
+// The period of the periodic timer in nanoseconds.
+
+DEFINE_PER_CPU(struct xperf_sample, xperf_samples);
+// The branch stack sample of each core, for the perf backend.
+
+struct workqueue_struct *xperf_wq;
+// The workqueue releasing the perf events.
+
+DEFINE_RATELIMIT_STATE(xprint_ratelimit_state, DEFAULT_RATELIMIT_INTERVAL,
+                        DEFAULT_RATELIMIT_BURST);
+// The rate limit of the debug messages a traced process can trigger.
+
+DEFINE_PER_CPU(u32, xbpf_busy);
+// The core is running the BPF snapshot hook with the LBR state locked.
+
+void (*xperf_func)(u32 tid, u32 nr, struct lbr_stack_entry *entries,
+                    u64 *info);
+// The perf backend callback receiving the branch stack samples.
 
 //
 // Cross-platform functions
@@ -45,6 +82,37 @@ void xfree(void *ptr)
     kfree(ptr);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xmalloc_pages
+// Description  : Cross platform kernel page aligned malloc function. Allocate
+//                zeroed pages that can be mapped into user space. The sizes
+//                come from user requests, so a failure is not warned about.
+//
+// Inputs       : size - size of the memory to be allocated.
+// Outputs      : void * - pointer to the allocated memory.
+
+void *xmalloc_pages(u64 size)
+{
+    return alloc_pages_exact(PAGE_ALIGN(size),
+                                GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xfree_pages
+// Description  : Cross platform kernel page aligned free function. Pages still
+//                mapped into user space are released on unmap.
+//
+// Inputs       : ptr - pointer to the memory to be freed.
+//                size - size of the memory to be freed.
+// Outputs      : void
+
+void xfree_pages(void *ptr, u64 size)
+{
+    free_pages_exact(ptr, PAGE_ALIGN(size));
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : xcopy_from_user
@@ -109,6 +177,20 @@ void *xmemcpy(void *dst, void *src, u64 cnt)
     return memcpy(dst, src, cnt);
 } 
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xvirt_to_phys
+// Description  : Cross platform kernel virtual to physical address function.
+//                Only valid for the memory allocated by `xmalloc_pages`.
+//
+// Inputs       : addr - the kernel virtual address.
+// Outputs      : u64 - the physical address.
+
+u64 xvirt_to_phys(void *addr)
+{
+    return virt_to_phys(addr);
+}
+
 //
 // CPU core, hardware, register read/write functions
 
@@ -181,6 +263,20 @@ u32 xcoreid(void)
     return smp_processor_id();
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xcore_count
+// Description  : Cross platform get number of core ids function. Every core
+//                id is below this number.
+//
+// Inputs       : void
+// Outputs      : u32 - number of core ids.
+
+u32 xcore_count(void)
+{
+    return nr_cpu_ids;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : xgetcurrent_pid
@@ -194,6 +290,94 @@ u32 xgetcurrent_pid(void)
     return current->pid;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xtrace_allowed
+// Description  : Cross platform check of the permission to trace a process,
+//                the rule of ptrace_may_access for PTRACE_MODE_READ_REALCREDS,
+//                which is not exported to modules. The current process may
+//                trace itself, the processes of the same real user and group
+//                that are dumpable, or any process with CAP_SYS_PTRACE.
+//
+// Inputs       : pid - the process id
+// Outputs      : u32 - 1 if the current process may trace it, else 0
+
+u32 xtrace_allowed(u32 pid)
+{
+    const struct cred *cred, *tcred;
+    struct task_struct *task;
+    u32 allowed = 0;
+
+    if (pid == current->pid || capable(CAP_SYS_PTRACE))
+        return 1;
+
+    rcu_read_lock();
+    task = pid_task(find_vpid(pid), PIDTYPE_PID);
+    if (task)
+    {
+        cred = current_cred();
+        tcred = __task_cred(task);
+        allowed = uid_eq(cred->uid, tcred->euid) &&
+                    uid_eq(cred->uid, tcred->suid) &&
+                    uid_eq(cred->uid, tcred->uid) &&
+                    gid_eq(cred->gid, tcred->egid) &&
+                    gid_eq(cred->gid, tcred->sgid) &&
+                    gid_eq(cred->gid, tcred->gid);
+
+        // A setuid process is not dumpable, even to its real user
+        task_lock(task);
+        if (task->mm && get_dumpable(task->mm) != SUID_DUMP_USER)
+            allowed = 0;
+        task_unlock(task);
+    }
+    rcu_read_unlock();
+
+    return allowed;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xgetcurrent_owner
+// Description  : Cross platform get the owner of the current process, i.e.
+//                its real user and group, so it can be checked by
+//                `xowner_allowed` once the process is gone. A process with
+//                mixed credentials or not dumpable, e.g. a setuid one, has no
+//                owner, like `xtrace_allowed` would refuse it.
+//
+// Inputs       : void
+// Outputs      : u64 - the owner, or XOWNER_NONE
+
+u64 xgetcurrent_owner(void)
+{
+    const struct cred *cred = current_cred();
+
+    if (!uid_eq(cred->uid, cred->euid) || !uid_eq(cred->uid, cred->suid) ||
+        !gid_eq(cred->gid, cred->egid) || !gid_eq(cred->gid, cred->sgid))
+        return XOWNER_NONE;
+    if (current->mm && get_dumpable(current->mm) != SUID_DUMP_USER)
+        return XOWNER_NONE;
+
+    return ((u64)__kgid_val(cred->gid) << 32) | __kuid_val(cred->uid);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xowner_allowed
+// Description  : Cross platform check of the permission to trace the
+//                processes of an owner from `xgetcurrent_owner`, the same real
+//                user and group, or CAP_SYS_PTRACE.
+//
+// Inputs       : owner - the owner
+// Outputs      : u32 - 1 if the current process may trace it, else 0
+
+u32 xowner_allowed(u64 owner)
+{
+    if (capable(CAP_SYS_PTRACE))
+        return 1;
+
+    return owner != XOWNER_NONE && owner == xgetcurrent_owner();
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : xcpuid
@@ -207,6 +391,61 @@ void xcpuid(u32 func_id, u32 *eax, u32 *ebx, u32 *ecx, u32 *edx)
     cpuid(func_id, eax, ebx, ecx, edx);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xcpuid_count
+// Description  : Cross platform cpuid with sub-leaf function. Get the cpuid
+//                information of a sub-leaf.
+//
+// Inputs       : func_id - function id.
+//                sub_id - sub-leaf id.
+// Outputs      : void
+
+void xcpuid_count(u32 func_id, u32 sub_id, u32 *eax, u32 *ebx, u32 *ecx,
+                    u32 *edx)
+{
+    cpuid_count(func_id, sub_id, eax, ebx, ecx, edx);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xsaves_area
+// Description  : Cross platform XSAVES function. Save the supervisor states
+//                of the mask into a 64-byte aligned area in compacted format.
+//
+// Inputs       : area - the XSAVE area.
+//                mask - the state components to save.
+// Outputs      : void
+
+void xsaves_area(void *area, u64 mask)
+{
+    u32 lo = (u32)mask;
+    u32 hi = (u32)(mask >> 32);
+
+    asm volatile("xsaves64 (%[area])"
+                 : : [area] "D" (area), "a" (lo), "d" (hi) : "memory");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xrstors_area
+// Description  : Cross platform XRSTORS function. Restore the supervisor
+//                states of the mask from a 64-byte aligned area in compacted
+//                format.
+//
+// Inputs       : area - the XSAVE area.
+//                mask - the state components to restore.
+// Outputs      : void
+
+void xrstors_area(void *area, u64 mask)
+{
+    u32 lo = (u32)mask;
+    u32 hi = (u32)(mask >> 32);
+
+    asm volatile("xrstors64 (%[area])"
+                 : : [area] "D" (area), "a" (lo), "d" (hi) : "memory");
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : xon_each_cpu
@@ -221,6 +460,83 @@ void xon_each_cpu(void (*func)(void))
     on_each_cpu((void *)(void *)func, NULL, 1);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xon_each_cpu_arg
+// Description  : Cross platform on each cpu function with an argument.
+//                Dispatch a function on each cpu and wait for all of them. It
+//                must not be called with interrupts disabled, i.e. with a
+//                state lock held.
+//
+// Inputs       : func - function to be run.
+//                arg - argument passed to the function.
+// Outputs      : void
+
+void xon_each_cpu_arg(void (*func)(void *), void *arg)
+{
+    on_each_cpu(func, arg, 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xset_probe_ops
+// Description  : Cross platform set CPU feature probing backend function.
+//                NULL restores the hardware backend.
+//
+// Inputs       : ops - the probing backend.
+// Outputs      : void
+
+void xset_probe_ops(struct xprobe_ops *ops)
+{
+    xprobe = ops ? ops : &xprobe_hw;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xrdtsc
+// Description  : Cross platform read timestamp counter function.
+//
+// Inputs       : void
+// Outputs      : u64 - current timestamp counter.
+
+u64 xrdtsc(void)
+{
+    return rdtsc();
+}
+
+//
+// Memory ordering functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xload_acquire
+// Description  : Cross platform load acquire function. Read a value that is
+//                published by another core, later accesses are not reordered
+//                before it.
+//
+// Inputs       : ptr - pointer to the value.
+// Outputs      : u64 - the value read.
+
+u64 xload_acquire(u64 *ptr)
+{
+    return smp_load_acquire(ptr);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xstore_release
+// Description  : Cross platform store release function. Publish a value to
+//                another core, earlier accesses are not reordered after it.
+//
+// Inputs       : ptr - pointer to the value.
+//                val - value to be stored.
+// Outputs      : void
+
+void xstore_release(u64 *ptr, u64 val)
+{
+    smp_store_release(ptr, val);
+}
+
 //
 // Lock functions
 
@@ -251,6 +567,23 @@ void xacquire_lock(void *lock, void *old_irql)
     spin_lock_irqsave((spinlock_t *)lock, *(unsigned long *)old_irql);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xtry_acquire_lock
+// Description  : Cross platform acquire lock without spinning function. Acquire
+//                a lock if it is free, e.g. from a context that may have
+//                interrupted its holder on the same core.
+//
+// Inputs       : lock - pointer to the lock to be acquired.
+//                old_irql - pointer to the old IRQL.
+// Outputs      : s32 - 0 if acquired, -1 if the lock is held.
+
+s32 xtry_acquire_lock(void *lock, void *old_irql)
+{
+    return spin_trylock_irqsave((spinlock_t *)lock,
+                                *(unsigned long *)old_irql) ? 0 : -1;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : xrelease_lock
@@ -265,6 +598,74 @@ void xrelease_lock(void *lock, void *new_irql)
     spin_unlock_irqrestore((spinlock_t *)lock, *(unsigned long *)new_irql);
 }
 
+//
+// Wait queue functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xwaitq_work
+// Description  : Deferred wake up of a wait queue. Wake up the readers blocked
+//                in read or poll, and signal the readers asked for SIGIO.
+//
+// Inputs       : work - pointer to the irq_work of the wait queue.
+// Outputs      : void
+
+void xwaitq_work(struct irq_work *work)
+{
+    struct xwaitq *waitq = container_of(work, struct xwaitq, work);
+
+    wake_up_interruptible(&waitq->head);
+    kill_fasync(&waitq->fasync, SIGIO, POLL_IN);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xinit_waitq
+// Description  : Cross platform init wait queue function. Initialize a wait
+//                queue.
+//
+// Inputs       : waitq - pointer to the wait queue to be initialized.
+// Outputs      : void
+
+void xinit_waitq(void *waitq)
+{
+    struct xwaitq *xwq = (struct xwaitq *)waitq;
+
+    BUILD_BUG_ON(sizeof(struct xwaitq) > MAX_WAITQ_LEN);
+    init_waitqueue_head(&xwq->head);
+    init_irq_work(&xwq->work, xwaitq_work);
+    xwq->fasync = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xwake_up
+// Description  : Cross platform wake up wait queue function. The wake up is
+//                deferred to an irq_work, so it is safe with the scheduler
+//                locks held.
+//
+// Inputs       : waitq - pointer to the wait queue.
+// Outputs      : void
+
+void xwake_up(void *waitq)
+{
+    irq_work_queue(&((struct xwaitq *)waitq)->work);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xdestroy_waitq
+// Description  : Cross platform destroy wait queue function. Wait for a
+//                pending deferred wake up to finish.
+//
+// Inputs       : waitq - pointer to the wait queue.
+// Outputs      : void
+
+void xdestroy_waitq(void *waitq)
+{
+    irq_work_sync(&((struct xwaitq *)waitq)->work);
+}
+
 //
 // List functions
 
@@ -340,6 +741,650 @@ void *xlist_prev(void *entry)
     return (void *)((struct list_head *)entry)->prev;
 }
 
+//
+// Process functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xparse_build_id
+// Description  : Read the GNU build id of a mapped ELF file from its first
+//                page, if the page is in the page cache. The ELF and program
+//                headers and the build id note are in the first page of the
+//                usual executables and libraries. Never sleeps.
+//
+// Inputs       : file - the mapped file
+//                record - the mapping record to fill
+// Outputs      : void
+
+void xparse_build_id(struct file *file, struct trace_mmap_record *record)
+{
+    struct page *page;
+    Elf64_Ehdr *ehdr;
+    Elf64_Phdr *phdr;
+    Elf64_Nhdr *nhdr;
+    u8 *addr;
+    u64 off, end, name_size, desc_size;
+    u32 i;
+
+    record->build_id_size = 0;
+    page = find_get_page(file->f_mapping, 0);
+    if (page == NULL)
+        return;
+    if (!PageUptodate(page))
+    {
+        put_page(page);
+        return;
+    }
+
+#ifdef HAVE_KMAP_LOCAL
+    addr = kmap_local_page(page);
+#else
+    addr = kmap_atomic(page);
+#endif
+
+    ehdr = (Elf64_Ehdr *)addr;
+    if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) ||
+        ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+        ehdr->e_phentsize != sizeof(Elf64_Phdr) || ehdr->e_phoff > PAGE_SIZE)
+        goto out;
+
+    // Bounded without summing e_phoff, which is untrusted and could wrap
+    if (ehdr->e_phnum > (PAGE_SIZE - ehdr->e_phoff) / sizeof(Elf64_Phdr))
+        goto out;
+
+    phdr = (Elf64_Phdr *)(addr + ehdr->e_phoff);
+    for (i = 0; i < ehdr->e_phnum && record->build_id_size == 0; i++)
+    {
+        if (phdr[i].p_type != PT_NOTE || phdr[i].p_offset > PAGE_SIZE ||
+            phdr[i].p_filesz > PAGE_SIZE - phdr[i].p_offset)
+            continue;
+
+        off = phdr[i].p_offset;
+        end = off + phdr[i].p_filesz;
+        while (off + sizeof(Elf64_Nhdr) <= end)
+        {
+            nhdr = (Elf64_Nhdr *)(addr + off);
+            name_size = ALIGN((u64)nhdr->n_namesz, 4);
+            desc_size = ALIGN((u64)nhdr->n_descsz, 4);
+            off += sizeof(Elf64_Nhdr);
+            if (name_size > end - off || desc_size > end - off - name_size)
+                break;
+
+            if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 &&
+                memcmp(addr + off, "GNU", 4) == 0 && nhdr->n_descsz > 0)
+            {
+                record->build_id_size = min_t(u32, nhdr->n_descsz,
+                                                LIBIHT_BUILD_ID_SIZE);
+                memcpy(record->build_id, addr + off + name_size,
+                        record->build_id_size);
+                break;
+            }
+            off += name_size + desc_size;
+        }
+    }
+
+out:
+#ifdef HAVE_KMAP_LOCAL
+    kunmap_local(addr);
+#else
+    kunmap_atomic(addr);
+#endif
+    put_page(page);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xfor_each_exec_mapping
+// Description  : Cross platform executable mapping walk function. Call a
+//                function on each executable file mapping of a process
+//                overlapping a range. For the current process the walk never
+//                sleeps, so it is safe in the syscall tracepoints, and is
+//                skipped if the mappings are being changed meanwhile.
+//
+// Inputs       : pid - the process id
+//                start - the start address of the range
+//                end - the end address of the range
+//                func - function to be called on each mapping
+//                ctx - context passed to the function
+// Outputs      : void
+
+void xfor_each_exec_mapping(u32 pid, u64 start, u64 end,
+                            void (*func)(void *ctx, u32 pid,
+                                struct trace_mmap_record *record,
+                                char *path, u32 path_size),
+                            void *ctx)
+{
+    struct trace_mmap_record record;
+    struct task_struct *task;
+    struct vm_area_struct *vma;
+    struct mm_struct *mm;
+    char buf[LIBIHT_MMAP_PATH_MAX];
+    char *path;
+    u32 self;
+#ifdef HAVE_VMA_ITERATOR
+    VMA_ITERATOR(vmi, NULL, 0);
+#endif
+
+    self = (pid == current->pid);
+    if (self)
+    {
+        mm = current->mm;
+    }
+    else
+    {
+        rcu_read_lock();
+        task = pid_task(find_vpid(pid), PIDTYPE_PID);
+        mm = task ? get_task_mm(task) : NULL;
+        rcu_read_unlock();
+    }
+    if (mm == NULL)
+        return;
+
+    if (self)
+    {
+        if (!mmap_read_trylock(mm))
+            return;
+    }
+    else
+    {
+        mmap_read_lock(mm);
+    }
+
+#ifdef HAVE_VMA_ITERATOR
+    vma_iter_init(&vmi, mm, start);
+    for_each_vma_range(vmi, vma, end)
+#else
+    for (vma = find_vma(mm, start); vma && vma->vm_start < end;
+            vma = vma->vm_next)
+#endif
+    {
+        if (!(vma->vm_flags & VM_EXEC) || vma->vm_file == NULL)
+            continue;
+
+        record.start = vma->vm_start;
+        record.end = vma->vm_end;
+        record.pgoff = (u64)vma->vm_pgoff << PAGE_SHIFT;
+        xparse_build_id(vma->vm_file, &record);
+
+        path = d_path(&vma->vm_file->f_path, buf, sizeof(buf));
+        if (IS_ERR(path))
+            path = "";
+        func(ctx, pid, &record, path, (u32)strlen(path) + 1);
+    }
+
+    mmap_read_unlock(mm);
+    if (!self)
+        mmput(mm);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xgetpid_cr3
+// Description  : Cross platform get page table root function. Get the physical
+//                address of the top level page table of a process, which is
+//                the CR3 it runs with, less the PCID bits and the page table
+//                isolation user copy.
+//
+// Inputs       : pid - the process id
+// Outputs      : u64 - the page table root, 0 if the process has no memory
+
+u64 xgetpid_cr3(u32 pid)
+{
+    struct task_struct *task;
+    struct mm_struct *mm;
+    u64 cr3;
+
+    if (pid == current->pid)
+        return current->mm ? __pa(current->mm->pgd) : 0;
+
+    rcu_read_lock();
+    task = pid_task(find_vpid(pid), PIDTYPE_PID);
+    mm = task ? get_task_mm(task) : NULL;
+    rcu_read_unlock();
+    if (mm == NULL)
+        return 0;
+
+    cr3 = __pa(mm->pgd);
+    mmput(mm);
+    return cr3;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xperfmon_capable
+// Description  : Cross platform check of the privilege to trace the kernel,
+//                i.e. CAP_PERFMON or CAP_SYS_ADMIN of the current process.
+//
+// Inputs       : void
+// Outputs      : u32 - 1 if the current process may trace the kernel, else 0
+
+u32 xperfmon_capable(void)
+{
+    return perfmon_capable() ? 1 : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xcond_resched
+// Description  : Cross platform yield the core if a reschedule is due
+//                function. Called in long loops of process context.
+//
+// Inputs       : void
+// Outputs      : void
+
+void xcond_resched(void)
+{
+    cond_resched();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xsignal_pending
+// Description  : Cross platform check of a pending signal of the current
+//                thread function, so a long request can stop early.
+//
+// Inputs       : void
+// Outputs      : u32 - 1 if a signal is pending, else 0
+
+u32 xsignal_pending(void)
+{
+    return signal_pending(current) != 0;
+}
+
+//
+// Timer functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xtimer_handler
+// Description  : The hrtimer callback of the periodic timer. Run the callback
+//                in hard interrupt context, then rearm the timer unless the
+//                callback stops it. A timer started again meanwhile is
+//                already queued and left so.
+//
+// Inputs       : timer - the hrtimer
+// Outputs      : enum hrtimer_restart - restart unless the callback stops it
+
+enum hrtimer_restart xtimer_handler(struct hrtimer *timer)
+{
+    if (!xtimer_func())
+        return HRTIMER_NORESTART;
+
+    hrtimer_forward_now(timer, ns_to_ktime(xtimer_period));
+    return HRTIMER_RESTART;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xtimer_start
+// Description  : Cross platform start periodic timer function. Call `func`
+//                every `period_ns` in interrupt context, until it returns 0.
+//                Starting a queued timer does nothing. Callers serialize the
+//                start and stop, and only start the timer again once `func`
+//                has decided to return 0.
+//
+// Inputs       : func - the callback, returning 0 to stop the timer
+//                period_ns - the period in nanoseconds
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 xtimer_start(u32 (*func)(void), u64 period_ns)
+{
+    if (func == NULL || period_ns == 0)
+        return -1;
+
+    if (xtimer_func == NULL)
+    {
+        xtimer_func = func;
+        xtimer_period = period_ns;
+#ifdef HAVE_HRTIMER_SETUP
+        hrtimer_setup(&xtimer, xtimer_handler, CLOCK_MONOTONIC,
+                        HRTIMER_MODE_REL);
+#else
+        hrtimer_init(&xtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+        xtimer.function = xtimer_handler;
+#endif
+    }
+
+    // The callback may still be returning from the stop, it keeps a timer
+    // queued meanwhile
+    if (!hrtimer_is_queued(&xtimer))
+        hrtimer_start(&xtimer, ns_to_ktime(xtimer_period), HRTIMER_MODE_REL);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xtimer_stop
+// Description  : Cross platform stop periodic timer function. Wait for the
+//                running callback, so it must not be called under the locks
+//                the callback takes.
+//
+// Inputs       : void
+// Outputs      : void
+
+void xtimer_stop(void)
+{
+    if (xtimer_func == NULL)
+        return;
+
+    hrtimer_cancel(&xtimer);
+    xtimer_func = NULL;
+}
+
+//
+// Perf functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xperf_branch_type
+// Description  : Translate a LBR_SELECT into perf branch filters. The
+//                LBR_SELECT bits suppress branches while the perf filters
+//                select them, and perf has no filter for the near relative
+//                jumps alone, so they are only kept along with all the other
+//                branches.
+//
+// Inputs       : lbr_select - the LBR_SELECT
+// Outputs      : u64 - the perf branch_sample_type
+
+u64 xperf_branch_type(u64 lbr_select)
+{
+    u64 type = 0;
+
+    if (!(lbr_select & (1UL << 0)))
+        type |= PERF_SAMPLE_BRANCH_KERNEL;
+    if (!(lbr_select & (1UL << 1)))
+        type |= PERF_SAMPLE_BRANCH_USER;
+
+    // Call-stack mode keeps only the calls and returns
+    if (lbr_select & (1UL << 9))
+        return type | PERF_SAMPLE_BRANCH_CALL_STACK;
+
+    // Nothing suppressed, every branch
+    if (!(lbr_select & 0x1fc))
+        return type | PERF_SAMPLE_BRANCH_ANY;
+
+    if (!(lbr_select & (1UL << 2)))
+        type |= PERF_SAMPLE_BRANCH_COND;
+    if (!(lbr_select & (1UL << 3)))
+        type |= PERF_SAMPLE_BRANCH_CALL;
+    if (!(lbr_select & (1UL << 4)))
+        type |= PERF_SAMPLE_BRANCH_IND_CALL;
+    if (!(lbr_select & (1UL << 5)))
+        type |= PERF_SAMPLE_BRANCH_ANY_RETURN;
+    if (!(lbr_select & (1UL << 6)))
+        type |= PERF_SAMPLE_BRANCH_IND_JUMP;
+
+    return type;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xperf_overflow
+// Description  : Overflow handler of the branch stack sampling events, in
+//                NMI. Copy the branch stack into the sample of the core, and
+//                defer the callback to an irq_work. A sample arriving before
+//                the previous one is consumed is dropped.
+//
+// Inputs       : event - the perf event
+//                data - the sample data
+//                regs - the registers at the overflow
+// Outputs      : void
+
+void xperf_overflow(struct perf_event *event, struct perf_sample_data *data,
+                    struct pt_regs *regs)
+{
+    struct xperf_sample *sample = this_cpu_ptr(&xperf_samples);
+    struct perf_branch_stack *stack;
+    struct perf_branch_entry *entry;
+    u32 i, nr;
+    u64 info;
+
+#ifdef HAVE_PERF_SAMPLE_FLAGS
+    if (!(data->sample_flags & PERF_SAMPLE_BRANCH_STACK))
+        return;
+#endif
+
+    stack = data->br_stack;
+    if (stack == NULL || READ_ONCE(sample->busy))
+        return;
+
+    nr = stack->nr < XPERF_MAX_BRANCHES ? stack->nr : XPERF_MAX_BRANCHES;
+    for (i = 0; i < nr; i++)
+    {
+        entry = &stack->entries[i];
+        info = entry->cycles & LIBIHT_LBR_INFO_CYCLES;
+        if (entry->mispred)
+            info |= LIBIHT_LBR_INFO_MISPRED;
+        if (entry->in_tx)
+            info |= LIBIHT_LBR_INFO_IN_TX;
+        if (entry->abort)
+            info |= LIBIHT_LBR_INFO_ABORT;
+
+        sample->entries[i].from = entry->from;
+        sample->entries[i].to = entry->to;
+        sample->info[i] = info;
+    }
+
+    sample->tid = current->pid;
+    sample->nr = nr;
+    WRITE_ONCE(sample->busy, 1);
+    irq_work_queue(&sample->work);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xperf_work
+// Description  : Hand a branch stack sample over to the perf backend callback,
+//                and free the sample of the core for the next one.
+//
+// Inputs       : work - pointer to the irq_work of the sample.
+// Outputs      : void
+
+void xperf_work(struct irq_work *work)
+{
+    struct xperf_sample *sample = container_of(work, struct xperf_sample, work);
+
+    if (xperf_func)
+        xperf_func(sample->tid, sample->nr, sample->entries, sample->info);
+
+    smp_store_release(&sample->busy, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xperf_release
+// Description  : Release a branch stack sampling event.
+//
+// Inputs       : work - pointer to the release work of the event.
+// Outputs      : void
+
+void xperf_release(struct work_struct *work)
+{
+    struct xperf_event *xevent = container_of(work, struct xperf_event,
+                                                release);
+
+    perf_event_release_kernel(xevent->event);
+    kfree(xevent);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xperf_init
+// Description  : Cross platform perf backend init function. Set the callback
+//                receiving the branch stack samples, in interrupt context.
+//
+// Inputs       : func - the callback, with the thread sampled, the number of
+//                       branches, the branches youngest first and their
+//                       flags in the LBR_INFO layout.
+// Outputs      : s32 - 0 on success, -1 on failure
+
+s32 xperf_init(void (*func)(u32 tid, u32 nr, struct lbr_stack_entry *entries,
+                            u64 *info))
+{
+    s32 cpu;
+
+    xperf_wq = alloc_workqueue("libiht-perf", 0, 0);
+    if (xperf_wq == NULL)
+        return -1;
+
+    for_each_possible_cpu(cpu)
+    {
+        init_irq_work(&per_cpu(xperf_samples, cpu).work, xperf_work);
+        per_cpu(xperf_samples, cpu).busy = 0;
+    }
+
+    xperf_func = func;
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xperf_exit
+// Description  : Cross platform perf backend exit function. Wait for the
+//                events closed to be released, then for the samples pending.
+//
+// Inputs       : void
+// Outputs      : void
+
+void xperf_exit(void)
+{
+    s32 cpu;
+
+    if (xperf_wq == NULL)
+        return;
+
+    destroy_workqueue(xperf_wq);
+    xperf_wq = NULL;
+
+    for_each_possible_cpu(cpu)
+        irq_work_sync(&per_cpu(xperf_samples, cpu).work);
+    xperf_func = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xperf_lbr_open
+// Description  : Cross platform open branch stack sampling event function.
+//                Open a kernel counter sampling the branch stack of a process
+//                every `period` branches, inherited by its future threads and
+//                children. Perf then switches the LBR with the process, along
+//                with its other users.
+//
+// Inputs       : pid - the process id
+//                lbr_select - the LBR_SELECT filtering the branches
+//                period - the branches between two samples
+// Outputs      : void * - the event, NULL on failure
+
+void *xperf_lbr_open(u32 pid, u64 lbr_select, u64 period)
+{
+    struct perf_event_attr attr;
+    struct xperf_event *xevent;
+    struct perf_event *event;
+    struct task_struct *task;
+
+    rcu_read_lock();
+    task = pid_task(find_vpid(pid), PIDTYPE_PID);
+    if (task)
+        get_task_struct(task);
+    rcu_read_unlock();
+    if (task == NULL)
+        return NULL;
+
+    xevent = kmalloc(sizeof(struct xperf_event), GFP_KERNEL);
+    if (xevent == NULL)
+    {
+        put_task_struct(task);
+        return NULL;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_BRANCH_INSTRUCTIONS;
+    attr.size = sizeof(attr);
+    attr.sample_period = period;
+    attr.sample_type = PERF_SAMPLE_BRANCH_STACK;
+    attr.branch_sample_type = xperf_branch_type(lbr_select);
+    attr.exclude_kernel = !(attr.branch_sample_type & PERF_SAMPLE_BRANCH_KERNEL);
+    attr.exclude_hv = 1;
+    attr.inherit = 1;
+
+    event = perf_event_create_kernel_counter(&attr, -1, task, xperf_overflow,
+                                                NULL);
+    put_task_struct(task);
+    if (IS_ERR(event))
+    {
+        xprintdbg(KERN_INFO "LIBIHT-LKM: Open perf event for pid %d failed "
+                    "%ld\n", pid, PTR_ERR(event));
+        kfree(xevent);
+        return NULL;
+    }
+
+    xevent->event = event;
+    INIT_WORK(&xevent->release, xperf_release);
+    return xevent;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xperf_lbr_close
+// Description  : Cross platform close branch stack sampling event function.
+//                The release is deferred to a work, so it is safe with
+//                spinlocks held.
+//
+// Inputs       : event - the event
+// Outputs      : void
+
+void xperf_lbr_close(void *event)
+{
+    struct xperf_event *xevent = (struct xperf_event *)event;
+
+    if (xevent)
+        queue_work(xperf_wq, &xevent->release);
+}
+
+//
+// BPF functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : libiht_lbr_snapshot
+// Description  : The attach point of BPF programs consuming LBR snapshots. A
+//                fentry program attached here can filter the snapshot and
+//                forward it into its own BPF ring buffer. The function does
+//                nothing by itself, the empty asm keeps the call and the
+//                arguments from being optimized away.
+//
+// Inputs       : snapshot - the snapshot header
+//                entries - the LBR entries following the header
+//                size - the size of the entries
+// Outputs      : void
+
+noinline void libiht_lbr_snapshot(struct lbr_snapshot *snapshot, void *entries,
+                                    u32 size)
+{
+    asm volatile("" : : "r"(snapshot), "r"(entries), "r"(size) : "memory");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xbpf_publish_lbr
+// Description  : Cross platform hand LBR snapshot to BPF programs function.
+//                The hook runs with the `lbr_state_lock` held, the core is
+//                marked busy meanwhile so the kfuncs reading the LBR state
+//                back off instead of taking the lock again.
+//
+// Inputs       : snapshot - the snapshot header
+//                entries - the LBR entries following the header
+//                size - the size of the entries
+// Outputs      : void
+
+void xbpf_publish_lbr(struct lbr_snapshot *snapshot, void *entries, u32 size)
+{
+    this_cpu_write(xbpf_busy, 1);
+    libiht_lbr_snapshot(snapshot, entries, size);
+    this_cpu_write(xbpf_busy, 0);
+}
+
 //
 // Debug functions
 
@@ -359,3 +1404,19 @@ void xprintdbg(const char *format, ...)
     va_end(args);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : xprint_ratelimit
+// Description  : Cross platform check if a rate limited debug message may
+//                print function. Guards the messages a traced process can
+//                trigger at will, so it cannot flood the kernel log. Never
+//                sleeps nor spins.
+//
+// Inputs       : void
+// Outputs      : u32 - 1 if the message may print, 0 if suppressed
+
+u32 xprint_ratelimit(void)
+{
+    return __ratelimit(&xprint_ratelimit_state) != 0;
+}
+
@@ -16,7 +16,7 @@
 
 unsigned int MAX_LBR_LIST_LEN = 0x20;
 // The default maximum number of LBR entries is 32
-// (may vary in different hardware)
+// (raised to the LBR capacity the kernel reports, e.g., 64 for Arch LBR)
 
 unsigned int MAX_BTS_LIST_LEN = 0x400;
 // The default maximum number of BTS entries is 1024
@@ -39,18 +39,74 @@ enum IOCTL {
     LIBIHT_IOCTL_DUMP_BTS,
     LIBIHT_IOCTL_CONFIG_BTS,
     LIBIHT_IOCTL_BTS_END,
+
+    LIBIHT_IOCTL_LBR_EXT_BASE = 0x10,
+    LIBIHT_IOCTL_SYSCALL_LBR,
+    LIBIHT_IOCTL_CFI_LBR,
+    LIBIHT_IOCTL_DUMP_LBR_INFO,
+    LIBIHT_IOCTL_LBR_EXT_END = 0x1f,
+
+    LIBIHT_IOCTL_BTS_EXT_BASE = 0x20,
+    LIBIHT_IOCTL_READ_BTS,
+    LIBIHT_IOCTL_GOVERN_BTS,
+    LIBIHT_IOCTL_BTS_EXT_END = 0x2f,
+
+    LIBIHT_IOCTL_PT_BASE = 0x30,
+    LIBIHT_IOCTL_ENABLE_PT,
+    LIBIHT_IOCTL_DISABLE_PT,
+    LIBIHT_IOCTL_CONFIG_PT,
+    LIBIHT_IOCTL_READ_PT,
+    LIBIHT_IOCTL_PT_END = 0x3f,
+
+    LIBIHT_IOCTL_SESSION_BASE = 0x40,
+    LIBIHT_IOCTL_CONFIG_SESSION,
+    LIBIHT_IOCTL_SESSION_END = 0x4f,
+
+    LIBIHT_IOCTL_CRASH_BASE = 0x50,
+    LIBIHT_IOCTL_DUMP_CRASH,
+    LIBIHT_IOCTL_CRASH_END = 0x5f,
+
+    LIBIHT_IOCTL_BATCH_BASE = 0x60,
+    LIBIHT_IOCTL_BATCH,
+    LIBIHT_IOCTL_BATCH_END = 0x6f,
 };
 
+enum MMAP_TYPE {
+    LIBIHT_MMAP_BASE,
+    LIBIHT_MMAP_BTS,
+    LIBIHT_MMAP_LBR,
+    LIBIHT_MMAP_SESSION,
+    LIBIHT_MMAP_PT,
+};
+
+#define LIBIHT_MMAP_PAGE_SIZE       0x1000
+#define LIBIHT_MMAP_OFFSET(type, pid) \
+    ((((unsigned long long)(type) << 32) | (unsigned int)(pid)) * LIBIHT_MMAP_PAGE_SIZE)
+
 struct lbr_stack_entry {
     unsigned long long from;
     unsigned long long to;
 };
 
+#define LIBIHT_LBR_INFO             0x1
+#define LIBIHT_LBR_CALL_STACK       0x2
+
+#define LIBIHT_LBR_INFO_MISPRED     (1ULL << 63)
+#define LIBIHT_LBR_INFO_IN_TX       (1ULL << 62)
+#define LIBIHT_LBR_INFO_ABORT       (1ULL << 61)
+#define LIBIHT_LBR_INFO_CYCLES      0xffffULL
+
+#define LIBIHT_LBR_FORMAT_ARCH      0xff
+#define LIBIHT_LBR_FORMAT_PERF      0xfe
+
 struct lbr_config {
     unsigned int pid;
+    unsigned int flags;
     unsigned long long lbr_select;
 };
 
+#define LIBIHT_LBR_DATA_ENTRIES     32
+
 struct lbr_data {
     unsigned long long lbr_tos;
     struct lbr_stack_entry* entries;
@@ -61,6 +117,65 @@ struct lbr_ioctl_request {
     struct lbr_data* buffer;
 };
 
+struct lbr_dump {
+    struct lbr_data data;
+    unsigned long long* info;
+    unsigned int lbr_format;
+    unsigned int lbr_count;
+    unsigned long long count;
+    unsigned long long lbr_capacity;
+};
+
+struct lbr_dump_request {
+    struct lbr_config lbr_config;
+    struct lbr_dump* buffer;
+};
+
+#define LIBIHT_SYSCALL_MAX          512
+#define LIBIHT_SYSCALL_WORDS        (LIBIHT_SYSCALL_MAX / 64)
+#define LIBIHT_NO_SYSCALL           ((unsigned long long)-1)
+
+struct lbr_syscall_request {
+    unsigned int pid;
+    unsigned long long syscalls[LIBIHT_SYSCALL_WORDS];
+};
+
+enum LBR_CFI_ACTION {
+    LIBIHT_CFI_OFF,
+    LIBIHT_CFI_LOG,
+    LIBIHT_CFI_DENY,
+};
+
+#define LIBIHT_CFI_MAX_EDGES        0x10000
+
+struct lbr_cfi_request {
+    unsigned int pid;
+    unsigned int action;
+    unsigned long long syscalls[LIBIHT_SYSCALL_WORDS];
+    unsigned long long edge_count;
+    struct lbr_stack_entry* edges;
+};
+
+struct lbr_snapshot {
+    unsigned long long lbr_tos;
+    unsigned int tid;
+    unsigned int cpu;
+    unsigned long long tsc;
+    unsigned long long syscall;
+    unsigned long long flags;
+    unsigned int lbr_format;
+    unsigned int lbr_count;
+};
+
+struct lbr_ring_header {
+    unsigned long long head;
+    unsigned long long tail;
+    unsigned long long slots;
+    unsigned long long slot_size;
+    unsigned long long lbr_capacity;
+    unsigned long long dropped;
+};
+
 struct bts_config {
     unsigned int pid;
     unsigned long long bts_config;
@@ -84,13 +199,214 @@ struct bts_ioctl_request {
     struct bts_data* buffer;
 };
 
+struct bts_cursor {
+    unsigned long long cursor;
+    unsigned long long lost;
+    unsigned long long count;
+    struct bts_record* records;
+};
+
+struct bts_read_request {
+    struct bts_config bts_config;
+    struct bts_cursor* buffer;
+};
+
+struct bts_governor_request {
+    unsigned int pid;
+    unsigned int budget;
+    unsigned long long period_ns;
+    unsigned long long record_cap;
+    unsigned long long record_cost;
+};
+
+struct bts_header {
+    unsigned long long bts_index;
+    unsigned long long bts_wrap_gen;
+    unsigned long long bts_buffer_size;
+};
+
+#define LIBIHT_PT_MAX_RANGES        4
+
+struct pt_range {
+    unsigned long long start;
+    unsigned long long end;
+};
+
+struct pt_config {
+    unsigned int pid;
+    unsigned int range_count;
+    unsigned long long rtit_ctl;
+    unsigned long long pt_buffer_size;
+    unsigned long long cr3_match;
+    struct pt_range ranges[LIBIHT_PT_MAX_RANGES];
+};
+
+struct pt_ioctl_request {
+    struct pt_config pt_config;
+};
+
+struct pt_cursor {
+    unsigned long long cursor;
+    unsigned long long lost;
+    unsigned long long count;
+    unsigned char* data;
+};
+
+struct pt_read_request {
+    struct pt_config pt_config;
+    struct pt_cursor* buffer;
+};
+
+struct pt_header {
+    unsigned long long pt_offset;
+    unsigned long long pt_wrap_gen;
+    unsigned long long pt_buffer_size;
+};
+
+#define LIBIHT_CRASH_LBR_ENTRIES    64
+#define LIBIHT_CRASH_BTS_RECORDS    0x100
+
+struct crash_capture {
+    unsigned int pid;
+    unsigned int sig;
+    unsigned long long addr;
+    unsigned long long tsc;
+    unsigned int cpu;
+    unsigned int reserved;
+    unsigned long long lbr_tos;
+    unsigned long long lbr_count;
+    struct lbr_stack_entry lbr[LIBIHT_CRASH_LBR_ENTRIES];
+    unsigned long long bts_count;
+    struct bts_record bts[LIBIHT_CRASH_BTS_RECORDS];
+};
+
+struct crash_ioctl_request {
+    unsigned int pid;
+    struct crash_capture* buffer;
+};
+
+enum TRACE_RECORD_TYPE {
+    LIBIHT_RECORD_BASE,
+    LIBIHT_RECORD_LBR,
+    LIBIHT_RECORD_BTS,
+    LIBIHT_RECORD_LOST,
+    LIBIHT_RECORD_MARKER,
+    LIBIHT_RECORD_MMAP,
+    LIBIHT_RECORD_SWITCH,
+    LIBIHT_RECORD_THROTTLE,
+    LIBIHT_RECORD_PT,
+};
+
+struct trace_record_header {
+    unsigned short type;
+    unsigned short reserved;
+    unsigned int size;
+    unsigned int tid;
+    unsigned int cpu;
+    unsigned long long tsc;
+};
+
+struct trace_lost_record {
+    unsigned long long lbr_snapshots;
+    unsigned long long bts_records;
+    unsigned long long markers;
+    unsigned long long mmaps;
+    unsigned long long switches;
+    unsigned long long pt_bytes;
+};
+
+struct trace_marker {
+    unsigned long long tag;
+};
+
+#define LIBIHT_BUILD_ID_SIZE        20
+#define LIBIHT_MMAP_PATH_MAX        256
+
+struct trace_mmap_record {
+    unsigned long long start;
+    unsigned long long end;
+    unsigned long long pgoff;
+    unsigned int build_id_size;
+    unsigned char build_id[LIBIHT_BUILD_ID_SIZE];
+};
+
+#define LIBIHT_SWITCH_OUT           0x0
+#define LIBIHT_SWITCH_IN            0x1
+#define LIBIHT_SWITCH_MIGRATED      0x2
+
+struct trace_switch_record {
+    unsigned int flags;
+    unsigned int other_tid;
+};
+
+#define LIBIHT_THROTTLE_OFF         0x0
+#define LIBIHT_THROTTLE_ON          0x1
+#define LIBIHT_THROTTLE_CAP         0x2
+
+struct trace_throttle_record {
+    unsigned int action;
+    unsigned int overhead;
+    unsigned long long seq;
+    unsigned long long records;
+    unsigned long long run_tsc;
+    unsigned long long cost_tsc;
+    unsigned long long off_ns;
+};
+
+#define LIBIHT_GATE_CLOSED          0
+#define LIBIHT_GATE_OPEN            1
+
+#define LIBIHT_MARKER_SLOTS         64
+
+struct session_marker_slot {
+    unsigned long long seq;
+    unsigned long long tag;
+    unsigned long long tsc;
+    unsigned int tid;
+    unsigned int cpu;
+};
+
+struct session_control {
+    unsigned long long gate;
+    unsigned long long marker_head;
+    unsigned long long reserved[6];
+    struct session_marker_slot markers[LIBIHT_MARKER_SLOTS];
+};
+
+struct session_config {
+    unsigned long long watermark;
+    unsigned long long buffer_size;
+};
+
+struct session_ioctl_request {
+    struct session_config session_config;
+};
+
+struct xioctl_request;
+
+struct batch_ioctl_request {
+    unsigned long long count;
+    struct xioctl_request* requests;
+    int* results;
+};
+
 struct xioctl_request {
     enum IOCTL cmd;
     union {
         struct lbr_ioctl_request lbr;
+        struct lbr_dump_request lbr_dump;
+        struct lbr_syscall_request lbr_syscall;
+        struct lbr_cfi_request lbr_cfi;
         struct bts_ioctl_request bts;
+        struct bts_read_request bts_read;
+        struct bts_governor_request bts_governor;
+        struct pt_ioctl_request pt;
+        struct pt_read_request pt_read;
+        struct session_ioctl_request session;
+        struct crash_ioctl_request crash;
+        struct batch_ioctl_request batch;
     }body;
 };
 
-// The above definitions are same as those in "types.h"
+// The above definitions are same as those in "xioctl.h", "bts.h" and "pt.h"
 #endif // LIBIHT_API_H
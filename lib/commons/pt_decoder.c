@@ -0,0 +1,1276 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lib/commons/pt_decoder.c
+//  Description    : This is the source code for the Intel PT packet decoder. It
+//                   parses the packets of a byte buffer and rebuilds the taken
+//                   branches by walking the code image of the traced process
+//                   along the TNT bits and the TIP targets, with a compact x86
+//                   instruction length decoder. Every PSB resets the decoder,
+//                   so a buffer split at PSB boundaries decodes in parallel.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : July 16, 2024
+//
+
+#include "pt_decoder.h"
+#include <string.h>
+
+//
+// Local constants
+
+// Pending walks of a decoder
+enum PT_WALK {
+    PT_WALK_NONE,               // Nothing to walk, parse the next packet
+    PT_WALK_TNT,                // Spend the pending TNT bits
+    PT_WALK_TIP,                // Walk to the branch taking the TIP target
+    PT_WALK_PGD,                // Walk to the branch disabling the trace
+    PT_WALK_FUP,                // Walk to the source of an event
+    PT_WALK_EVENT,              // Branch from the event source to the target
+    PT_WALK_EVENT_PGD,          // Same, then the trace is disabled
+};
+
+// Branch classes of an instruction
+enum PT_INSN_CLASS {
+    PT_INSN_OTHER,              // Not a branch
+    PT_INSN_JCC,                // Conditional branch, a TNT bit
+    PT_INSN_JMP,                // Direct jump
+    PT_INSN_CALL,               // Direct call
+    PT_INSN_JMP_IND,            // Indirect jump, a TIP
+    PT_INSN_CALL_IND,           // Indirect call, a TIP
+    PT_INSN_RET,                // Near return, a TNT bit if compressed or a TIP
+    PT_INSN_FAR,                // Far transfer, syscall or interrupt, a TIP
+};
+
+// Longest x86 instruction
+#define PT_INSN_MAX_SIZE            15
+
+//
+// Type definitions
+
+// Define the output of a walk
+struct pt_branch_out {
+    struct pt_branch *branches; // Output branches
+    unsigned int max;           // Output branches size
+    unsigned int count;         // Output branches written
+};
+
+//
+// Global Variables
+
+static const unsigned char pt_psb_pattern[PT_PSB_SIZE] = {
+    0x02, 0x82, 0x02, 0x82, 0x02, 0x82, 0x02, 0x82,
+    0x02, 0x82, 0x02, 0x82, 0x02, 0x82, 0x02, 0x82
+};
+// The PSB packet bytes
+
+static const unsigned int pt_ip_sizes[8] = { 0, 2, 4, 6, 6, 0, 8, 0 };
+// The payload bytes of the IP packets by IPBytes, 0 if reserved
+
+//
+// Packet functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_read_le
+// Description  : Read a little endian value of up to 8 bytes
+//
+// Inputs       : const unsigned char *buf : the bytes
+//                unsigned int size : the value size in bytes
+// Outputs      : unsigned long long : the value
+
+static unsigned long long pt_read_le(const unsigned char *buf, unsigned int size) {
+    unsigned long long value = 0;
+
+    while (size--)
+        value = (value << 8) | buf[size];
+    return value;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_stop_bit
+// Description  : Find the stop bit of a TNT payload, its highest set bit. The
+//                TNT bits are below it, the oldest one first.
+//
+// Inputs       : unsigned long long payload : the TNT payload, not 0
+// Outputs      : unsigned int : the stop bit index, which is the bits count
+
+static unsigned int pt_stop_bit(unsigned long long payload) {
+    unsigned int bit = 0;
+
+    if (payload >> 32) { payload >>= 32; bit += 32; }
+    if (payload >> 16) { payload >>= 16; bit += 16; }
+    if (payload >> 8)  { payload >>= 8;  bit += 8; }
+    if (payload >> 4)  { payload >>= 4;  bit += 4; }
+    if (payload >> 2)  { payload >>= 2;  bit += 2; }
+    if (payload >> 1)  { bit += 1; }
+    return bit;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_next_packet
+// Description  : Parse the packet at the start of a buffer. IP packets carry
+//                their compressed IP in `payload` and their IPBytes in
+//                `count`, which the decoder expands with the last IP. TNT
+//                packets carry their bits in `payload`, the oldest one in bit
+//                `count - 1`.
+//
+// Inputs       : const unsigned char *buf : the packet bytes
+//                unsigned long long size : the packet bytes size
+//                struct pt_packet *packet : the decoded packet
+// Outputs      : int : the packet size, 0 if the buffer ends within the packet,
+//                -1 if the bytes are not a packet
+
+int pt_next_packet(const unsigned char *buf, unsigned long long size,
+                   struct pt_packet *packet) {
+    unsigned int byte, need, bits, shift;
+    unsigned long long payload;
+
+    if (size == 0)
+        return 0;
+
+    byte = buf[0];
+    packet->count = 0;
+    packet->reserved = 0;
+    packet->payload = 0;
+
+    // CYC, the low two bits set, extended while the Exp bit is set
+    if ((byte & 0x3) == 0x3) {
+        packet->type = PT_PACKET_CYC;
+        payload = byte >> 3;
+        shift = 5;
+        need = 1;
+        if (byte & 0x4) {
+            do {
+                if (need >= size)
+                    return 0;
+                if (shift < 64)
+                    payload |= (unsigned long long)(buf[need] >> 1) << shift;
+                shift += 7;
+            } while (buf[need++] & 0x1);
+        }
+        packet->payload = payload;
+        packet->size = need;
+        return need;
+    }
+
+    // IP packets, TSC, MTC and MODE
+    if (byte & 0x1) {
+        switch (byte & 0x1f) {
+        case 0x0d:
+            packet->type = PT_PACKET_TIP;
+            break;
+        case 0x11:
+            packet->type = PT_PACKET_TIP_PGE;
+            break;
+        case 0x01:
+            packet->type = PT_PACKET_TIP_PGD;
+            break;
+        case 0x1d:
+            packet->type = PT_PACKET_FUP;
+            break;
+        case 0x19:
+            if (byte == 0x19) {
+                packet->type = PT_PACKET_TSC;
+                need = 8;
+            } else if (byte == 0x59) {
+                packet->type = PT_PACKET_MTC;
+                need = 2;
+            } else if (byte == 0x99) {
+                packet->type = PT_PACKET_MODE;
+                need = 2;
+            } else {
+                return -1;
+            }
+            if (need > size)
+                return 0;
+            packet->payload = pt_read_le(buf + 1, need - 1);
+            packet->size = need;
+            return need;
+        default:
+            return -1;
+        }
+
+        packet->count = byte >> 5;
+        need = pt_ip_sizes[packet->count];
+        if (need == 0 && packet->count != 0)
+            return -1;
+        if (1 + need > size)
+            return 0;
+        packet->payload = pt_read_le(buf + 1, need);
+        packet->size = 1 + need;
+        return 1 + need;
+    }
+
+    // PAD
+    if (byte == 0x00) {
+        packet->type = PT_PACKET_PAD;
+        packet->size = 1;
+        return 1;
+    }
+
+    // Short TNT, up to 6 bits below the stop bit
+    if (byte != 0x02) {
+        payload = byte >> 1;
+        bits = pt_stop_bit(payload);
+        packet->type = PT_PACKET_TNT;
+        packet->count = bits;
+        packet->payload = payload & ((1ULL << bits) - 1);
+        packet->size = 1;
+        return 1;
+    }
+
+    // Extended packets
+    if (size < 2)
+        return 0;
+
+    switch (buf[1]) {
+    case 0x82:
+        packet->type = PT_PACKET_PSB;
+        need = PT_PSB_SIZE;
+        break;
+    case 0x23:
+        packet->type = PT_PACKET_PSBEND;
+        need = 2;
+        break;
+    case 0xf3:
+        packet->type = PT_PACKET_OVF;
+        need = 2;
+        break;
+    case 0xa3:
+        packet->type = PT_PACKET_TNT;
+        need = 8;
+        break;
+    case 0x03:
+        packet->type = PT_PACKET_CBR;
+        need = 4;
+        break;
+    case 0x43:
+        packet->type = PT_PACKET_PIP;
+        need = 8;
+        break;
+    case 0x73:
+        packet->type = PT_PACKET_TMA;
+        need = 7;
+        break;
+    case 0xc8:
+        packet->type = PT_PACKET_VMCS;
+        need = 7;
+        break;
+    case 0xc3:
+        packet->type = PT_PACKET_MNT;
+        need = 11;
+        break;
+    case 0x83:
+        packet->type = PT_PACKET_STOP;
+        need = 2;
+        break;
+    case 0x62:
+    case 0xe2:
+        packet->type = PT_PACKET_POWER;
+        need = 2;
+        break;
+    case 0x22:
+        packet->type = PT_PACKET_POWER;
+        need = 4;
+        break;
+    case 0xa2:
+        packet->type = PT_PACKET_POWER;
+        need = 7;
+        break;
+    case 0xc2:
+        packet->type = PT_PACKET_POWER;
+        need = 10;
+        break;
+    default:
+        // PTW, the payload size in bits 6:5
+        if ((buf[1] & 0x1f) != 0x12 || (buf[1] & 0x40))
+            return -1;
+        packet->type = PT_PACKET_PTW;
+        packet->count = (buf[1] & 0x20) ? 8 : 4;
+        need = 2 + packet->count;
+        break;
+    }
+
+    if (need > size)
+        return 0;
+
+    switch (packet->type) {
+    case PT_PACKET_PSB:
+        if (memcmp(buf, pt_psb_pattern, PT_PSB_SIZE) != 0)
+            return -1;
+        break;
+    case PT_PACKET_TNT:
+        // Long TNT, up to 47 bits below the stop bit
+        payload = pt_read_le(buf + 2, 6);
+        if (payload == 0)
+            return -1;
+        bits = pt_stop_bit(payload);
+        packet->count = bits;
+        packet->payload = payload & ((1ULL << bits) - 1);
+        break;
+    case PT_PACKET_PIP:
+        // CR3 bits 51:5 in payload bits 47:1
+        packet->payload = (pt_read_le(buf + 2, 6) & ~1ULL) << 4;
+        break;
+    case PT_PACKET_MNT:
+        if (buf[2] != 0x88)
+            return -1;
+        packet->payload = pt_read_le(buf + 3, 8);
+        break;
+    case PT_PACKET_CBR:
+        packet->payload = buf[2];
+        break;
+    case PT_PACKET_PTW:
+        packet->payload = pt_read_le(buf + 2, packet->count);
+        break;
+    default:
+        packet->payload = pt_read_le(buf + 2, need - 2 > 8 ? 8 : need - 2);
+        break;
+    }
+
+    packet->size = need;
+    return need;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_sync_forward
+// Description  : Find the next PSB at or after an offset of a buffer. Only the
+//                PSB bytes are searched, the packets in between are skipped
+//                unparsed, so this is the fast path to split a buffer.
+//
+// Inputs       : const unsigned char *buf : the packet bytes
+//                unsigned long long size : the packet bytes size
+//                unsigned long long offset : the offset to search from
+// Outputs      : long long : the PSB offset, -1 if none
+
+long long pt_sync_forward(const unsigned char *buf, unsigned long long size,
+                          unsigned long long offset) {
+    const unsigned char *psb;
+
+    while (offset + PT_PSB_SIZE <= size) {
+        psb = memchr(buf + offset, 0x02, size - offset - PT_PSB_SIZE + 1);
+        if (psb == NULL)
+            break;
+        offset = psb - buf;
+        if (memcmp(psb, pt_psb_pattern, PT_PSB_SIZE) == 0)
+            return offset;
+        offset++;
+    }
+
+    return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_split_chunks
+// Description  : Split a buffer at PSB boundaries into chunks that decode
+//                independently. Chunk `i` spans from `offsets[i]` to
+//                `offsets[i + 1]`, the last one to the end of the buffer. The
+//                bytes before the first PSB can not be decoded and belong to
+//                no chunk.
+//
+// Inputs       : const unsigned char *buf : the packet bytes
+//                unsigned long long size : the packet bytes size
+//                unsigned long long min_chunk : the minimum chunk size
+//                unsigned long long *offsets : the chunk offsets
+//                unsigned long long max : the chunk offsets size
+// Outputs      : unsigned long long : the number of chunks
+
+unsigned long long pt_split_chunks(const unsigned char *buf,
+                                   unsigned long long size,
+                                   unsigned long long min_chunk,
+                                   unsigned long long *offsets,
+                                   unsigned long long max) {
+    unsigned long long count = 0;
+    long long offset;
+
+    if (min_chunk < PT_PSB_SIZE)
+        min_chunk = PT_PSB_SIZE;
+
+    offset = pt_sync_forward(buf, size, 0);
+    while (offset >= 0 && count < max) {
+        offsets[count++] = offset;
+        offset = pt_sync_forward(buf, size, offset + min_chunk);
+    }
+
+    return count;
+}
+
+//
+// Instruction functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_decode_insn
+// Description  : Decode the size and branch class of an x86 instruction. Only
+//                the prefixes, opcode maps, ModRM, SIB, displacement and
+//                immediate are decoded, which is all the flow needs.
+//
+// Inputs       : const unsigned char *code : the instruction bytes
+//                unsigned long long avail : the instruction bytes available
+//                unsigned long long ip : the instruction address
+//                unsigned int mode64 : the code runs in 64-bit mode
+//                struct pt_insn *insn : the decoded instruction
+// Outputs      : int : 0 if successful, -1 if not decoded
+
+static int pt_decode_insn(const unsigned char *code, unsigned long long avail,
+                          unsigned long long ip, unsigned int mode64,
+                          struct pt_insn *insn) {
+    unsigned int i = 0, limit, op, map = 0, opsize = 0, adsize = 0, rexw = 0;
+    unsigned int modrm = 0, reg = 0, disp = 0, imm = 0, rel = 0, mod, rm;
+    long long offset;
+
+    limit = avail < PT_INSN_MAX_SIZE ? (unsigned int)avail : PT_INSN_MAX_SIZE;
+    insn->iclass = PT_INSN_OTHER;
+    insn->target = 0;
+
+    // Legacy prefixes
+    for (;;) {
+        if (i >= limit)
+            return -1;
+        op = code[i];
+        if (op == 0x66)
+            opsize = 1;
+        else if (op == 0x67)
+            adsize = 1;
+        else if (op != 0xf0 && op != 0xf2 && op != 0xf3 && op != 0x2e &&
+                 op != 0x36 && op != 0x3e && op != 0x26 && op != 0x64 &&
+                 op != 0x65)
+            break;
+        i++;
+    }
+
+    // REX
+    if (mode64 && (op & 0xf0) == 0x40) {
+        rexw = op & 0x08;
+        if (++i >= limit)
+            return -1;
+        op = code[i];
+    }
+
+    if ((op == 0xc4 || op == 0xc5 || op == 0x62) && i + 1 < limit &&
+        (mode64 || (code[i + 1] & 0xc0) == 0xc0)) {
+        // VEX and EVEX, LES, LDS and BOUND with a register outside 64-bit mode
+        if (op == 0xc5) {
+            map = 1;
+            i += 2;
+        } else if (op == 0xc4) {
+            map = code[i + 1] & 0x1f;
+            i += 3;
+        } else {
+            map = code[i + 1] & 0x07;
+            i += 4;
+        }
+        if (i >= limit)
+            return -1;
+        op = code[i++];
+        modrm = !(map == 1 && op == 0x77);
+        if (map == 3 || (map == 1 && ((op >= 0x70 && op <= 0x73) ||
+                                      op == 0xc2 || (op >= 0xc4 && op <= 0xc6))))
+            imm = 1;
+    } else if (op == 0x0f) {
+        // Two and three byte opcodes
+        if (++i >= limit)
+            return -1;
+        op = code[i++];
+        if (op == 0x38 || op == 0x3a) {
+            if (i >= limit)
+                return -1;
+            map = op == 0x38 ? 2 : 3;
+            imm = map == 3;
+            op = code[i++];
+            modrm = 1;
+        } else {
+            map = 1;
+            modrm = 1;
+            if ((op >= 0x05 && op <= 0x09) || op == 0x0b || op == 0x0e ||
+                (op >= 0x30 && op <= 0x37) || op == 0x77 ||
+                (op >= 0xa0 && op <= 0xa2) || (op >= 0xa8 && op <= 0xaa) ||
+                (op >= 0xc8 && op <= 0xcf))
+                modrm = 0;
+            if ((op >= 0x70 && op <= 0x73) || op == 0xa4 || op == 0xac ||
+                op == 0xba || op == 0xc2 || (op >= 0xc4 && op <= 0xc6))
+                imm = 1;
+            if (op >= 0x80 && op <= 0x8f) {
+                insn->iclass = PT_INSN_JCC;
+                modrm = 0;
+                rel = (opsize && !mode64) ? 2 : 4;
+            } else if (op == 0x05 || op == 0x07 || op == 0x34 || op == 0x35) {
+                insn->iclass = PT_INSN_FAR;
+            }
+        }
+    } else {
+        // One byte opcodes
+        i++;
+        if (op < 0x40) {
+            modrm = (op & 0x7) < 4;
+            if ((op & 0x7) == 4)
+                imm = 1;
+            else if ((op & 0x7) == 5)
+                imm = opsize ? 2 : 4;
+        } else if ((op >= 0x80 && op <= 0x8f) || (op >= 0xd0 && op <= 0xd3) ||
+                   (op >= 0xd8 && op <= 0xdf) || op == 0x62 || op == 0x63 ||
+                   op == 0xc4 || op == 0xc5 || op == 0xfe || op == 0xff) {
+            modrm = 1;
+            if (op == 0x80 || op == 0x82 || op == 0x83)
+                imm = 1;
+            else if (op == 0x81)
+                imm = opsize ? 2 : 4;
+        } else if (op >= 0x70 && op <= 0x7f) {
+            insn->iclass = PT_INSN_JCC;
+            rel = 1;
+        } else if (op >= 0xb0 && op <= 0xb7) {
+            imm = 1;
+        } else if (op >= 0xb8 && op <= 0xbf) {
+            imm = rexw ? 8 : (opsize ? 2 : 4);
+        } else if (op >= 0xa0 && op <= 0xa3) {
+            imm = mode64 ? (adsize ? 4 : 8) : (adsize ? 2 : 4);
+        } else if (op >= 0xe0 && op <= 0xe3) {
+            insn->iclass = PT_INSN_JCC;
+            rel = 1;
+        } else if (op >= 0xe4 && op <= 0xe7) {
+            imm = 1;
+        } else {
+            switch (op) {
+            case 0x68:
+            case 0xa9:
+                imm = opsize ? 2 : 4;
+                break;
+            case 0x69:
+            case 0xc7:
+                modrm = 1;
+                imm = opsize ? 2 : 4;
+                break;
+            case 0x6b:
+            case 0xc0:
+            case 0xc1:
+            case 0xc6:
+                modrm = 1;
+                imm = 1;
+                break;
+            case 0xf6:
+            case 0xf7:
+                modrm = 1;
+                break;
+            case 0x6a:
+            case 0xa8:
+            case 0xd4:
+            case 0xd5:
+                imm = 1;
+                break;
+            case 0xc2:
+                insn->iclass = PT_INSN_RET;
+                imm = 2;
+                break;
+            case 0xc3:
+                insn->iclass = PT_INSN_RET;
+                break;
+            case 0xc8:
+                imm = 3;
+                break;
+            case 0xca:
+                insn->iclass = PT_INSN_FAR;
+                imm = 2;
+                break;
+            case 0xcd:
+                insn->iclass = PT_INSN_FAR;
+                imm = 1;
+                break;
+            case 0xcb:
+            case 0xcc:
+            case 0xce:
+            case 0xcf:
+            case 0xf1:
+                insn->iclass = PT_INSN_FAR;
+                break;
+            case 0x9a:
+            case 0xea:
+                if (mode64)
+                    return -1;
+                insn->iclass = PT_INSN_FAR;
+                imm = opsize ? 4 : 6;
+                break;
+            case 0xe8:
+                insn->iclass = PT_INSN_CALL;
+                rel = (opsize && !mode64) ? 2 : 4;
+                break;
+            case 0xe9:
+                insn->iclass = PT_INSN_JMP;
+                rel = (opsize && !mode64) ? 2 : 4;
+                break;
+            case 0xeb:
+                insn->iclass = PT_INSN_JMP;
+                rel = 1;
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    // ModRM, SIB and displacement
+    if (modrm) {
+        if (i >= limit)
+            return -1;
+        mod = code[i] >> 6;
+        reg = (code[i] >> 3) & 0x7;
+        rm = code[i++] & 0x7;
+        if (mod != 3) {
+            if (!mode64 && adsize) {
+                if ((mod == 0 && rm == 6) || mod == 2)
+                    disp = 2;
+                else if (mod == 1)
+                    disp = 1;
+            } else {
+                if (rm == 4) {
+                    if (i >= limit)
+                        return -1;
+                    if (mod == 0 && (code[i] & 0x7) == 5)
+                        disp = 4;
+                    i++;
+                }
+                if ((mod == 0 && rm == 5) || mod == 2)
+                    disp = 4;
+                else if (mod == 1)
+                    disp = 1;
+            }
+        }
+    }
+
+    // Opcodes told apart by the ModRM reg field
+    if (map == 0 && modrm) {
+        if ((op == 0xf6 || op == 0xf7) && reg < 2)
+            imm = op == 0xf6 ? 1 : (opsize ? 2 : 4);
+        else if (op == 0xff && (reg == 2 || reg == 3 || reg == 4 || reg == 5))
+            insn->iclass = reg == 2 ? PT_INSN_CALL_IND :
+                           reg == 4 ? PT_INSN_JMP_IND : PT_INSN_FAR;
+    }
+
+    insn->size = i + disp + imm + rel;
+    if (insn->size > limit)
+        return -1;
+
+    if (rel) {
+        if (rel == 1)
+            offset = (signed char)code[i];
+        else if (rel == 2)
+            offset = (short)pt_read_le(code + i, 2);
+        else
+            offset = (int)pt_read_le(code + i, 4);
+        insn->target = ip + insn->size + offset;
+        if (!mode64)
+            insn->target &= 0xffffffffULL;
+    }
+
+    return 0;
+}
+
+//
+// Decoder functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_image_lookup
+// Description  : Find the code bytes of an address in the code image
+//
+// Inputs       : struct pt_decoder *dec : the decoder
+//                unsigned long long ip : the address
+//                unsigned long long *avail : the code bytes available
+// Outputs      : const unsigned char * : the code bytes, NULL if not mapped
+
+static const unsigned char *pt_image_lookup(struct pt_decoder *dec,
+                                            unsigned long long ip,
+                                            unsigned long long *avail) {
+    const struct pt_image_section *section;
+    unsigned int i;
+
+    if (dec->section_count == 0)
+        return NULL;
+
+    // The flow mostly stays in one section
+    section = &dec->sections[dec->last_section];
+    if (ip - section->vaddr >= section->size) {
+        for (i = 0; i < dec->section_count; i++)
+            if (ip - dec->sections[i].vaddr < dec->sections[i].size)
+                break;
+        if (i == dec->section_count)
+            return NULL;
+        dec->last_section = i;
+        section = &dec->sections[i];
+    }
+
+    *avail = section->size - (ip - section->vaddr);
+    return section->data + (ip - section->vaddr);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_packet_ip
+// Description  : Expand the compressed IP of an IP packet with the last IP,
+//                and make it the last IP
+//
+// Inputs       : struct pt_decoder *dec : the decoder
+//                struct pt_packet *packet : the IP packet, its payload is
+//                                           replaced by the full IP
+// Outputs      : int : 1 if the IP is present, 0 if suppressed
+
+static int pt_packet_ip(struct pt_decoder *dec, struct pt_packet *packet) {
+    unsigned long long ip = packet->payload;
+
+    switch (packet->count) {
+    case 1:
+        ip |= dec->last_ip & ~0xffffULL;
+        break;
+    case 2:
+        ip |= dec->last_ip & ~0xffffffffULL;
+        break;
+    case 3:
+        if (ip & (1ULL << 47))
+            ip |= 0xffff000000000000ULL;
+        break;
+    case 4:
+        ip |= dec->last_ip & 0xffff000000000000ULL;
+        break;
+    case 6:
+        break;
+    default:
+        return 0;
+    }
+
+    dec->last_ip = ip;
+    packet->payload = ip;
+    return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_set_mode
+// Description  : Switch the execution mode of the flow, the instructions
+//                cached in the other mode no longer apply
+//
+// Inputs       : struct pt_decoder *dec : the decoder
+//                unsigned int mode64 : the flow runs in 64-bit mode
+// Outputs      : void
+
+static void pt_set_mode(struct pt_decoder *dec, unsigned int mode64) {
+    if (dec->mode64 != mode64)
+        memset(dec->insn_cache, 0, sizeof(dec->insn_cache));
+    dec->mode64 = mode64;
+    dec->mode_pending = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_set_ip
+// Description  : Move the flow to a target IP. Without a code image the flow
+//                IP stays unknown, and only the TIP targets are decoded.
+//
+// Inputs       : struct pt_decoder *dec : the decoder
+//                unsigned long long ip : the target IP
+// Outputs      : void
+
+static void pt_set_ip(struct pt_decoder *dec, unsigned long long ip) {
+    // A MODE.Exec takes effect at the target of its far branch
+    if (dec->mode_pending)
+        pt_set_mode(dec, dec->next_mode64);
+
+    dec->ip = ip;
+    dec->ip_valid = dec->section_count != 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_lose_sync
+// Description  : Drop the flow state after the packets no longer match the
+//                code image. The next IP packet resyncs the flow.
+//
+// Inputs       : struct pt_decoder *dec : the decoder
+// Outputs      : void
+
+static void pt_lose_sync(struct pt_decoder *dec) {
+    dec->ip_valid = 0;
+    dec->tnt = 0;
+    dec->tnt_count = 0;
+    dec->errors++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_reset
+// Description  : Reset the decoder state at a PSB or a parse error
+//
+// Inputs       : struct pt_decoder *dec : the decoder
+// Outputs      : void
+
+static void pt_reset(struct pt_decoder *dec) {
+    dec->last_ip = 0;
+    dec->ip_valid = 0;
+    dec->tnt = 0;
+    dec->tnt_count = 0;
+    dec->walk = PT_WALK_NONE;
+    dec->fup_pending = 0;
+    dec->in_ovf = 0;
+    dec->ret_top = 0;
+    dec->ret_count = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_pop_tnt
+// Description  : Take the oldest pending TNT bit
+//
+// Inputs       : struct pt_decoder *dec : the decoder, with a pending bit
+// Outputs      : unsigned int : 1 if taken, 0 if not taken
+
+static unsigned int pt_pop_tnt(struct pt_decoder *dec) {
+    dec->tnt_count--;
+    return (dec->tnt >> dec->tnt_count) & 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_push_ret
+// Description  : Push a return address, dropping the oldest one when full
+//
+// Inputs       : struct pt_decoder *dec : the decoder
+//                unsigned long long ip : the return address
+// Outputs      : void
+
+static void pt_push_ret(struct pt_decoder *dec, unsigned long long ip) {
+    dec->ret_stack[dec->ret_top] = ip;
+    dec->ret_top = (dec->ret_top + 1) % PT_RET_STACK_DEPTH;
+    if (dec->ret_count < PT_RET_STACK_DEPTH)
+        dec->ret_count++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_pop_ret
+// Description  : Pop the last return address
+//
+// Inputs       : struct pt_decoder *dec : the decoder, with a return address
+// Outputs      : unsigned long long : the return address
+
+static unsigned long long pt_pop_ret(struct pt_decoder *dec) {
+    dec->ret_top = (dec->ret_top + PT_RET_STACK_DEPTH - 1) % PT_RET_STACK_DEPTH;
+    dec->ret_count--;
+    return dec->ret_stack[dec->ret_top];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_emit
+// Description  : Write a taken branch to the walk output, which has room
+//
+// Inputs       : struct pt_decoder *dec : the decoder
+//                struct pt_branch_out *out : the walk output
+//                unsigned long long from : the branch source
+//                unsigned long long to : the branch target
+// Outputs      : void
+
+static void pt_emit(struct pt_decoder *dec, struct pt_branch_out *out,
+                    unsigned long long from, unsigned long long to) {
+    struct pt_branch *branch = &out->branches[out->count++];
+
+    branch->from = from;
+    branch->to = to;
+    branch->misc = dec->tsc;
+    dec->branches++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_walk_blind
+// Description  : Finish the pending walk of a decoder whose flow IP is not
+//                known. A TIP target is still a branch, from an unknown source.
+//
+// Inputs       : struct pt_decoder *dec : the decoder
+//                struct pt_branch_out *out : the walk output
+// Outputs      : int : 1 if the walk is done, 0 if the output is full
+
+static int pt_walk_blind(struct pt_decoder *dec, struct pt_branch_out *out) {
+    if (dec->walk == PT_WALK_TIP && dec->target_valid) {
+        if (out->count >= out->max)
+            return 0;
+        pt_emit(dec, out, 0, dec->target);
+        pt_set_ip(dec, dec->target);
+    } else if (dec->walk == PT_WALK_FUP) {
+        dec->fup_pending = 1;
+    }
+
+    dec->tnt = 0;
+    dec->tnt_count = 0;
+    return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_walk
+// Description  : Walk the code image from the flow IP for the pending walk of
+//                a decoder, writing the taken branches on the way. The direct
+//                branches are followed, the conditional ones and compressed
+//                returns take the TNT bits, and the walk stops at the branch
+//                the pending TIP or PGD is for, or at the FUP source.
+//
+// Inputs       : struct pt_decoder *dec : the decoder
+//                struct pt_branch_out *out : the walk output
+// Outputs      : int : 1 if the walk is done, 0 if the output is full
+
+static int pt_walk(struct pt_decoder *dec, struct pt_branch_out *out) {
+    const unsigned char *code;
+    struct pt_insn *insn;
+    unsigned long long avail, next, target, steps;
+
+    // An event branches from its source, nothing to walk
+    if (dec->walk == PT_WALK_EVENT || dec->walk == PT_WALK_EVENT_PGD) {
+        if (dec->target_valid) {
+            if (out->count >= out->max)
+                return 0;
+            pt_emit(dec, out, dec->fup_ip, dec->target);
+        }
+        dec->fup_pending = 0;
+        if (dec->walk == PT_WALK_EVENT && dec->target_valid)
+            pt_set_ip(dec, dec->target);
+        else
+            dec->ip_valid = 0;
+        return 1;
+    }
+
+    for (steps = 0; ; steps++) {
+        if (!dec->ip_valid)
+            return pt_walk_blind(dec, out);
+        if (dec->walk == PT_WALK_TNT && dec->tnt_count == 0)
+            return 1;
+        if (dec->walk == PT_WALK_FUP && dec->ip == dec->fup_ip) {
+            dec->fup_pending = 1;
+            return 1;
+        }
+        if (out->count >= out->max)
+            return 0;
+
+        insn = &dec->insn_cache[dec->ip % PT_INSN_CACHE_SIZE];
+        if (insn->size == 0 || insn->ip != dec->ip) {
+            code = pt_image_lookup(dec, dec->ip, &avail);
+            if (code == NULL ||
+                pt_decode_insn(code, avail, dec->ip, dec->mode64, insn) != 0) {
+                insn->size = 0;
+                pt_lose_sync(dec);
+                continue;
+            }
+            insn->ip = dec->ip;
+        }
+        if (steps >= PT_WALK_MAX_INSNS) {
+            pt_lose_sync(dec);
+            continue;
+        }
+
+        next = dec->ip + insn->size;
+        if (!dec->mode64)
+            next &= 0xffffffffULL;
+
+        switch (insn->iclass) {
+        case PT_INSN_OTHER:
+            dec->ip = next;
+            continue;
+        case PT_INSN_JMP:
+            pt_emit(dec, out, dec->ip, insn->target);
+            dec->ip = insn->target;
+            continue;
+        case PT_INSN_CALL:
+            pt_emit(dec, out, dec->ip, insn->target);
+            pt_push_ret(dec, next);
+            dec->ip = insn->target;
+            continue;
+        case PT_INSN_JCC:
+            if (dec->tnt_count) {
+                if (pt_pop_tnt(dec)) {
+                    pt_emit(dec, out, dec->ip, insn->target);
+                    dec->ip = insn->target;
+                } else {
+                    dec->ip = next;
+                }
+                continue;
+            }
+            // Only a conditional branch leaving the filters goes without a bit
+            if (dec->walk != PT_WALK_PGD) {
+                pt_lose_sync(dec);
+                continue;
+            }
+            break;
+        case PT_INSN_RET:
+            // A compressed return goes back to its call
+            if (dec->tnt_count) {
+                if (!pt_pop_tnt(dec) || dec->ret_count == 0) {
+                    pt_lose_sync(dec);
+                    continue;
+                }
+                target = pt_pop_ret(dec);
+                pt_emit(dec, out, dec->ip, target);
+                dec->ip = target;
+                continue;
+            }
+            break;
+        default:
+            break;
+        }
+
+        // The branch takes the pending TIP or PGD target, the TNT bits before
+        // it are all spent by then
+        if ((dec->walk != PT_WALK_TIP && dec->walk != PT_WALK_PGD) ||
+            dec->tnt_count) {
+            pt_lose_sync(dec);
+            continue;
+        }
+
+        if (insn->iclass == PT_INSN_RET && dec->ret_count)
+            pt_pop_ret(dec);
+        else if (insn->iclass == PT_INSN_CALL_IND)
+            pt_push_ret(dec, next);
+
+        if (dec->target_valid)
+            pt_emit(dec, out, dec->ip, dec->target);
+        if (dec->walk == PT_WALK_TIP && dec->target_valid)
+            pt_set_ip(dec, dec->target);
+        else
+            dec->ip_valid = 0;
+        return 1;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_resync
+// Description  : Skip the bytes that are not packets to the next PSB
+//
+// Inputs       : struct pt_decoder *dec : the decoder
+// Outputs      : void
+
+static void pt_resync(struct pt_decoder *dec) {
+    long long offset;
+
+    offset = pt_sync_forward(dec->buf, dec->size, dec->pos + 1);
+    dec->pos = offset < 0 ? dec->size : (unsigned long long)offset;
+    pt_reset(dec);
+    dec->errors++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_step
+// Description  : Parse the next packet of a decoder and update the decoder
+//                state, setting up the walk the packet asks for
+//
+// Inputs       : struct pt_decoder *dec : the decoder
+// Outputs      : int : 1 if a packet is parsed or skipped, 0 at the end
+
+static int pt_step(struct pt_decoder *dec) {
+    struct pt_packet packet;
+    int size, valid;
+
+    size = pt_next_packet(dec->buf + dec->pos, dec->size - dec->pos, &packet);
+    if (size == 0)
+        return 0;
+    if (size < 0) {
+        pt_resync(dec);
+        return 1;
+    }
+
+    dec->pos += size;
+    dec->packets++;
+
+    switch (packet.type) {
+    case PT_PACKET_PSB:
+        pt_reset(dec);
+        dec->in_psb = 1;
+        break;
+    case PT_PACKET_PSBEND:
+        dec->in_psb = 0;
+        break;
+    case PT_PACKET_TNT:
+        if (!dec->ip_valid)
+            break;
+        if (dec->tnt_count + packet.count > 64) {
+            pt_lose_sync(dec);
+            break;
+        }
+        dec->tnt = (dec->tnt << packet.count) | packet.payload;
+        dec->tnt_count += packet.count;
+        dec->walk = PT_WALK_TNT;
+        break;
+    case PT_PACKET_TIP:
+        dec->target_valid = pt_packet_ip(dec, &packet);
+        dec->target = packet.payload;
+        dec->walk = dec->fup_pending ? PT_WALK_EVENT : PT_WALK_TIP;
+        break;
+    case PT_PACKET_TIP_PGD:
+        dec->target_valid = pt_packet_ip(dec, &packet);
+        dec->target = packet.payload;
+        dec->walk = dec->fup_pending ? PT_WALK_EVENT_PGD : PT_WALK_PGD;
+        break;
+    case PT_PACKET_TIP_PGE:
+        valid = pt_packet_ip(dec, &packet);
+        dec->fup_pending = 0;
+        dec->in_ovf = 0;
+        if (valid)
+            pt_set_ip(dec, packet.payload);
+        break;
+    case PT_PACKET_FUP:
+        if (!pt_packet_ip(dec, &packet))
+            break;
+        // Status FUPs tell where the trace goes on
+        if (dec->in_psb || dec->in_ovf) {
+            dec->in_ovf = 0;
+            dec->fup_pending = 0;
+            pt_set_ip(dec, packet.payload);
+            break;
+        }
+        dec->fup_ip = packet.payload;
+        dec->walk = PT_WALK_FUP;
+        break;
+    case PT_PACKET_MODE:
+        if ((packet.payload >> 5) != PT_MODE_EXEC)
+            break;
+        dec->next_mode64 = packet.payload & PT_MODE_EXEC_CSL;
+        dec->mode_pending = 1;
+        if (!dec->ip_valid || dec->in_psb)
+            pt_set_mode(dec, dec->next_mode64);
+        break;
+    case PT_PACKET_TSC:
+        dec->tsc = packet.payload;
+        break;
+    case PT_PACKET_OVF:
+        pt_reset(dec);
+        dec->in_ovf = 1;
+        dec->overflows++;
+        break;
+    default:
+        break;
+    }
+
+    return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_decoder_init
+// Description  : Set up a decoder on a buffer, synced to its first PSB. The
+//                code image is optional, without it only the TIP targets are
+//                decoded, as branches from an unknown source. The buffer and
+//                the image must outlive the decoder.
+//
+// Inputs       : struct pt_decoder *dec : the decoder
+//                const unsigned char *buf : the packet bytes
+//                unsigned long long size : the packet bytes size
+//                const struct pt_image_section *sections : the code image
+//                unsigned int section_count : the code image sections
+// Outputs      : void
+
+void pt_decoder_init(struct pt_decoder *dec, const unsigned char *buf,
+                     unsigned long long size,
+                     const struct pt_image_section *sections,
+                     unsigned int section_count) {
+    long long offset;
+
+    memset(dec, 0, sizeof(*dec));
+    dec->buf = buf;
+    dec->size = size;
+    dec->sections = sections;
+    dec->section_count = sections == NULL ? 0 : section_count;
+    dec->mode64 = 1;
+
+    offset = pt_sync_forward(buf, size, 0);
+    dec->pos = offset < 0 ? size : (unsigned long long)offset;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_decode_packets
+// Description  : Decode the next packets of a decoder, without the branches.
+//                The IP packets carry the full IP in `payload`, or have a
+//                `count` of 0 if the IP is suppressed. Bytes that are not
+//                packets are skipped to the next PSB.
+//
+// Inputs       : struct pt_decoder *dec : the decoder
+//                struct pt_packet *packets : the decoded packets
+//                unsigned int max : the decoded packets size
+// Outputs      : int : the number of packets decoded, 0 at the end
+
+int pt_decode_packets(struct pt_decoder *dec, struct pt_packet *packets,
+                      unsigned int max) {
+    struct pt_packet *packet;
+    unsigned int count = 0;
+    int size;
+
+    while (count < max) {
+        packet = &packets[count];
+        size = pt_next_packet(dec->buf + dec->pos, dec->size - dec->pos, packet);
+        if (size == 0)
+            break;
+        if (size < 0) {
+            pt_resync(dec);
+            continue;
+        }
+
+        dec->pos += size;
+        dec->packets++;
+        count++;
+
+        switch (packet->type) {
+        case PT_PACKET_PSB:
+            dec->last_ip = 0;
+            break;
+        case PT_PACKET_TIP:
+        case PT_PACKET_TIP_PGE:
+        case PT_PACKET_TIP_PGD:
+        case PT_PACKET_FUP:
+            if (!pt_packet_ip(dec, packet))
+                packet->count = 0;
+            break;
+        case PT_PACKET_TSC:
+            dec->tsc = packet->payload;
+            break;
+        default:
+            break;
+        }
+    }
+
+    return count;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_decode_branches
+// Description  : Decode the next taken branches of a decoder. The branches
+//                are written in execution order, each stamped with the last
+//                TSC. A branch from an unknown source, e.g. without the code
+//                image or after the flow lost sync, has a `from` of 0.
+//
+// Inputs       : struct pt_decoder *dec : the decoder
+//                struct pt_branch *branches : the decoded branches
+//                unsigned int max : the decoded branches size
+// Outputs      : int : the number of branches decoded, 0 at the end
+
+int pt_decode_branches(struct pt_decoder *dec, struct pt_branch *branches,
+                       unsigned int max) {
+    struct pt_branch_out out;
+
+    out.branches = branches;
+    out.max = max;
+    out.count = 0;
+
+    while (out.count < max) {
+        if (dec->walk != PT_WALK_NONE) {
+            if (!pt_walk(dec, &out))
+                break;
+            dec->walk = PT_WALK_NONE;
+            continue;
+        }
+        if (!pt_step(dec))
+            break;
+    }
+
+    return out.count;
+}
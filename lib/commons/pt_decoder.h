@@ -0,0 +1,171 @@
+#ifndef LIBIHT_PT_DECODER_H
+#define LIBIHT_PT_DECODER_H
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lib/commons/pt_decoder.h
+//  Description    : This is the header file for the Intel Processor Trace (PT)
+//                   packet decoder. It parses the packet stream captured by the
+//                   PT backend and rebuilds the taken branches from it, walking
+//                   the code image of the traced process. It depends on no
+//                   platform or kernel interface, so recorded packet files can
+//                   be decoded offline.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : July 16, 2024
+//
+
+//
+// Library constants
+
+// PT packet types
+enum PT_PACKET_TYPE {
+    PT_PACKET_INVALID,
+    PT_PACKET_PAD,
+    PT_PACKET_PSB,              // Packet stream boundary, a sync point
+    PT_PACKET_PSBEND,           // End of the status packets after a PSB
+    PT_PACKET_TNT,              // Taken / not taken bits, short or long
+    PT_PACKET_TIP,              // Target IP of an indirect branch or event
+    PT_PACKET_TIP_PGE,          // Target IP, packet generation enabled
+    PT_PACKET_TIP_PGD,          // Target IP, packet generation disabled
+    PT_PACKET_FUP,              // Source IP of an asynchronous event
+    PT_PACKET_MODE,             // Execution mode or transaction state
+    PT_PACKET_TSC,              // Timestamp counter
+    PT_PACKET_MTC,              // Mini timestamp counter
+    PT_PACKET_CYC,              // Cycle count
+    PT_PACKET_TMA,              // TSC to core crystal clock ratio
+    PT_PACKET_CBR,              // Core bus ratio
+    PT_PACKET_OVF,              // Internal buffer overflow, packets lost
+    PT_PACKET_PIP,              // CR3 change
+    PT_PACKET_VMCS,             // VMCS pointer
+    PT_PACKET_MNT,              // Maintenance
+    PT_PACKET_PTW,              // PTWRITE payload
+    PT_PACKET_STOP,             // TraceStop
+    PT_PACKET_POWER,            // EXSTOP, MWAIT, PWRE or PWRX
+};
+
+// MODE packet leaves
+#define PT_MODE_EXEC                0x0
+#define PT_MODE_TSX                 0x1
+
+// MODE.Exec bits
+#define PT_MODE_EXEC_CSL            (1 << 0)
+#define PT_MODE_EXEC_CSD            (1 << 1)
+
+// Size of a PSB packet, the pattern 02 82 repeated 8 times
+#define PT_PSB_SIZE                 16
+
+// Depth of the return stack for the compressed returns
+#define PT_RET_STACK_DEPTH          64
+
+// Instructions cached by a decoder, a power of 2
+#define PT_INSN_CACHE_SIZE          256
+
+// Most instructions walked for a single packet before losing sync, e.g. on a
+// `jmp .` or a wrong image
+#define PT_WALK_MAX_INSNS           0x100000
+
+//
+// Type definitions
+
+// Define a decoded PT packet
+struct pt_packet {
+    unsigned int type;          // enum PT_PACKET_TYPE
+    unsigned int size;          // Packet size in bytes
+    unsigned int count;         // IPBytes of IP packets, bits of TNT packets
+    unsigned int reserved;      // Reserved for future use
+    unsigned long long payload; // IP, TNT bits oldest first, TSC, mode, ...
+};
+
+// Define a code section of the traced process, e.g. the text of a mapped
+// file at the address in its mapping record
+struct pt_image_section {
+    unsigned long long vaddr;   // Virtual address of the first byte
+    unsigned long long size;    // Size in bytes
+    const unsigned char *data;  // Code bytes
+};
+
+// Define a decoded branch, laid out like `struct bts_record`, so the decoded
+// branches feed the same consumers as the BTS records
+struct pt_branch {
+    unsigned long long from;    // Branch source, 0 if not known
+    unsigned long long to;      // Branch target
+    unsigned long long misc;    // TSC of the last timing packet, 0 if none
+};
+
+// Define a decoded instruction, cached by the decoder
+struct pt_insn {
+    unsigned long long ip;      // Instruction address
+    unsigned long long target;  // Target of a direct branch
+    unsigned int size;          // Instruction size in bytes, 0 if not cached
+    unsigned int iclass;        // Branch class, see pt_decoder.c
+};
+
+// Define the PT decoder state. A decoder only looks at its own buffer, so the
+// chunks of a stream split at PSB boundaries decode in parallel.
+struct pt_decoder {
+    const unsigned char *buf;   // Packet bytes
+    unsigned long long size;    // Packet bytes size
+    unsigned long long pos;     // Offset of the next packet
+    const struct pt_image_section *sections; // Code image, can be NULL
+    unsigned int section_count; // Code image sections
+    unsigned int last_section;  // Section of the last code lookup
+    unsigned long long last_ip; // Base of the IP compression
+    unsigned long long ip;      // IP of the next instruction in the flow
+    unsigned long long fup_ip;  // Source IP of the pending event
+    unsigned long long target;  // Target IP of the pending walk
+    unsigned int target_valid;  // The target IP is not suppressed
+    unsigned long long tsc;     // TSC of the last TSC packet
+    unsigned long long tnt;     // Pending TNT bits, oldest first
+    unsigned int tnt_count;     // Pending TNT bits count
+    unsigned int walk;          // Pending walk, see pt_decoder.c
+    unsigned int ip_valid;      // The flow IP is known
+    unsigned int mode64;        // The flow runs in 64-bit mode
+    unsigned int next_mode64;   // Mode of the pending MODE.Exec
+    unsigned int mode_pending;  // MODE.Exec applies at the next target IP
+    unsigned int in_psb;        // Between PSB and PSBEND
+    unsigned int in_ovf;        // Between OVF and the FUP resuming the trace
+    unsigned int fup_pending;   // An event source waits for its target
+    unsigned int ret_top;       // Next slot of the return stack
+    unsigned int ret_count;     // Entries in the return stack
+    unsigned long long ret_stack[PT_RET_STACK_DEPTH]; // Return addresses
+    struct pt_insn insn_cache[PT_INSN_CACHE_SIZE]; // Decoded instructions
+    unsigned long long packets; // Packets decoded
+    unsigned long long branches; // Branches decoded
+    unsigned long long errors;  // Sync losses, e.g. a gap in the image
+    unsigned long long overflows; // OVF packets, trace lost by the hardware
+};
+
+//
+// Function prototypes
+
+int pt_next_packet(const unsigned char *buf, unsigned long long size,
+                   struct pt_packet *packet);
+// Parse the packet at the start of a buffer
+
+long long pt_sync_forward(const unsigned char *buf, unsigned long long size,
+                          unsigned long long offset);
+// Find the next PSB at or after an offset of a buffer
+
+unsigned long long pt_split_chunks(const unsigned char *buf,
+                                   unsigned long long size,
+                                   unsigned long long min_chunk,
+                                   unsigned long long *offsets,
+                                   unsigned long long max);
+// Split a buffer at PSB boundaries into chunks that decode independently
+
+void pt_decoder_init(struct pt_decoder *dec, const unsigned char *buf,
+                     unsigned long long size,
+                     const struct pt_image_section *sections,
+                     unsigned int section_count);
+// Set up a decoder on a buffer, synced to its first PSB
+
+int pt_decode_packets(struct pt_decoder *dec, struct pt_packet *packets,
+                      unsigned int max);
+// Decode the next packets of a decoder, without the branches
+
+int pt_decode_branches(struct pt_decoder *dec, struct pt_branch *branches,
+                       unsigned int max);
+// Decode the next taken branches of a decoder
+
+#endif // LIBIHT_PT_DECODER_H
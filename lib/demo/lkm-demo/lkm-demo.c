@@ -92,19 +92,20 @@ int main(int argc, char* argv[]){
     // Simulate critical logic
     func1();
 
-    // Dump BTS
-    dump_bts(query);
+    // Read BTS records since the start of tracing
+    struct bts_cursor cursor;
+    cursor.cursor = 0;
+    cursor.count = MAX_BTS_LIST_LEN;
+    cursor.records = query.buffer->bts_buffer_base;
+    read_bts(query, &cursor);
 
     // Disable BTS
     disable_bts(query);
-    // Print BTS buffer
-    int bts_tos = 0;
-    while (bts_tos < 1024 && (query.buffer->bts_buffer_base[bts_tos].from !=0 || query.buffer->bts_buffer_base[bts_tos].to != 0)) {
-        bts_tos ++;
-    }
-    printf("BTS TOS: %d\n", bts_tos);
-    for (int i = 0; i < bts_tos; i++) {
-        printf("BTS[%d]: 0x%llx -> 0x%llx %llu\n", i, query.buffer->bts_buffer_base[i].from, query.buffer->bts_buffer_base[i].to, query.buffer->bts_buffer_base[i].misc);
+
+    // Print BTS records in order
+    printf("BTS records: %llu, lost: %llu\n", cursor.count, cursor.lost);
+    for (int i = 0; i < cursor.count; i++) {
+        printf("BTS[%d]: 0x%llx -> 0x%llx %llu\n", i, cursor.records[i].from, cursor.records[i].to, cursor.records[i].misc);
     }
     printf("\n");
 #endif
@@ -0,0 +1,355 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lib/demo/lkm-demo/pt-bench.c
+//  Description    : This is a simple throughput benchmark of the Intel PT
+//                   packet decoder. It decodes a recorded packet file, or a
+//                   synthetic stream of a small loop, first packets only, then
+//                   branches on one thread, then branches on several threads
+//                   over the chunks split at PSB boundaries, and reports the
+//                   packets per second of each.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : July 16, 2024
+//
+
+#include "../../commons/pt_decoder.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_SECTIONS        16
+#define MAX_THREADS         256
+#define DECODE_BATCH        1024
+#define CHUNKS_PER_THREAD   16
+
+// The synthetic stream has a PSB every 4K, like the default PSB frequency
+#define SYNTH_PSB_PERIOD    0x1000
+#define SYNTH_VADDR         0x400000ULL
+
+// The synthetic loop, the TNT bits drive the jne and the TIPs the jmp
+static const unsigned char synth_code[] = {
+    0x48, 0x83, 0xc0, 0x01,     // 0x400000: add rax, 1
+    0x75, 0xfa,                 // 0x400004: jne 0x400000
+    0xff, 0xe0,                 // 0x400006: jmp rax
+};
+
+// Define a parallel decode job
+struct bench_job {
+    const unsigned char *buf;
+    unsigned long long size;
+    const struct pt_image_section *sections;
+    unsigned int section_count;
+    unsigned long long *offsets;
+    unsigned long long chunks;
+    unsigned long long next;
+    unsigned long long packets;
+    unsigned long long branches;
+    unsigned long long errors;
+};
+
+void print_usage()
+{
+    printf("Usage: pt-bench [-t threads] [-s MiB] [-o file] [-i file:vaddr[:offset]]... [trace]\n");
+    printf("-t: the number of decode threads, all cores by default\n");
+    printf("-s: the size of the synthetic stream, 64 MiB by default\n");
+    printf("-o: write the synthetic stream to file and its code to file.img\n");
+    printf("-i: load the code image of a trace from a file at a virtual address\n");
+    printf("trace: a recorded packet file, a synthetic stream if none\n");
+    printf("Example: pt-bench -t 8 -s 256\n");
+    fflush(stdout);
+    exit(-1);
+}
+
+double elapsed_ns(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+unsigned char *read_file(const char *path, unsigned long long *size)
+{
+    unsigned char *data;
+    FILE *file;
+    long length;
+
+    file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    data = malloc(length > 0 ? length : 1);
+    if (data == NULL || fread(data, 1, length, file) != (size_t)length) {
+        perror(path);
+        free(data);
+        fclose(file);
+        return NULL;
+    }
+
+    fclose(file);
+    *size = length;
+    return data;
+}
+
+int write_file(const char *path, const unsigned char *data, unsigned long long size)
+{
+    FILE *file;
+
+    file = fopen(path, "wb");
+    if (file == NULL || fwrite(data, 1, size, file) != size) {
+        perror(path);
+        if (file != NULL)
+            fclose(file);
+        return -1;
+    }
+
+    fclose(file);
+    return 0;
+}
+
+int load_section(char *arg, struct pt_image_section *section)
+{
+    unsigned long long offset = 0, size;
+    unsigned char *data;
+    char *vaddr, *skip;
+
+    vaddr = strchr(arg, ':');
+    if (vaddr == NULL)
+        return -1;
+    *vaddr++ = '\0';
+    skip = strchr(vaddr, ':');
+    if (skip != NULL) {
+        *skip++ = '\0';
+        offset = strtoull(skip, NULL, 0);
+    }
+
+    data = read_file(arg, &size);
+    if (data == NULL || offset > size)
+        return -1;
+
+    section->vaddr = strtoull(vaddr, NULL, 0);
+    section->size = size - offset;
+    section->data = data + offset;
+    return 0;
+}
+
+unsigned long long put_bytes(unsigned char *buf, unsigned long long pos,
+                             unsigned long long value, int size)
+{
+    while (size--) {
+        buf[pos++] = value & 0xff;
+        value >>= 8;
+    }
+    return pos;
+}
+
+// Synthesize the packets of the loop, each iteration takes the jne 64 times,
+// falls through once to the jmp and goes back with a TIP
+unsigned long long synth_trace(unsigned char *buf, unsigned long long size,
+                               unsigned long long *branches)
+{
+    unsigned long long pos = 0, next_psb = 0, tsc = 1;
+    int i;
+
+    *branches = 0;
+    while (pos + 64 <= size) {
+        if (pos >= next_psb) {
+            // PSB+, with the IP the trace goes on from
+            for (i = 0; i < PT_PSB_SIZE / 2; i++) {
+                buf[pos++] = 0x02;
+                buf[pos++] = 0x82;
+            }
+            buf[pos++] = 0x99;              // MODE.Exec, 64-bit
+            buf[pos++] = PT_MODE_EXEC_CSL;
+            buf[pos++] = 0xdd;              // FUP, full IP
+            pos = put_bytes(buf, pos, SYNTH_VADDR, 8);
+            buf[pos++] = 0x02;              // PSBEND
+            buf[pos++] = 0x23;
+            next_psb = pos + SYNTH_PSB_PERIOD;
+        }
+
+        buf[pos++] = 0x19;                  // TSC
+        pos = put_bytes(buf, pos, tsc++, 7);
+        buf[pos++] = 0xfe;                  // TNT, 6 taken
+        buf[pos++] = 0xfe;                  // TNT, 6 taken
+        buf[pos++] = 0x02;                  // Long TNT, 47 taken
+        buf[pos++] = 0xa3;
+        pos = put_bytes(buf, pos, 0xffffffffffffULL, 6);
+        buf[pos++] = 0xfc;                  // TNT, 5 taken and 1 not taken
+        buf[pos++] = 0x2d;                  // TIP, low 16 bits of the IP
+        pos = put_bytes(buf, pos, SYNTH_VADDR, 2);
+        *branches += 6 + 6 + 47 + 5 + 1;
+    }
+
+    return pos;
+}
+
+void *decode_worker(void *arg)
+{
+    struct bench_job *job = arg;
+    struct pt_branch branches[DECODE_BATCH];
+    struct pt_decoder dec;
+    unsigned long long i, start, end;
+    unsigned long long packets = 0, decoded = 0, errors = 0;
+
+    while ((i = __sync_fetch_and_add(&job->next, 1)) < job->chunks) {
+        start = job->offsets[i];
+        end = i + 1 < job->chunks ? job->offsets[i + 1] : job->size;
+        pt_decoder_init(&dec, job->buf + start, end - start, job->sections,
+                        job->section_count);
+        while (pt_decode_branches(&dec, branches, DECODE_BATCH) > 0)
+            ;
+        packets += dec.packets;
+        decoded += dec.branches;
+        errors += dec.errors;
+    }
+
+    __sync_fetch_and_add(&job->packets, packets);
+    __sync_fetch_and_add(&job->branches, decoded);
+    __sync_fetch_and_add(&job->errors, errors);
+    return NULL;
+}
+
+void report(const char *name, unsigned long long packets,
+            unsigned long long branches, unsigned long long size, double ns)
+{
+    printf("%-18s %llu packets, %llu branches, %.1f Mpackets/s, %.1f Mbranches/s, %.1f MiB/s\n",
+            name, packets, branches, packets * 1e3 / ns, branches * 1e3 / ns,
+            size * 1e9 / ns / (1 << 20));
+}
+
+int main(int argc, char* argv[]){
+    struct pt_image_section sections[MAX_SECTIONS];
+    struct pt_branch *branches;
+    struct pt_packet *packets;
+    struct pt_decoder dec;
+    struct bench_job job;
+    struct timespec start, end;
+    pthread_t threads[MAX_THREADS];
+    unsigned long long size, expected = 0, min_chunk, max_chunks;
+    unsigned char *trace;
+    unsigned int section_count = 0;
+    char *out = NULL, *img;
+    int i, thread_count, mib = 64;
+    double ns;
+
+    thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+            thread_count = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            mib = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            out = argv[++i];
+        else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc &&
+                 section_count < MAX_SECTIONS) {
+            if (load_section(argv[++i], &sections[section_count++]) != 0)
+                print_usage();
+        } else if (argv[i][0] != '-' && i == argc - 1)
+            break;
+        else
+            print_usage();
+    }
+    if (thread_count <= 0 || thread_count > MAX_THREADS || mib <= 0)
+        print_usage();
+
+    if (i < argc) {
+        trace = read_file(argv[i], &size);
+        if (trace == NULL)
+            return -1;
+    } else {
+        // Synthetic stream on its own code image
+        size = (unsigned long long)mib << 20;
+        trace = malloc(size);
+        if (trace == NULL)
+            return -1;
+        size = synth_trace(trace, size, &expected);
+        sections[0].vaddr = SYNTH_VADDR;
+        sections[0].size = sizeof(synth_code);
+        sections[0].data = synth_code;
+        section_count = 1;
+
+        if (out != NULL) {
+            img = malloc(strlen(out) + 5);
+            if (img == NULL)
+                return -1;
+            sprintf(img, "%s.img", out);
+            if (write_file(out, trace, size) != 0 ||
+                write_file(img, synth_code, sizeof(synth_code)) != 0)
+                return -1;
+            printf("Wrote %s, decode with: pt-decode -i %s:0x%llx %s\n",
+                    out, img, SYNTH_VADDR, out);
+            free(img);
+        }
+    }
+
+    branches = malloc(sizeof(*branches) * DECODE_BATCH);
+    packets = malloc(sizeof(*packets) * DECODE_BATCH);
+    if (branches == NULL || packets == NULL)
+        return -1;
+    printf("Trace: %llu bytes, %u image sections, %d threads\n",
+            size, section_count, thread_count);
+
+    // Packets only
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pt_decoder_init(&dec, trace, size, sections, section_count);
+    while (pt_decode_packets(&dec, packets, DECODE_BATCH) > 0)
+        ;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    report("packets:", dec.packets, 0, size, elapsed_ns(&start, &end));
+
+    // Branches on one thread
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pt_decoder_init(&dec, trace, size, sections, section_count);
+    while (pt_decode_branches(&dec, branches, DECODE_BATCH) > 0)
+        ;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    report("branches:", dec.packets, dec.branches, size, elapsed_ns(&start, &end));
+    if (dec.errors)
+        printf("  %llu sync errors\n", dec.errors);
+
+    // Branches on several threads, over the chunks split at PSB boundaries
+    min_chunk = size / ((unsigned long long)thread_count * CHUNKS_PER_THREAD);
+    if (min_chunk < PT_PSB_SIZE)
+        min_chunk = PT_PSB_SIZE;
+    max_chunks = size / min_chunk + 1;
+    memset(&job, 0, sizeof(job));
+    job.buf = trace;
+    job.size = size;
+    job.sections = sections;
+    job.section_count = section_count;
+    job.offsets = malloc(sizeof(*job.offsets) * max_chunks);
+    if (job.offsets == NULL)
+        return -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    job.chunks = pt_split_chunks(trace, size, min_chunk, job.offsets, max_chunks);
+    for (i = 0; i < thread_count; i++)
+        pthread_create(&threads[i], NULL, decode_worker, &job);
+    for (i = 0; i < thread_count; i++)
+        pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ns = elapsed_ns(&start, &end);
+    report("parallel:", job.packets, job.branches, size, ns);
+    printf("  %llu chunks\n", job.chunks);
+
+    if (job.branches != dec.branches)
+        printf("Mismatch: %llu branches in parallel, %llu on one thread\n",
+                job.branches, dec.branches);
+    if (expected && dec.branches != expected)
+        printf("Mismatch: %llu branches decoded, %llu expected\n",
+                dec.branches, expected);
+
+    free(job.offsets);
+    free(packets);
+    free(branches);
+    free(trace);
+    return (job.branches != dec.branches ||
+            (expected && dec.branches != expected)) ? -1 : 0;
+}
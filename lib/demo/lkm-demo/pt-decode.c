@@ -0,0 +1,139 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lib/demo/lkm-demo/pt-decode.c
+//  Description    : This is a simple offline decoder for recorded Intel PT
+//                   packet files, e.g. the bytes of the PT records of a
+//                   session or a synthetic stream written by pt-bench. It
+//                   prints the taken branches, or the packets with -p. The code
+//                   image is loaded from files at their virtual addresses.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : July 16, 2024
+//
+
+#include "../../commons/pt_decoder.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_SECTIONS    16
+#define DECODE_BATCH    256
+
+static const char *packet_names[] = {
+    "INVALID", "PAD", "PSB", "PSBEND", "TNT", "TIP", "TIP.PGE", "TIP.PGD",
+    "FUP", "MODE", "TSC", "MTC", "CYC", "TMA", "CBR", "OVF", "PIP", "VMCS",
+    "MNT", "PTW", "STOP", "POWER"
+};
+
+void print_usage()
+{
+    printf("Usage: pt-decode [-p] [-i file:vaddr[:offset]]... trace\n");
+    printf("-p: print the packets instead of the branches\n");
+    printf("-i: load the code image from a file at a virtual address, skipping\n");
+    printf("    offset bytes of the file\n");
+    printf("Example: pt-decode -i /usr/bin/ls:0x5555555586c0:0x46c0 ls.pt\n");
+    fflush(stdout);
+    exit(-1);
+}
+
+unsigned char *read_file(const char *path, unsigned long long *size)
+{
+    unsigned char *data;
+    FILE *file;
+    long length;
+
+    file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    data = malloc(length > 0 ? length : 1);
+    if (data == NULL || fread(data, 1, length, file) != (size_t)length) {
+        perror(path);
+        free(data);
+        fclose(file);
+        return NULL;
+    }
+
+    fclose(file);
+    *size = length;
+    return data;
+}
+
+int load_section(char *arg, struct pt_image_section *section)
+{
+    unsigned long long offset = 0, size;
+    unsigned char *data;
+    char *vaddr, *skip;
+
+    vaddr = strchr(arg, ':');
+    if (vaddr == NULL)
+        return -1;
+    *vaddr++ = '\0';
+    skip = strchr(vaddr, ':');
+    if (skip != NULL) {
+        *skip++ = '\0';
+        offset = strtoull(skip, NULL, 0);
+    }
+
+    data = read_file(arg, &size);
+    if (data == NULL || offset > size)
+        return -1;
+
+    section->vaddr = strtoull(vaddr, NULL, 0);
+    section->size = size - offset;
+    section->data = data + offset;
+    return 0;
+}
+
+int main(int argc, char* argv[]){
+    struct pt_image_section sections[MAX_SECTIONS];
+    struct pt_branch branches[DECODE_BATCH];
+    struct pt_packet packets[DECODE_BATCH];
+    struct pt_decoder dec;
+    unsigned char *trace;
+    unsigned long long size;
+    unsigned int section_count = 0;
+    int i, count, print_packets = 0;
+
+    for (i = 1; i < argc - 1; i++) {
+        if (strcmp(argv[i], "-p") == 0) {
+            print_packets = 1;
+        } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc - 1 &&
+                   section_count < MAX_SECTIONS) {
+            if (load_section(argv[++i], &sections[section_count++]) != 0)
+                print_usage();
+        } else {
+            print_usage();
+        }
+    }
+    if (i != argc - 1)
+        print_usage();
+
+    trace = read_file(argv[argc - 1], &size);
+    if (trace == NULL)
+        return -1;
+
+    pt_decoder_init(&dec, trace, size, sections, section_count);
+    if (print_packets) {
+        while ((count = pt_decode_packets(&dec, packets, DECODE_BATCH)) > 0)
+            for (i = 0; i < count; i++)
+                printf("%-8s size %u count %u payload 0x%llx\n",
+                        packet_names[packets[i].type], packets[i].size,
+                        packets[i].count, packets[i].payload);
+    } else {
+        while ((count = pt_decode_branches(&dec, branches, DECODE_BATCH)) > 0)
+            for (i = 0; i < count; i++)
+                printf("PT: 0x%llx -> 0x%llx %llu\n", branches[i].from,
+                        branches[i].to, branches[i].misc);
+    }
+
+    fprintf(stderr, "%llu packets, %llu branches, %llu errors, %llu overflows\n",
+            dec.packets, dec.branches, dec.errors, dec.overflows);
+    return 0;
+}
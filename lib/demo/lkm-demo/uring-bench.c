@@ -0,0 +1,129 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lib/demo/lkm-demo/uring-bench.c
+//  Description    : This is a simple benchmark comparing the ioctl path and the
+//                   io_uring path of LIBIHT LKM APIs. The same requests are
+//                   sent one syscall each through ioctl, then in batches
+//                   through io_uring and through the batch request.
+//
+//   Author        : Thomason Zhao
+//   Last Modified : July 16, 2024
+//
+
+#include "../../commons/api.h"
+#include "../../lkm/include/lkm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LIBIHT_LKM_IOCTL_MAGIC 'l'
+#define LIBIHT_LKM_IOCTL_BASE       _IO(LIBIHT_LKM_IOCTL_MAGIC, 0)
+
+void print_usage()
+{
+    printf("Usage: uring-bench [count] [batch]\n");
+    printf("count: the number of requests to send on each path\n");
+    printf("batch: the number of requests submitted per io_uring syscall\n");
+    printf("Example: uring-bench 100000 64\n");
+    fflush(stdout);
+    exit(-1);
+}
+
+double elapsed_ns(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+int main(int argc, char* argv[]){
+    struct libiht_uring *ring;
+    struct xioctl_request request, *requests;
+    struct timespec start, end;
+    unsigned long long user_data;
+    int count, batch, i, done, res, failed, *results;
+    double ioctl_ns, uring_ns, batch_ns;
+
+    if (argc != 3)
+        print_usage();
+
+    count = atoi(argv[1]);
+    batch = atoi(argv[2]);
+    if (count <= 0 || batch <= 0)
+        print_usage();
+
+    ring = open_uring(batch);
+    if (ring == NULL)
+        return -1;
+
+    // A cheap request, so the cost is dominated by the submission path
+    request.cmd = LIBIHT_IOCTL_CONFIG_SESSION;
+    request.body.session.session_config.watermark = 0;
+    request.body.session.session_config.buffer_size = 0;
+
+    // One syscall per request
+    failed = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; i++)
+        if (ioctl(ring->dev_fd, LIBIHT_LKM_IOCTL_BASE, &request) != 0)
+            failed++;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ioctl_ns = elapsed_ns(&start, &end);
+    printf("ioctl:    %d requests, %d failed, %.1f ns/request\n",
+            count, failed, ioctl_ns / count);
+
+    // One syscall per batch
+    failed = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; i += batch) {
+        for (done = 0; done < batch && i + done < count; done++)
+            queue_uring_request(ring, &request, i + done);
+        if (submit_uring(ring, done) < 0) {
+            close_uring(ring);
+            return -1;
+        }
+        while (reap_uring_completion(ring, &user_data, &res))
+            if (res != 0)
+                failed++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uring_ns = elapsed_ns(&start, &end);
+    printf("io_uring: %d requests, %d failed, %.1f ns/request, batch %d\n",
+            count, failed, uring_ns / count, batch);
+    printf("speedup:  %.2fx\n", ioctl_ns / uring_ns);
+
+    // One batch request per batch
+    requests = malloc(batch * sizeof(struct xioctl_request));
+    results = malloc(batch * sizeof(int));
+    if (requests == NULL || results == NULL) {
+        free(requests);
+        free(results);
+        close_uring(ring);
+        return -1;
+    }
+    for (i = 0; i < batch; i++)
+        requests[i] = request;
+
+    failed = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; i += batch) {
+        done = count - i < batch ? count - i : batch;
+        if (submit_batch(ring->dev_fd, requests, results, done) != 0) {
+            failed += done;
+            continue;
+        }
+        while (done--)
+            if (results[done] != 0)
+                failed++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    batch_ns = elapsed_ns(&start, &end);
+    printf("batch:    %d requests, %d failed, %.1f ns/request, batch %d\n",
+            count, failed, batch_ns / count, batch);
+    printf("speedup:  %.2fx\n", ioctl_ns / batch_ns);
+
+    free(requests);
+    free(results);
+    close_uring(ring);
+    return 0;
+}
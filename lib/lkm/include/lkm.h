@@ -12,6 +12,32 @@
 //
 
 #include "../../commons/api.h"
+#include <sys/types.h>
+
+//
+// Type definitions
+
+// io_uring set up for submitting requests to the device
+struct libiht_uring {
+    int ring_fd;                // io_uring file descriptor
+    int dev_fd;                 // Device file descriptor, a session of its own
+    unsigned int sq_entries;    // Number of submission entries
+    unsigned int pending;       // Queued requests not yet submitted
+    unsigned int *sq_head;      // Submission ring head
+    unsigned int *sq_tail;      // Submission ring tail
+    unsigned int *sq_mask;      // Submission ring mask
+    unsigned int *sq_array;     // Submission ring index array
+    unsigned int *cq_head;      // Completion ring head
+    unsigned int *cq_tail;      // Completion ring tail
+    unsigned int *cq_mask;      // Completion ring mask
+    void *sqes;                 // Submission entries
+    void *cqes;                 // Completion entries
+    void *sq_ring;              // Mapped submission ring
+    void *cq_ring;              // Mapped completion ring
+    size_t sq_ring_size;        // Size of the submission ring mapping
+    size_t cq_ring_size;        // Size of the completion ring mapping
+    size_t sqes_size;           // Size of the submission entries mapping
+};
 
 //
 // Function prototypes
@@ -23,15 +49,44 @@
 struct lbr_ioctl_request enable_lbr(unsigned int pid);
 // Enable LBR for a given process ID
 
+struct lbr_ioctl_request enable_lbr_flags(unsigned int pid, unsigned int flags);
+// Enable LBR for a given process ID with LIBIHT_LBR_* flags
+
 void disable_lbr(struct lbr_ioctl_request usr_request);
 // Disable LBR for a user request
 
 void dump_lbr(struct lbr_ioctl_request usr_request);
 // Dump LBR for a user request
 
+int dump_lbr_info(unsigned int pid, struct lbr_dump *dump);
+// Dump LBR of a process with the LBR_INFO and format of its core
+
 void config_lbr(struct lbr_ioctl_request usr_request);
 // Configure LBR for a user request
 
+int syscall_lbr(unsigned int pid, const int *syscalls, int count);
+// Snapshot LBR at the entry of the given syscalls
+
+int cfi_lbr(unsigned int pid, int action, const int *syscalls, int count,
+            struct lbr_stack_entry *edges, unsigned long long edge_count);
+// Check LBR against an allowlist of edges at the entry of the given syscalls
+
+struct lbr_ring_header *mmap_lbr(struct lbr_ioctl_request usr_request);
+// Map the LBR snapshot ring for a user request
+
+void munmap_lbr(struct lbr_ring_header *ring);
+// Unmap the LBR snapshot ring
+
+int consume_lbr_snapshot(struct lbr_ring_header *ring,
+                         struct lbr_snapshot *snapshot,
+                         struct lbr_stack_entry *entries,
+                         unsigned long long *info);
+// Consume the oldest snapshot from a mapped LBR snapshot ring
+
+int lbr_call_chain(unsigned long long tos, struct lbr_stack_entry *entries,
+                   unsigned int capacity, unsigned long long *chain, int max);
+// Unwind a LBR recorded in call-stack mode into a call chain
+
 // For BTS
 
 struct bts_ioctl_request enable_bts(unsigned int pid);
@@ -46,4 +101,108 @@ void dump_bts(struct bts_ioctl_request usr_request);
 void config_bts(struct bts_ioctl_request usr_request);
 // Configure BTS for a user request
 
+void read_bts(struct bts_ioctl_request usr_request, struct bts_cursor *cursor);
+// Read BTS records written since the cursor for a user request
+
+int govern_bts(unsigned int pid, unsigned int budget,
+               unsigned long long period_ns, unsigned long long record_cap);
+// Bound the BTS overhead of a process by duty cycling or a record cap
+
+struct bts_header *mmap_bts(struct bts_ioctl_request usr_request);
+// Map the BTS header page and buffer read-only for a user request
+
+void munmap_bts(struct bts_header *header);
+// Unmap the BTS header page and buffer
+
+struct bts_record *bts_mmap_records(struct bts_header *header);
+// Get the BTS records of a mapped BTS buffer
+
+unsigned long long bts_mmap_index(struct bts_header *header);
+// Get the record index the hardware will write next in a mapped BTS buffer
+
+// For PT
+
+struct pt_ioctl_request enable_pt(unsigned int pid);
+// Enable PT for a given process ID
+
+void disable_pt(struct pt_ioctl_request usr_request);
+// Disable PT for a user request
+
+void config_pt(struct pt_ioctl_request usr_request);
+// Configure PT trace bits and filters for a user request
+
+void read_pt(struct pt_ioctl_request usr_request, struct pt_cursor *cursor);
+// Read PT packet bytes written since the cursor for a user request
+
+struct pt_header *mmap_pt(struct pt_ioctl_request usr_request);
+// Map the PT header page and buffer read-only for a user request
+
+void munmap_pt(struct pt_header *header);
+// Unmap the PT header page and buffer
+
+unsigned char *pt_mmap_data(struct pt_header *header);
+// Get the packet bytes of a mapped PT buffer
+
+// For session
+
+int lbr_session_fd(void);
+// Get the file descriptor of the LBR session
+
+int bts_session_fd(void);
+// Get the file descriptor of the BTS session
+
+int pt_session_fd(void);
+// Get the file descriptor of the PT session
+
+int config_session(int fd, unsigned long long watermark,
+                   unsigned long long buffer_size);
+// Configure the readiness watermark and drain buffer size of a session
+
+int read_trace_record(int fd, struct trace_record_header *record,
+                      unsigned int size);
+// Read one whole record from a blocking session file descriptor
+
+ssize_t splice_session(int fd, int out_fd, size_t length);
+// Move the records of a session into another file descriptor
+
+struct session_control *mmap_session(int fd);
+// Map the control page of a session
+
+void munmap_session(struct session_control *control);
+// Unmap the control page of a session
+
+void set_trace_gate(struct session_control *control, int open);
+// Open or close the tracing gate of a session without any syscall
+
+int emit_marker(struct session_control *control, unsigned long long tag);
+// Emit a marker interleaved in order with the trace records of a session
+
+// For batch
+
+int dump_crash(unsigned int pid, struct crash_capture *capture);
+// Dump the branch history frozen at the crash of a process
+
+int submit_batch(int fd, struct xioctl_request *requests, int *results,
+                 unsigned long long count);
+// Submit an array of requests with a single syscall
+
+// For io_uring
+
+struct libiht_uring *open_uring(unsigned int entries);
+// Open the character device and set up an io_uring to submit requests to it
+
+void close_uring(struct libiht_uring *ring);
+// Tear down an io_uring and close its device file descriptor
+
+int queue_uring_request(struct libiht_uring *ring, struct xioctl_request *request,
+                        unsigned long long user_data);
+// Queue a request into the submission ring without entering the kernel
+
+int submit_uring(struct libiht_uring *ring, unsigned int wait_nr);
+// Submit all queued requests with a single syscall
+
+int reap_uring_completion(struct libiht_uring *ring, unsigned long long *user_data,
+                          int *res);
+// Reap one completion from the completion ring
+
 #endif // LIBIHT_LKM_H
\ No newline at end of file
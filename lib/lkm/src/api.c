@@ -10,34 +10,68 @@
 
 // TODO: Refactor the code, current design is bad architected :(
 
+#define _GNU_SOURCE
+
 #include "../../commons/api.h"
 #include "../include/lkm.h"
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <string.h>
+#include <x86intrin.h>
 
 #define DEVICE_NAME "libiht-info"
 
 #define LIBIHT_LKM_IOCTL_MAGIC 'l'
 #define LIBIHT_LKM_IOCTL_BASE       _IO(LIBIHT_LKM_IOCTL_MAGIC, 0)
 
+// io_uring command payload, placed in the command area of the SQE
+struct libiht_uring_cmd {
+    unsigned long long request;
+};
+
 //
 // Global Variables
 
-int lbr_fd;
-// File descriptor for opened LBR
+int lbr_fd = -1;
+// File descriptor for opened LBR, shared by every pid enabled
+
+int lbr_enabled = 0;
+// Number of pids with LBR enabled through lbr_fd
 
 struct xioctl_request lbr_send_request;
 // Request for sending to LBR
 
-int bts_fd;
-// File descriptor for opened BTS
+unsigned long long lbr_entries = 0;
+// LBR entries of the deepest core as reported by the kernel, 0 until known
+
+int bts_fd = -1;
+// File descriptor for opened BTS, shared by every pid enabled
+
+int bts_enabled = 0;
+// Number of pids with BTS enabled through bts_fd
 
 struct xioctl_request bts_send_request;
 // Request for sending to BTS
 
+int pt_fd = -1;
+// File descriptor for opened PT, shared by every pid enabled
+
+int pt_enabled = 0;
+// Number of pids with PT enabled through pt_fd
+
+struct xioctl_request pt_send_request;
+// Request for sending to PT
+
+int splice_pipe[2] = {-1, -1};
+// Pipe for splicing a session into a non-pipe file descriptor
+
 
 //
 // LBR management functions
@@ -51,6 +85,47 @@ struct xioctl_request bts_send_request;
 // Outputs      : struct lbr_ioctl_request : the request for LBR
 
 struct lbr_ioctl_request enable_lbr(unsigned int pid) {
+    return enable_lbr_flags(pid, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : size_lbr_list
+// Description  : Ask the kernel for the LBR entries of the deepest core, and
+//                raise MAX_LBR_LIST_LEN to it
+//
+// Inputs       : unsigned int pid : a process ID with LBR enabled
+// Outputs      : void
+
+static void size_lbr_list(unsigned int pid) {
+    struct xioctl_request request;
+    struct lbr_dump dump;
+
+    // A dump without buffers only reports the capacity
+    memset(&request, 0, sizeof(request));
+    memset(&dump, 0, sizeof(dump));
+    request.cmd = LIBIHT_IOCTL_DUMP_LBR_INFO;
+    request.body.lbr_dump.lbr_config.pid = pid;
+    request.body.lbr_dump.buffer = &dump;
+    if (ioctl(lbr_fd, LIBIHT_LKM_IOCTL_BASE, &request) != 0 || dump.lbr_capacity == 0)
+        return;
+
+    lbr_entries = dump.lbr_capacity;
+    if (lbr_entries > MAX_LBR_LIST_LEN)
+        MAX_LBR_LIST_LEN = lbr_entries;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : enable_lbr_flags
+// Description  : Enable LBR for a given process ID with configuration flags,
+//                e.g., LIBIHT_LBR_CALL_STACK to record the LBR as a call stack
+//
+// Inputs       : unsigned int pid : the process ID
+//                unsigned int flags : the LIBIHT_LBR_* flags
+// Outputs      : struct lbr_ioctl_request : the request for LBR
+
+struct lbr_ioctl_request enable_lbr_flags(unsigned int pid, unsigned int flags) {
     struct lbr_ioctl_request usr_request;
     if (pid == 0) {
         usr_request.lbr_config.pid = getpid();
@@ -61,15 +136,14 @@ struct lbr_ioctl_request enable_lbr(unsigned int pid) {
 
     fprintf(stderr, "LIBIHT-API: starting enable LBR on pid : %u\n", usr_request.lbr_config.pid);
 
+    usr_request.lbr_config.flags = flags;
     usr_request.lbr_config.lbr_select = 0;
 
     usr_request.buffer = NULL;
 
-    usr_request.buffer = malloc(sizeof(struct lbr_data));
-    usr_request.buffer->lbr_tos = 0;
-    usr_request.buffer->entries = malloc(sizeof(struct lbr_stack_entry) * MAX_LBR_LIST_LEN);
-
-    lbr_fd = open("/proc/" DEVICE_NAME, O_RDWR);
+    // Every pid is traced through the same fd, closing it would release all
+    if (lbr_fd < 0)
+        lbr_fd = open("/proc/" DEVICE_NAME, O_RDWR);
 
     lbr_send_request.cmd = LIBIHT_IOCTL_ENABLE_LBR;
     lbr_send_request.body.lbr = usr_request;
@@ -77,11 +151,25 @@ struct lbr_ioctl_request enable_lbr(unsigned int pid) {
 
     if (res == 0) {
         fprintf(stderr, "LIBIHT-API: enable LBR for pid %u\n", usr_request.lbr_config.pid);
+        lbr_enabled++;
+        if (lbr_entries == 0)
+            size_lbr_list(usr_request.lbr_config.pid);
     }
     else {
         fprintf(stderr, "LIBIHT-API: failed to enable LBR for pid %u\n", usr_request.lbr_config.pid);
+        // Nothing is traced on this fd, do not leak it
+        if (lbr_enabled == 0 && lbr_fd >= 0) {
+            close(lbr_fd);
+            lbr_fd = -1;
+        }
     }
 
+    // The buffer holds the LBR of the deepest core
+    usr_request.buffer = malloc(sizeof(struct lbr_data));
+    usr_request.buffer->lbr_tos = 0;
+    usr_request.buffer->entries = malloc(sizeof(struct lbr_stack_entry) *
+                                         (lbr_entries > MAX_LBR_LIST_LEN ? lbr_entries : MAX_LBR_LIST_LEN));
+
     return usr_request;
 }
 
@@ -96,9 +184,15 @@ struct lbr_ioctl_request enable_lbr(unsigned int pid) {
 void disable_lbr(struct lbr_ioctl_request usr_request) {
     lbr_send_request.cmd = LIBIHT_IOCTL_DISABLE_LBR;
     lbr_send_request.body.lbr = usr_request;
-    ioctl(lbr_fd, LIBIHT_LKM_IOCTL_BASE, &lbr_send_request);
+    if (ioctl(lbr_fd, LIBIHT_LKM_IOCTL_BASE, &lbr_send_request) == 0 && lbr_enabled > 0)
+        lbr_enabled--;
     fprintf(stderr, "LIBIHT-API: disable LBR for pid %u\n", usr_request.lbr_config.pid);
-    lbr_fd = 0;
+    // Closing the fd releases every state left in its session, so only once
+    // no other pid is traced through it
+    if (lbr_enabled == 0 && lbr_fd >= 0) {
+        close(lbr_fd);
+        lbr_fd = -1;
+    }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -110,12 +204,52 @@ void disable_lbr(struct lbr_ioctl_request usr_request) {
 // Outputs      : void
 
 void dump_lbr(struct lbr_ioctl_request usr_request) {
-    lbr_send_request.cmd = LIBIHT_IOCTL_DUMP_LBR;
-    lbr_send_request.body.lbr = usr_request;
-    ioctl(lbr_fd, LIBIHT_LKM_IOCTL_BASE, &lbr_send_request);
+    struct lbr_dump dump;
+
+    // The lbr_data has no length, dump through a lbr_dump bound by the
+    // entries the buffer was allocated with
+    memset(&dump, 0, sizeof(dump));
+    if (usr_request.buffer) {
+        dump.data.entries = usr_request.buffer->entries;
+        dump.count = lbr_entries ? lbr_entries : MAX_LBR_LIST_LEN;
+    }
+
+    lbr_send_request.cmd = LIBIHT_IOCTL_DUMP_LBR_INFO;
+    lbr_send_request.body.lbr_dump.lbr_config = usr_request.lbr_config;
+    lbr_send_request.body.lbr_dump.buffer = &dump;
+    if (ioctl(lbr_fd, LIBIHT_LKM_IOCTL_BASE, &lbr_send_request) == 0 && usr_request.buffer)
+        usr_request.buffer->lbr_tos = dump.data.lbr_tos;
     fprintf(stderr, "LIBIHT-API: dump LBR for pid %u\n", usr_request.lbr_config.pid);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_lbr_info
+// Description  : Dump LBR of a process with the MSR_LBR_INFO of each entry,
+//                and the LBR format and number of entries of the core they
+//                were saved on
+//
+// Inputs       : unsigned int pid : the process ID, 0 for the current one
+//                struct lbr_dump *dump : the dump, with the entries and info
+//                                        buffers to fill and the entries they
+//                                        hold in count, info can be NULL
+// Outputs      : int : 0 on success, -1 on failure
+
+int dump_lbr_info(unsigned int pid, struct lbr_dump *dump) {
+    struct xioctl_request request;
+    int res;
+
+    memset(&request, 0, sizeof(request));
+    request.cmd = LIBIHT_IOCTL_DUMP_LBR_INFO;
+    request.body.lbr_dump.lbr_config.pid = pid ? pid : (unsigned int)getpid();
+    request.body.lbr_dump.buffer = dump;
+
+    res = ioctl(lbr_fd, LIBIHT_LKM_IOCTL_BASE, &request);
+    fprintf(stderr, "LIBIHT-API: dump LBR info for pid %u\n",
+            request.body.lbr_dump.lbr_config.pid);
+    return res;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : config_lbr
@@ -131,6 +265,224 @@ void config_lbr(struct lbr_ioctl_request usr_request) {
     fprintf(stderr, "LIBIHT-API: config LBR for pid %u\n", usr_request.lbr_config.pid);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : syscall_lbr
+// Description  : Snapshot the LBR of a process at the entry of the given
+//                syscalls, with the syscall number in the snapshot. An empty
+//                list turns it off.
+//
+// Inputs       : unsigned int pid : the process ID, 0 for the current one
+//                const int *syscalls : the syscall numbers
+//                int count : the number of syscalls
+// Outputs      : int : 0 on success, -1 on failure
+
+int syscall_lbr(unsigned int pid, const int *syscalls, int count) {
+    struct xioctl_request request;
+    int i, res;
+
+    memset(&request, 0, sizeof(request));
+    request.cmd = LIBIHT_IOCTL_SYSCALL_LBR;
+    request.body.lbr_syscall.pid = pid ? pid : (unsigned int)getpid();
+    for (i = 0; i < count; i++) {
+        if (syscalls[i] < 0 || syscalls[i] >= LIBIHT_SYSCALL_MAX)
+            return -1;
+        request.body.lbr_syscall.syscalls[syscalls[i] / 64] |= 1ULL << (syscalls[i] % 64);
+    }
+
+    res = ioctl(lbr_fd, LIBIHT_LKM_IOCTL_BASE, &request);
+    fprintf(stderr, "LIBIHT-API: syscall LBR for pid %u on %d syscalls\n",
+            request.body.lbr_syscall.pid, count);
+    return res;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : compare_cfi_edge
+// Description  : Order CFI edges by from then to address, as the kernel
+//                module expects them
+//
+// Inputs       : const void *a : the first edge
+//                const void *b : the second edge
+// Outputs      : int : negative, 0 or positive as a is before, equal or after b
+
+static int compare_cfi_edge(const void *a, const void *b) {
+    const struct lbr_stack_entry *x = a, *y = b;
+
+    if (x->from != y->from)
+        return x->from < y->from ? -1 : 1;
+    if (x->to != y->to)
+        return x->to < y->to ? -1 : 1;
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cfi_lbr
+// Description  : Check the LBR of a process against an allowlist of edges at
+//                the entry of the given syscalls. The edges are sorted in
+//                place. LIBIHT_CFI_OFF drops the policy.
+//
+// Inputs       : unsigned int pid : the process ID, 0 for the current one
+//                int action : LIBIHT_CFI_OFF, LIBIHT_CFI_LOG or LIBIHT_CFI_DENY
+//                const int *syscalls : the syscall numbers to check at
+//                int count : the number of syscalls
+//                struct lbr_stack_entry *edges : the allowed edges
+//                unsigned long long edge_count : the number of edges
+// Outputs      : int : 0 on success, -1 on failure
+
+int cfi_lbr(unsigned int pid, int action, const int *syscalls, int count,
+            struct lbr_stack_entry *edges, unsigned long long edge_count) {
+    struct xioctl_request request;
+    int i, res;
+
+    memset(&request, 0, sizeof(request));
+    request.cmd = LIBIHT_IOCTL_CFI_LBR;
+    request.body.lbr_cfi.pid = pid ? pid : (unsigned int)getpid();
+    request.body.lbr_cfi.action = action;
+    for (i = 0; i < count; i++) {
+        if (syscalls[i] < 0 || syscalls[i] >= LIBIHT_SYSCALL_MAX)
+            return -1;
+        request.body.lbr_cfi.syscalls[syscalls[i] / 64] |= 1ULL << (syscalls[i] % 64);
+    }
+
+    if (action != LIBIHT_CFI_OFF)
+        qsort(edges, edge_count, sizeof(struct lbr_stack_entry), compare_cfi_edge);
+    request.body.lbr_cfi.edge_count = edge_count;
+    request.body.lbr_cfi.edges = edges;
+
+    res = ioctl(lbr_fd, LIBIHT_LKM_IOCTL_BASE, &request);
+    fprintf(stderr, "LIBIHT-API: CFI LBR for pid %u with %llu edges\n",
+            request.body.lbr_cfi.pid, edge_count);
+    return res;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mmap_lbr
+// Description  : Map the LBR snapshot ring for a user request. Every LBR save
+//                in the kernel publishes a snapshot into this ring, so the
+//                snapshots can be consumed without any syscall.
+//
+// Inputs       : struct lbr_ioctl_request usr_request : the request for LBR
+// Outputs      : struct lbr_ring_header * : the mapped ring, NULL on failure
+
+struct lbr_ring_header *mmap_lbr(struct lbr_ioctl_request usr_request) {
+    struct lbr_ring_header *ring;
+    unsigned long long size;
+
+    // Map the header page first to learn the ring size
+    ring = mmap(NULL, LIBIHT_MMAP_PAGE_SIZE, PROT_READ, MAP_SHARED, lbr_fd,
+                LIBIHT_MMAP_OFFSET(LIBIHT_MMAP_LBR, usr_request.lbr_config.pid));
+    if (ring == MAP_FAILED) {
+        fprintf(stderr, "LIBIHT-API: failed to mmap LBR for pid %u\n", usr_request.lbr_config.pid);
+        return NULL;
+    }
+    size = LIBIHT_MMAP_PAGE_SIZE + ring->slots * ring->slot_size;
+    munmap(ring, LIBIHT_MMAP_PAGE_SIZE);
+
+    ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, lbr_fd,
+                LIBIHT_MMAP_OFFSET(LIBIHT_MMAP_LBR, usr_request.lbr_config.pid));
+    if (ring == MAP_FAILED) {
+        fprintf(stderr, "LIBIHT-API: failed to mmap LBR for pid %u\n", usr_request.lbr_config.pid);
+        return NULL;
+    }
+
+    fprintf(stderr, "LIBIHT-API: mmap LBR for pid %u\n", usr_request.lbr_config.pid);
+    return ring;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : munmap_lbr
+// Description  : Unmap the LBR snapshot ring
+//
+// Inputs       : struct lbr_ring_header *ring : the mapped ring
+// Outputs      : void
+
+void munmap_lbr(struct lbr_ring_header *ring) {
+    munmap(ring, LIBIHT_MMAP_PAGE_SIZE + ring->slots * ring->slot_size);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : consume_lbr_snapshot
+// Description  : Consume the oldest snapshot from a mapped LBR snapshot ring.
+//                The head is published by the kernel with release semantics,
+//                and the tail is published back once the slot is copied out.
+//
+// Inputs       : struct lbr_ring_header *ring : the mapped ring
+//                struct lbr_snapshot *snapshot : the snapshot buffer
+//                struct lbr_stack_entry *entries : the LBR entries buffer
+//                unsigned long long *info : the LBR_INFO buffer, can be NULL,
+//                                           only filled if the snapshot has them
+// Outputs      : int : 1 if a snapshot is consumed, 0 if the ring is empty
+
+int consume_lbr_snapshot(struct lbr_ring_header *ring,
+                         struct lbr_snapshot *snapshot,
+                         struct lbr_stack_entry *entries,
+                         unsigned long long *info) {
+    unsigned long long head, tail;
+    char *slot;
+
+    tail = ring->tail;
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (head == tail)
+        return 0;
+
+    slot = (char *)ring + LIBIHT_MMAP_PAGE_SIZE + (tail % ring->slots) * ring->slot_size;
+    memcpy(snapshot, slot, sizeof(struct lbr_snapshot));
+    memcpy(entries, slot + sizeof(struct lbr_snapshot),
+           ring->lbr_capacity * sizeof(struct lbr_stack_entry));
+    if (info && (snapshot->flags & LIBIHT_LBR_INFO))
+        memcpy(info, slot + sizeof(struct lbr_snapshot) +
+               ring->lbr_capacity * sizeof(struct lbr_stack_entry),
+               ring->lbr_capacity * sizeof(unsigned long long));
+
+    // Hand the slot back to the kernel
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lbr_call_chain
+// Description  : Unwind a LBR recorded in call-stack mode into a call chain,
+//                without frame pointers. In call-stack mode, a call pushes an
+//                entry and a return pops it, so the entries from the TOS down
+//                are the calls not yet returned, innermost first. The walk
+//                stops at the first empty entry or after capacity entries.
+//
+// Inputs       : unsigned long long tos : the TOS of the LBR
+//                struct lbr_stack_entry *entries : the LBR entries
+//                unsigned int capacity : the number of LBR entries
+//                unsigned long long *chain : the call sites, innermost first
+//                int max : the size of the chain buffer
+// Outputs      : int : the depth of the call chain
+
+int lbr_call_chain(unsigned long long tos, struct lbr_stack_entry *entries,
+                   unsigned int capacity, unsigned long long *chain, int max) {
+    unsigned int i, idx;
+    unsigned long long from;
+    int depth = 0;
+
+    if (capacity == 0)
+        return 0;
+
+    for (i = 0; i < capacity && depth < max; i++) {
+        idx = (unsigned int)((tos + capacity - i) % capacity);
+        from = entries[idx].from;
+        if (from == 0)
+            break;
+
+        // Formats before MSR_LBR_INFO keep flags in bits 63:61 of the source,
+        // sign extend the address from bit 60 to drop them
+        chain[depth++] = (unsigned long long)(((long long)(from << 3)) >> 3);
+    }
+
+    return depth;
+}
+
 //
 // BTS management functions
 
@@ -159,7 +511,9 @@ struct bts_ioctl_request enable_bts(unsigned int pid) {
     usr_request.buffer->bts_buffer_base = malloc(sizeof(struct bts_record) * MAX_BTS_LIST_LEN);
     usr_request.buffer->bts_index = malloc(sizeof(struct bts_record) * MAX_BTS_LIST_LEN);
 
-    bts_fd = open("/proc/" DEVICE_NAME, O_RDWR);
+    // Every pid is traced through the same fd, closing it would release all
+    if (bts_fd < 0)
+        bts_fd = open("/proc/" DEVICE_NAME, O_RDWR);
 
     bts_send_request.body.bts = usr_request;
     bts_send_request.cmd = LIBIHT_IOCTL_ENABLE_BTS;
@@ -167,9 +521,15 @@ struct bts_ioctl_request enable_bts(unsigned int pid) {
 
     if (res == 0) {
         fprintf(stderr, "LIBIHT-API: enable BTS for pid %u\n", usr_request.bts_config.pid);
+        bts_enabled++;
     }
     else {
         fprintf(stderr, "LIBIHT-API: failed to enable BTS for pid %u\n", usr_request.bts_config.pid);
+        // Nothing is traced on this fd, do not leak it
+        if (bts_enabled == 0 && bts_fd >= 0) {
+            close(bts_fd);
+            bts_fd = -1;
+        }
     }
 
     return usr_request;
@@ -186,9 +546,15 @@ struct bts_ioctl_request enable_bts(unsigned int pid) {
 void disable_bts(struct bts_ioctl_request usr_request) {
     bts_send_request.cmd = LIBIHT_IOCTL_DISABLE_BTS;
     bts_send_request.body.bts = usr_request;
-    ioctl(bts_fd, LIBIHT_LKM_IOCTL_BASE, &bts_send_request);
+    if (ioctl(bts_fd, LIBIHT_LKM_IOCTL_BASE, &bts_send_request) == 0 && bts_enabled > 0)
+        bts_enabled--;
     fprintf(stderr, "LIBIHT-API: disable BTS for pid : %u\n", usr_request.bts_config.pid);
-    bts_fd = 0;
+    // Closing the fd releases every state left in its session, so only once
+    // no other pid is traced through it
+    if (bts_enabled == 0 && bts_fd >= 0) {
+        close(bts_fd);
+        bts_fd = -1;
+    }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -220,3 +586,817 @@ void config_bts(struct bts_ioctl_request usr_request) {
     ioctl(bts_fd, LIBIHT_LKM_IOCTL_BASE, &bts_send_request);
     fprintf(stderr, "LIBIHT-API: config BTS for pid : %u\n", usr_request.bts_config.pid);
 }
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : read_bts
+// Description  : Read BTS records written since the cursor for a user request.
+//                On return, `cursor->count` holds the number of records read,
+//                `cursor->lost` the number of records overwritten before they
+//                could be read, and `cursor->cursor` is advanced for the next
+//                call.
+//
+// Inputs       : struct bts_ioctl_request usr_request : the request for BTS
+//                struct bts_cursor *cursor : the cursor and records buffer
+// Outputs      : void
+
+void read_bts(struct bts_ioctl_request usr_request, struct bts_cursor *cursor) {
+    bts_send_request.cmd = LIBIHT_IOCTL_READ_BTS;
+    bts_send_request.body.bts_read.bts_config = usr_request.bts_config;
+    bts_send_request.body.bts_read.buffer = cursor;
+    ioctl(bts_fd, LIBIHT_LKM_IOCTL_BASE, &bts_send_request);
+    fprintf(stderr, "LIBIHT-API: read BTS for pid : %u\n", usr_request.bts_config.pid);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : govern_bts
+// Description  : Bound the BTS overhead of a process. With a budget, the BTS
+//                is duty cycled off after each window over the budget. With a
+//                record cap, the BTS is turned off for good at the cap. Each
+//                decision is reported as a LIBIHT_RECORD_THROTTLE record in the
+//                BTS session. Zero budget and cap leave the BTS ungoverned.
+//
+// Inputs       : unsigned int pid : the process ID, 0 for the current one
+//                unsigned int budget : the overhead budget in per mille
+//                unsigned long long period_ns : the window, 0 for the default
+//                unsigned long long record_cap : the record cap, 0 for none
+// Outputs      : int : 0 on success, -1 on failure
+
+int govern_bts(unsigned int pid, unsigned int budget,
+               unsigned long long period_ns, unsigned long long record_cap) {
+    struct xioctl_request request;
+    int res;
+
+    memset(&request, 0, sizeof(request));
+    request.cmd = LIBIHT_IOCTL_GOVERN_BTS;
+    request.body.bts_governor.pid = pid ? pid : (unsigned int)getpid();
+    request.body.bts_governor.budget = budget;
+    request.body.bts_governor.period_ns = period_ns;
+    request.body.bts_governor.record_cap = record_cap;
+
+    res = ioctl(bts_fd, LIBIHT_LKM_IOCTL_BASE, &request);
+    fprintf(stderr, "LIBIHT-API: govern BTS for pid : %u, budget %u per mille\n",
+            request.body.bts_governor.pid, budget);
+    return res;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mmap_bts
+// Description  : Map the BTS header page and buffer read-only for a user
+//                request. The records can then be read in place without any
+//                syscall. The mapping is not updated when the BTS buffer is
+//                reconfigured, map it again in that case.
+//
+// Inputs       : struct bts_ioctl_request usr_request : the request for BTS
+// Outputs      : struct bts_header * : the mapped header page, NULL on failure
+
+struct bts_header *mmap_bts(struct bts_ioctl_request usr_request) {
+    struct bts_header *header;
+    unsigned long long size;
+
+    // Map the header page first to learn the buffer size
+    header = mmap(NULL, LIBIHT_MMAP_PAGE_SIZE, PROT_READ, MAP_SHARED, bts_fd,
+                  LIBIHT_MMAP_OFFSET(LIBIHT_MMAP_BTS, usr_request.bts_config.pid));
+    if (header == MAP_FAILED) {
+        fprintf(stderr, "LIBIHT-API: failed to mmap BTS for pid : %u\n", usr_request.bts_config.pid);
+        return NULL;
+    }
+    size = LIBIHT_MMAP_PAGE_SIZE + header->bts_buffer_size;
+    munmap(header, LIBIHT_MMAP_PAGE_SIZE);
+
+    header = mmap(NULL, size, PROT_READ, MAP_SHARED, bts_fd,
+                  LIBIHT_MMAP_OFFSET(LIBIHT_MMAP_BTS, usr_request.bts_config.pid));
+    if (header == MAP_FAILED) {
+        fprintf(stderr, "LIBIHT-API: failed to mmap BTS for pid : %u\n", usr_request.bts_config.pid);
+        return NULL;
+    }
+
+    fprintf(stderr, "LIBIHT-API: mmap BTS for pid : %u\n", usr_request.bts_config.pid);
+    return header;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : munmap_bts
+// Description  : Unmap the BTS header page and buffer
+//
+// Inputs       : struct bts_header *header : the mapped header page
+// Outputs      : void
+
+void munmap_bts(struct bts_header *header) {
+    munmap(header, LIBIHT_MMAP_PAGE_SIZE + header->bts_buffer_size);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bts_mmap_records
+// Description  : Get the BTS records of a mapped BTS buffer, which follows the
+//                header page.
+//
+// Inputs       : struct bts_header *header : the mapped header page
+// Outputs      : struct bts_record * : the BTS records
+
+struct bts_record *bts_mmap_records(struct bts_header *header) {
+    return (struct bts_record *)((char *)header + LIBIHT_MMAP_PAGE_SIZE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bts_mmap_index
+// Description  : Get the record index the hardware will write next in a mapped
+//                BTS buffer, as of the last pause of the target, i.e. its
+//                last context switch out or read. Together with
+//                `bts_wrap_gen`, the records written so far are
+//                `bts_wrap_gen * capacity + index`.
+//
+// Inputs       : struct bts_header *header : the mapped header page
+// Outputs      : unsigned long long : the next record index
+
+unsigned long long bts_mmap_index(struct bts_header *header) {
+    return header->bts_index;
+}
+
+//
+// PT management functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : enable_pt
+// Description  : Enable PT for a given process ID, with the default trace
+//                bits and buffer size and no filter. Use `config_pt` on the
+//                returned request to set IP ranges or a CR3 filter.
+//
+// Inputs       : unsigned int pid : the process ID
+// Outputs      : struct pt_ioctl_request : the request for PT
+
+struct pt_ioctl_request enable_pt(unsigned int pid) {
+    struct pt_ioctl_request usr_request;
+
+    memset(&usr_request, 0, sizeof(usr_request));
+    usr_request.pt_config.pid = pid ? pid : (unsigned int)getpid();
+    fprintf(stderr, "LIBIHT-API: starting enable PT on pid : %u\n", usr_request.pt_config.pid);
+
+    // Every pid is traced through the same fd, closing it would release all
+    if (pt_fd < 0)
+        pt_fd = open("/proc/" DEVICE_NAME, O_RDWR);
+
+    pt_send_request.body.pt = usr_request;
+    pt_send_request.cmd = LIBIHT_IOCTL_ENABLE_PT;
+    int res = ioctl(pt_fd, LIBIHT_LKM_IOCTL_BASE, &pt_send_request);
+
+    if (res == 0) {
+        fprintf(stderr, "LIBIHT-API: enable PT for pid %u\n", usr_request.pt_config.pid);
+        pt_enabled++;
+    }
+    else {
+        fprintf(stderr, "LIBIHT-API: failed to enable PT for pid %u\n", usr_request.pt_config.pid);
+        // Nothing is traced on this fd, do not leak it
+        if (pt_enabled == 0 && pt_fd >= 0) {
+            close(pt_fd);
+            pt_fd = -1;
+        }
+    }
+
+    return usr_request;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : disable_pt
+// Description  : Disable PT for a user request
+//
+// Inputs       : struct pt_ioctl_request usr_request : the request for PT
+// Outputs      : void
+
+void disable_pt(struct pt_ioctl_request usr_request) {
+    pt_send_request.cmd = LIBIHT_IOCTL_DISABLE_PT;
+    pt_send_request.body.pt = usr_request;
+    if (ioctl(pt_fd, LIBIHT_LKM_IOCTL_BASE, &pt_send_request) == 0 && pt_enabled > 0)
+        pt_enabled--;
+    fprintf(stderr, "LIBIHT-API: disable PT for pid : %u\n", usr_request.pt_config.pid);
+    // Closing the fd releases every state left in its session, so only once
+    // no other pid is traced through it
+    if (pt_enabled == 0 && pt_fd >= 0) {
+        close(pt_fd);
+        pt_fd = -1;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : config_pt
+// Description  : Configure PT for a user request. The RTIT_CTL trace bits, the
+//                IP filter ranges and the CR3 to match are all replaced, a
+//                zero CR3 matches the address space of the process if
+//                RTIT_CTL_CR3_FILTER is set. A new buffer size restarts the
+//                packet stream.
+//
+// Inputs       : struct pt_ioctl_request usr_request : the request for PT
+// Outputs      : void
+
+void config_pt(struct pt_ioctl_request usr_request) {
+    pt_send_request.cmd = LIBIHT_IOCTL_CONFIG_PT;
+    pt_send_request.body.pt = usr_request;
+    ioctl(pt_fd, LIBIHT_LKM_IOCTL_BASE, &pt_send_request);
+    fprintf(stderr, "LIBIHT-API: config PT for pid : %u\n", usr_request.pt_config.pid);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : read_pt
+// Description  : Read the PT packet bytes written since the cursor for a user
+//                request. On return, `count` holds the bytes copied into
+//                `data` and `lost` the bytes overwritten before being read, in
+//                which case decoding should resync at the next PSB.
+//
+// Inputs       : struct pt_ioctl_request usr_request : the request for PT
+//                struct pt_cursor *cursor : the cursor and bytes buffer
+// Outputs      : void
+
+void read_pt(struct pt_ioctl_request usr_request, struct pt_cursor *cursor) {
+    pt_send_request.cmd = LIBIHT_IOCTL_READ_PT;
+    pt_send_request.body.pt_read.pt_config = usr_request.pt_config;
+    pt_send_request.body.pt_read.buffer = cursor;
+    ioctl(pt_fd, LIBIHT_LKM_IOCTL_BASE, &pt_send_request);
+    fprintf(stderr, "LIBIHT-API: read PT for pid : %u\n", usr_request.pt_config.pid);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mmap_pt
+// Description  : Map the PT header page and output buffer read-only for a user
+//                request. The header is only updated when the process is
+//                switched out or read, as the output position of a running
+//                process lives in its core. The mapping is not updated when
+//                the PT buffer is reconfigured, map it again in that case.
+//
+// Inputs       : struct pt_ioctl_request usr_request : the request for PT
+// Outputs      : struct pt_header * : the mapped header page, NULL on failure
+
+struct pt_header *mmap_pt(struct pt_ioctl_request usr_request) {
+    struct pt_header *header;
+    unsigned long long size;
+
+    // Map the header page first to learn the buffer size
+    header = mmap(NULL, LIBIHT_MMAP_PAGE_SIZE, PROT_READ, MAP_SHARED, pt_fd,
+                  LIBIHT_MMAP_OFFSET(LIBIHT_MMAP_PT, usr_request.pt_config.pid));
+    if (header == MAP_FAILED) {
+        fprintf(stderr, "LIBIHT-API: failed to mmap PT for pid : %u\n", usr_request.pt_config.pid);
+        return NULL;
+    }
+    size = LIBIHT_MMAP_PAGE_SIZE + header->pt_buffer_size;
+    munmap(header, LIBIHT_MMAP_PAGE_SIZE);
+
+    header = mmap(NULL, size, PROT_READ, MAP_SHARED, pt_fd,
+                  LIBIHT_MMAP_OFFSET(LIBIHT_MMAP_PT, usr_request.pt_config.pid));
+    if (header == MAP_FAILED) {
+        fprintf(stderr, "LIBIHT-API: failed to mmap PT for pid : %u\n", usr_request.pt_config.pid);
+        return NULL;
+    }
+
+    fprintf(stderr, "LIBIHT-API: mmap PT for pid : %u\n", usr_request.pt_config.pid);
+    return header;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : munmap_pt
+// Description  : Unmap the PT header page and output buffer
+//
+// Inputs       : struct pt_header *header : the mapped header page
+// Outputs      : void
+
+void munmap_pt(struct pt_header *header) {
+    munmap(header, LIBIHT_MMAP_PAGE_SIZE + header->pt_buffer_size);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_mmap_data
+// Description  : Get the packet bytes of a mapped PT buffer, which follows the
+//                header page. The bytes written so far are
+//                `pt_wrap_gen * pt_buffer_size + pt_offset`.
+//
+// Inputs       : struct pt_header *header : the mapped header page
+// Outputs      : unsigned char * : the PT packet bytes
+
+unsigned char *pt_mmap_data(struct pt_header *header) {
+    return (unsigned char *)header + LIBIHT_MMAP_PAGE_SIZE;
+}
+
+//
+// Session management functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lbr_session_fd
+// Description  : Get the file descriptor of the LBR session. The LBR enabled
+//                through it is streamed out by read, and can be waited on by
+//                poll, select or epoll.
+//
+// Inputs       : void
+// Outputs      : int : the file descriptor
+
+int lbr_session_fd(void) {
+    return lbr_fd;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bts_session_fd
+// Description  : Get the file descriptor of the BTS session. The BTS enabled
+//                through it is streamed out by read, and can be waited on by
+//                poll, select or epoll.
+//
+// Inputs       : void
+// Outputs      : int : the file descriptor
+
+int bts_session_fd(void) {
+    return bts_fd;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pt_session_fd
+// Description  : Get the file descriptor of the PT session. The packet stream
+//                of the PT enabled through it is streamed out by read as
+//                LIBIHT_RECORD_PT records, and can be waited on by poll,
+//                select or epoll.
+//
+// Inputs       : void
+// Outputs      : int : the file descriptor
+
+int pt_session_fd(void) {
+    return pt_fd;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : config_session
+// Description  : Configure the readiness watermark and the drain buffer size
+//                of a session. Resizing the drain buffer discards unread data.
+//
+// Inputs       : int fd : the session file descriptor
+//                unsigned long long watermark : readable bytes to signal
+//                                               readiness, 0 for any record
+//                unsigned long long buffer_size : drain buffer size, 0 to keep
+// Outputs      : int : 0 on success, -1 on failure
+
+int config_session(int fd, unsigned long long watermark,
+                   unsigned long long buffer_size) {
+    struct xioctl_request request;
+    int res;
+
+    request.cmd = LIBIHT_IOCTL_CONFIG_SESSION;
+    request.body.session.session_config.watermark = watermark;
+    request.body.session.session_config.buffer_size = buffer_size;
+    res = ioctl(fd, LIBIHT_LKM_IOCTL_BASE, &request);
+    fprintf(stderr, "LIBIHT-API: config session watermark : %llu\n", watermark);
+
+    return res;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : read_trace_record
+// Description  : Read one whole record from a blocking session file
+//                descriptor. A record larger than the buffer is skipped to
+//                keep the stream aligned.
+//
+// Inputs       : int fd : the session file descriptor
+//                struct trace_record_header *record : the record buffer
+//                unsigned int size : the size of the record buffer
+// Outputs      : int : the record size on success, -1 on failure
+
+int read_trace_record(int fd, struct trace_record_header *record,
+                      unsigned int size) {
+    char discard[256];
+    unsigned int done, want;
+    ssize_t res;
+
+    if (size < sizeof(struct trace_record_header))
+        return -1;
+
+    // Read the header, then the rest of the record
+    for (done = 0; done < sizeof(struct trace_record_header); done += res) {
+        res = read(fd, (char *)record + done,
+                   sizeof(struct trace_record_header) - done);
+        if (res <= 0)
+            return -1;
+    }
+
+    for (; done < record->size; done += res) {
+        want = record->size - done;
+        if (done < size) {
+            want = want < size - done ? want : size - done;
+            res = read(fd, (char *)record + done, want);
+        }
+        else {
+            want = want < sizeof(discard) ? want : sizeof(discard);
+            res = read(fd, discard, want);
+        }
+        if (res <= 0)
+            return -1;
+    }
+
+    if (record->size > size) {
+        fprintf(stderr, "LIBIHT-API: skip record of size : %u\n", record->size);
+        return -1;
+    }
+
+    return record->size;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : splice_session
+// Description  : Move the records of a session into another file descriptor
+//                without copying them through user space. A pipe is spliced
+//                into directly, any other file descriptor goes through an
+//                internal pipe.
+//
+// Inputs       : int fd : the session file descriptor
+//                int out_fd : the destination file descriptor
+//                size_t length : the maximum number of bytes to move
+// Outputs      : ssize_t : the number of bytes moved, -1 on failure
+
+ssize_t splice_session(int fd, int out_fd, size_t length) {
+    struct stat out_stat;
+    ssize_t in, out, total;
+
+    if (fstat(out_fd, &out_stat) == 0 && S_ISFIFO(out_stat.st_mode))
+        return splice(fd, NULL, out_fd, NULL, length, SPLICE_F_MOVE);
+
+    if (splice_pipe[0] < 0 && pipe(splice_pipe)) {
+        fprintf(stderr, "LIBIHT-API: failed to create splice pipe\n");
+        return -1;
+    }
+
+    in = splice(fd, NULL, splice_pipe[1], NULL, length, SPLICE_F_MOVE);
+    if (in <= 0)
+        return in;
+
+    // Drain the whole pipe, so no record is left behind
+    for (total = 0; total < in; total += out) {
+        out = splice(splice_pipe[0], NULL, out_fd, NULL, in - total,
+                     SPLICE_F_MOVE);
+        if (out <= 0) {
+            fprintf(stderr, "LIBIHT-API: failed to splice into fd : %d\n", out_fd);
+            return -1;
+        }
+    }
+
+    return total;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mmap_session
+// Description  : Map the control page of a session. The tracing gate in it is
+//                honored by the kernel at the next context switch or drain.
+//
+// Inputs       : int fd : the session file descriptor
+// Outputs      : struct session_control * : the mapped page, NULL on failure
+
+struct session_control *mmap_session(int fd) {
+    struct session_control *control;
+
+    control = mmap(NULL, LIBIHT_MMAP_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd, LIBIHT_MMAP_OFFSET(LIBIHT_MMAP_SESSION, 0));
+    if (control == MAP_FAILED) {
+        fprintf(stderr, "LIBIHT-API: failed to mmap session control page\n");
+        return NULL;
+    }
+
+    return control;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : munmap_session
+// Description  : Unmap the control page of a session
+//
+// Inputs       : struct session_control *control : the mapped page
+// Outputs      : void
+
+void munmap_session(struct session_control *control) {
+    munmap(control, LIBIHT_MMAP_PAGE_SIZE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_trace_gate
+// Description  : Open or close the tracing gate of a session with a plain
+//                store, so hot sections can be bracketed without any syscall.
+//                The processes traced only by closed sessions stop being
+//                traced from their next context switch.
+//
+// Inputs       : struct session_control *control : the mapped page
+//                int open : non-zero to open the gate, 0 to close it
+// Outputs      : void
+
+void set_trace_gate(struct session_control *control, int open) {
+    __atomic_store_n(&control->gate, open ? LIBIHT_GATE_OPEN : LIBIHT_GATE_CLOSED,
+                     __ATOMIC_RELEASE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : emit_marker
+// Description  : Emit a marker into the control page of a session, drained by
+//                the kernel in order with the trace records. Safe to call
+//                from several threads at once, each claims a slot with a
+//                compare and swap on the marker head.
+//
+// Inputs       : struct session_control *control : the mapped page
+//                unsigned long long tag : the user defined tag
+// Outputs      : int : 0 on success, -1 if all the slots are pending
+
+int emit_marker(struct session_control *control, unsigned long long tag) {
+    static __thread unsigned int tid;
+    struct session_marker_slot *slot;
+    unsigned long long pos, seq;
+    unsigned int aux;
+
+    if (tid == 0)
+        tid = syscall(SYS_gettid);
+
+    pos = __atomic_load_n(&control->marker_head, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = &control->markers[pos % LIBIHT_MARKER_SLOTS];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            // Claim the slot, pos is reloaded on failure
+            if (__atomic_compare_exchange_n(&control->marker_head, &pos, pos + 1,
+                                            0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (seq < pos) {
+            // Not drained yet
+            return -1;
+        }
+        else {
+            pos = __atomic_load_n(&control->marker_head, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->tag = tag;
+    slot->tsc = __rdtscp(&aux);
+    slot->tid = tid;
+    // The low 12 bits of TSC_AUX hold the core id on Linux
+    slot->cpu = aux & 0xfff;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+//
+// io_uring functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : open_uring
+// Description  : Open the character device and set up an io_uring to submit
+//                requests to it. The device file descriptor is a session of
+//                its own, the states enabled through the ring drain into it.
+//
+// Inputs       : unsigned int entries : the number of submission entries
+// Outputs      : struct libiht_uring * : the ring, NULL on failure
+
+struct libiht_uring *open_uring(unsigned int entries) {
+    struct libiht_uring *ring;
+    struct io_uring_params params;
+
+    ring = calloc(1, sizeof(struct libiht_uring));
+    if (ring == NULL)
+        return NULL;
+
+    ring->dev_fd = open("/dev/" DEVICE_NAME, O_RDWR);
+    if (ring->dev_fd < 0) {
+        fprintf(stderr, "LIBIHT-API: failed to open /dev/" DEVICE_NAME "\n");
+        free(ring);
+        return NULL;
+    }
+
+    memset(&params, 0, sizeof(params));
+    ring->ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->ring_fd < 0) {
+        fprintf(stderr, "LIBIHT-API: failed to setup io_uring\n");
+        close(ring->dev_fd);
+        free(ring);
+        return NULL;
+    }
+
+    // Map the submission ring, completion ring and submission entries
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cq_ring = ring->sq_ring;
+    else
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+        ring->sqes == MAP_FAILED) {
+        fprintf(stderr, "LIBIHT-API: failed to mmap io_uring\n");
+        close_uring(ring);
+        return NULL;
+    }
+
+    ring->sq_entries = params.sq_entries;
+    ring->sq_head = (unsigned int *)((char *)ring->sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)((char *)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)((char *)ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned int *)((char *)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)((char *)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (char *)ring->cq_ring + params.cq_off.cqes;
+
+    fprintf(stderr, "LIBIHT-API: open io_uring with entries : %u\n", ring->sq_entries);
+    return ring;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : close_uring
+// Description  : Tear down an io_uring and close its device file descriptor
+//
+// Inputs       : struct libiht_uring *ring : the ring
+// Outputs      : void
+
+void close_uring(struct libiht_uring *ring) {
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED &&
+        ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->ring_fd);
+    close(ring->dev_fd);
+    free(ring);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : queue_uring_request
+// Description  : Queue a request into the submission ring without entering
+//                the kernel. The request must stay valid until its completion
+//                is reaped.
+//
+// Inputs       : struct libiht_uring *ring : the ring
+//                struct xioctl_request *request : the request
+//                unsigned long long user_data : tag returned with completion
+// Outputs      : int : 0 on success, -1 if the submission ring is full
+
+int queue_uring_request(struct libiht_uring *ring, struct xioctl_request *request,
+                        unsigned long long user_data) {
+    struct io_uring_sqe *sqe;
+    unsigned int head, tail, index;
+
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    tail = *ring->sq_tail;
+    if (tail - head >= ring->sq_entries)
+        return -1;
+
+    index = tail & *ring->sq_mask;
+    sqe = &((struct io_uring_sqe *)ring->sqes)[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_URING_CMD;
+    sqe->fd = ring->dev_fd;
+    sqe->cmd_op = LIBIHT_LKM_IOCTL_BASE;
+    sqe->user_data = user_data;
+    ((struct libiht_uring_cmd *)sqe->cmd)->request = (unsigned long long)request;
+    ring->sq_array[index] = index;
+
+    // Publish the entry before the new tail
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : submit_uring
+// Description  : Submit all queued requests with a single syscall, and
+//                optionally wait for completions
+//
+// Inputs       : struct libiht_uring *ring : the ring
+//                unsigned int wait_nr : the number of completions to wait for
+// Outputs      : int : the number of requests submitted, -1 on failure
+
+int submit_uring(struct libiht_uring *ring, unsigned int wait_nr) {
+    int res;
+
+    res = syscall(__NR_io_uring_enter, ring->ring_fd, ring->pending, wait_nr,
+                  wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (res < 0) {
+        fprintf(stderr, "LIBIHT-API: failed to submit io_uring\n");
+        return -1;
+    }
+
+    ring->pending -= res;
+    return res;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : reap_uring_completion
+// Description  : Reap one completion from the completion ring without
+//                entering the kernel
+//
+// Inputs       : struct libiht_uring *ring : the ring
+//                unsigned long long *user_data : the tag of the request
+//                int *res : the status of the request, negative errno on error
+// Outputs      : int : 1 if a completion is reaped, 0 if none
+
+int reap_uring_completion(struct libiht_uring *ring, unsigned long long *user_data,
+                          int *res) {
+    struct io_uring_cqe *cqe;
+    unsigned int head;
+
+    head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return 0;
+
+    cqe = &((struct io_uring_cqe *)ring->cqes)[head & *ring->cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+
+    // Release the entry back to the kernel
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+//
+// Batch functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_crash
+// Description  : Dump the LBR and BTS tail frozen when a fatal signal was
+//                delivered to a traced process. The capture outlives the
+//                process, so it can be retrieved after the crash.
+//
+// Inputs       : unsigned int pid : the process ID, 0 for the latest crash
+//                struct crash_capture *capture : the capture buffer
+// Outputs      : int : 0 on success, -1 on failure
+
+int dump_crash(unsigned int pid, struct crash_capture *capture) {
+    struct xioctl_request request;
+    int fd, res;
+
+    fd = open("/proc/" DEVICE_NAME, O_RDWR);
+    if (fd < 0)
+        return -1;
+
+    memset(&request, 0, sizeof(request));
+    request.cmd = LIBIHT_IOCTL_DUMP_CRASH;
+    request.body.crash.pid = pid;
+    request.body.crash.buffer = capture;
+    res = ioctl(fd, LIBIHT_LKM_IOCTL_BASE, &request);
+    close(fd);
+
+    fprintf(stderr, "LIBIHT-API: dump crash for pid %u\n", pid);
+    return res;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : submit_batch
+// Description  : Submit an array of requests (enable, disable, dump, config,
+//                LBR or BTS, for any pid) with a single syscall. A failed
+//                request does not stop the rest, its status is reported in
+//                the results array.
+//
+// Inputs       : int fd : the device file descriptor
+//                struct xioctl_request *requests : the requests
+//                int *results : the status of each request, 0 on success
+//                unsigned long long count : the number of requests
+// Outputs      : int : 0 if the batch is processed, -1 on failure
+
+int submit_batch(int fd, struct xioctl_request *requests, int *results,
+                 unsigned long long count) {
+    struct xioctl_request request;
+    int res;
+
+    request.cmd = LIBIHT_IOCTL_BATCH;
+    request.body.batch.count = count;
+    request.body.batch.requests = requests;
+    request.body.batch.results = results;
+    res = ioctl(fd, LIBIHT_LKM_IOCTL_BASE, &request);
+
+    return res;
+}
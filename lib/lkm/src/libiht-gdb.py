@@ -84,6 +84,19 @@ class Cbts_data(ctypes.Structure):
         self.bts_index = bts_index
         self.bts_interrupt_threshold = bts_interrupt_threshold
 
+class Cbts_cursor(ctypes.Structure):
+    _fields_ = [
+        ('cursor', ctypes.c_ulonglong),
+        ('lost', ctypes.c_ulonglong),
+        ('count', ctypes.c_ulonglong),
+        ('records', ctypes.POINTER(Cbts_record))
+    ]
+    def __init__(self, cursor, lost, count, records):
+        self.cursor = cursor
+        self.lost = lost
+        self.count = count
+        self.records = records
+
 class Cbts_ioctl_request(ctypes.Structure):
     _fields_ = [
         ('bts_config', Cbts_config),
@@ -121,6 +134,7 @@ enable_bts = my_lib.enable_bts
 disable_bts = my_lib.disable_bts
 dump_bts = my_lib.dump_bts
 config_bts = my_lib.config_bts
+read_bts = my_lib.read_bts
 
 enable_lbr.restype = Clbr_ioctl_request
 enable_bts.restype = Cbts_ioctl_request
@@ -133,11 +147,14 @@ enable_bts.argtypes = [ctypes.c_uint]
 disable_bts.argtypes = [Cbts_ioctl_request]
 dump_bts.argtypes = [Cbts_ioctl_request]
 config_bts.argtypes = [Cbts_ioctl_request]
+read_bts.argtypes = [Cbts_ioctl_request, ctypes.POINTER(Cbts_cursor)]
 
 lbr_req = None
 lbr_enable = False
 bts_req = None
 bts_enable = False
+bts_cursor = None
+bts_records = (Cbts_record * 1024)()
 
 def get_function_name(address):
     symbol_output = gdb.execute("info symbol " + str(address), to_string=True)
@@ -207,10 +224,11 @@ class EnableBTS(gdb.Command):
         super(EnableBTS, self).__init__("enable_bts", gdb.COMMAND_USER)
 
     def invoke(self, args, from_tty):
-        global bts_req, bts_enable
+        global bts_req, bts_enable, bts_cursor
         process_pid = get_gdb_pid()
         bts_req = enable_bts(process_pid)
         bts_enable = True
+        bts_cursor = Cbts_cursor(0, 0, 0, ctypes.cast(bts_records, ctypes.POINTER(Cbts_record)))
         print("LIBIHT-GDB: enable bts for pid :", bts_req.bts_config.pid)
 
 class DisableBTS(gdb.Command):
@@ -228,18 +246,22 @@ class DumpBTS(gdb.Command):
         super(DumpBTS, self).__init__("dump_bts", gdb.COMMAND_USER)
     
     def invoke(self, args, from_tty):
-        global bts_req
+        global bts_req, bts_cursor
         print("LIBIHT-GDB: dump bts for pid :", bts_req.bts_config.pid)
-        dump_bts(bts_req)
-        data_pointer = ctypes.cast(bts_req.bts_data.contents.bts_buffer_base, ctypes.POINTER(Cbts_record))
+
+        # Only read the records written since the last dump
+        bts_cursor.count = 1024
+        read_bts(bts_req, ctypes.byref(bts_cursor))
+        data_pointer = bts_cursor.records
 
         bts_content = []
-        for i in range(1024):
-            if data_pointer[i].from_ !=0 or data_pointer[i].to != 0:
-                bts_content.append(BTSContent(data_pointer[i].from_, data_pointer[i].to, data_pointer[i].misc))
+        for i in range(bts_cursor.count):
+            bts_content.append(BTSContent(data_pointer[i].from_, data_pointer[i].to, data_pointer[i].misc))
 
         bts_tos=len(bts_content)
         print (bts_tos)
+        if bts_cursor.lost:
+            print("LIBIHT-GDB: lost", bts_cursor.lost, "bts records")
         print ("BTS Information:")
         for i in range(bts_tos):
             print("Last [", i, "] branch record:")